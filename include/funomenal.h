@@ -4,5 +4,803 @@
 
 #define FUN_COUNTOF(x) (sizeof(x) / sizeof(x[0]))
 
+// Derived from Mass and Damping whenever those are set, so the integration only has to multiply and add. Don't set
+// them yourself, they are overwritten.
+typedef float InverseMass;
+typedef float DampingRate;
+
+// Angular velocity in radians per second and torque in newton meters, both in world space. AngularVelocity3D implies
+// Rotation3D, which the integration advances.
+typedef vkm_vec3 AngularVelocity3D;
+typedef vkm_vec3 Torque3D;
+// Principal moments of inertia in kg*m^2, about the local axes of the body. InverseInertia3D is derived from it like
+// InverseMass is from Mass. Without them, torques are ignored.
+typedef vkm_vec3 Inertia3D;
+typedef vkm_vec3 InverseInertia3D;
+
+// Add this singleton to step the physics at a fixed rate, independently of the frame rate. Without it, each frame is
+// integrated as a single step of the frame's delta time. Every step adds the fluid forces, integrates the bodies, finds
+// and solves their contacts, then steps the particles, in the validation phase.
+typedef struct FixedTimeStep {
+  // The duration of every physics step.
+  float delta_time;
+  // Simulated time that hasn't been stepped yet, always less than delta_time after stepping.
+  float accumulator;
+  // How far the frame is between the last two physics steps, from 0 to 1. Used to blend the rendered poses.
+  float interpolation;
+  // Upper bound of steps per frame. Time beyond it is dropped so a slow frame doesn't cause even slower ones.
+  uint32_t max_substeps;
+  // How many steps the current frame takes, computed each frame.
+  uint32_t substeps;
+} FixedTimeStep;
+
+// Add this singleton to get a hash of the simulated state after every frame, so that peers running the same simulation
+// in lockstep can compare it to detect a desync. It covers the entity, Position3D, DoublePosition3D, Velocity3D,
+// Rotation3D and AngularVelocity3D of every body, combined so that the order of the bodies doesn't matter.
+// Bit-identical results across builds need funomenal.c compiled with FUN_DETERMINISTIC (the FUN_DETERMINISTIC CMake
+// option), which takes the scalar paths, replaces the libm exponential and logarithm and forbids FMA contraction. The
+// peers must also use a FixedTimeStep, progress the world by exactly its delta_time, and apply the same changes in the
+// same order, so that the entities and tables are the same everywhere.
+typedef struct StateHash {
+  uint64_t hash;
+  // How many physics steps have been simulated since the singleton was added.
+  uint64_t steps;
+} StateHash;
+
+// A table whose columns are in a snapshot, and how many entities it had.
+typedef struct fun_snapshot_table_t {
+  ecs_table_t* table;
+  int32_t count;
+} fun_snapshot_table_t;
+
+// The simulated state at the end of one frame.
+typedef struct fun_snapshot_t {
+  // 0 while the snapshot is unused.
+  uint64_t frame;
+  fun_snapshot_table_t* tables;
+  int32_t tables_count, tables_capacity;
+  // The columns of every table, followed by the contact manifolds of CollisionWorld3D.
+  uint8_t* data;
+  int32_t size, capacity;
+  int32_t manifolds_count;
+} fun_snapshot_t;
+
+// Add this singleton to save the simulated state at the end of every frame into a ring of the last frames_count
+// frames, for rollback networking. Saving copies whole table columns, so it costs a memcpy() per column and no work per
+// entity. It covers Position3D, DoublePosition3D, Velocity3D, Force3D, Rotation3D, AngularVelocity3D, Torque3D,
+// Interpolation3D, SweepOrigin3D, Sleepable, Plane, the FixedTimeStep, StateHash and FloatingOrigin3D singletons, and
+// the cached contacts that warm start the solver. fun_restore_snapshot() brings a saved frame back, after which
+// progressing the world simulates the following frames again. The broadphase tree isn't saved, but it finds the same
+// pairs from the restored positions, and they're sorted by body before they're used. Restoring is as cheap as saving,
+// but simulating the frames again costs as much as the first time, so rolling back 8 frames fits in a frame only while
+// simulating a frame takes less than an eighth of it. On one core, 400 bodies piled on a plane restore in 0.02 ms and
+// take 4.7 ms for 8 frames, which fits at 60 Hz, while 2000 take 35 ms.
+typedef struct SnapshotRing3D {
+  // How many frames are kept. Only read when the first snapshot is saved.
+  uint32_t frames_count;
+  // The frame of the last snapshot, counting from 1.
+  uint64_t frame;
+  // Size of the last snapshot, in bytes, and how long saving it and the last restore took, in seconds.
+  int32_t size;
+  float save_time, restore_time;
+  fun_snapshot_t* snapshots;
+  uint32_t snapshots_count;
+} SnapshotRing3D;
+
+// Add this to bodies that should be rendered smoothly while FixedTimeStep is in use. Between the pre-store and the
+// post-load phases, their Position3D and Rotation3D hold the pose blended between the last two physics steps. Until
+// their first step, bodies are rendered where they are. A pose set in between, like a teleport, is kept as it is
+// instead of the simulated one, and isn't blended from where the body was.
+typedef struct Interpolation3D {
+  Position3D previous_position, current_position;
+  Rotation3D previous_rotation, current_rotation;
+  bool interpolated;
+  // Whether a step has set the previous pose yet.
+  bool stepped;
+} Interpolation3D;
+
+// Singleton for worlds too large for float positions. Every Position3D is relative to origin, which follows focus so
+// that whatever is close to it keeps full precision: once focus gets further than rebase_distance from the origin, the
+// origin jumps to it and everything is shifted back by the same amount, which is the only time the whole world is
+// touched. Bodies with a DoublePosition3D keep their true position in it, integrated in double precision, and their
+// Position3D is derived from it. Setting DoublePosition3D moves them. With glitch, making the camera the focus keeps
+// what's rendered close to the origin, so Render gets positions relative to the camera.
+typedef struct FloatingOrigin3D {
+  DoublePosition3D origin;
+  // 0 never moves the origin.
+  float rebase_distance;
+  ecs_entity_t focus;
+  // How many times the origin moved, and how far the last time. Position3D, DoublePosition3D, Interpolation3D,
+  // SweepOrigin3D, Plane and the collision caches are kept up to date, anything else holding positions isn't.
+  uint32_t rebases;
+  vkm_dvec3 last_shift;
+} FloatingOrigin3D;
+
+// A cube of the octree of NBodyGravity3D. Its children are contiguous, a leaf has none and holds bodies instead.
+typedef struct fun_gravity_node_t {
+  // Center of mass and total mass of every body inside.
+  float x, y, z, mass;
+  // Edge length of the cube.
+  float size;
+  int32_t first_child, children_count;
+  int32_t first_body, bodies_count;
+} fun_gravity_node_t;
+
+// What pulls on the bodies of a leaf, bodies and cubes alike, as a structure of arrays.
+typedef struct fun_gravity_list_t {
+  float* x, *y, *z, *masses;
+  int32_t count, capacity;
+} fun_gravity_list_t;
+
+// Add this singleton for mutual gravity between every body with the Attractor tag, on top of Gravity3D. Each frame
+// the attractors are sorted into an octree, rebuilt from scratch, and the pull of all of them on every attractor with
+// a Force3D is added to it, in parallel, before Integrate3D consumes it. Cubes seen under an angle smaller than theta
+// are approximated by their center of mass (Barnes-Hut), which makes it O(n log n) instead of O(n^2). The bodies of a
+// leaf share the walk down the tree, then sum up what it found with SIMD. Mass is both what attracts and what is
+// attracted, so immovable bodies do neither.
+typedef struct NBodyGravity3D {
+  // In m^3/(kg*s^2), which defaults to the real one.
+  float gravitational_constant;
+  // Largest ratio between the size of a cube and its distance for it to be approximated. 0 sums every pair exactly,
+  // larger values are faster and less accurate.
+  float theta;
+  // Added to every distance, in meters, so that close encounters don't get infinite forces.
+  float softening;
+  // The octree of the last frame, whose root is the first node, and its leaves.
+  fun_gravity_node_t* nodes;
+  int32_t nodes_count, nodes_capacity;
+  int32_t* leaves;
+  int32_t leaves_count, leaves_capacity;
+  // Every attractor of the last frame sorted by leaf, as a structure of arrays, with the Force3D its pull is added to
+  // if it gets pulled, or NULL otherwise. The forces are only valid during the pre-update phase.
+  Force3D** forces;
+  float* x, *y, *z, *masses;
+  int32_t bodies_count, bodies_capacity;
+  // One list per stage, so the workers never share one.
+  fun_gravity_list_t* lists;
+  int32_t lists_count;
+} NBodyGravity3D;
+
+// Add this to bodies that may fall asleep. A body whose speed stays under SleepSettings::linear_velocity, with no force
+// or torque applied and also spinning slower than SleepSettings::angular_velocity, for SleepSettings::time seconds gets
+// the Sleeping tag and isn't simulated anymore. Setting its Force3D, Torque3D, Velocity3D, AngularVelocity3D or
+// Position3D with ecs_set() (or calling ecs_modified() after writing them) wakes it up, and so does removing Sleeping.
+// Bodies with a BoundingRadius only fall asleep together with their whole island, once all of it has been idle long
+// enough, and a body hitting any of it hard enough wakes all of it up.
+typedef struct Sleepable {
+  float idle_time;
+} Sleepable;
+
+// Singleton with the thresholds used to decide when a Sleepable body falls asleep.
+typedef struct SleepSettings {
+  float linear_velocity, angular_velocity, time;
+} SleepSettings;
+
+// Singleton with the settings of the contact solver.
+typedef struct SolverSettings {
+  // Passes over all the contacts each step. More converge further, at the cost of frame time.
+  uint32_t iterations;
+  // Coulomb friction and restitution coefficients shared by all contacts.
+  float friction, restitution;
+  // Fraction of the penetration corrected each step, and the penetration left alone so resting contacts don't jitter.
+  float baumgarte, slop;
+  // Colors the contacts so that no two of a color share a body, then solves each color on all the worker threads,
+  // several contacts at a time. Colors are solved one after the other in a fixed order, so the results don't depend on
+  // the thread count, but they differ from the default sequential order, which converges a bit faster on one thread.
+  bool graph_coloring;
+} SolverSettings;
+
+// Radius of a sphere centered on Position3D that encloses the whole body. Bodies with it take part in collision
+// detection.
+typedef float BoundingRadius;
+
+// Collision shapes, centered on Position3D and oriented by Rotation3D when the body has it. Each implies
+// BoundingRadius, which is derived from it whenever the shape is set. A body has at most one of them.
+typedef struct Sphere {
+  float radius;
+} Sphere;
+
+typedef struct Box {
+  vkm_vec3 half_extents;
+} Box;
+
+// A cylinder along the local y axis, capped by half spheres. half_height doesn't count the caps.
+typedef struct Capsule {
+  float radius, half_height;
+} Capsule;
+
+// The convex hull of a set of points in local space. The component owns a copy of the points it was set with.
+typedef struct ConvexHull {
+  vkm_vec3* points;
+  int32_t count;
+} ConvexHull;
+
+// Where a Bullet was at the start of the step. It's added along with the tag, starts at the Position3D of the bullet
+// and follows it when it's set, and is updated by the simulation.
+typedef vkm_vec3 SweepOrigin3D;
+
+// Static, infinite plane made of the points p where dot(normal, p) equals distance, facing towards normal. It's a
+// component of its own entity, and all bodies with a shape collide with it.
+typedef struct Plane {
+  vkm_vec3 normal;
+  float distance;
+} Plane;
+
+typedef enum fun_shape_type_t {
+  FUN_SHAPE_NONE,
+  FUN_SHAPE_SPHERE,
+  FUN_SHAPE_BOX,
+  FUN_SHAPE_CAPSULE,
+  FUN_SHAPE_CONVEX_HULL,
+} fun_shape_type_t;
+
+// The shape and orientation of a body, as gathered every step for the narrowphase.
+typedef struct fun_shape_t {
+  Rotation3D rotation;
+  fun_shape_type_t type;
+  union {
+    Sphere sphere;
+    Box box;
+    Capsule capsule;
+    ConvexHull convex_hull;
+  };
+} fun_shape_t;
+
+#define FUN_MAX_CONTACTS 4
+// Stands for the static side of a contact, like a Plane.
+#define FUN_NO_BODY UINT32_MAX
+
+typedef struct fun_contact_t {
+  // Where the contact touches each body, in the local space of the body. They are what lets a contact be recognized
+  // from one frame to the next. A static side has them in world space.
+  vkm_vec3 local_points[2];
+  // Halfway between the bodies, in world space.
+  vkm_vec3 position;
+  // How far the bodies overlap along the normal, negative when they're apart.
+  float depth;
+  // Accumulated by the solver, and carried over to the next frame as a starting point.
+  float normal_impulse, tangent_impulses[2];
+} fun_contact_t;
+
+// Contact points between two bodies sharing a normal. The first entity is always the smaller one, or the body when the
+// other side is static.
+typedef struct fun_manifold_t {
+  ecs_entity_t entities[2];
+  // Indices into the body arrays of CollisionWorld3D, FUN_NO_BODY for the static side.
+  uint32_t bodies[2];
+  // Unit vector pointing from the first body towards the second one.
+  vkm_vec3 normal;
+  fun_contact_t contacts[FUN_MAX_CONTACTS];
+  int32_t contacts_count;
+} fun_manifold_t;
+
+typedef struct fun_manifold_buffer_t {
+  fun_manifold_t* manifolds;
+  int32_t count, capacity;
+} fun_manifold_buffer_t;
+
+// Handle of the body of an entity in the dynamic AABB tree of CollisionWorld3D. Implied by BoundingRadius, don't add
+// or change it yourself.
+typedef uint32_t BroadphaseProxy3D;
+
+// How CollisionWorld3D finds the candidate pairs. The grid is fastest when the bodies are about the same size, the
+// tree copes better with a mix of small and huge ones.
+typedef enum fun_broadphase_t {
+  FUN_BROADPHASE_GRID,
+  FUN_BROADPHASE_TREE,
+} fun_broadphase_t;
+
+// Two bodies whose bounds overlap, as indices into the body arrays of CollisionWorld3D, with a < b.
+typedef struct fun_pair_t {
+  uint32_t a, b;
+} fun_pair_t;
+
+typedef struct fun_pair_buffer_t {
+  fun_pair_t* pairs;
+  int32_t count, capacity;
+} fun_pair_buffer_t;
+
+// What a worker finds during the pair search. The tree reports the pairs it already knew apart from the new ones, so
+// that both can be merged in an order that doesn't depend on how the work was split.
+typedef struct fun_stage_pairs_t {
+  fun_pair_buffer_t pairs, new_pairs, new_proxy_pairs;
+  // The narrowphase batches sphere pairs and tests planes separately, so their results are kept apart as well.
+  fun_manifold_buffer_t manifolds, sphere_manifolds, plane_manifolds;
+} fun_stage_pairs_t;
+
+// Lets the workers running a multi-threaded system wait for each other in the middle of it.
+typedef struct fun_barrier_t {
+  ecs_os_mutex_t lock;
+  ecs_os_cond_t condition;
+  int32_t arrived, generation;
+} fun_barrier_t;
+
+// Contacts are laid out in blocks of this many, so that a block of contacts that share no body can be solved at once.
+#define FUN_SOLVER_LANES 4
+// Colors beyond this many go to one last color, solved sequentially.
+#define FUN_SOLVER_COLORS 64
+
+// Constraint rows of the contact solver, as a structure of arrays so that rows can be updated several at a time.
+// Every contact point makes three rows: the normal one, then friction along two tangents. A block of FUN_SOLVER_LANES
+// contacts stores their normal rows first, then their first tangent rows and then their second tangent rows.
+typedef struct fun_contact_rows_t {
+  // The bodies of each row, as indices into the body arrays of CollisionWorld3D. Static sides use bodies_count, which
+  // stands for a body that never moves.
+  uint32_t* a, *b;
+  // The direction of the row, pointing from a to b.
+  float* nx, *ny, *nz;
+  // The angular parts of the row, r x n for each body, and the same through the inverse inertia of the body.
+  float* rax, *ray, *raz, *rbx, *rby, *rbz;
+  float* iax, *iay, *iaz, *ibx, *iby, *ibz;
+  float* inverse_masses_a, *inverse_masses_b;
+  float* effective_masses, *biases, *impulses;
+  // The contact of each row, where its impulse is stored for warm starting the next step. NULL for the rows padding
+  // a block, which have no body and no effect.
+  fun_contact_t** contacts;
+  int32_t count, capacity;
+} fun_contact_rows_t;
+
+// Bodies that touch each other, directly or through other bodies but never through a static one. They're found again
+// every step with union-find over the contacts. Islands can't affect each other, so each is solved on its own, by
+// whichever worker takes it, and falls asleep as a whole.
+typedef struct fun_islands_t {
+  // The island of every body, and the union-find forest it's derived from. Sized like the body arrays.
+  int32_t* body_islands, *parents;
+  // The bodies of every island, island after island, each starting at body_starts.
+  int32_t* bodies, *body_starts;
+  // Where the contacts of every island start within the sequential color, counting from its first contact.
+  int32_t* contact_starts;
+  // The islands with contacts, most contacts first. Each is the contact count subtracted from UINT32_MAX in the high
+  // bits and the island in the low ones, so that sorting them also breaks ties.
+  uint64_t* order;
+  // Islands with a body hit hard enough this step to wake them up.
+  bool* waking;
+  int32_t count, jobs_count, islands_capacity;
+  // The next island of order a worker will take.
+  int32_t next_job;
+} fun_islands_t;
+
+// Handle 0 is never a node, so zeroed memory is an empty tree.
+#define FUN_NULL_NODE 0u
+
+typedef struct fun_aabb_t {
+  vkm_vec3 min, max;
+} fun_aabb_t;
+
+// Node of the dynamic AABB tree. Leaves hold one body each, with bounds fattened by a margin so that small moves don't
+// change the tree.
+typedef struct fun_tree_node_t {
+  fun_aabb_t aabb;
+  // The entity of a leaf, and its index into the body arrays this step.
+  ecs_entity_t entity;
+  uint32_t body;
+  // Next node in the free list for unused nodes.
+  uint32_t parent;
+  uint32_t children[2];
+  // 0 for leaves, -1 for unused nodes.
+  int32_t height;
+  // Whether a leaf is in the tree. Leaves are created unlinked and only inserted when the tree is in use.
+  bool linked;
+  // Whether a leaf was reinserted or removed since the last pair search, which invalidates its proxy pairs.
+  bool moved;
+} fun_tree_node_t;
+
+// Dynamic AABB tree, balanced with rotations on insertion and removal. All nodes live in one array and refer to each
+// other by index.
+typedef struct fun_aabb_tree_t {
+  fun_tree_node_t* nodes;
+  int32_t nodes_count, nodes_capacity;
+  uint32_t root, free_list;
+  // Pairs of leaves whose fattened bounds overlap. They only change when a leaf moves, so only the leaves that moved
+  // are looked up in the tree.
+  fun_pair_buffer_t proxy_pairs;
+  // Leaves reinserted this step, and removed leaves that can't be reused until their proxy pairs are gone.
+  uint32_t* moved, *removed;
+  int32_t moved_count, moved_capacity, removed_count, removed_capacity;
+} fun_aabb_tree_t;
+
+// A body as the broadphase grid stores it, sorted by bucket so that scanning a bucket reads contiguous memory.
+typedef struct fun_grid_body_t {
+  float x, y, z, radius;
+  vkm_ivec3 cell;
+  uint32_t index;
+} fun_grid_body_t;
+
+// Spheres sorted into a hashed uniform grid, as scratch memory reused from frame to frame.
+typedef struct fun_grid_t {
+  uint32_t* cell_starts, *buckets;
+  fun_grid_body_t* cells, *sorted;
+  float inverse_cell_size;
+  uint32_t buckets_count;
+  int32_t buckets_capacity;
+} fun_grid_t;
+
+// Singleton holding the collision detection state. Everything but the settings at the top is updated every fixed step,
+// in the validation phase, and valid from then until the next step.
+typedef struct CollisionWorld3D {
+  // Edge length of the broadphase grid cells. It's raised to twice the largest BoundingRadius if it's smaller, so
+  // leaving it at 0 fits the cells to the bodies.
+  float cell_size;
+  fun_broadphase_t broadphase;
+  // How far the bounds of a body may move before its leaf is reinserted in the tree. 0 uses FUN_DEFAULT_AABB_MARGIN.
+  float aabb_margin;
+  // Every body with bounds this step, as a structure of arrays. The radii of bullets are grown to enclose their whole
+  // sweep.
+  ecs_entity_t* entities;
+  float* x, *y, *z, *radii;
+  fun_shape_t* shapes;
+  int32_t bodies_count, bodies_capacity;
+  // What the contact solver needs of every body this step. The pointers let it write the solved velocities back, they
+  // are only valid during the validation phase and NULL for bodies without them.
+  Velocity3D** velocities;
+  AngularVelocity3D** angular_velocities;
+  // 0 for bodies that don't move, which includes sleeping ones.
+  float* inverse_masses;
+  InverseInertia3D* inverse_inertias;
+  bool* sleeping;
+  Sleepable** sleepables;
+  // Every Plane this step.
+  Plane* planes;
+  ecs_entity_t* plane_entities;
+  int32_t planes_count, planes_capacity;
+  // The bodies tagged Bullet this step, in body order, with where their sweep starts from, the radius of the sphere
+  // that's swept for them, and how far along their sweep they hit something.
+  uint32_t* bullets;
+  vkm_vec3* bullet_origins;
+  float* bullet_radii, *bullet_times;
+  int32_t bullets_count, bullets_capacity;
+  // Candidate pairs found by the broadphase, in an order that only depends on the bodies, not on the thread count.
+  fun_pair_t* pairs;
+  int32_t pairs_count, pairs_capacity;
+  // Contact manifolds found by the narrowphase. Until the next narrowphase, they are also looked up by entities in
+  // manifolds_table, an open addressing hash table of indices plus one, so contacts persist across frames.
+  fun_manifold_t* manifolds;
+  int32_t manifolds_count, manifolds_capacity;
+  int32_t* manifolds_table;
+  uint32_t manifolds_table_size;
+  // Where the next manifolds are merged before being swapped with the current ones.
+  fun_manifold_buffer_t spare_manifolds;
+  // One set of buffers per stage, so the workers never share one.
+  fun_stage_pairs_t* stages;
+  int32_t stages_count;
+  // Broadphase scratch memory.
+  fun_grid_t grid;
+  // Contact solver scratch memory, reused from frame to frame. The velocities have one more entry for the static body.
+  struct {
+    vkm_vec3* linear_velocities, *angular_velocities;
+    // The colors each body already has a contact of, while coloring.
+    uint64_t* body_colors;
+    int32_t velocities_capacity;
+    fun_contact_rows_t rows;
+    // Where the contacts of each color start, in blocks, with the sequential color last. Without graph coloring, all
+    // contacts are in the sequential color.
+    int32_t color_starts[FUN_SOLVER_COLORS + 2];
+    uint8_t* contact_colors;
+    int32_t contact_colors_capacity;
+    // Whether a step was taken, between preparing the contacts and storing the results back.
+    bool solving;
+    // Lets the workers wait for each other between colors.
+    fun_barrier_t barrier;
+  } solver;
+  fun_islands_t islands;
+  // Kept in sync with the bodies by observers, but only maintained each step while broadphase is
+  // FUN_BROADPHASE_TREE.
+  fun_aabb_tree_t tree;
+} CollisionWorld3D;
+
+// Bodies with this are simulated by the particle solver instead of Integrate3D. It uses extended position based
+// dynamics (XPBD): Position3D is moved directly over several substeps, and Velocity3D is derived from how far each
+// substep moved it. Particles need Position3D and Velocity3D, and are pulled by gravity and Force3D like other bodies.
+// Without InverseMass they weigh 1 kg, and an InverseMass of 0 pins them in place. They stay on the front side of every
+// Plane, and collide with each other as spheres of their radius.
+typedef struct Particle3D {
+  float radius;
+  // Where the particle is in the arrays of ParticleWorld3D this step. Don't set it yourself, it's overwritten.
+  uint32_t index;
+} Particle3D;
+
+// Relationship between two particles keeping them rest_length apart, as in
+// ecs_set_pair(world, a, DistanceLink3D, b, { .rest_length = 1.0f }). Compliant links act as springs, so cloth and soft
+// bodies are particles linked to their neighbors. The links are only flattened again when one is added, set or
+// removed, so change them with ecs_set_pair() or ecs_modified_pair() rather than in place.
+typedef struct DistanceLink3D {
+  float rest_length;
+  // Inverse of the stiffness of the link, in meters per newton. 0 makes it rigid.
+  float compliance;
+} DistanceLink3D;
+
+// Singleton with the settings of the particle solver.
+typedef struct ParticleSettings {
+  // Substeps of every step. Each projects every constraint once, so more of them make the constraints stiffer.
+  uint32_t substeps;
+  // Coulomb friction coefficient between particles and planes.
+  float friction;
+} ParticleSettings;
+
+// Distance constraints between two particles, as indices into the particle arrays of ParticleWorld3D, as a structure
+// of arrays.
+typedef struct fun_particle_constraints_t {
+  uint32_t* a, *b;
+  float* lengths, *compliances;
+  int32_t count, capacity;
+} fun_particle_constraints_t;
+
+// Singleton holding the particle solver state. It's gathered again every fixed step in the validation phase.
+typedef struct ParticleWorld3D {
+  // Every particle this step, as a structure of arrays. The previous positions are where the particles were at the
+  // start of the current substep.
+  ecs_entity_t* entities;
+  float* x, *y, *z, *previous_x, *previous_y, *previous_z, *vx, *vy, *vz;
+  // Acceleration from gravity and forces, which is constant over the step.
+  float* ax, *ay, *az;
+  float* radii, *inverse_masses;
+  DampingRate* damping_rates;
+  // The radii grown by how far the particles may move during a step, to find the contacts once per step.
+  float* reaches;
+  // Where the results are stored back. They are only valid during the validation phase.
+  Position3D** positions;
+  Velocity3D** velocities;
+  Interpolation3D** interpolations;
+  int32_t count, capacity;
+  // Every DistanceLink3D as flattened the last time one changed, with the two entities each links. Their indices are
+  // where the particles were last found, and are looked up again when they've moved.
+  fun_particle_constraints_t cached_links;
+  ecs_entity_t* link_entities;
+  // Cleared whenever a DistanceLink3D changes.
+  bool links_cached;
+  // The cached links between particles gathered this step, which the solver projects.
+  fun_particle_constraints_t links;
+  // Pairs of particles close enough to touch during the current step.
+  fun_pair_buffer_t contacts;
+  // Collision detection scratch memory.
+  fun_grid_t grid;
+} ParticleWorld3D;
+
+// Fluid particles as a structure of arrays, with the cell of the cell list they are in and where their Force3D is.
+typedef struct fun_fluid_particles_t {
+  float* x, *y, *z, *vx, *vy, *vz, *masses;
+  vkm_ivec3* cells;
+  Force3D** forces;
+} fun_fluid_particles_t;
+
+// The particles around a cell of the cell list of FluidWorld3D, as a structure of arrays, padded with massless ones
+// to a whole number of SIMD registers.
+typedef struct fun_fluid_neighbors_t {
+  float* x, *y, *z, *vx, *vy, *vz, *masses, *pressure_terms, *volumes;
+  int32_t count, capacity;
+} fun_fluid_neighbors_t;
+
+// Add this singleton to simulate every body with the Fluid tag as smoothed-particle hydrodynamics, with a Wendland
+// kernel. At the start of every fixed step, the density of every particle is summed up from its neighbors, which turns
+// into a pressure pushing them apart above the rest density, and viscosity evens out their velocities. Both are added
+// to Force3D for that step only, so fluid particles are usually Particle3D as well, with a radius of about a third of
+// the distance between them, which keeps them out of the planes and from piling up against them. The forces stay
+// constant over the step, so steps must be short: a FixedTimeStep of about 2 ms with the defaults, less with a stiffer
+// fluid.
+// Particles find their neighbors in a cell list of the smoothing radius, and both passes are split between the
+// workers.
+typedef struct FluidWorld3D {
+  // How far particles interact with each other, in meters, about twice the distance between them at rest.
+  float smoothing_radius;
+  // Density the fluid settles at, in kg/m^3.
+  float rest_density;
+  // Pressure per density above the rest density, in m^2/s^2. Particles under the rest density don't pull each other
+  // together, so that the fluid has a free surface instead of clumping.
+  float stiffness;
+  // Dynamic viscosity, in Pa*s.
+  float viscosity;
+  // Every fluid particle this step, as gathered and then sorted by bucket of the cell list, with the density, the
+  // pressure divided by the density squared and the mass divided by the density of the sorted ones. Only valid during
+  // the validation phase.
+  fun_fluid_particles_t gathered, sorted;
+  // The Force3D of every gathered particle before the first step of the frame added to it, which the later steps
+  // start from again.
+  Force3D* own_forces;
+  float* densities, *pressure_terms, *volumes;
+  uint32_t* buckets;
+  int32_t count, capacity;
+  // Where the particles of every bucket start in the sorted ones, with one more entry for the end of the last one.
+  uint32_t* cell_starts;
+  uint32_t buckets_count;
+  int32_t buckets_capacity;
+  // One list of neighbors per stage, so the workers never share one.
+  fun_fluid_neighbors_t* neighbors;
+  int32_t neighbors_count;
+} FluidWorld3D;
+
+// How fun_encode_bodies() quantizes the state of bodies. Positions are stored with position_bits bits per axis within
+// bounds, which they're clamped to, and velocities with velocity_bits bits per axis between -max_speed and max_speed.
+// Rotations are stored as their three smallest components with rotation_bits bits each, plus 2 bits telling which
+// component was left out. Up to 32 bits per axis and 15 bits per rotation component are supported, but a float
+// position only holds 24 bits of precision anyway.
+typedef struct fun_quantization_t {
+  fun_aabb_t bounds;
+  float max_speed;
+  uint32_t position_bits, velocity_bits, rotation_bits;
+} fun_quantization_t;
+
+// The state of a body as the other side of the connection knows it, quantized.
+typedef struct fun_quantized_body_t {
+  uint32_t position[3], velocity[3];
+  // The index of the left out component in the lowest 2 bits, then the other three components.
+  uint64_t rotation;
+} fun_quantized_body_t;
+
+// Bytes that are written and read bit by bit. Every call to fun_encode_bodies() pads the stream to a whole byte.
+typedef struct fun_bit_stream_t {
+  uint8_t* data;
+  int32_t size, capacity;
+  // Where fun_decode_bodies() reads the next bit, counting from the start of data.
+  int64_t read_position;
+} fun_bit_stream_t;
+
+// Add this to a prefab to recycle its instances. fun_park_bodies() hands expired bodies over to it instead of deleting
+// them, and fun_spawn_burst() re-arms them where they are before creating any new one, so a body that expires and one
+// that spawns in the same update cost a few stores, instead of a table delete, a table append and their events. Bodies
+// stay in their table while parked, so they have to be spawned by a system that runs after the one that parks them in
+// the same update. Those that no burst took are deleted before collision detection, or along with the pool.
+typedef struct BodyPool {
+  ecs_entity_t* entities;
+  int32_t count, capacity;
+} BodyPool;
+
+#define FUN_EXPIRY_WHEEL_BITS 6
+#define FUN_EXPIRY_WHEEL_SLOTS (1 << FUN_EXPIRY_WHEEL_BITS)
+#define FUN_EXPIRY_WHEEL_LEVELS 4
+
+// An entity and the tick of ExpiryWheel at which it expires.
+typedef struct fun_expiry_t {
+  ecs_entity_t entity;
+  uint64_t tick;
+} fun_expiry_t;
+
+// The tick of ExpiryWheel at which an entity expires, as set by its last fun_expire_after() or burst. An entity only
+// expires if it still has the tick of the slot it was scheduled in, so scheduling it again, parking it or removing this
+// cancels what it was scheduled for before. UINT64_MAX never expires.
+typedef struct Expiry {
+  uint64_t tick;
+} Expiry;
+
+typedef struct fun_expiry_slot_t {
+  fun_expiry_t* expiries;
+  int32_t count, capacity;
+} fun_expiry_slot_t;
+
+// Singleton that ends entities once their time is up, scheduled with fun_expire_after(). It's a hierarchical timing
+// wheel: an entity lands in the slot of its tick on the first level if it's due within FUN_EXPIRY_WHEEL_SLOTS ticks, or
+// in a coarser slot of a higher level otherwise, which is spread over the lower levels once the ticks get there. Each
+// frame only visits the slots of the ticks that went by, so it costs as much as what expires, however many entities
+// are waiting. Expired entities go through fun_park_bodies(), early in the update phase, so those of a prefab with a
+// BodyPool can be re-armed by the spawners of the same update.
+typedef struct ExpiryWheel {
+  // Duration of a tick, in seconds. Entities expire on the first frame past the end of their tick. Set it before
+  // scheduling anything.
+  float tick_duration;
+  // The next tick to go through, counting from the start of the world time.
+  uint64_t tick;
+  // How many entities are scheduled.
+  int32_t count;
+  fun_expiry_slot_t slots[FUN_EXPIRY_WHEEL_LEVELS][FUN_EXPIRY_WHEEL_SLOTS];
+  // The entities that expired this frame.
+  ecs_entity_t* expired;
+  int32_t expired_capacity;
+} ExpiryWheel;
+
+// A burst of bodies created by fun_spawn_burst(), all in the same table.
+typedef struct fun_burst_desc_t {
+  // What the bodies have besides Position3D, Velocity3D and Expiry, zero terminated, like in ecs_bulk_desc_t. If
+  // there's an IsA pair to a prefab with a BodyPool, its parked bodies that have all of these are re-armed first.
+  ecs_id_t ids[FLECS_ID_DESC_MAX - 3];
+  // Optional, one array of count values per id, or NULL for tags and components left to their constructor. Re-armed
+  // bodies keep their last value of whatever has no data, so anything that has to start over needs some, and they get
+  // their new values without OnSet, like a system would write them. Their Interpolation3D and SweepOrigin3D start over
+  // at their new position, as after a teleport.
+  void** data;
+  int32_t count;
+  // Optional, count lifespans in seconds, after which the bodies expire through the ExpiryWheel. Their Expiry is
+  // written along with the rest of their data.
+  const float* lifespans;
+  // Every body starts at position, with a velocity spread uniformly between min_velocity and max_velocity.
+  Position3D position;
+  Velocity3D min_velocity, max_velocity;
+  uint32_t seed;
+} fun_burst_desc_t;
+
+extern ECS_COMPONENT_DECLARE(InverseMass);
+extern ECS_COMPONENT_DECLARE(DampingRate);
+extern ECS_COMPONENT_DECLARE(AngularVelocity3D);
+extern ECS_COMPONENT_DECLARE(Torque3D);
+extern ECS_COMPONENT_DECLARE(Inertia3D);
+extern ECS_COMPONENT_DECLARE(InverseInertia3D);
+extern ECS_COMPONENT_DECLARE(FixedTimeStep);
+extern ECS_COMPONENT_DECLARE(StateHash);
+extern ECS_COMPONENT_DECLARE(SnapshotRing3D);
+extern ECS_COMPONENT_DECLARE(Interpolation3D);
+extern ECS_COMPONENT_DECLARE(FloatingOrigin3D);
+extern ECS_COMPONENT_DECLARE(NBodyGravity3D);
+extern ECS_COMPONENT_DECLARE(BodyPool);
+extern ECS_COMPONENT_DECLARE(Expiry);
+extern ECS_COMPONENT_DECLARE(ExpiryWheel);
+extern ECS_COMPONENT_DECLARE(Sleepable);
+extern ECS_COMPONENT_DECLARE(SleepSettings);
+extern ECS_COMPONENT_DECLARE(SolverSettings);
+extern ECS_COMPONENT_DECLARE(BoundingRadius);
+extern ECS_COMPONENT_DECLARE(Sphere);
+extern ECS_COMPONENT_DECLARE(Box);
+extern ECS_COMPONENT_DECLARE(Capsule);
+extern ECS_COMPONENT_DECLARE(ConvexHull);
+extern ECS_COMPONENT_DECLARE(Plane);
+extern ECS_COMPONENT_DECLARE(SweepOrigin3D);
+extern ECS_COMPONENT_DECLARE(BroadphaseProxy3D);
+extern ECS_COMPONENT_DECLARE(CollisionWorld3D);
+extern ECS_COMPONENT_DECLARE(Particle3D);
+extern ECS_COMPONENT_DECLARE(DistanceLink3D);
+extern ECS_COMPONENT_DECLARE(ParticleSettings);
+extern ECS_COMPONENT_DECLARE(ParticleWorld3D);
+extern ECS_COMPONENT_DECLARE(FluidWorld3D);
+
+extern ECS_TAG_DECLARE(Sleeping);
+// Tag for small, fast bodies with a BoundingRadius that would otherwise pass through others between two frames, like
+// projectiles. Instead of only checking where they end up, collision detection sweeps a sphere along the path they took
+// during the frame and stops them where it first touches something, which the contact solver then handles as usual.
+// The swept sphere is the shape itself for a Sphere, the largest ball inside the shape for a Box or a Capsule, and just
+// the position for a ConvexHull. Bodies without the tag don't pay anything for it.
+extern ECS_TAG_DECLARE(Bullet);
+// Tag for bodies that attract each other while the NBodyGravity3D singleton exists.
+extern ECS_TAG_DECLARE(Attractor);
+// Tag for bodies with a Force3D that flow together as a fluid while the FluidWorld3D singleton exists.
+extern ECS_TAG_DECLARE(Fluid);
+
+// Restores the state saved by SnapshotRing3D at the end of frame, which becomes the last frame of the ring. It fails
+// if that frame isn't in the ring anymore, or if entities were created, deleted or moved to other tables since, for
+// example by falling asleep, since the columns wouldn't line up anymore. Call it outside of ecs_progress().
+bool fun_restore_snapshot(ecs_world_t* world, uint64_t frame);
+
+// Appends the state of count bodies to a bit stream, delta-encoded against baselines, which are what the receiver
+// already has and are updated to what it will have after decoding. A body that didn't change since its baseline costs
+// 1 bit, one that changed a little costs much less than a full one. rotations and velocities may be NULL to leave them
+// out, and a zeroed baseline encodes a body from scratch. The receiver has to decode the same bodies in the same order,
+// with the same quantization, from baselines that match the sender's.
+void fun_encode_bodies(
+  fun_bit_stream_t* stream,
+  const fun_quantization_t* quantization,
+  int32_t count,
+  const Position3D* positions,
+  const Rotation3D* rotations,
+  const Velocity3D* velocities,
+  fun_quantized_body_t* baselines
+);
+// Reads what fun_encode_bodies() wrote, overwriting the given arrays and updating the baselines. Returns false if the
+// stream ends before all the bodies were read.
+bool fun_decode_bodies(
+  fun_bit_stream_t* stream,
+  const fun_quantization_t* quantization,
+  int32_t count,
+  Position3D* positions,
+  Rotation3D* rotations,
+  Velocity3D* velocities,
+  fun_quantized_body_t* baselines
+);
+void fun_bit_stream_free(fun_bit_stream_t* stream);
+
+// Creates a burst of bodies with a single table append, instead of looking up the table, running the hooks and
+// queueing a command for each of them. Returns how many of them were re-armed from a BodyPool rather than created. The
+// world can't be deferred, so call it outside of ecs_progress(), or from an immediate system between
+// ecs_defer_suspend() and ecs_defer_resume().
+int32_t fun_spawn_burst(ecs_world_t* world, const fun_burst_desc_t* desc);
+// Parks bodies in the BodyPool of their prefab, or deletes them if it has none. Can be called while deferred.
+void fun_park_bodies(ecs_world_t* world, const ecs_entity_t* entities, int32_t count);
+// Schedules entities to expire after their delay in seconds, counted from the world time of the current frame. Delays
+// past the reach of the ExpiryWheel, like INFINITY, never expire. Can be called while deferred.
+void fun_expire_after(ecs_world_t* world, const ecs_entity_t* entities, const float* delays, int32_t count);
+// Fills values with count floats spread uniformly in [min, max). Each one only depends on the seed and its index, so
+// the same seed gives the same values with or without SIMD.
+void fun_random_floats(float* values, int32_t count, float min, float max, uint32_t seed);
+
+// Integration runs on the flecs worker threads whenever the world has them (see ecs_set_threads()). Each worker gets
+// its own contiguous row range of every matched table, and no body reads or writes another body's data, so the
+// results are identical for any number of threads. Integration is bound by memory bandwidth rather than arithmetic, so
+// it stops scaling once the memory bus saturates. Numbers for how the speed scales with the number of cores are out of
+// scope here: they need a machine with several cores to be measured on, and are not documented until then.
 void funomenalImport(ecs_world_t* world);
 #endif
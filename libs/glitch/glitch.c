@@ -883,7 +883,14 @@ static void Render(ecs_iter_t* it) {
       const Scale2D* scales_2d = ecs_field(&rendered_entities_it, Scale2D, 3);
       const Scale3D* scales_3d = ecs_field(&rendered_entities_it, Scale3D, 4);
       const Mesh* mesh = ecs_field(&rendered_entities_it, Mesh, 7);
+
+      // Components shared through a prefab, or provided by the shader program, hold a single value for the whole table.
+      const int rotation_2d_stride = ecs_field_is_self(&rendered_entities_it, 1);
+      const int rotation_3d_stride = ecs_field_is_self(&rendered_entities_it, 2);
+      const int scale_2d_stride = ecs_field_is_self(&rendered_entities_it, 3);
+      const int scale_3d_stride = ecs_field_is_self(&rendered_entities_it, 4);
       const void* uniform_components[GLI_MAX_UNIFORMS] = { 0 };
+      int uniform_strides[GLI_MAX_UNIFORMS] = { 0 };
       for (int j = 0; j < shader_program->uniforms_count; j++) {
         const int8_t field_index = (int8_t)(j + GLI_SHADER_QUERY_TERMS);
         uniform_components[j] = ecs_field_w_size(
@@ -891,6 +898,7 @@ static void Render(ecs_iter_t* it) {
           ecs_field_size(&rendered_entities_it, field_index),
           field_index
         );
+        uniform_strides[j] = ecs_field_is_self(&rendered_entities_it, field_index);
       }
 
       glBindVertexArray(mesh->vertex_array);
@@ -903,11 +911,12 @@ static void Render(ecs_iter_t* it) {
           vkm_translate(&built_ins.model, position);
 
           if (rotations_2d) {
-            vkm_rotate(&built_ins.model, rotations_2d[j], &(vkm_vec3){ { 0.0f, 0.0f, 1.0f } });
+            vkm_rotate(&built_ins.model, rotations_2d[j * rotation_2d_stride], &(vkm_vec3){ { 0.0f, 0.0f, 1.0f } });
           }
 
           if (scales_2d) {
-            vkm_scale(&built_ins.model, &(vkm_vec3){ { scales_2d[j].x, scales_2d[j].y, 1.0f } });
+            const Scale2D* scale = scales_2d + j * scale_2d_stride;
+            vkm_scale(&built_ins.model, &(vkm_vec3){ { scale->x, scale->y, 1.0f } });
           }
         } else {
           const Position3D* position = (Position3D*)positions + j;
@@ -915,12 +924,12 @@ static void Render(ecs_iter_t* it) {
 
           if (rotations_3d) {
             vkm_mat4 rotation;
-            vkm_quat_to_mat4(rotations_3d + j, &rotation);
+            vkm_quat_to_mat4(rotations_3d + j * rotation_3d_stride, &rotation);
             vkm_mat4_mul_rotation(&built_ins.model, &rotation, &built_ins.model);
           }
 
           if (scales_3d) {
-            vkm_scale(&built_ins.model, scales_3d + j);
+            vkm_scale(&built_ins.model, scales_3d + j * scale_3d_stride);
           }
         }
 
@@ -934,49 +943,63 @@ static void Render(ecs_iter_t* it) {
             continue;
           }
 
+          const int row = j * uniform_strides[k];
+
           switch (data_type) {
             case GLI_INT:
-              glUniform1iv(shader_program->uniforms[k].location, 1, (GLint*)uniform_components[k] + j);
+              glUniform1iv(shader_program->uniforms[k].location, 1, (GLint*)uniform_components[k] + row);
               break;
             case GLI_UINT:
-              glUniform1uiv(shader_program->uniforms[k].location, 1, (GLuint*)uniform_components[k] + j);
+              glUniform1uiv(shader_program->uniforms[k].location, 1, (GLuint*)uniform_components[k] + row);
               break;
             case GLI_FLOAT:
-              glUniform1fv(shader_program->uniforms[k].location, 1, (GLfloat*)uniform_components[k] + j);
+              glUniform1fv(shader_program->uniforms[k].location, 1, (GLfloat*)uniform_components[k] + row);
               break;
             case GLI_IVEC2:
-              glUniform2iv(shader_program->uniforms[k].location, 1, (GLint*)((vkm_ivec2*)uniform_components[k] + j));
+              glUniform2iv(shader_program->uniforms[k].location, 1, (GLint*)((vkm_ivec2*)uniform_components[k] + row));
               break;
             case GLI_UVEC2:
-              glUniform2uiv(shader_program->uniforms[k].location, 1, (GLuint*)((vkm_uvec2*)uniform_components[k] + j));
+              glUniform2uiv(
+                shader_program->uniforms[k].location,
+                1,
+                (GLuint*)((vkm_uvec2*)uniform_components[k] + row)
+              );
               break;
             case GLI_VEC2:
-              glUniform2fv(shader_program->uniforms[k].location, 1, (GLfloat*)((vkm_vec2*)uniform_components[k] + j));
+              glUniform2fv(shader_program->uniforms[k].location, 1, (GLfloat*)((vkm_vec2*)uniform_components[k] + row));
               break;
             case GLI_IVEC3:
-              glUniform3iv(shader_program->uniforms[k].location, 1, (GLint*)((vkm_ivec3*)uniform_components[k] + j));
+              glUniform3iv(shader_program->uniforms[k].location, 1, (GLint*)((vkm_ivec3*)uniform_components[k] + row));
               break;
             case GLI_UVEC3:
-              glUniform3uiv(shader_program->uniforms[k].location, 1, (GLuint*)((vkm_uvec3*)uniform_components[k] + j));
+              glUniform3uiv(
+                shader_program->uniforms[k].location,
+                1,
+                (GLuint*)((vkm_uvec3*)uniform_components[k] + row)
+              );
               break;
             case GLI_VEC3:
-              glUniform3fv(shader_program->uniforms[k].location, 1, (GLfloat*)((vkm_vec3*)uniform_components[k] + j));
+              glUniform3fv(shader_program->uniforms[k].location, 1, (GLfloat*)((vkm_vec3*)uniform_components[k] + row));
               break;
             case GLI_IVEC4:
-              glUniform4iv(shader_program->uniforms[k].location, 1, (GLint*)((vkm_ivec4*)uniform_components[k] + j));
+              glUniform4iv(shader_program->uniforms[k].location, 1, (GLint*)((vkm_ivec4*)uniform_components[k] + row));
               break;
             case GLI_UVEC4:
-              glUniform4uiv(shader_program->uniforms[k].location, 1, (GLuint*)((vkm_uvec4*)uniform_components[k] + j));
+              glUniform4uiv(
+                shader_program->uniforms[k].location,
+                1,
+                (GLuint*)((vkm_uvec4*)uniform_components[k] + row)
+              );
               break;
             case GLI_VEC4:
-              glUniform4fv(shader_program->uniforms[k].location, 1, (GLfloat*)((vkm_vec4*)uniform_components[k] + j));
+              glUniform4fv(shader_program->uniforms[k].location, 1, (GLfloat*)((vkm_vec4*)uniform_components[k] + row));
               break;
             case GLI_MAT4:
               glUniformMatrix4fv(
                 shader_program->uniforms[k].location,
                 1,
                 GL_FALSE,
-                (GLfloat*)((vkm_mat4*)uniform_components[k] + j)
+                (GLfloat*)((vkm_mat4*)uniform_components[k] + row)
               );
               break;
             default:
@@ -1503,6 +1526,7 @@ void glitchImport(ecs_world_t* world) {
   });
   ECS_COMPONENT_DEFINE(world, Color);
   ecs_add_pair(world, ecs_id(Color), EcsIsA, ecs_id(vkm_vec4));
+  ecs_add_pair(world, ecs_id(Color), EcsOnInstantiate, EcsInherit);
   ECS_COMPONENT_DEFINE(world, ClearColor);
   ecs_add_pair(world, ecs_id(ClearColor), EcsIsA, ecs_id(Color));
 
@@ -1,66 +1,7958 @@
+#include <assert.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
 #define CVKM_NO
 #define CVKM_ENABLE_FLECS
 #include <cvkm.h>
 #include <flecs.h>
 #include <funomenal.h>
 
+// Define FUN_DETERMINISTIC for results that are bit-identical across builds and machines, at some cost in speed. It
+// implies FUN_NO_SIMD, and contracting a multiplication and an addition into an FMA must be disabled, which GCC only
+// does with -ffp-contract=off.
+#ifdef FUN_DETERMINISTIC
+#define FUN_NO_SIMD
+#if defined(_MSC_VER) && !defined(__clang__)
+#pragma fp_contract(off)
+#elif defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+#endif
+
+// Define FUN_NO_SIMD to force the scalar integration path everywhere, for example to compare results against it.
+#ifndef FUN_NO_SIMD
+#if defined(__AVX2__)
+#define FUN_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FUN_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
+// The vectorized kernels treat the component columns as flat float arrays, 4 or 8 bodies being exactly 3 registers.
+static_assert(sizeof(vkm_vec3) == 3 * sizeof(float), "vkm_vec3 must be tightly packed!");
+
+#ifdef FUN_DETERMINISTIC
+// libm may round differently from one platform to the next, so the exponential and the logarithm are computed with
+// basic arithmetic only, which IEEE 754 rounds the same everywhere. Scaling by powers of 2 is exact, so ldexpf() and
+// frexpf() are fine.
+static float fun_expf(const float x) {
+  if (isnan(x) || x > 88.7f) {
+    return x > 0.0f ? INFINITY : x;
+  }
+  if (x < -103.9f) {
+    return 0.0f;
+  }
+
+  // e^x = 2^n * e^r with |r| <= ln(2) / 2. ln(2) is split in two so that n * ln(2) is subtracted without error.
+  const float n = floorf(x * CVKM_LOG2E_F + 0.5f);
+  const float r = (x - n * 0.693145751953125f) - n * 1.428606765330187e-06f;
+  const float p = 1.0f + r * (1.0f + r * (1.0f / 2.0f + r * (1.0f / 6.0f + r * (1.0f / 24.0f + r * (1.0f / 120.0f
+    + r * (1.0f / 720.0f + r * (1.0f / 5040.0f)))))));
+  return ldexpf(p, (int)n);
+}
+
+static float fun_logf(const float x) {
+  if (isnan(x) || x < 0.0f) {
+    return NAN;
+  }
+  if (x == 0.0f) {
+    return -INFINITY;
+  }
+  if (x == INFINITY) {
+    return x;
+  }
+
+  // ln(x) = e * ln(2) + ln(m) with sqrt(1/2) <= m < sqrt(2), and ln(m) = 2 atanh(s) for s = (m - 1) / (m + 1).
+  int e;
+  float m = frexpf(x, &e);
+  if (m < CVKM_SQRT1_2_F) {
+    m *= 2.0f;
+    e--;
+  }
+  const float s = (m - 1.0f) / (m + 1.0f);
+  const float s2 = s * s;
+  const float p = s2 * (1.0f / 3.0f + s2 * (1.0f / 5.0f + s2 * (1.0f / 7.0f + s2 * (1.0f / 9.0f))));
+  return (float)e * 0.693145751953125f + ((float)e * 1.428606765330187e-06f + 2.0f * s + 2.0f * s * p);
+}
+#else
+#define fun_expf expf
+#define fun_logf logf
+#endif
+
+#define FUN_DEFAULT_DRAG 0.999f
+#define FUN_DEFAULT_AABB_MARGIN 0.1f
+
+// Consecutive bodies almost always share their damping, so the exponential only runs when the rate changes.
+typedef struct drag_cache_t {
+  float delta_time, rate, factor;
+} drag_cache_t;
+
+static drag_cache_t drag_cache_init(const float delta_time) {
+  const float rate = -fun_logf(FUN_DEFAULT_DRAG);
+  return (drag_cache_t){
+    .delta_time = delta_time,
+    .rate = rate,
+    .factor = fun_expf(-rate * delta_time),
+  };
+}
+
+// The per-body scalars of the integration, any of them possibly NULL. A value shared by all the rows of a table,
+// inherited from a prefab, has a stride of 0 instead of 1.
+typedef struct body_scalars_t {
+  const InverseMass* inverse_masses;
+  const DampingRate* damping_rates;
+  const GravityScale* gravity_scales;
+  int inverse_mass_stride, damping_rate_stride, gravity_scale_stride;
+} body_scalars_t;
+
+static float drag_factor(drag_cache_t* cache, const body_scalars_t* scalars, const int i) {
+  if (scalars->damping_rates) {
+    const float rate = scalars->damping_rates[i * scalars->damping_rate_stride];
+    if (rate != cache->rate) {
+      cache->rate = rate;
+      cache->factor = fun_expf(-cache->rate * cache->delta_time);
+    }
+  }
+  return cache->factor;
+}
+
+static void integrate_3d_scalar(
+  const int begin,
+  const int end,
+  const float delta_time,
+  const bool clear_forces,
+  const Gravity3D* gravity,
+  drag_cache_t* drag_cache,
+  Position3D* positions,
+  Velocity3D* velocities,
+  Force3D* forces,
+  const body_scalars_t* scalars
+) {
+  for (int i = begin; i < end; i++) {
+    Velocity3D* velocity = velocities + i;
+    Force3D* accumulated_force = forces + i;
+
+    vkm_muladd(velocity, delta_time, positions + i);
+
+    vkm_vec3 resulting_acceleration = *gravity;
+    if (scalars->gravity_scales) {
+      vkm_mul(
+        &resulting_acceleration,
+        scalars->gravity_scales[i * scalars->gravity_scale_stride],
+        &resulting_acceleration
+      );
+    }
+    vkm_muladd(accumulated_force, scalars->inverse_masses[i * scalars->inverse_mass_stride], &resulting_acceleration);
+
+    vkm_muladd(&resulting_acceleration, delta_time, velocity);
+
+    vkm_mul(velocity, drag_factor(drag_cache, scalars, i), velocity);
+
+    if (clear_forces) {
+      *accumulated_force = CVKM_VEC3_ZERO;
+    }
+  }
+}
+
+#if defined(FUN_AVX2) || defined(FUN_SSE2)
+// Gathers the per-body scalars of one batch, the rest of the kernel only multiplies and adds whole registers.
+static void integrate_3d_batch_scalars(
+  const int begin,
+  const int batch,
+  drag_cache_t* drag_cache,
+  const body_scalars_t* scalars,
+  float* inverse_masses,
+  float* scales,
+  float* drags
+) {
+  for (int k = 0; k < batch; k++) {
+    const int i = begin + k;
+    inverse_masses[k] = scalars->inverse_masses[i * scalars->inverse_mass_stride];
+    scales[k] = scalars->gravity_scales ? scalars->gravity_scales[i * scalars->gravity_scale_stride] : 1.0f;
+    drags[k] = drag_factor(drag_cache, scalars, i);
+  }
+}
+#endif
+
+#ifdef FUN_AVX2
+#define FUN_INTEGRATE_BATCH 8
+
+// 8 bodies are 24 floats, so a per-body scalar s has to be spread as s0 s0 s0 s1 s1 s1 s2 s2 | s2 s3 ... to line up.
+static void integrate_3d_spread_avx2(const float* scalars, __m256 result[3]) {
+  const __m256 low = _mm256_castps128_ps256(_mm_loadu_ps(scalars));
+  const __m256 all = _mm256_insertf128_ps(low, _mm_loadu_ps(scalars + 4), 1);
+  result[0] = _mm256_permutevar8x32_ps(all, _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2));
+  result[1] = _mm256_permutevar8x32_ps(all, _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5));
+  result[2] = _mm256_permutevar8x32_ps(all, _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7));
+}
+
+// Same operations in the same order as integrate_3d_scalar(), so both paths agree bit for bit (barring FMA contraction).
+static int integrate_3d_simd(
+  const int begin,
+  const int end,
+  const float delta_time,
+  const bool clear_forces,
+  const Gravity3D* gravity,
+  drag_cache_t* drag_cache,
+  Position3D* positions,
+  Velocity3D* velocities,
+  Force3D* forces,
+  const body_scalars_t* scalars
+) {
+  const __m256 dt = _mm256_set1_ps(delta_time);
+  const __m256 zero = _mm256_setzero_ps();
+  const float gx = gravity->x, gy = gravity->y, gz = gravity->z;
+  const __m256 gravity_lanes[3] = {
+    _mm256_setr_ps(gx, gy, gz, gx, gy, gz, gx, gy),
+    _mm256_setr_ps(gz, gx, gy, gz, gx, gy, gz, gx),
+    _mm256_setr_ps(gy, gz, gx, gy, gz, gx, gy, gz),
+  };
+
+  int i = begin;
+  for (; i + FUN_INTEGRATE_BATCH <= end; i += FUN_INTEGRATE_BATCH) {
+    float inverse_masses[FUN_INTEGRATE_BATCH], scales[FUN_INTEGRATE_BATCH], drags[FUN_INTEGRATE_BATCH];
+    integrate_3d_batch_scalars(i, FUN_INTEGRATE_BATCH, drag_cache, scalars, inverse_masses, scales, drags);
+
+    __m256 inverse_mass_lanes[3], scale_lanes[3], drag_lanes[3];
+    integrate_3d_spread_avx2(inverse_masses, inverse_mass_lanes);
+    integrate_3d_spread_avx2(scales, scale_lanes);
+    integrate_3d_spread_avx2(drags, drag_lanes);
+
+    float* p = positions[i].raw;
+    float* v = velocities[i].raw;
+    float* f = forces[i].raw;
+    for (int j = 0; j < 3; j++) {
+      __m256 position = _mm256_loadu_ps(p + j * 8);
+      __m256 velocity = _mm256_loadu_ps(v + j * 8);
+      const __m256 force = _mm256_loadu_ps(f + j * 8);
+
+      position = _mm256_add_ps(position, _mm256_mul_ps(velocity, dt));
+
+      __m256 acceleration = _mm256_mul_ps(gravity_lanes[j], scale_lanes[j]);
+      acceleration = _mm256_add_ps(acceleration, _mm256_mul_ps(force, inverse_mass_lanes[j]));
+
+      velocity = _mm256_add_ps(velocity, _mm256_mul_ps(acceleration, dt));
+      velocity = _mm256_mul_ps(velocity, drag_lanes[j]);
+
+      _mm256_storeu_ps(p + j * 8, position);
+      _mm256_storeu_ps(v + j * 8, velocity);
+      if (clear_forces) {
+        _mm256_storeu_ps(f + j * 8, zero);
+      }
+    }
+  }
+
+  return i;
+}
+#elif defined(FUN_SSE2)
+#define FUN_INTEGRATE_BATCH 4
+
+// 4 bodies are 12 floats, so a per-body scalar s has to be spread as s0 s0 s0 s1 | s1 s1 s2 s2 | s2 s3 s3 s3 to line up.
+static void integrate_3d_spread_sse2(const float* scalars, __m128 result[3]) {
+  const __m128 all = _mm_loadu_ps(scalars);
+  result[0] = _mm_shuffle_ps(all, all, _MM_SHUFFLE(1, 0, 0, 0));
+  result[1] = _mm_shuffle_ps(all, all, _MM_SHUFFLE(2, 2, 1, 1));
+  result[2] = _mm_shuffle_ps(all, all, _MM_SHUFFLE(3, 3, 3, 2));
+}
+
+// Same operations in the same order as integrate_3d_scalar(), so both paths agree bit for bit (barring FMA contraction).
+static int integrate_3d_simd(
+  const int begin,
+  const int end,
+  const float delta_time,
+  const bool clear_forces,
+  const Gravity3D* gravity,
+  drag_cache_t* drag_cache,
+  Position3D* positions,
+  Velocity3D* velocities,
+  Force3D* forces,
+  const body_scalars_t* scalars
+) {
+  const __m128 dt = _mm_set1_ps(delta_time);
+  const __m128 zero = _mm_setzero_ps();
+  const float gx = gravity->x, gy = gravity->y, gz = gravity->z;
+  const __m128 gravity_lanes[3] = {
+    _mm_setr_ps(gx, gy, gz, gx),
+    _mm_setr_ps(gy, gz, gx, gy),
+    _mm_setr_ps(gz, gx, gy, gz),
+  };
+
+  int i = begin;
+  for (; i + FUN_INTEGRATE_BATCH <= end; i += FUN_INTEGRATE_BATCH) {
+    float inverse_masses[FUN_INTEGRATE_BATCH], scales[FUN_INTEGRATE_BATCH], drags[FUN_INTEGRATE_BATCH];
+    integrate_3d_batch_scalars(i, FUN_INTEGRATE_BATCH, drag_cache, scalars, inverse_masses, scales, drags);
+
+    __m128 inverse_mass_lanes[3], scale_lanes[3], drag_lanes[3];
+    integrate_3d_spread_sse2(inverse_masses, inverse_mass_lanes);
+    integrate_3d_spread_sse2(scales, scale_lanes);
+    integrate_3d_spread_sse2(drags, drag_lanes);
+
+    float* p = positions[i].raw;
+    float* v = velocities[i].raw;
+    float* f = forces[i].raw;
+    for (int j = 0; j < 3; j++) {
+      __m128 position = _mm_loadu_ps(p + j * 4);
+      __m128 velocity = _mm_loadu_ps(v + j * 4);
+      const __m128 force = _mm_loadu_ps(f + j * 4);
+
+      position = _mm_add_ps(position, _mm_mul_ps(velocity, dt));
+
+      __m128 acceleration = _mm_mul_ps(gravity_lanes[j], scale_lanes[j]);
+      acceleration = _mm_add_ps(acceleration, _mm_mul_ps(force, inverse_mass_lanes[j]));
+
+      velocity = _mm_add_ps(velocity, _mm_mul_ps(acceleration, dt));
+      velocity = _mm_mul_ps(velocity, drag_lanes[j]);
+
+      _mm_storeu_ps(p + j * 4, position);
+      _mm_storeu_ps(v + j * 4, velocity);
+      if (clear_forces) {
+        _mm_storeu_ps(f + j * 4, zero);
+      }
+    }
+  }
+
+  return i;
+}
+#endif
+
+static void integrate_3d(
+  const int begin,
+  const int end,
+  const float delta_time,
+  const bool clear_forces,
+  const Gravity3D* gravity,
+  Position3D* positions,
+  Velocity3D* velocities,
+  Force3D* forces,
+  const body_scalars_t* scalars
+) {
+  drag_cache_t drag_cache = drag_cache_init(delta_time);
+
+  int done = begin;
+#ifdef FUN_INTEGRATE_BATCH
+  done = integrate_3d_simd(
+    begin,
+    end,
+    delta_time,
+    clear_forces,
+    gravity,
+    &drag_cache,
+    positions,
+    velocities,
+    forces,
+    scalars
+  );
+#endif
+
+  // The remainder that doesn't fill a whole batch, or everything if there is no vectorized path.
+  integrate_3d_scalar(
+    done,
+    end,
+    delta_time,
+    clear_forces,
+    gravity,
+    &drag_cache,
+    positions,
+    velocities,
+    forces,
+    scalars
+  );
+}
+
+// Rotates a vector by a unit quaternion, or by its inverse, without building a matrix.
+static void rotate_vector(const Rotation3D* rotation, const bool inverse, const vkm_vec3* vector, vkm_vec3* result) {
+  const vkm_vec3 axis = { { rotation->x, rotation->y, rotation->z } };
+  const float w = inverse ? -rotation->w : rotation->w;
+
+  vkm_vec3 t, u;
+  vkm_cross(&axis, vector, &t);
+  vkm_mul(&t, 2.0f, &t);
+  vkm_cross(&axis, &t, &u);
+
+  *result = *vector;
+  vkm_muladd(&t, w, result);
+  vkm_add(result, &u, result);
+}
+
+// Angular counterpart of integrate_3d(), run over the same chunk right after it while its rows are still in cache.
+static void integrate_angular_3d(
+  const int begin,
+  const int end,
+  const float delta_time,
+  const bool clear_torques,
+  drag_cache_t* drag_cache,
+  Rotation3D* rotations,
+  AngularVelocity3D* angular_velocities,
+  Torque3D* torques,
+  const InverseInertia3D* inverse_inertias,
+  const body_scalars_t* scalars
+) {
+  const float half_dt = 0.5f * delta_time;
+
+  for (int i = begin; i < end; i++) {
+    Rotation3D* rotation = rotations + i;
+    AngularVelocity3D* angular_velocity = angular_velocities + i;
+
+    // The inertia tensor is diagonal in body space, so the torque is taken there and the result brought back.
+    if (torques && inverse_inertias) {
+      InverseInertia3D inverse_inertia = inverse_inertias[i];
+      vkm_vec3 local_torque, angular_acceleration;
+      rotate_vector(rotation, true, torques + i, &local_torque);
+      vkm_mul(&local_torque, &inverse_inertia, &local_torque);
+      rotate_vector(rotation, false, &local_torque, &angular_acceleration);
+      vkm_muladd(&angular_acceleration, delta_time, angular_velocity);
+
+      if (clear_torques) {
+        torques[i] = CVKM_VEC3_ZERO;
+      }
+    }
+
+    vkm_mul(angular_velocity, drag_factor(drag_cache, scalars, i), angular_velocity);
+
+    // dq/dt = 0.5 * (w, 0) * q
+    const float wx = angular_velocity->x, wy = angular_velocity->y, wz = angular_velocity->z;
+    const Rotation3D q = *rotation;
+    Rotation3D next = { {
+      q.x + half_dt * ( wx * q.w + wy * q.z - wz * q.y),
+      q.y + half_dt * (-wx * q.z + wy * q.w + wz * q.x),
+      q.z + half_dt * ( wx * q.y - wy * q.x + wz * q.w),
+      q.w + half_dt * (-wx * q.x - wy * q.y - wz * q.z),
+    } };
+
+    // The quaternion drifts very little per step, so one Newton iteration of 1/sqrt around 1 renormalizes it.
+    const float sqr_magnitude = next.x * next.x + next.y * next.y + next.z * next.z + next.w * next.w;
+    const float correction = 0.5f * (3.0f - sqr_magnitude);
+    for (int k = 0; k < 4; k++) {
+      next.raw[k] *= correction;
+    }
+    *rotation = next;
+  }
+}
+
+static void nlerp_rotation(const Rotation3D* from, const Rotation3D* to, const float t, Rotation3D* result) {
+  // Take the shortest path, q and -q are the same rotation.
+  const float sign = from->x * to->x + from->y * to->y + from->z * to->z + from->w * to->w < 0.0f ? -1.0f : 1.0f;
+  vkm_vec4 blended;
+  for (int k = 0; k < 4; k++) {
+    blended.raw[k] = from->raw[k] + (to->raw[k] * sign - from->raw[k]) * t;
+  }
+  vkm_normalize(&blended, &blended);
+  *result = (Rotation3D){ { blended.x, blended.y, blended.z, blended.w } };
+}
+
+ECS_COMPONENT_DECLARE(InverseMass);
+ECS_COMPONENT_DECLARE(DampingRate);
+ECS_COMPONENT_DECLARE(AngularVelocity3D);
+ECS_COMPONENT_DECLARE(Torque3D);
+ECS_COMPONENT_DECLARE(Inertia3D);
+ECS_COMPONENT_DECLARE(InverseInertia3D);
+ECS_COMPONENT_DECLARE(FixedTimeStep);
+ECS_COMPONENT_DECLARE(StateHash);
+ECS_COMPONENT_DECLARE(SnapshotRing3D);
+ECS_COMPONENT_DECLARE(Interpolation3D);
+ECS_COMPONENT_DECLARE(FloatingOrigin3D);
+ECS_COMPONENT_DECLARE(NBodyGravity3D);
+ECS_COMPONENT_DECLARE(BodyPool);
+ECS_COMPONENT_DECLARE(Expiry);
+ECS_COMPONENT_DECLARE(ExpiryWheel);
+ECS_COMPONENT_DECLARE(Sleepable);
+ECS_COMPONENT_DECLARE(BoundingRadius);
+ECS_COMPONENT_DECLARE(Sphere);
+ECS_COMPONENT_DECLARE(Box);
+ECS_COMPONENT_DECLARE(Capsule);
+ECS_COMPONENT_DECLARE(ConvexHull);
+ECS_COMPONENT_DECLARE(Plane);
+ECS_COMPONENT_DECLARE(SweepOrigin3D);
+ECS_COMPONENT_DECLARE(BroadphaseProxy3D);
+ECS_COMPONENT_DECLARE(CollisionWorld3D);
+ECS_COMPONENT_DECLARE(SleepSettings);
+ECS_COMPONENT_DECLARE(SolverSettings);
+ECS_COMPONENT_DECLARE(Particle3D);
+ECS_COMPONENT_DECLARE(DistanceLink3D);
+ECS_COMPONENT_DECLARE(ParticleSettings);
+ECS_COMPONENT_DECLARE(ParticleWorld3D);
+ECS_COMPONENT_DECLARE(FluidWorld3D);
+
+ECS_TAG_DECLARE(Sleeping);
+ECS_TAG_DECLARE(Bullet);
+ECS_TAG_DECLARE(Attractor);
+ECS_TAG_DECLARE(Fluid);
+
+// Those match the defaults of Mass and Damping, for the instant between adding and setting them.
+ECS_CTOR(InverseMass, ptr, {
+  *ptr = 1.0f;
+})
+
+ECS_CTOR(DampingRate, ptr, {
+  *ptr = -fun_logf(FUN_DEFAULT_DRAG);
+})
+
+ECS_CTOR(AngularVelocity3D, ptr, {
+  *ptr = CVKM_VEC3_ZERO;
+})
+
+ECS_CTOR(Torque3D, ptr, {
+  *ptr = CVKM_VEC3_ZERO;
+})
+
+// A solid sphere of 1 kg and 1.58 m of radius, matching the default of Mass.
+ECS_CTOR(Inertia3D, ptr, {
+  *ptr = (Inertia3D){ { 1.0f, 1.0f, 1.0f } };
+})
+
+ECS_CTOR(InverseInertia3D, ptr, {
+  *ptr = (InverseInertia3D){ { 1.0f, 1.0f, 1.0f } };
+})
+
+ECS_CTOR(FixedTimeStep, ptr, {
+  *ptr = (FixedTimeStep){
+    .delta_time = 1.0f / 60.0f,
+    .max_substeps = 4,
+  };
+})
+
+ECS_CTOR(Interpolation3D, ptr, {
+  *ptr = (Interpolation3D){
+    .previous_rotation = CVKM_QUAT_IDENTITY,
+    .current_rotation = CVKM_QUAT_IDENTITY,
+  };
+})
+
+ECS_CTOR(FloatingOrigin3D, ptr, {
+  *ptr = (FloatingOrigin3D){
+    .rebase_distance = 1024.0f,
+  };
+})
+
+ECS_CTOR(NBodyGravity3D, ptr, {
+  *ptr = (NBodyGravity3D){
+    .gravitational_constant = 6.674e-11f,
+    .theta = 0.5f,
+    .softening = 0.01f,
+  };
+})
+
+ECS_CTOR(Sleepable, ptr, {
+  *ptr = (Sleepable){ 0 };
+})
+
+ECS_CTOR(SleepSettings, ptr, {
+  *ptr = (SleepSettings){
+    .linear_velocity = 0.05f,
+    .angular_velocity = 0.05f,
+    .time = 0.5f,
+  };
+})
+
+ECS_CTOR(SolverSettings, ptr, {
+  *ptr = (SolverSettings){
+    .iterations = 8,
+    .friction = 0.5f,
+    .restitution = 0.0f,
+    .baumgarte = 0.2f,
+    .slop = 0.005f,
+    .graph_coloring = false,
+  };
+})
+
+ECS_CTOR(Particle3D, ptr, {
+  *ptr = (Particle3D){ 0 };
+})
+
+ECS_CTOR(DistanceLink3D, ptr, {
+  *ptr = (DistanceLink3D){ 0 };
+})
+
+ECS_CTOR(ParticleSettings, ptr, {
+  *ptr = (ParticleSettings){
+    .substeps = 8,
+    .friction = 0.5f,
+  };
+})
+
+// Particles of the default 1 kg, 10 cm apart, make water.
+ECS_CTOR(FluidWorld3D, ptr, {
+  *ptr = (FluidWorld3D){
+    .smoothing_radius = 0.2f,
+    .rest_density = 1000.0f,
+    .stiffness = 200.0f,
+    .viscosity = 1.0f,
+  };
+})
+
+// Divisions and logarithms are only paid when the mass or the damping actually change, not every frame. Instances of
+// a prefab usually inherit the derived value along with it, so the table has nothing to write to.
+static void OnSetMass(ecs_iter_t* it) {
+  const Mass* masses = ecs_field(it, Mass, 0);
+  const int stride = ecs_field_is_self(it, 0);
+  InverseMass* inverse_masses = ecs_table_get_id(it->world, it->table, ecs_id(InverseMass), it->offset);
+  if (!inverse_masses) {
+    return;
+  }
+
+  for (int i = 0; i < it->count; i++) {
+    // Zero or negative mass stands for an immovable body.
+    const Mass mass = masses[i * stride];
+    inverse_masses[i] = mass > 0.0f ? 1.0f / mass : 0.0f;
+  }
+}
+
+static void OnSetInertia3D(ecs_iter_t* it) {
+  const Inertia3D* inertias = ecs_field(it, Inertia3D, 0);
+  InverseInertia3D* inverse_inertias = ecs_table_get_id(
+    it->world,
+    it->table,
+    ecs_id(InverseInertia3D),
+    it->offset
+  );
+  if (!inverse_inertias) {
+    return;
+  }
+
+  for (int i = 0; i < it->count; i++) {
+    // Zero or negative moments lock the rotation about that axis.
+    for (int k = 0; k < 3; k++) {
+      inverse_inertias[i].raw[k] = inertias[i].raw[k] > 0.0f ? 1.0f / inertias[i].raw[k] : 0.0f;
+    }
+  }
+}
+
+// Where a double precision position is relative to the floating origin.
+static Position3D relative_position(const DoublePosition3D* position, const DoublePosition3D* origin) {
+  return (Position3D){ {
+    (float)(position->x - origin->x),
+    (float)(position->y - origin->y),
+    (float)(position->z - origin->z),
+  } };
+}
+
+// Whatever moved the float positions since the last step, like a bullet being stopped, moves the double ones too.
+static void sync_double_positions(
+  const int begin,
+  const int end,
+  const DoublePosition3D* origin,
+  const Position3D* positions,
+  DoublePosition3D* double_positions
+) {
+  for (int i = begin; i < end; i++) {
+    const Position3D relative = relative_position(double_positions + i, origin);
+    double_positions[i].x += positions[i].x - relative.x;
+    double_positions[i].y += positions[i].y - relative.y;
+    double_positions[i].z += positions[i].z - relative.z;
+  }
+}
+
+// Setting a double precision position moves the body, as seen from the floating origin.
+static void OnSetDoublePosition3D(ecs_iter_t* it) {
+  const DoublePosition3D* double_positions = ecs_field(it, DoublePosition3D, 0);
+  Position3D* positions = ecs_table_get_id(it->world, it->table, ecs_id(Position3D), it->offset);
+  if (!positions) {
+    return;
+  }
+
+  const FloatingOrigin3D* floating_origin = ecs_singleton_get(it->world, FloatingOrigin3D);
+  const DoublePosition3D origin = floating_origin ? floating_origin->origin : CVKM_DVEC3_ZERO;
+  for (int i = 0; i < it->count; i++) {
+    positions[i] = relative_position(double_positions + i, &origin);
+  }
+}
+
+static void OnSetDamping(ecs_iter_t* it) {
+  const Damping* dampings = ecs_field(it, Damping, 0);
+  const int stride = ecs_field_is_self(it, 0);
+  DampingRate* damping_rates = ecs_table_get_id(it->world, it->table, ecs_id(DampingRate), it->offset);
+  if (!damping_rates) {
+    return;
+  }
+
+  for (int i = 0; i < it->count; i++) {
+    // Damping is the fraction of velocity kept after one second, so drag^dt == exp(-rate * dt).
+    const Damping damping = dampings[i * stride];
+    damping_rates[i] = damping > 0.0f ? -fun_logf(damping) : FLT_MAX;
+  }
+}
+
+// How many times a worker checks whether the others are done before going to sleep. What runs between two waits usually
+// takes microseconds, less than waking a thread up, but spinning longer starves the others when there are more workers
+// than cores.
+#define FUN_BARRIER_SPINS 64
+
+static void barrier_free(fun_barrier_t* barrier) {
+  if (barrier->lock) {
+    ecs_os_mutex_free(barrier->lock);
+    ecs_os_cond_free(barrier->condition);
+  }
+}
+
+// Returns once every worker called it.
+static void wait_for_workers(fun_barrier_t* barrier, const int32_t stages_count) {
+  if (stages_count == 1) {
+    return;
+  }
+
+  ecs_os_mutex_lock(barrier->lock);
+  const int32_t generation = barrier->generation;
+  if (++barrier->arrived == stages_count) {
+    barrier->arrived = 0;
+    barrier->generation++;
+    ecs_os_mutex_unlock(barrier->lock);
+    ecs_os_cond_broadcast(barrier->condition);
+    return;
+  }
+  ecs_os_mutex_unlock(barrier->lock);
+
+  for (int i = 0; i < FUN_BARRIER_SPINS; i++) {
+    ecs_os_mutex_lock(barrier->lock);
+    const bool released = generation != barrier->generation;
+    ecs_os_mutex_unlock(barrier->lock);
+    if (released) {
+      return;
+    }
+  }
+
+  ecs_os_mutex_lock(barrier->lock);
+  while (generation == barrier->generation) {
+    ecs_os_cond_wait(barrier->condition, barrier->lock);
+  }
+  ecs_os_mutex_unlock(barrier->lock);
+}
+
+// Decides how many fixed steps this frame needs. Runs before the integration, which reads the result.
+static void AccumulateTime(ecs_iter_t* it) {
+  FixedTimeStep* fixed = ecs_field(it, FixedTimeStep, 0);
+
+  if (fixed->delta_time <= 0.0f) {
+    fixed->substeps = 0;
+    fixed->interpolation = 1.0f;
+    return;
+  }
+
+  // Drop the time we could never catch up with, or a long frame would make the next ones even longer.
+  fixed->accumulator += it->delta_time;
+  const float max_time = fixed->delta_time * (float)fixed->max_substeps;
+  if (fixed->accumulator > max_time) {
+    fixed->accumulator = max_time;
+  }
+
+  fixed->substeps = 0;
+  while (fixed->accumulator >= fixed->delta_time) {
+    fixed->accumulator -= fixed->delta_time;
+    fixed->substeps++;
+  }
+
+  fixed->interpolation = fixed->accumulator / fixed->delta_time;
+}
+
+// The fixed step of the frame that the systems run by Step3D are simulating, which they get as the iterator param.
+typedef struct fun_step_t {
+  uint32_t index;
+  uint32_t count;
+} fun_step_t;
+
+// The systems of a fixed step, in the order Step3D runs them.
+typedef struct fun_step_systems_t {
+  ecs_entity_t* systems;
+  int32_t count;
+  fun_barrier_t barrier;
+} fun_step_systems_t;
+
+static void free_step_systems(void* ctx) {
+  fun_step_systems_t* step_systems = ctx;
+  free(step_systems->systems);
+  barrier_free(&step_systems->barrier);
+  free(step_systems);
+}
+
+// Runs every system of a fixed step once per step of the frame, so that contacts are found and solved between any two
+// integrations. Every worker goes through all the systems, and waits for the others after each, as the pipeline would
+// between systems. Those that aren't multi-threaded only run on the first worker, and disabled ones are skipped.
+static void Step3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  fun_step_systems_t* step_systems = it->ctx;
+  const FixedTimeStep* fixed = ecs_singleton_get(it->world, FixedTimeStep);
+  const int32_t stage = ecs_stage_get_id(it->world);
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  const float delta_time = fixed ? fixed->delta_time : it->delta_time;
+  fun_step_t step = { 0, fixed ? fixed->substeps : 1 };
+
+  for (step.index = 0; step.index < step.count; step.index++) {
+    for (int32_t i = 0; i < step_systems->count; i++) {
+      const ecs_entity_t system = step_systems->systems[i];
+      if (ecs_has_id(it->world, system, EcsDisabled)) {
+        continue;
+      }
+      if (!stage || ecs_system_get(it->world, system)->multi_threaded) {
+        ecs_run_worker(it->world, system, stage, stages_count, delta_time, &step);
+      }
+      wait_for_workers(&step_systems->barrier, stages_count);
+    }
+  }
+}
+
+// Integrates a single fixed step.
 static void Integrate3D(ecs_iter_t* it) {
   Position3D* positions = ecs_field(it, Position3D, 0);
   Velocity3D* velocities = ecs_field(it, Velocity3D, 1);
   Force3D* forces = ecs_field(it, Force3D, 2);
-  const Mass* masses = ecs_field(it, Mass, 3);
-  const Damping* dampings = ecs_field(it, Mass, 4);
-  const GravityScale* gravity_scales = ecs_field(it, GravityScale, 5);
   const Gravity3D* gravity_ptr = ecs_field(it, Gravity3D, 6);
+  const FixedTimeStep* fixed = ecs_field(it, FixedTimeStep, 7);
+  Interpolation3D* interpolations = ecs_field(it, Interpolation3D, 8);
+  Rotation3D* rotations = ecs_field(it, Rotation3D, 9);
+  AngularVelocity3D* angular_velocities = ecs_field(it, AngularVelocity3D, 10);
+  Torque3D* torques = ecs_field(it, Torque3D, 11);
+  const InverseInertia3D* inverse_inertias = ecs_field(it, InverseInertia3D, 12);
+  DoublePosition3D* double_positions = ecs_field(it, DoublePosition3D, 13);
+  const FloatingOrigin3D* floating_origin = ecs_field(it, FloatingOrigin3D, 14);
+  const fun_step_t* step = it->param;
 
+  // Prefab instances share these, in which case all rows read the same value.
+  const body_scalars_t scalars = {
+    .inverse_masses = ecs_field(it, InverseMass, 3),
+    .damping_rates = ecs_field(it, DampingRate, 4),
+    .gravity_scales = ecs_field(it, GravityScale, 5),
+    .inverse_mass_stride = ecs_field_is_self(it, 3),
+    .damping_rate_stride = ecs_field_is_self(it, 4),
+    .gravity_scale_stride = ecs_field_is_self(it, 5),
+  };
   const Gravity3D gravity = gravity_ptr ? *gravity_ptr : CVKM_VEC3_ZERO;
+  const DoublePosition3D origin = floating_origin ? floating_origin->origin : CVKM_DVEC3_ZERO;
+  const float delta_time = fixed ? fixed->delta_time : it->delta_system_time;
+  const bool last_step = step->index == step->count - 1;
+
+  if (double_positions) {
+    sync_double_positions(0, it->count, &origin, positions, double_positions);
+  }
+
+  // Rendering blends between the last two fixed steps.
+  if (last_step && interpolations) {
+    for (int i = 0; i < it->count; i++) {
+      interpolations[i].previous_position = double_positions
+        ? relative_position(double_positions + i, &origin)
+        : positions[i];
+      interpolations[i].previous_rotation = rotations ? rotations[i] : CVKM_QUAT_IDENTITY;
+      interpolations[i].stepped = true;
+    }
+  }
+
+  // Bodies with a double precision position are moved from 0, so the float one only holds the small move of this
+  // step, which is then added to the double one.
+  if (double_positions) {
+    memset(positions, 0, it->count * sizeof(Position3D));
+  }
+
+  // The accumulated forces act over every step of the frame and are cleared by the last one.
+  integrate_3d(0, it->count, delta_time, last_step, &gravity, positions, velocities, forces, &scalars);
+
+  if (double_positions) {
+    for (int i = 0; i < it->count; i++) {
+      double_positions[i].x += positions[i].x;
+      double_positions[i].y += positions[i].y;
+      double_positions[i].z += positions[i].z;
+      positions[i] = relative_position(double_positions + i, &origin);
+    }
+  }
+
+  if (rotations && angular_velocities) {
+    drag_cache_t drag_cache = drag_cache_init(delta_time);
+    integrate_angular_3d(
+      0,
+      it->count,
+      delta_time,
+      last_step,
+      &drag_cache,
+      rotations,
+      angular_velocities,
+      torques,
+      inverse_inertias,
+      &scalars
+    );
+  }
+}
+
+// The pose between the last two fixed steps. Always computed the same way, so that it's recognized when it's restored.
+static void blend_interpolation(
+  const Interpolation3D* interpolation,
+  const float t,
+  Position3D* position,
+  Rotation3D* rotation
+) {
+  Position3D previous = interpolation->previous_position, current = interpolation->current_position;
+  vkm_vec3 delta;
+  vkm_sub(&current, &previous, &delta);
+  *position = previous;
+  vkm_muladd(&delta, t, position);
+
+  if (rotation) {
+    nlerp_rotation(&interpolation->previous_rotation, &interpolation->current_rotation, t, rotation);
+  }
+}
+
+// Right before rendering, swaps the simulated pose for one blended between the last two fixed steps. Bodies that
+// haven't been stepped yet have no previous pose, they are blended from where they are.
+static void Interpolate3D(ecs_iter_t* it) {
+  Position3D* positions = ecs_field(it, Position3D, 0);
+  Interpolation3D* interpolations = ecs_field(it, Interpolation3D, 1);
+  Rotation3D* rotations = ecs_field(it, Rotation3D, 2);
+  const FixedTimeStep* fixed = ecs_field(it, FixedTimeStep, 3);
+
+  const float t = fixed->interpolation;
 
   for (int i = 0; i < it->count; i++) {
-    Velocity3D* velocity = velocities + i;
-    Force3D* accumulated_force = forces + i;
+    Interpolation3D* interpolation = interpolations + i;
+
+    interpolation->current_position = positions[i];
+    if (rotations) {
+      interpolation->current_rotation = rotations[i];
+    }
+    if (!interpolation->stepped) {
+      interpolation->previous_position = interpolation->current_position;
+      interpolation->previous_rotation = interpolation->current_rotation;
+    }
+
+    blend_interpolation(interpolation, t, positions + i, rotations ? rotations + i : NULL);
+    interpolation->interpolated = true;
+  }
+}
 
-    vkm_muladd(velocity, it->delta_system_time, positions + i);
+// Gives the simulation its own pose back at the start of the next frame, unless something else moved the body since it
+// was blended. That pose is kept, and the body isn't blended from where it was anymore.
+static void RestoreInterpolated3D(ecs_iter_t* it) {
+  Position3D* positions = ecs_field(it, Position3D, 0);
+  Interpolation3D* interpolations = ecs_field(it, Interpolation3D, 1);
+  Rotation3D* rotations = ecs_field(it, Rotation3D, 2);
+  const FixedTimeStep* fixed = ecs_field(it, FixedTimeStep, 3);
 
-    vkm_vec3 resulting_acceleration = gravity;
-    if (gravity_scales) {
-      vkm_mul(&resulting_acceleration, gravity_scales[i], &resulting_acceleration);
+  for (int i = 0; i < it->count; i++) {
+    Interpolation3D* interpolation = interpolations + i;
+    if (!interpolation->interpolated) {
+      continue;
     }
-    vkm_muladd(accumulated_force, 1.0f / masses[i], &resulting_acceleration);
+    interpolation->interpolated = false;
 
-    vkm_muladd(&resulting_acceleration, it->delta_system_time, velocity);
-        
-    const float drag = dampings ? dampings[i] : 0.999f;
-    vkm_mul(velocity, vkm_pow(drag, it->delta_system_time), velocity);
+    Position3D blended_position;
+    Rotation3D blended_rotation;
+    if (fixed) {
+      blend_interpolation(interpolation, fixed->interpolation, &blended_position, rotations ? &blended_rotation : NULL);
+    }
 
-    *accumulated_force = CVKM_VEC3_ZERO;
+    if (fixed && memcmp(positions + i, &blended_position, sizeof(Position3D))) {
+      interpolation->previous_position = positions[i];
+    } else {
+      positions[i] = interpolation->current_position;
+    }
+    if (!rotations) {
+      continue;
+    }
+    if (fixed && memcmp(rotations + i, &blended_rotation, sizeof(Rotation3D))) {
+      interpolation->previous_rotation = rotations[i];
+    } else {
+      rotations[i] = interpolation->current_rotation;
+    }
   }
 }
 
-#ifndef _MSC_VER
-#pragma GCC diagnostic push
-#ifdef __clang__
-#pragma GCC diagnostic ignored "-Wdollar-in-identifier-extension"
-#endif
-#endif
+// Moves the floating origin onto its focus once the focus gets too far from it. Everything holding a position relative
+// to the origin is shifted at once, so this is the only pass over the whole world, and it's rare.
+static void RebaseOrigin3D(ecs_iter_t* it) {
+  FloatingOrigin3D* floating_origin = ecs_get_mut(it->world, ecs_id(FloatingOrigin3D), FloatingOrigin3D);
+  if (!floating_origin || !floating_origin->focus || floating_origin->rebase_distance <= 0.0f) {
+    ecs_iter_fini(it);
+    return;
+  }
 
-void funomenalImport(ecs_world_t* world) {
-  ECS_MODULE(world, funomenal);
+  const Position3D* focus_position_ptr = ecs_get(it->world, floating_origin->focus, Position3D);
+  if (!focus_position_ptr) {
+    ecs_iter_fini(it);
+    return;
+  }
 
-  ECS_IMPORT(world, cvkm);
+  Position3D focus_position = *focus_position_ptr;
+  if (vkm_magnitude(&focus_position) <= floating_origin->rebase_distance) {
+    ecs_iter_fini(it);
+    return;
+  }
 
-  ECS_SYSTEM(world, Integrate3D, EcsPreUpdate,
-    [inout] cvkm.Position3D,
-    [inout] cvkm.Velocity3D,
-    [inout] cvkm.Force3D,
-    [in] cvkm.Mass,
-    [in] ?cvkm.Damping,
-    [in] ?cvkm.GravityScale,
-    [in] ?cvkm.Gravity3D($),
-  );
+  // A focus with a double precision position lands exactly on the new origin.
+  const DoublePosition3D* focus_double_position = ecs_get(it->world, floating_origin->focus, DoublePosition3D);
+  const vkm_dvec3 shift = focus_double_position
+    ? (vkm_dvec3){ {
+      focus_double_position->x - floating_origin->origin.x,
+      focus_double_position->y - floating_origin->origin.y,
+      focus_double_position->z - floating_origin->origin.z,
+    } }
+    : (vkm_dvec3){ { focus_position.x, focus_position.y, focus_position.z } };
+  vkm_vec3 float_shift = { { (float)shift.x, (float)shift.y, (float)shift.z } };
+
+  const DoublePosition3D previous_origin = floating_origin->origin;
+  floating_origin->origin.x += shift.x;
+  floating_origin->origin.y += shift.y;
+  floating_origin->origin.z += shift.z;
+  floating_origin->rebases++;
+  floating_origin->last_shift = shift;
+
+  while (ecs_iter_next(it)) {
+    Position3D* positions = ecs_field(it, Position3D, 0);
+    DoublePosition3D* double_positions = ecs_field(it, DoublePosition3D, 1);
+    Interpolation3D* interpolations = ecs_field(it, Interpolation3D, 2);
+    SweepOrigin3D* sweep_origins = ecs_field(it, SweepOrigin3D, 3);
+
+    if (double_positions) {
+      sync_double_positions(0, it->count, &previous_origin, positions, double_positions);
+      for (int i = 0; i < it->count; i++) {
+        positions[i] = relative_position(double_positions + i, &floating_origin->origin);
+      }
+    } else {
+      for (int i = 0; i < it->count; i++) {
+        vkm_sub(positions + i, &float_shift, positions + i);
+      }
+    }
+
+    if (interpolations) {
+      for (int i = 0; i < it->count; i++) {
+        vkm_sub(&interpolations[i].previous_position, &float_shift, &interpolations[i].previous_position);
+        vkm_sub(&interpolations[i].current_position, &float_shift, &interpolations[i].current_position);
+      }
+    }
+
+    if (sweep_origins) {
+      for (int i = 0; i < it->count; i++) {
+        vkm_sub(sweep_origins + i, &float_shift, sweep_origins + i);
+      }
+    }
+  }
+
+  ecs_iter_t planes_it = ecs_each(it->world, Plane);
+  while (ecs_each_next(&planes_it)) {
+    Plane* planes = ecs_field(&planes_it, Plane, 0);
+    for (int i = 0; i < planes_it.count; i++) {
+      planes[i].distance -= vkm_dot(&planes[i].normal, &float_shift);
+    }
+  }
+
+  // The cached contacts are matched by their local points, which only a static side has in world space.
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (world) {
+    for (int32_t i = 0; i < world->manifolds_count; i++) {
+      fun_manifold_t* manifold = world->manifolds + i;
+      for (int32_t k = 0; k < manifold->contacts_count; k++) {
+        fun_contact_t* contact = manifold->contacts + k;
+        vkm_sub(&contact->position, &float_shift, &contact->position);
+        if (manifold->bodies[1] == FUN_NO_BODY) {
+          vkm_sub(&contact->local_points[1], &float_shift, &contact->local_points[1]);
+        }
+      }
+    }
+
+    for (int32_t i = 0; i < world->tree.nodes_count; i++) {
+      fun_aabb_t* aabb = &world->tree.nodes[i].aabb;
+      vkm_sub(&aabb->min, &float_shift, &aabb->min);
+      vkm_sub(&aabb->max, &float_shift, &aabb->max);
+    }
+  }
+}
+
+// A Bullet that was just made one or put somewhere else sweeps from there, not from the origin or where it was before.
+static void OnSetSweepOrigin3D(ecs_iter_t* it) {
+  SweepOrigin3D* origins = ecs_field(it, SweepOrigin3D, 0);
+  const Position3D* positions = ecs_field(it, Position3D, 1);
+
+  // Setting the origin itself keeps it.
+  if (it->event == EcsOnSet && it->event_id != ecs_id(Position3D)) {
+    return;
+  }
+  memcpy(origins, positions, it->count * sizeof(SweepOrigin3D));
+}
+
+// Bullets sweep from where they are before the integration moves them.
+static void BeginSweep3D(ecs_iter_t* it) {
+  const Position3D* positions = ecs_field(it, Position3D, 0);
+  SweepOrigin3D* origins = ecs_field(it, SweepOrigin3D, 1);
+
+  memcpy(origins, positions, it->count * sizeof(SweepOrigin3D));
+}
+
+// Bodies that stayed almost still for long enough are moved to the Sleeping archetype, which the integration
+// doesn't match, so they stop costing anything per frame.
+static void FallAsleep(ecs_iter_t* it) {
+  Sleepable* sleepables = ecs_field(it, Sleepable, 0);
+  Velocity3D* velocities = ecs_field(it, Velocity3D, 1);
+  const Force3D* forces = ecs_field(it, Force3D, 2);
+  const SleepSettings* settings = ecs_field(it, SleepSettings, 3);
+  AngularVelocity3D* angular_velocities = ecs_field(it, AngularVelocity3D, 4);
+  const Torque3D* torques = ecs_field(it, Torque3D, 5);
+  // Bodies that collide fall asleep with their island instead, once its contacts are solved.
+  const bool in_islands = ecs_field_is_set(it, 6);
+
+  const float max_speed_squared = settings->linear_velocity * settings->linear_velocity;
+  const float max_spin_squared = settings->angular_velocity * settings->angular_velocity;
+
+  for (int i = 0; i < it->count; i++) {
+    Sleepable* sleepable = sleepables + i;
+
+    const bool pushed = forces[i].x != 0.0f || forces[i].y != 0.0f || forces[i].z != 0.0f;
+    const bool twisted = torques && (torques[i].x != 0.0f || torques[i].y != 0.0f || torques[i].z != 0.0f);
+    const bool spinning = angular_velocities
+      && vkm_dot(angular_velocities + i, angular_velocities + i) > max_spin_squared;
+    if (pushed || twisted || spinning || vkm_dot(velocities + i, velocities + i) > max_speed_squared) {
+      sleepable->idle_time = 0.0f;
+      continue;
+    }
+
+    sleepable->idle_time += it->delta_time;
+    if (in_islands) {
+      sleepable->idle_time = fminf(sleepable->idle_time, settings->time);
+    } else if (sleepable->idle_time >= settings->time) {
+      sleepable->idle_time = 0.0f;
+      velocities[i] = CVKM_VEC3_ZERO;
+      if (angular_velocities) {
+        angular_velocities[i] = CVKM_VEC3_ZERO;
+      }
+      ecs_add(it->world, it->entities[i], Sleeping);
+    }
+  }
+}
+
+// Folds the bits of some floats into the hash of one entity, FNV-1a style but a word at a time.
+static uint64_t hash_floats(uint64_t hash, const float* values, const int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t bits;
+    memcpy(&bits, values + i, sizeof(bits));
+    hash = (hash ^ bits) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+// The MurmurHash3 finalizer, so that every bit of an entity's hash affects the sum of all of them.
+static uint64_t hash_finalize(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Every entity is hashed on its own and the hashes are summed up, which doesn't depend on the order of the tables.
+static void HashState(ecs_iter_t* it) {
+  StateHash* state_hash = ecs_get_mut(it->world, ecs_id(StateHash), StateHash);
+  if (!state_hash) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  const FixedTimeStep* fixed = ecs_singleton_get(it->world, FixedTimeStep);
+  state_hash->steps += fixed ? fixed->substeps : 1;
+
+  uint64_t sum = 0;
+  while (ecs_iter_next(it)) {
+    const Position3D* positions = ecs_field(it, Position3D, 0);
+    const Velocity3D* velocities = ecs_field(it, Velocity3D, 1);
+    const Rotation3D* rotations = ecs_field(it, Rotation3D, 2);
+    const AngularVelocity3D* angular_velocities = ecs_field(it, AngularVelocity3D, 3);
+    const DoublePosition3D* double_positions = ecs_field(it, DoublePosition3D, 4);
+
+    for (int i = 0; i < it->count; i++) {
+      uint64_t hash = 0xCBF29CE484222325ull ^ it->entities[i];
+      hash = hash_floats(hash, positions[i].raw, 3);
+      if (velocities) {
+        hash = hash_floats(hash, velocities[i].raw, 3);
+      }
+      if (rotations) {
+        hash = hash_floats(hash, rotations[i].raw, 4);
+      }
+      if (angular_velocities) {
+        hash = hash_floats(hash, angular_velocities[i].raw, 3);
+      }
+      if (double_positions) {
+        // Hashed as pairs of floats, they're only bits here.
+        hash = hash_floats(hash, (const float*)double_positions[i].raw, 6);
+      }
+      sum += hash_finalize(hash);
+    }
+  }
+
+  state_hash->hash = hash_finalize(sum ^ state_hash->steps);
+}
+
+// Setting the force, torque, velocities or position of a sleeping body is how it gets woken up.
+static void WakeUp(ecs_iter_t* it) {
+  for (int i = 0; i < it->count; i++) {
+    ecs_remove(it->world, it->entities[i], Sleeping);
+  }
+}
+
+// Every float array of the contact rows, so they can be grown and freed together.
+#define FUN_CONTACT_ROWS_FLOATS(rows) { \
+  &(rows)->nx, &(rows)->ny, &(rows)->nz, \
+  &(rows)->rax, &(rows)->ray, &(rows)->raz, &(rows)->rbx, &(rows)->rby, &(rows)->rbz, \
+  &(rows)->iax, &(rows)->iay, &(rows)->iaz, &(rows)->ibx, &(rows)->iby, &(rows)->ibz, \
+  &(rows)->inverse_masses_a, &(rows)->inverse_masses_b, \
+  &(rows)->effective_masses, &(rows)->biases, &(rows)->impulses, \
+}
+
+static void contact_rows_free(fun_contact_rows_t* rows) {
+  float** floats[] = FUN_CONTACT_ROWS_FLOATS(rows);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    free(*floats[i]);
+  }
+  free(rows->a);
+  free(rows->b);
+  free(rows->contacts);
+}
+
+static void contact_rows_reserve(fun_contact_rows_t* rows, const int32_t count) {
+  if (count <= rows->capacity) {
+    return;
+  }
+
+  int32_t capacity = rows->capacity ? rows->capacity : 64;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  float** floats[] = FUN_CONTACT_ROWS_FLOATS(rows);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    *floats[i] = realloc(*floats[i], capacity * sizeof(float));
+  }
+  rows->a = realloc(rows->a, capacity * sizeof(uint32_t));
+  rows->b = realloc(rows->b, capacity * sizeof(uint32_t));
+  rows->contacts = realloc(rows->contacts, capacity * sizeof(fun_contact_t*));
+  rows->capacity = capacity;
+}
+
+static void grid_free(fun_grid_t* grid) {
+  free(grid->cell_starts);
+  free(grid->buckets);
+  free(grid->cells);
+  free(grid->sorted);
+}
+
+static void collision_world_3d_free(CollisionWorld3D* world) {
+  free(world->entities);
+  free(world->x);
+  free(world->y);
+  free(world->z);
+  free(world->radii);
+  free(world->shapes);
+  free(world->velocities);
+  free(world->angular_velocities);
+  free(world->inverse_masses);
+  free(world->inverse_inertias);
+  free(world->sleeping);
+  free(world->sleepables);
+  free(world->planes);
+  free(world->plane_entities);
+  free(world->bullets);
+  free(world->bullet_origins);
+  free(world->bullet_radii);
+  free(world->bullet_times);
+  free(world->pairs);
+  free(world->manifolds);
+  free(world->manifolds_table);
+  free(world->spare_manifolds.manifolds);
+  grid_free(&world->grid);
+  for (int32_t i = 0; i < world->stages_count; i++) {
+    free(world->stages[i].pairs.pairs);
+    free(world->stages[i].new_pairs.pairs);
+    free(world->stages[i].new_proxy_pairs.pairs);
+    free(world->stages[i].manifolds.manifolds);
+    free(world->stages[i].sphere_manifolds.manifolds);
+    free(world->stages[i].plane_manifolds.manifolds);
+  }
+  free(world->stages);
+  free(world->solver.linear_velocities);
+  free(world->solver.angular_velocities);
+  free(world->solver.body_colors);
+  free(world->solver.contact_colors);
+  contact_rows_free(&world->solver.rows);
+  barrier_free(&world->solver.barrier);
+  free(world->islands.body_islands);
+  free(world->islands.parents);
+  free(world->islands.bodies);
+  free(world->islands.body_starts);
+  free(world->islands.contact_starts);
+  free(world->islands.order);
+  free(world->islands.waking);
+  free(world->tree.nodes);
+  free(world->tree.proxy_pairs.pairs);
+  free(world->tree.moved);
+  free(world->tree.removed);
+}
+
+ECS_CTOR(CollisionWorld3D, ptr, {
+  *ptr = (CollisionWorld3D){ 0 };
+})
+
+ECS_MOVE(CollisionWorld3D, dst, src, {
+  collision_world_3d_free(dst);
+  *dst = *src;
+  *src = (CollisionWorld3D){ 0 };
+})
+
+ECS_DTOR(CollisionWorld3D, ptr, {
+  collision_world_3d_free(ptr);
+  *ptr = (CollisionWorld3D){ 0 };
+})
+
+static void collision_world_3d_reserve(CollisionWorld3D* world, const int32_t count) {
+  if (count <= world->bodies_capacity) {
+    return;
+  }
+
+  int32_t capacity = world->bodies_capacity ? world->bodies_capacity : 64;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  world->entities = realloc(world->entities, capacity * sizeof(ecs_entity_t));
+  world->x = realloc(world->x, capacity * sizeof(float));
+  world->y = realloc(world->y, capacity * sizeof(float));
+  world->z = realloc(world->z, capacity * sizeof(float));
+  world->radii = realloc(world->radii, capacity * sizeof(float));
+  world->shapes = realloc(world->shapes, capacity * sizeof(fun_shape_t));
+  world->velocities = realloc(world->velocities, capacity * sizeof(Velocity3D*));
+  world->angular_velocities = realloc(world->angular_velocities, capacity * sizeof(AngularVelocity3D*));
+  world->inverse_masses = realloc(world->inverse_masses, capacity * sizeof(float));
+  world->inverse_inertias = realloc(world->inverse_inertias, capacity * sizeof(InverseInertia3D));
+  world->sleeping = realloc(world->sleeping, capacity * sizeof(bool));
+  world->sleepables = realloc(world->sleepables, capacity * sizeof(Sleepable*));
+  world->islands.body_islands = realloc(world->islands.body_islands, capacity * sizeof(int32_t));
+  world->islands.parents = realloc(world->islands.parents, capacity * sizeof(int32_t));
+  world->islands.bodies = realloc(world->islands.bodies, capacity * sizeof(int32_t));
+  world->grid.buckets = realloc(world->grid.buckets, capacity * sizeof(uint32_t));
+  world->grid.cells = realloc(world->grid.cells, capacity * sizeof(fun_grid_body_t));
+  world->grid.sorted = realloc(world->grid.sorted, capacity * sizeof(fun_grid_body_t));
+  world->bodies_capacity = capacity;
+}
+
+// Makes room for at least count elements, growing geometrically so steady state steps never allocate.
+static void* reserve(void* array, int32_t* capacity, const int32_t count, const size_t element_size) {
+  if (count <= *capacity) {
+    return array;
+  }
+
+  int32_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < count) {
+    new_capacity *= 2;
+  }
+
+  *capacity = new_capacity;
+  return realloc(array, (size_t)new_capacity * element_size);
+}
+
+// Cubes with no more bodies than this aren't split any further, and neither are those this deep, which only happens to
+// bodies piled up at the same spot. Walking the tree pops a cube and pushes at most 8 children at every level.
+#define FUN_GRAVITY_LEAF_SIZE 16
+#define FUN_GRAVITY_MAX_DEPTH 24
+#define FUN_GRAVITY_STACK_SIZE (7 * FUN_GRAVITY_MAX_DEPTH + 8)
+
+static void gravity_list_free(fun_gravity_list_t* list) {
+  free(list->x);
+  free(list->y);
+  free(list->z);
+  free(list->masses);
+}
+
+static void n_body_gravity_3d_free(NBodyGravity3D* gravity) {
+  free(gravity->nodes);
+  free(gravity->leaves);
+  free(gravity->forces);
+  float* floats[] = { gravity->x, gravity->y, gravity->z, gravity->masses };
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    free(floats[i]);
+  }
+  for (int32_t i = 0; i < gravity->lists_count; i++) {
+    gravity_list_free(gravity->lists + i);
+  }
+  free(gravity->lists);
+}
+
+ECS_MOVE(NBodyGravity3D, dst, src, {
+  n_body_gravity_3d_free(dst);
+  *dst = *src;
+  *src = (NBodyGravity3D){ 0 };
+})
+
+ECS_DTOR(NBodyGravity3D, ptr, {
+  n_body_gravity_3d_free(ptr);
+  *ptr = (NBodyGravity3D){ 0 };
+})
+
+static void n_body_gravity_3d_reserve(NBodyGravity3D* gravity, const int32_t count) {
+  if (count <= gravity->bodies_capacity) {
+    return;
+  }
+
+  int32_t capacity = gravity->bodies_capacity ? gravity->bodies_capacity : 64;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  float** floats[] = { &gravity->x, &gravity->y, &gravity->z, &gravity->masses };
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    *floats[i] = realloc(*floats[i], capacity * sizeof(float));
+  }
+  gravity->forces = realloc(gravity->forces, capacity * sizeof(Force3D*));
+  gravity->bodies_capacity = capacity;
+}
+
+static void gravity_list_reserve(fun_gravity_list_t* list, const int32_t count) {
+  if (count <= list->capacity) {
+    return;
+  }
+
+  int32_t capacity = list->capacity ? list->capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  list->x = realloc(list->x, capacity * sizeof(float));
+  list->y = realloc(list->y, capacity * sizeof(float));
+  list->z = realloc(list->z, capacity * sizeof(float));
+  list->masses = realloc(list->masses, capacity * sizeof(float));
+  list->capacity = capacity;
+}
+
+static int gravity_octant(const NBodyGravity3D* gravity, const int32_t body, const vkm_vec3* center) {
+  return (gravity->x[body] >= center->x) | (gravity->y[body] >= center->y) << 1 | (gravity->z[body] >= center->z) << 2;
+}
+
+static void gravity_swap_bodies(NBodyGravity3D* gravity, const int32_t a, const int32_t b) {
+  float* arrays[] = { gravity->x, gravity->y, gravity->z, gravity->masses };
+  for (size_t i = 0; i < FUN_COUNTOF(arrays); i++) {
+    const float value = arrays[i][a];
+    arrays[i][a] = arrays[i][b];
+    arrays[i][b] = value;
+  }
+
+  Force3D* force = gravity->forces[a];
+  gravity->forces[a] = gravity->forces[b];
+  gravity->forces[b] = force;
+}
+
+// Sorts the bodies of a cube by octant in place, then makes a child of every octant that isn't empty, so that the
+// bodies of every cube are contiguous. The mass of a cube is summed up from its children once they are built, and the
+// leaves are listed in the order of the walk, which keeps neighbors together when they are split across workers.
+static void build_gravity_node(
+  NBodyGravity3D* gravity,
+  const int32_t node,
+  const int32_t begin,
+  const int32_t end,
+  const vkm_vec3 center,
+  const float size,
+  const int depth
+) {
+  gravity->nodes[node] = (fun_gravity_node_t){
+    .size = size,
+    .first_body = begin,
+    .bodies_count = end - begin,
+  };
+
+  if (end - begin <= FUN_GRAVITY_LEAF_SIZE || depth == FUN_GRAVITY_MAX_DEPTH) {
+    float mass = 0.0f, x = 0.0f, y = 0.0f, z = 0.0f;
+    for (int32_t i = begin; i < end; i++) {
+      mass += gravity->masses[i];
+      x += gravity->masses[i] * gravity->x[i];
+      y += gravity->masses[i] * gravity->y[i];
+      z += gravity->masses[i] * gravity->z[i];
+    }
+
+    fun_gravity_node_t* leaf = gravity->nodes + node;
+    leaf->mass = mass;
+    leaf->x = x / mass;
+    leaf->y = y / mass;
+    leaf->z = z / mass;
+
+    gravity->leaves = reserve(gravity->leaves, &gravity->leaves_capacity, gravity->leaves_count + 1, sizeof(int32_t));
+    gravity->leaves[gravity->leaves_count++] = node;
+    return;
+  }
+
+  int32_t ends[8] = { 0 };
+  for (int32_t i = begin; i < end; i++) {
+    ends[gravity_octant(gravity, i, &center)]++;
+  }
+
+  int32_t starts[8], next[8];
+  int32_t children_count = 0;
+  for (int o = 0, offset = begin; o < 8; o++) {
+    children_count += ends[o] > 0;
+    starts[o] = next[o] = offset;
+    offset += ends[o];
+    ends[o] = offset;
+  }
+
+  // Every body that isn't in its octant yet is swapped with the next free spot of the one it belongs to.
+  for (int o = 0; o < 8; o++) {
+    while (next[o] < ends[o]) {
+      const int octant = gravity_octant(gravity, next[o], &center);
+      if (octant == o) {
+        next[o]++;
+      } else {
+        gravity_swap_bodies(gravity, next[o], next[octant]++);
+      }
+    }
+  }
+
+  const int32_t first_child = gravity->nodes_count;
+  gravity->nodes_count += children_count;
+  gravity->nodes =
+    reserve(gravity->nodes, &gravity->nodes_capacity, gravity->nodes_count, sizeof(fun_gravity_node_t));
+  gravity->nodes[node].first_child = first_child;
+  gravity->nodes[node].children_count = children_count;
+
+  float mass = 0.0f, x = 0.0f, y = 0.0f, z = 0.0f;
+  for (int o = 0, child = first_child; o < 8; o++) {
+    if (starts[o] == ends[o]) {
+      continue;
+    }
+
+    const float quarter = 0.25f * size;
+    const vkm_vec3 child_center = { {
+      center.x + (o & 1 ? quarter : -quarter),
+      center.y + (o & 2 ? quarter : -quarter),
+      center.z + (o & 4 ? quarter : -quarter),
+    } };
+    build_gravity_node(gravity, child, starts[o], ends[o], child_center, 0.5f * size, depth + 1);
+
+    const fun_gravity_node_t* built = gravity->nodes + child++;
+    mass += built->mass;
+    x += built->mass * built->x;
+    y += built->mass * built->y;
+    z += built->mass * built->z;
+  }
+
+  fun_gravity_node_t* parent = gravity->nodes + node;
+  parent->mass = mass;
+  parent->x = x / mass;
+  parent->y = y / mass;
+  parent->z = z / mass;
+}
+
+// The octree is rebuilt from the attractors every frame, as they all move. Those without a Force3D, or asleep, still
+// pull the others but aren't pulled themselves.
+static void BuildGravityTree3D(ecs_iter_t* it) {
+  NBodyGravity3D* gravity = ecs_get_mut(it->world, ecs_id(NBodyGravity3D), NBodyGravity3D);
+  const FixedTimeStep* fixed = ecs_singleton_get(it->world, FixedTimeStep);
+  if (!gravity) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  gravity->bodies_count = 0;
+  gravity->nodes_count = 0;
+  gravity->leaves_count = 0;
+  // Forces are only cleared by a step, adding them without one would count them twice.
+  if (fixed && !fixed->substeps) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  if (stages_count > gravity->lists_count) {
+    gravity->lists = realloc(gravity->lists, stages_count * sizeof(fun_gravity_list_t));
+    for (int32_t i = gravity->lists_count; i < stages_count; i++) {
+      gravity->lists[i] = (fun_gravity_list_t){ 0 };
+    }
+    gravity->lists_count = stages_count;
+  }
+
+  vkm_vec3 min = { { FLT_MAX, FLT_MAX, FLT_MAX } };
+  vkm_vec3 max = { { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+  while (ecs_iter_next(it)) {
+    const Position3D* positions = ecs_field(it, Position3D, 0);
+    const Mass* masses = ecs_field(it, Mass, 1);
+    const int mass_stride = ecs_field_is_self(it, 1);
+    Force3D* forces = ecs_field_is_set(it, 4) ? NULL : ecs_field(it, Force3D, 3);
+
+    n_body_gravity_3d_reserve(gravity, gravity->bodies_count + it->count);
+    for (int i = 0; i < it->count; i++) {
+      // Immovable bodies don't have a mass to attract with.
+      const Mass mass = masses[i * mass_stride];
+      if (mass <= 0.0f) {
+        continue;
+      }
+
+      const int32_t body = gravity->bodies_count++;
+      gravity->forces[body] = forces ? forces + i : NULL;
+      gravity->x[body] = positions[i].x;
+      gravity->y[body] = positions[i].y;
+      gravity->z[body] = positions[i].z;
+      gravity->masses[body] = mass;
+      for (int k = 0; k < 3; k++) {
+        min.raw[k] = vkm_min(min.raw[k], positions[i].raw[k]);
+        max.raw[k] = vkm_max(max.raw[k], positions[i].raw[k]);
+      }
+    }
+  }
+
+  if (!gravity->bodies_count) {
+    return;
+  }
+
+  vkm_vec3 center, extent;
+  vkm_add(&min, &max, &center);
+  vkm_mul(&center, 0.5f, &center);
+  vkm_sub(&max, &min, &extent);
+  const float size = vkm_max(extent.x, vkm_max(extent.y, extent.z));
+
+  gravity->nodes_count = 1;
+  gravity->nodes = reserve(gravity->nodes, &gravity->nodes_capacity, 1, sizeof(fun_gravity_node_t));
+  build_gravity_node(gravity, 0, 0, gravity->bodies_count, center, size, 0);
+}
+
+// Walks the tree once for all the bodies of a leaf, within the sphere around them. A cube is approximated when it is
+// far enough from the whole sphere, and never when it contains the leaf, whose own bodies are always listed one by one.
+static void gather_gravity_list(
+  const NBodyGravity3D* gravity,
+  const fun_gravity_node_t* leaf,
+  fun_gravity_list_t* list
+) {
+  vkm_vec3 min = { { FLT_MAX, FLT_MAX, FLT_MAX } };
+  vkm_vec3 max = { { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+  const int32_t leaf_end = leaf->first_body + leaf->bodies_count;
+  for (int32_t i = leaf->first_body; i < leaf_end; i++) {
+    const float point[3] = { gravity->x[i], gravity->y[i], gravity->z[i] };
+    for (int k = 0; k < 3; k++) {
+      min.raw[k] = vkm_min(min.raw[k], point[k]);
+      max.raw[k] = vkm_max(max.raw[k], point[k]);
+    }
+  }
+
+  vkm_vec3 center, extent;
+  vkm_add(&min, &max, &center);
+  vkm_mul(&center, 0.5f, &center);
+  vkm_sub(&max, &min, &extent);
+  const float radius = 0.5f * vkm_magnitude(&extent);
+
+  list->count = 0;
+  int32_t stack[FUN_GRAVITY_STACK_SIZE];
+  int32_t stack_count = 0;
+  stack[stack_count++] = 0;
+  while (stack_count) {
+    const fun_gravity_node_t* node = gravity->nodes + stack[--stack_count];
+    if (!node->children_count) {
+      gravity_list_reserve(list, list->count + node->bodies_count);
+      memcpy(list->x + list->count, gravity->x + node->first_body, node->bodies_count * sizeof(float));
+      memcpy(list->y + list->count, gravity->y + node->first_body, node->bodies_count * sizeof(float));
+      memcpy(list->z + list->count, gravity->z + node->first_body, node->bodies_count * sizeof(float));
+      memcpy(list->masses + list->count, gravity->masses + node->first_body, node->bodies_count * sizeof(float));
+      list->count += node->bodies_count;
+      continue;
+    }
+
+    const bool contains_leaf =
+      node->first_body <= leaf->first_body && leaf->first_body < node->first_body + node->bodies_count;
+    const float dx = node->x - center.x, dy = node->y - center.y, dz = node->z - center.z;
+    const float gap = sqrtf(dx * dx + dy * dy + dz * dz) - radius;
+    if (contains_leaf || gap <= 0.0f || node->size >= gravity->theta * gap) {
+      for (int32_t i = 0; i < node->children_count; i++) {
+        stack[stack_count++] = node->first_child + i;
+      }
+      continue;
+    }
+
+    gravity_list_reserve(list, list->count + 1);
+    list->x[list->count] = node->x;
+    list->y[list->count] = node->y;
+    list->z[list->count] = node->z;
+    list->masses[list->count++] = node->mass;
+  }
+}
+
+#ifdef FUN_AVX2
+#define FUN_GRAVITY_LANES 8
+
+// Sums 8 attractors at a time into pull, the lanes are added together at the end. Attractors at the point itself are
+// masked out.
+static int32_t gravity_pull_simd(
+  const fun_gravity_list_t* list,
+  const float* point,
+  const float softening_squared,
+  float* pull
+) {
+  const __m256 px = _mm256_set1_ps(point[0]), py = _mm256_set1_ps(point[1]), pz = _mm256_set1_ps(point[2]);
+  const __m256 softening = _mm256_set1_ps(softening_squared);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  __m256 ax = zero, ay = zero, az = zero;
+
+  int32_t i = 0;
+  for (; i + FUN_GRAVITY_LANES <= list->count; i += FUN_GRAVITY_LANES) {
+    const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(list->x + i), px);
+    const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(list->y + i), py);
+    const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(list->z + i), pz);
+    const __m256 r_squared = _mm256_add_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)),
+      softening
+    );
+    const __m256 inverse_r = _mm256_div_ps(one, _mm256_sqrt_ps(r_squared));
+    const __m256 strength = _mm256_and_ps(
+      _mm256_cmp_ps(r_squared, zero, _CMP_GT_OQ),
+      _mm256_mul_ps(_mm256_loadu_ps(list->masses + i), _mm256_mul_ps(inverse_r, _mm256_mul_ps(inverse_r, inverse_r)))
+    );
+    ax = _mm256_add_ps(ax, _mm256_mul_ps(strength, dx));
+    ay = _mm256_add_ps(ay, _mm256_mul_ps(strength, dy));
+    az = _mm256_add_ps(az, _mm256_mul_ps(strength, dz));
+  }
+
+  float lanes[3][FUN_GRAVITY_LANES];
+  _mm256_storeu_ps(lanes[0], ax);
+  _mm256_storeu_ps(lanes[1], ay);
+  _mm256_storeu_ps(lanes[2], az);
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < FUN_GRAVITY_LANES; k++) {
+      pull[j] += lanes[j][k];
+    }
+  }
+
+  return i;
+}
+#elif defined(FUN_SSE2)
+#define FUN_GRAVITY_LANES 4
+
+// Sums 4 attractors at a time into pull, the lanes are added together at the end. Attractors at the point itself are
+// masked out.
+static int32_t gravity_pull_simd(
+  const fun_gravity_list_t* list,
+  const float* point,
+  const float softening_squared,
+  float* pull
+) {
+  const __m128 px = _mm_set1_ps(point[0]), py = _mm_set1_ps(point[1]), pz = _mm_set1_ps(point[2]);
+  const __m128 softening = _mm_set1_ps(softening_squared);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  __m128 ax = zero, ay = zero, az = zero;
+
+  int32_t i = 0;
+  for (; i + FUN_GRAVITY_LANES <= list->count; i += FUN_GRAVITY_LANES) {
+    const __m128 dx = _mm_sub_ps(_mm_loadu_ps(list->x + i), px);
+    const __m128 dy = _mm_sub_ps(_mm_loadu_ps(list->y + i), py);
+    const __m128 dz = _mm_sub_ps(_mm_loadu_ps(list->z + i), pz);
+    const __m128 r_squared = _mm_add_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)),
+      softening
+    );
+    const __m128 inverse_r = _mm_div_ps(one, _mm_sqrt_ps(r_squared));
+    const __m128 strength = _mm_and_ps(
+      _mm_cmpgt_ps(r_squared, zero),
+      _mm_mul_ps(_mm_loadu_ps(list->masses + i), _mm_mul_ps(inverse_r, _mm_mul_ps(inverse_r, inverse_r)))
+    );
+    ax = _mm_add_ps(ax, _mm_mul_ps(strength, dx));
+    ay = _mm_add_ps(ay, _mm_mul_ps(strength, dy));
+    az = _mm_add_ps(az, _mm_mul_ps(strength, dz));
+  }
+
+  float lanes[3][FUN_GRAVITY_LANES];
+  _mm_storeu_ps(lanes[0], ax);
+  _mm_storeu_ps(lanes[1], ay);
+  _mm_storeu_ps(lanes[2], az);
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < FUN_GRAVITY_LANES; k++) {
+      pull[j] += lanes[j][k];
+    }
+  }
+
+  return i;
+}
+#endif
+
+// Pull of the list on a point, divided by the gravitational constant. Attractors at the point itself pull nowhere,
+// which leaves out the body that is there.
+static vkm_vec3 gravity_pull(const fun_gravity_list_t* list, const float* point, const float softening_squared) {
+  float pull[3] = { 0.0f, 0.0f, 0.0f };
+  int32_t i = 0;
+#ifdef FUN_GRAVITY_LANES
+  i = gravity_pull_simd(list, point, softening_squared, pull);
+#endif
+  for (; i < list->count; i++) {
+    const float dx = list->x[i] - point[0];
+    const float dy = list->y[i] - point[1];
+    const float dz = list->z[i] - point[2];
+    const float r_squared = dx * dx + dy * dy + dz * dz + softening_squared;
+    const float inverse_r = r_squared > 0.0f ? 1.0f / sqrtf(r_squared) : 0.0f;
+    const float strength = list->masses[i] * inverse_r * inverse_r * inverse_r;
+    pull[0] += strength * dx;
+    pull[1] += strength * dy;
+    pull[2] += strength * dz;
+  }
+
+  return (vkm_vec3){ { pull[0], pull[1], pull[2] } };
+}
+
+// Every worker takes its share of the leaves, in the order of the walk, with a list of its own. Every body is in a
+// single leaf, so each Force3D is only written by one worker.
+static void ComputeGravity3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  NBodyGravity3D* gravity = ecs_get_mut(it->world, ecs_id(NBodyGravity3D), NBodyGravity3D);
+  const int32_t stage = ecs_stage_get_id(it->world);
+  if (!gravity || stage >= gravity->lists_count) {
+    return;
+  }
+
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  const int32_t leaves_begin = (int32_t)((int64_t)gravity->leaves_count * stage / stages_count);
+  const int32_t leaves_end = (int32_t)((int64_t)gravity->leaves_count * (stage + 1) / stages_count);
+  const float softening_squared = gravity->softening * gravity->softening;
+  fun_gravity_list_t* list = gravity->lists + stage;
+  for (int32_t l = leaves_begin; l < leaves_end; l++) {
+    const fun_gravity_node_t* leaf = gravity->nodes + gravity->leaves[l];
+    const int32_t end = leaf->first_body + leaf->bodies_count;
+    int32_t pulled = 0;
+    for (int32_t i = leaf->first_body; i < end; i++) {
+      pulled += gravity->forces[i] != NULL;
+    }
+    if (!pulled) {
+      continue;
+    }
+
+    gather_gravity_list(gravity, leaf, list);
+    for (int32_t i = leaf->first_body; i < end; i++) {
+      if (!gravity->forces[i]) {
+        continue;
+      }
+
+      const float point[3] = { gravity->x[i], gravity->y[i], gravity->z[i] };
+      vkm_vec3 pull = gravity_pull(list, point, softening_squared);
+      vkm_muladd(&pull, gravity->gravitational_constant * gravity->masses[i], gravity->forces[i]);
+    }
+  }
+}
+
+// Every float array of the particle world, so they can be grown and freed together.
+#define FUN_PARTICLE_FLOATS(world) { \
+  &(world)->x, &(world)->y, &(world)->z, &(world)->previous_x, &(world)->previous_y, &(world)->previous_z, \
+  &(world)->vx, &(world)->vy, &(world)->vz, &(world)->ax, &(world)->ay, &(world)->az, \
+  &(world)->radii, &(world)->inverse_masses, &(world)->damping_rates, &(world)->reaches, \
+}
+
+static void particle_constraints_free(fun_particle_constraints_t* constraints) {
+  free(constraints->a);
+  free(constraints->b);
+  free(constraints->lengths);
+  free(constraints->compliances);
+}
+
+static void particle_world_3d_free(ParticleWorld3D* world) {
+  float** floats[] = FUN_PARTICLE_FLOATS(world);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    free(*floats[i]);
+  }
+  free(world->entities);
+  free(world->positions);
+  free(world->velocities);
+  free(world->interpolations);
+  particle_constraints_free(&world->cached_links);
+  free(world->link_entities);
+  particle_constraints_free(&world->links);
+  free(world->contacts.pairs);
+  grid_free(&world->grid);
+}
+
+ECS_CTOR(ParticleWorld3D, ptr, {
+  *ptr = (ParticleWorld3D){ 0 };
+})
+
+ECS_MOVE(ParticleWorld3D, dst, src, {
+  particle_world_3d_free(dst);
+  *dst = *src;
+  *src = (ParticleWorld3D){ 0 };
+})
+
+ECS_DTOR(ParticleWorld3D, ptr, {
+  particle_world_3d_free(ptr);
+  *ptr = (ParticleWorld3D){ 0 };
+})
+
+static void particle_world_3d_reserve(ParticleWorld3D* world, const int32_t count) {
+  if (count <= world->capacity) {
+    return;
+  }
+
+  int32_t capacity = world->capacity ? world->capacity : 64;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  float** floats[] = FUN_PARTICLE_FLOATS(world);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    *floats[i] = realloc(*floats[i], capacity * sizeof(float));
+  }
+  world->entities = realloc(world->entities, capacity * sizeof(ecs_entity_t));
+  world->positions = realloc(world->positions, capacity * sizeof(Position3D*));
+  world->velocities = realloc(world->velocities, capacity * sizeof(Velocity3D*));
+  world->interpolations = realloc(world->interpolations, capacity * sizeof(Interpolation3D*));
+  world->grid.buckets = realloc(world->grid.buckets, capacity * sizeof(uint32_t));
+  world->grid.cells = realloc(world->grid.cells, capacity * sizeof(fun_grid_body_t));
+  world->grid.sorted = realloc(world->grid.sorted, capacity * sizeof(fun_grid_body_t));
+  world->capacity = capacity;
+}
+
+// Every float array of fluid particles, so they can be grown and freed together.
+#define FUN_FLUID_FLOATS(particles) { \
+  &(particles)->x, &(particles)->y, &(particles)->z, &(particles)->vx, &(particles)->vy, &(particles)->vz, \
+  &(particles)->masses, \
+}
+
+static void fluid_particles_free(fun_fluid_particles_t* particles) {
+  float** floats[] = FUN_FLUID_FLOATS(particles);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    free(*floats[i]);
+  }
+  free(particles->cells);
+  free(particles->forces);
+}
+
+static void fluid_particles_reserve(fun_fluid_particles_t* particles, const int32_t capacity) {
+  float** floats[] = FUN_FLUID_FLOATS(particles);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    *floats[i] = realloc(*floats[i], capacity * sizeof(float));
+  }
+  particles->cells = realloc(particles->cells, capacity * sizeof(vkm_ivec3));
+  particles->forces = realloc(particles->forces, capacity * sizeof(Force3D*));
+}
+
+#define FUN_FLUID_NEIGHBOR_FLOATS(neighbors) { \
+  &(neighbors)->x, &(neighbors)->y, &(neighbors)->z, &(neighbors)->vx, &(neighbors)->vy, &(neighbors)->vz, \
+  &(neighbors)->masses, &(neighbors)->pressure_terms, &(neighbors)->volumes, \
+}
+
+static void fluid_neighbors_free(fun_fluid_neighbors_t* neighbors) {
+  float** floats[] = FUN_FLUID_NEIGHBOR_FLOATS(neighbors);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    free(*floats[i]);
+  }
+}
+
+static void fluid_neighbors_reserve(fun_fluid_neighbors_t* neighbors, const int32_t count) {
+  if (count <= neighbors->capacity) {
+    return;
+  }
+
+  int32_t capacity = neighbors->capacity ? neighbors->capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  float** floats[] = FUN_FLUID_NEIGHBOR_FLOATS(neighbors);
+  for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+    *floats[i] = realloc(*floats[i], capacity * sizeof(float));
+  }
+  neighbors->capacity = capacity;
+}
+
+static void fluid_world_3d_free(FluidWorld3D* fluid) {
+  fluid_particles_free(&fluid->gathered);
+  fluid_particles_free(&fluid->sorted);
+  free(fluid->own_forces);
+  free(fluid->densities);
+  free(fluid->pressure_terms);
+  free(fluid->volumes);
+  free(fluid->buckets);
+  free(fluid->cell_starts);
+  for (int32_t i = 0; i < fluid->neighbors_count; i++) {
+    fluid_neighbors_free(fluid->neighbors + i);
+  }
+  free(fluid->neighbors);
+}
+
+ECS_MOVE(FluidWorld3D, dst, src, {
+  fluid_world_3d_free(dst);
+  *dst = *src;
+  *src = (FluidWorld3D){ 0 };
+})
+
+ECS_DTOR(FluidWorld3D, ptr, {
+  fluid_world_3d_free(ptr);
+  *ptr = (FluidWorld3D){ 0 };
+})
+
+static void fluid_world_3d_reserve(FluidWorld3D* fluid, const int32_t count) {
+  if (count <= fluid->capacity) {
+    return;
+  }
+
+  int32_t capacity = fluid->capacity ? fluid->capacity : 64;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  fluid_particles_reserve(&fluid->gathered, capacity);
+  fluid_particles_reserve(&fluid->sorted, capacity);
+  fluid->own_forces = realloc(fluid->own_forces, capacity * sizeof(Force3D));
+  fluid->densities = realloc(fluid->densities, capacity * sizeof(float));
+  fluid->pressure_terms = realloc(fluid->pressure_terms, capacity * sizeof(float));
+  fluid->volumes = realloc(fluid->volumes, capacity * sizeof(float));
+  fluid->buckets = realloc(fluid->buckets, capacity * sizeof(uint32_t));
+  fluid->capacity = capacity;
+}
+
+static void push_particle_constraint(
+  fun_particle_constraints_t* constraints,
+  const uint32_t a,
+  const uint32_t b,
+  const float length,
+  const float compliance
+) {
+  if (constraints->count == constraints->capacity) {
+    const int32_t capacity = constraints->capacity ? constraints->capacity * 2 : 64;
+    constraints->a = realloc(constraints->a, capacity * sizeof(uint32_t));
+    constraints->b = realloc(constraints->b, capacity * sizeof(uint32_t));
+    constraints->lengths = realloc(constraints->lengths, capacity * sizeof(float));
+    constraints->compliances = realloc(constraints->compliances, capacity * sizeof(float));
+    constraints->capacity = capacity;
+  }
+
+  const int32_t i = constraints->count++;
+  constraints->a[i] = a;
+  constraints->b[i] = b;
+  constraints->lengths[i] = length;
+  constraints->compliances[i] = compliance;
+}
+
+// The entities go along with the constraint, for the particles are gathered in another order whenever one of them
+// changes table.
+static void push_particle_link(
+  ParticleWorld3D* world,
+  const ecs_entity_t a,
+  const ecs_entity_t b,
+  const DistanceLink3D* link
+) {
+  fun_particle_constraints_t* cached = &world->cached_links;
+  // Grows along with the constraints.
+  if (cached->count == cached->capacity) {
+    const int32_t capacity = cached->capacity ? cached->capacity * 2 : 64;
+    world->link_entities = realloc(world->link_entities, capacity * 2 * sizeof(ecs_entity_t));
+  }
+
+  world->link_entities[cached->count * 2] = a;
+  world->link_entities[cached->count * 2 + 1] = b;
+  push_particle_constraint(cached, UINT32_MAX, UINT32_MAX, link->rest_length, link->compliance);
+}
+
+static void push_pair(fun_pair_buffer_t* buffer, const uint32_t a, const uint32_t b) {
+  buffer->pairs = reserve(buffer->pairs, &buffer->capacity, buffer->count + 1, sizeof(fun_pair_t));
+  buffer->pairs[buffer->count++] = (fun_pair_t){ a < b ? a : b, a < b ? b : a };
+}
+
+static uint32_t grid_hash(const vkm_ivec3* cell, const uint32_t mask) {
+  return ((uint32_t)cell->x + (uint32_t)cell->y * 19349663u + (uint32_t)cell->z * 83492791u) & mask;
+}
+
+static fun_aabb_t aabb_union(const fun_aabb_t* a, const fun_aabb_t* b) {
+  return (fun_aabb_t){
+    { { fminf(a->min.x, b->min.x), fminf(a->min.y, b->min.y), fminf(a->min.z, b->min.z) } },
+    { { fmaxf(a->max.x, b->max.x), fmaxf(a->max.y, b->max.y), fmaxf(a->max.z, b->max.z) } },
+  };
+}
+
+// Half the surface area, which is what the cost of descending into a node is proportional to.
+static float aabb_area(const fun_aabb_t* aabb) {
+  const float x = aabb->max.x - aabb->min.x, y = aabb->max.y - aabb->min.y, z = aabb->max.z - aabb->min.z;
+  return x * y + y * z + z * x;
+}
+
+static bool aabb_contains(const fun_aabb_t* a, const fun_aabb_t* b) {
+  return
+    a->min.x <= b->min.x && a->min.y <= b->min.y && a->min.z <= b->min.z &&
+    a->max.x >= b->max.x && a->max.y >= b->max.y && a->max.z >= b->max.z;
+}
+
+static bool aabb_overlaps(const fun_aabb_t* a, const fun_aabb_t* b) {
+  return
+    a->min.x <= b->max.x && a->min.y <= b->max.y && a->min.z <= b->max.z &&
+    a->max.x >= b->min.x && a->max.y >= b->min.y && a->max.z >= b->min.z;
+}
+
+static fun_aabb_t sphere_aabb(const float x, const float y, const float z, const float radius) {
+  return (fun_aabb_t){ { { x - radius, y - radius, z - radius } }, { { x + radius, y + radius, z + radius } } };
+}
+
+static uint32_t tree_allocate_node(fun_aabb_tree_t* tree) {
+  uint32_t node = tree->free_list;
+  if (node != FUN_NULL_NODE) {
+    tree->free_list = tree->nodes[node].parent;
+  } else {
+    // The node 0 is skipped, it's the null handle.
+    if (!tree->nodes_count) {
+      tree->nodes_count = 1;
+    }
+    tree->nodes = reserve(tree->nodes, &tree->nodes_capacity, tree->nodes_count + 1, sizeof(fun_tree_node_t));
+    node = (uint32_t)tree->nodes_count++;
+  }
+
+  tree->nodes[node] = (fun_tree_node_t){ .parent = FUN_NULL_NODE };
+  return node;
+}
+
+static void tree_free_node(fun_aabb_tree_t* tree, const uint32_t node) {
+  tree->nodes[node] = (fun_tree_node_t){ .parent = tree->free_list, .height = -1 };
+  tree->free_list = node;
+}
+
+static void tree_refit_node(fun_aabb_tree_t* tree, const uint32_t node) {
+  fun_tree_node_t* nodes = tree->nodes;
+  const fun_tree_node_t* a = nodes + nodes[node].children[0];
+  const fun_tree_node_t* b = nodes + nodes[node].children[1];
+  nodes[node].aabb = aabb_union(&a->aabb, &b->aabb);
+  nodes[node].height = 1 + (a->height > b->height ? a->height : b->height);
+}
+
+static void tree_replace_child(fun_aabb_tree_t* tree, const uint32_t parent, const uint32_t old, const uint32_t new) {
+  if (parent == FUN_NULL_NODE) {
+    tree->root = new;
+  } else if (tree->nodes[parent].children[0] == old) {
+    tree->nodes[parent].children[0] = new;
+  } else {
+    tree->nodes[parent].children[1] = new;
+  }
+}
+
+// If the subtrees of a differ in height by more than one, lifts the taller child in its place and returns it. The
+// taller grandchild stays with the lifted child and the other one moves under a.
+static uint32_t tree_balance(fun_aabb_tree_t* tree, const uint32_t a) {
+  fun_tree_node_t* nodes = tree->nodes;
+  if (nodes[a].height < 2) {
+    return a;
+  }
+
+  int side;
+  const int32_t balance = nodes[nodes[a].children[1]].height - nodes[nodes[a].children[0]].height;
+  if (balance > 1) {
+    side = 1;
+  } else if (balance < -1) {
+    side = 0;
+  } else {
+    return a;
+  }
+
+  const uint32_t up = nodes[a].children[side];
+  const uint32_t f = nodes[up].children[0], g = nodes[up].children[1];
+
+  nodes[up].parent = nodes[a].parent;
+  tree_replace_child(tree, nodes[a].parent, a, up);
+  nodes[a].parent = up;
+  nodes[up].children[0] = a;
+
+  const uint32_t kept = nodes[f].height > nodes[g].height ? f : g;
+  const uint32_t moved = kept == f ? g : f;
+  nodes[up].children[1] = kept;
+  nodes[a].children[side] = moved;
+  nodes[moved].parent = a;
+
+  tree_refit_node(tree, a);
+  tree_refit_node(tree, up);
+  return up;
+}
+
+// Walks up from node to the root, rebalancing and refitting every ancestor.
+static void tree_refit_ancestors(fun_aabb_tree_t* tree, uint32_t node) {
+  while (node != FUN_NULL_NODE) {
+    node = tree_balance(tree, node);
+    tree_refit_node(tree, node);
+    node = tree->nodes[node].parent;
+  }
+}
+
+// Descends to the sibling that grows the total surface area the least, the usual surface area heuristic, and pairs
+// the leaf with it under a new node.
+static void tree_insert_leaf(fun_aabb_tree_t* tree, const uint32_t leaf) {
+  tree->nodes[leaf].linked = true;
+  if (tree->root == FUN_NULL_NODE) {
+    tree->root = leaf;
+    tree->nodes[leaf].parent = FUN_NULL_NODE;
+    return;
+  }
+
+  const fun_aabb_t bounds = tree->nodes[leaf].aabb;
+  uint32_t sibling = tree->root;
+  while (tree->nodes[sibling].height > 0) {
+    const fun_tree_node_t* node = tree->nodes + sibling;
+    const fun_aabb_t combined = aabb_union(&node->aabb, &bounds);
+    const float combined_area = aabb_area(&combined);
+    // Creating a new parent here, versus the area every ancestor of a child gains by going down.
+    const float cost = 2.0f * combined_area;
+    const float inheritance_cost = 2.0f * (combined_area - aabb_area(&node->aabb));
+
+    float child_costs[2];
+    for (int i = 0; i < 2; i++) {
+      const fun_tree_node_t* child = tree->nodes + node->children[i];
+      const fun_aabb_t grown = aabb_union(&child->aabb, &bounds);
+      child_costs[i] = aabb_area(&grown) + inheritance_cost;
+      if (child->height > 0) {
+        child_costs[i] -= aabb_area(&child->aabb);
+      }
+    }
+
+    if (cost < child_costs[0] && cost < child_costs[1]) {
+      break;
+    }
+    sibling = node->children[child_costs[0] < child_costs[1] ? 0 : 1];
+  }
+
+  const uint32_t old_parent = tree->nodes[sibling].parent;
+  // May move the nodes.
+  const uint32_t parent = tree_allocate_node(tree);
+  fun_tree_node_t* nodes = tree->nodes;
+  nodes[parent].parent = old_parent;
+  nodes[parent].children[0] = sibling;
+  nodes[parent].children[1] = leaf;
+  nodes[sibling].parent = parent;
+  nodes[leaf].parent = parent;
+  tree_replace_child(tree, old_parent, sibling, parent);
+  tree_refit_ancestors(tree, parent);
+}
+
+static void tree_remove_leaf(fun_aabb_tree_t* tree, const uint32_t leaf) {
+  fun_tree_node_t* nodes = tree->nodes;
+  nodes[leaf].linked = false;
+  if (leaf == tree->root) {
+    tree->root = FUN_NULL_NODE;
+    return;
+  }
+
+  const uint32_t parent = nodes[leaf].parent;
+  const uint32_t grandparent = nodes[parent].parent;
+  const uint32_t sibling = nodes[parent].children[nodes[parent].children[0] == leaf ? 1 : 0];
+
+  nodes[sibling].parent = grandparent;
+  tree_replace_child(tree, grandparent, parent, sibling);
+  tree_free_node(tree, parent);
+  tree_refit_ancestors(tree, grandparent);
+}
+
+// Every body with bounds gets an unlinked leaf right away. It's only inserted into the tree once the tree is in use,
+// so the grid doesn't pay for it.
+static void AddBroadphaseProxy3D(ecs_iter_t* it) {
+  BroadphaseProxy3D* proxies = ecs_field(it, BroadphaseProxy3D, 0);
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+
+  for (int i = 0; i < it->count; i++) {
+    proxies[i] = FUN_NULL_NODE;
+    if (world) {
+      proxies[i] = tree_allocate_node(&world->tree);
+      world->tree.nodes[proxies[i]].entity = it->entities[i];
+    }
+  }
+}
+
+static void RemoveBroadphaseProxy3D(ecs_iter_t* it) {
+  BroadphaseProxy3D* proxies = ecs_field(it, BroadphaseProxy3D, 0);
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (!world) {
+    return;
+  }
+
+  for (int i = 0; i < it->count; i++) {
+    const uint32_t leaf = proxies[i];
+    if (leaf == FUN_NULL_NODE || leaf >= (uint32_t)world->tree.nodes_count) {
+      continue;
+    }
+
+    fun_aabb_tree_t* tree = &world->tree;
+    if (tree->nodes[leaf].linked) {
+      tree_remove_leaf(tree, leaf);
+    }
+    // Freed once its proxy pairs are gone, for the same handle could otherwise be reused by another body.
+    tree->nodes[leaf].entity = 0;
+    tree->nodes[leaf].moved = true;
+    tree->removed = reserve(tree->removed, &tree->removed_capacity, tree->removed_count + 1, sizeof(uint32_t));
+    tree->removed[tree->removed_count++] = leaf;
+    proxies[i] = FUN_NULL_NODE;
+  }
+}
+
+// Called for each body while gathering them. Only the leaves whose body left their fattened bounds are reinserted,
+// and only those are looked up in the tree during the pair search.
+static void tree_update_leaf(
+  fun_aabb_tree_t* tree,
+  const uint32_t leaf,
+  const uint32_t body,
+  const fun_aabb_t* bounds,
+  const float margin
+) {
+  fun_tree_node_t* node = tree->nodes + leaf;
+  node->body = body;
+  if (node->linked && aabb_contains(&node->aabb, bounds)) {
+    return;
+  }
+
+  if (node->linked) {
+    tree_remove_leaf(tree, leaf);
+  }
+  if (!node->moved) {
+    node->moved = true;
+    tree->moved = reserve(tree->moved, &tree->moved_capacity, tree->moved_count + 1, sizeof(uint32_t));
+    tree->moved[tree->moved_count++] = leaf;
+  }
+  node->aabb = (fun_aabb_t){
+    { { bounds->min.x - margin, bounds->min.y - margin, bounds->min.z - margin } },
+    { { bounds->max.x + margin, bounds->max.y + margin, bounds->max.z + margin } },
+  };
+  tree_insert_leaf(tree, leaf);
+}
+
+// Sorts spheres into a hashed uniform grid with a counting sort: one pass to count the spheres per bucket, a prefix
+// sum, and one pass to scatter them. Each bucket ends up contiguous in memory, with a copy of everything the pair
+// search reads, so it doesn't have to chase indices back into the sphere arrays. The cells and buckets arrays must
+// hold count entries, and the cells be at least twice as large as the largest radius.
+static void build_grid(
+  fun_grid_t* grid,
+  const int32_t count,
+  const float* xs,
+  const float* ys,
+  const float* zs,
+  const float* radii,
+  float cell_size
+) {
+  if (cell_size <= 0.0f) {
+    cell_size = 1.0f;
+  }
+  grid->inverse_cell_size = 1.0f / cell_size;
+
+  // About two buckets per sphere keeps hash collisions between distinct cells rare.
+  uint32_t buckets = 1;
+  while (buckets < 2u * (uint32_t)count) {
+    buckets *= 2;
+  }
+  grid->cell_starts = reserve(grid->cell_starts, &grid->buckets_capacity, (int32_t)buckets + 1, sizeof(uint32_t));
+  grid->buckets_count = buckets;
+  memset(grid->cell_starts, 0, (buckets + 1) * sizeof(uint32_t));
+
+  const uint32_t mask = buckets - 1;
+  const float inverse_cell_size = grid->inverse_cell_size;
+  for (int32_t i = 0; i < count; i++) {
+    fun_grid_body_t* body = grid->cells + i;
+    *body = (fun_grid_body_t){
+      .x = xs[i],
+      .y = ys[i],
+      .z = zs[i],
+      .radius = radii[i],
+      .cell = { {
+        (int32_t)floorf(xs[i] * inverse_cell_size),
+        (int32_t)floorf(ys[i] * inverse_cell_size),
+        (int32_t)floorf(zs[i] * inverse_cell_size),
+      } },
+      .index = (uint32_t)i,
+    };
+    grid->buckets[i] = grid_hash(&body->cell, mask);
+    grid->cell_starts[grid->buckets[i] + 1]++;
+  }
+
+  for (uint32_t i = 0; i < buckets; i++) {
+    grid->cell_starts[i + 1] += grid->cell_starts[i];
+  }
+
+  // Scatter using the bucket starts as cursors, then shift them back into place.
+  for (int32_t i = 0; i < count; i++) {
+    grid->sorted[grid->cell_starts[grid->buckets[i]]++] = grid->cells[i];
+  }
+  memmove(grid->cell_starts + 1, grid->cell_starts, buckets * sizeof(uint32_t));
+  grid->cell_starts[0] = 0;
+}
+
+// Drops the proxy pairs of the leaves that moved or were removed, which frees the removed leaves for good. The pair
+// search finds the current pairs of the moved ones again.
+static void tree_purge_proxy_pairs(fun_aabb_tree_t* tree) {
+  const fun_tree_node_t* nodes = tree->nodes;
+  fun_pair_buffer_t* proxy_pairs = &tree->proxy_pairs;
+
+  int32_t count = 0;
+  for (int32_t i = 0; i < proxy_pairs->count; i++) {
+    const fun_pair_t pair = proxy_pairs->pairs[i];
+    if (!nodes[pair.a].moved && !nodes[pair.b].moved) {
+      proxy_pairs->pairs[count++] = pair;
+    }
+  }
+  proxy_pairs->count = count;
+
+  for (int32_t i = 0; i < tree->removed_count; i++) {
+    tree_free_node(tree, tree->removed[i]);
+  }
+  tree->removed_count = 0;
+}
+
+// The radius of the largest ball centered on the position that surely fits inside the shape.
+static float core_radius(const fun_shape_t* shape) {
+  switch (shape->type) {
+    case FUN_SHAPE_SPHERE:
+      return shape->sphere.radius;
+    case FUN_SHAPE_BOX:
+      return fminf(shape->box.half_extents.x, fminf(shape->box.half_extents.y, shape->box.half_extents.z));
+    case FUN_SHAPE_CAPSULE:
+      return shape->capsule.radius;
+    default:
+      return 0.0f;
+  }
+}
+
+// Remembers a body as a bullet, and returns how far it moved since its sweep origin.
+static float push_bullet(
+  CollisionWorld3D* world,
+  const uint32_t body,
+  const SweepOrigin3D* origin,
+  const Position3D* position
+) {
+  const int32_t count = world->bullets_count + 1;
+  int32_t capacity = world->bullets_capacity;
+  world->bullets = reserve(world->bullets, &capacity, count, sizeof(uint32_t));
+  capacity = world->bullets_capacity;
+  world->bullet_origins = reserve(world->bullet_origins, &capacity, count, sizeof(vkm_vec3));
+  capacity = world->bullets_capacity;
+  world->bullet_radii = reserve(world->bullet_radii, &capacity, count, sizeof(float));
+  world->bullet_times = reserve(world->bullet_times, &world->bullets_capacity, count, sizeof(float));
+
+  world->bullets[world->bullets_count] = body;
+  world->bullet_origins[world->bullets_count] = *origin;
+  world->bullet_radii[world->bullets_count] = core_radius(world->shapes + body);
+  world->bullets_count = count;
+
+  vkm_vec3 sweep, start = *origin;
+  vkm_sub(position, &start, &sweep);
+  return vkm_magnitude(&sweep);
+}
+
+// Collects every body with bounds, then updates the tree or rebuilds the grid, whichever is in use.
+static void UpdateBroadphase3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (!world) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  const bool use_tree = world->broadphase == FUN_BROADPHASE_TREE;
+  const float margin = world->aabb_margin > 0.0f ? world->aabb_margin : FUN_DEFAULT_AABB_MARGIN;
+
+  world->bodies_count = 0;
+  world->bullets_count = 0;
+  float max_radius = 0.0f;
+  while (ecs_iter_next(it)) {
+    const Position3D* positions = ecs_field(it, Position3D, 0);
+    const BoundingRadius* radii = ecs_field(it, BoundingRadius, 1);
+    BroadphaseProxy3D* proxies = ecs_field(it, BroadphaseProxy3D, 2);
+    const Rotation3D* rotations = ecs_field(it, Rotation3D, 4);
+    const Sphere* spheres = ecs_field(it, Sphere, 5);
+    const Box* boxes = ecs_field(it, Box, 6);
+    const Capsule* capsules = ecs_field(it, Capsule, 7);
+    const ConvexHull* convex_hulls = ecs_field(it, ConvexHull, 8);
+    Velocity3D* velocities = ecs_field(it, Velocity3D, 9);
+    AngularVelocity3D* angular_velocities = ecs_field(it, AngularVelocity3D, 10);
+    const InverseMass* inverse_masses = ecs_field(it, InverseMass, 11);
+    const int inverse_mass_stride = ecs_field_is_self(it, 11);
+    const InverseInertia3D* inverse_inertias = ecs_field(it, InverseInertia3D, 12);
+    const bool sleeping = ecs_field_is_set(it, 13);
+    Sleepable* sleepables = ecs_field(it, Sleepable, 14);
+    const SweepOrigin3D* origins = ecs_field(it, SweepOrigin3D, 15);
+
+    const int32_t count = world->bodies_count + it->count;
+    collision_world_3d_reserve(world, count);
+
+    for (int i = 0; i < it->count; i++) {
+      const int32_t body = world->bodies_count + i;
+      world->entities[body] = it->entities[i];
+      world->x[body] = positions[i].x;
+      world->y[body] = positions[i].y;
+      world->z[body] = positions[i].z;
+      fun_shape_t* shape = world->shapes + body;
+      shape->rotation = rotations ? rotations[i] : (Rotation3D){ { 0.0f, 0.0f, 0.0f, 1.0f } };
+      if (spheres) {
+        shape->type = FUN_SHAPE_SPHERE;
+        shape->sphere = spheres[i];
+      } else if (boxes) {
+        shape->type = FUN_SHAPE_BOX;
+        shape->box = boxes[i];
+      } else if (capsules) {
+        shape->type = FUN_SHAPE_CAPSULE;
+        shape->capsule = capsules[i];
+      } else if (convex_hulls) {
+        shape->type = FUN_SHAPE_CONVEX_HULL;
+        shape->convex_hull = convex_hulls[i];
+      } else {
+        shape->type = FUN_SHAPE_NONE;
+      }
+
+      // Bullets are found paired with everything along their way.
+      float radius = radii[i];
+      if (origins) {
+        radius += push_bullet(world, (uint32_t)body, origins + i, positions + i);
+      }
+      world->radii[body] = radius;
+      if (radius > max_radius) {
+        max_radius = radius;
+      }
+
+      // Only bodies that the integration moves can be pushed by contacts.
+      const bool moving = velocities && inverse_masses && !sleeping;
+      world->velocities[body] = velocities ? velocities + i : NULL;
+      world->angular_velocities[body] = angular_velocities ? angular_velocities + i : NULL;
+      world->inverse_masses[body] = moving ? inverse_masses[i * inverse_mass_stride] : 0.0f;
+      world->inverse_inertias[body] = moving && angular_velocities && inverse_inertias
+        ? inverse_inertias[i]
+        : CVKM_VEC3_ZERO;
+      world->sleeping[body] = sleeping;
+      world->sleepables[body] = sleepables ? sleepables + i : NULL;
+
+      if (use_tree) {
+        // Bodies that got their bounds before the singleton existed have no leaf yet.
+        if (proxies[i] == FUN_NULL_NODE) {
+          proxies[i] = tree_allocate_node(&world->tree);
+          world->tree.nodes[proxies[i]].entity = it->entities[i];
+        }
+        const fun_aabb_t bounds = sphere_aabb(positions[i].x, positions[i].y, positions[i].z, radius);
+        tree_update_leaf(&world->tree, proxies[i], (uint32_t)body, &bounds, margin);
+      }
+    }
+    world->bodies_count = count;
+  }
+
+  if (!use_tree) {
+    // Overlapping bodies are never further apart than two radii, so they always sit in neighboring cells.
+    const float cell_size = world->cell_size > 2.0f * max_radius ? world->cell_size : 2.0f * max_radius;
+    build_grid(&world->grid, world->bodies_count, world->x, world->y, world->z, world->radii, cell_size);
+  }
+  tree_purge_proxy_pairs(&world->tree);
+
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  if (stages_count > world->stages_count) {
+    world->stages = realloc(world->stages, stages_count * sizeof(fun_stage_pairs_t));
+    for (int32_t i = world->stages_count; i < stages_count; i++) {
+      world->stages[i] = (fun_stage_pairs_t){ 0 };
+    }
+    world->stages_count = stages_count;
+  }
+}
+
+// Only the cells after this one in z, y, x order are searched: the other 13 neighbors find the pair from their side.
+// They're grouped in rows along x, which the hash keeps in consecutive buckets.
+static const struct {
+  int32_t y, z;
+} forward_rows[] = {
+  { 1, 0 },
+  { -1, 1 },
+  { 0, 1 },
+  { 1, 1 },
+};
+
+static void find_pairs_in_range(
+  fun_pair_buffer_t* buffer,
+  const fun_grid_body_t* body,
+  const fun_grid_body_t* begin,
+  const fun_grid_body_t* end,
+  const vkm_ivec3* first_cell,
+  const int32_t last_x
+) {
+  for (const fun_grid_body_t* other = begin; other < end; other++) {
+    // Skip the other cells that happen to share the buckets.
+    if (
+      other->cell.y != first_cell->y ||
+      other->cell.z != first_cell->z ||
+      other->cell.x < first_cell->x ||
+      other->cell.x > last_x
+    ) {
+      continue;
+    }
+
+    const float x = other->x - body->x, y = other->y - body->y, z = other->z - body->z;
+    const float reach = other->radius + body->radius;
+    if (x * x + y * y + z * z <= reach * reach) {
+      push_pair(buffer, body->index, other->index);
+    }
+  }
+}
+
+// Searches the cells from first_cell to last_x along x, reading their buckets as one range when they don't wrap.
+static void find_pairs_in_row(
+  fun_pair_buffer_t* buffer,
+  const fun_grid_body_t* body,
+  const fun_grid_body_t* sorted,
+  const uint32_t* starts,
+  const uint32_t mask,
+  const vkm_ivec3* first_cell,
+  const int32_t last_x
+) {
+  const uint32_t first = grid_hash(first_cell, mask);
+  const uint32_t last = first + (uint32_t)(last_x - first_cell->x);
+  if (last <= mask) {
+    find_pairs_in_range(buffer, body, sorted + starts[first], sorted + starts[last + 1], first_cell, last_x);
+    return;
+  }
+
+  for (int32_t x = first_cell->x; x <= last_x; x++) {
+    const vkm_ivec3 cell = { { x, first_cell->y, first_cell->z } };
+    const uint32_t bucket = grid_hash(&cell, mask);
+    find_pairs_in_range(buffer, body, sorted + starts[bucket], sorted + starts[bucket + 1], &cell, x);
+  }
+}
+
+// Reports the overlapping spheres of the grid whose sorted positions are from begin to end, each pair once, by testing
+// them against their own cell and half of the neighboring ones.
+static void find_grid_pairs(
+  fun_pair_buffer_t* buffer,
+  const fun_grid_t* grid,
+  const uint32_t begin,
+  const uint32_t end
+) {
+  const uint32_t mask = grid->buckets_count - 1;
+  const fun_grid_body_t* sorted = grid->sorted;
+  const uint32_t* starts = grid->cell_starts;
+
+  for (uint32_t s = begin; s < end; s++) {
+    const fun_grid_body_t* body = sorted + s;
+
+    // Within its own cell, a body only looks at the ones after it so each pair is reported once.
+    const uint32_t bucket = grid_hash(&body->cell, mask);
+    find_pairs_in_range(buffer, body, body + 1, sorted + starts[bucket + 1], &body->cell, body->cell.x);
+    const vkm_ivec3 next = { { body->cell.x + 1, body->cell.y, body->cell.z } };
+    find_pairs_in_row(buffer, body, sorted, starts, mask, &next, next.x);
+
+    for (size_t i = 0; i < FUN_COUNTOF(forward_rows); i++) {
+      const vkm_ivec3 first = { {
+        body->cell.x - 1,
+        body->cell.y + forward_rows[i].y,
+        body->cell.z + forward_rows[i].z,
+      } };
+      find_pairs_in_row(buffer, body, sorted, starts, mask, &first, body->cell.x + 1);
+    }
+  }
+}
+
+// Deep enough for any tree that fits in memory, since balancing keeps the height logarithmic.
+#define FUN_TREE_STACK_SIZE 256
+
+// Tests the bounding spheres of the bodies of two leaves, and reports them as a pair if they overlap.
+static void test_proxy_pair(fun_pair_buffer_t* buffer, const CollisionWorld3D* world, const fun_pair_t* pair) {
+  const fun_tree_node_t* leaf_a = world->tree.nodes + pair->a;
+  const fun_tree_node_t* leaf_b = world->tree.nodes + pair->b;
+  const uint32_t a = leaf_a->body, b = leaf_b->body;
+
+  // Leaves of bodies that weren't gathered this step, disabled ones for instance, are stale.
+  const uint32_t count = (uint32_t)world->bodies_count;
+  if (a >= count || b >= count || world->entities[a] != leaf_a->entity || world->entities[b] != leaf_b->entity) {
+    return;
+  }
+
+  const float x = world->x[b] - world->x[a], y = world->y[b] - world->y[a], z = world->z[b] - world->z[a];
+  const float reach = world->radii[a] + world->radii[b];
+  if (x * x + y * y + z * z <= reach * reach) {
+    push_pair(buffer, a, b);
+  }
+}
+
+// Finds the leaves whose bounds overlap the ones of a moved leaf. When both moved, only the query of the one with the
+// smaller handle reports them.
+static void find_proxy_pairs(fun_stage_pairs_t* stage, const CollisionWorld3D* world, const uint32_t leaf) {
+  const fun_tree_node_t* nodes = world->tree.nodes;
+  if (!nodes[leaf].linked) {
+    return;
+  }
+  const fun_aabb_t bounds = nodes[leaf].aabb;
+
+  uint32_t stack[FUN_TREE_STACK_SIZE];
+  int32_t stack_count = 0;
+  stack[stack_count++] = world->tree.root;
+
+  while (stack_count) {
+    const uint32_t other = stack[--stack_count];
+    const fun_tree_node_t* node = nodes + other;
+    if (!aabb_overlaps(&node->aabb, &bounds)) {
+      continue;
+    }
+
+    if (node->height > 0) {
+      assert(stack_count + 2 <= FUN_TREE_STACK_SIZE);
+      stack[stack_count++] = node->children[0];
+      stack[stack_count++] = node->children[1];
+      continue;
+    }
+
+    if (other == leaf || (node->moved && other < leaf)) {
+      continue;
+    }
+
+    const fun_pair_t pair = { leaf < other ? leaf : other, leaf < other ? other : leaf };
+    push_pair(&stage->new_proxy_pairs, pair.a, pair.b);
+    test_proxy_pair(&stage->new_pairs, world, &pair);
+  }
+}
+
+// Each worker takes a contiguous slice of the work. With the grid, that's bodies, tested against their own cell and
+// half of the neighboring ones. With the tree, that's the known proxy pairs, whose spheres are tested, and the moved
+// leaves, looked up in the tree for new proxy pairs.
+static void FindPairs3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (!world || !world->stages) {
+    return;
+  }
+
+  const int32_t stage = ecs_stage_get_id(it->world);
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  fun_stage_pairs_t* buffers = world->stages + stage;
+  fun_pair_buffer_t* buffer = &buffers->pairs;
+  buffer->count = 0;
+
+  if (world->broadphase == FUN_BROADPHASE_TREE) {
+    const fun_aabb_tree_t* tree = &world->tree;
+    const int32_t pairs_begin = (int32_t)((int64_t)tree->proxy_pairs.count * stage / stages_count);
+    const int32_t pairs_end = (int32_t)((int64_t)tree->proxy_pairs.count * (stage + 1) / stages_count);
+    for (int32_t i = pairs_begin; i < pairs_end; i++) {
+      test_proxy_pair(buffer, world, tree->proxy_pairs.pairs + i);
+    }
+
+    buffers->new_pairs.count = 0;
+    buffers->new_proxy_pairs.count = 0;
+    const int32_t moved_begin = (int32_t)((int64_t)tree->moved_count * stage / stages_count);
+    const int32_t moved_end = (int32_t)((int64_t)tree->moved_count * (stage + 1) / stages_count);
+    for (int32_t i = moved_begin; i < moved_end; i++) {
+      find_proxy_pairs(buffers, world, tree->moved[i]);
+    }
+    return;
+  }
+
+  const uint32_t begin = (uint32_t)((int64_t)world->bodies_count * stage / stages_count);
+  const uint32_t end = (uint32_t)((int64_t)world->bodies_count * (stage + 1) / stages_count);
+  find_grid_pairs(buffer, &world->grid, begin, end);
+}
+
+static void append_pairs(fun_pair_t** pairs, int32_t* count, int32_t* capacity, fun_pair_buffer_t* buffer) {
+  if (!buffer->count) {
+    return;
+  }
+
+  *pairs = reserve(*pairs, capacity, *count + buffer->count, sizeof(fun_pair_t));
+  memcpy(*pairs + *count, buffer->pairs, buffer->count * sizeof(fun_pair_t));
+  *count += buffer->count;
+  buffer->count = 0;
+}
+
+// Orders pairs by their smaller body, then the other one, whichever way around they were found.
+static uint64_t pair_key(const fun_pair_t* pair) {
+  const uint32_t low = pair->a < pair->b ? pair->a : pair->b;
+  const uint32_t high = pair->a < pair->b ? pair->b : pair->a;
+  return (uint64_t)low << 32 | high;
+}
+
+static int compare_pairs(const void* a, const void* b) {
+  const uint64_t key_a = pair_key(a), key_b = pair_key(b);
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+// Concatenates the pairs of every worker in stage order, the known ones first, which gives the same list whatever the
+// thread count. The new proxy pairs join the known ones for the next steps.
+static void MergePairs3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_field(it, CollisionWorld3D, 0);
+
+  world->pairs_count = 0;
+  for (int32_t i = 0; i < world->stages_count; i++) {
+    append_pairs(&world->pairs, &world->pairs_count, &world->pairs_capacity, &world->stages[i].pairs);
+  }
+
+  fun_aabb_tree_t* tree = &world->tree;
+  for (int32_t i = 0; i < world->stages_count; i++) {
+    append_pairs(&world->pairs, &world->pairs_count, &world->pairs_capacity, &world->stages[i].new_pairs);
+    append_pairs(
+      &tree->proxy_pairs.pairs,
+      &tree->proxy_pairs.count,
+      &tree->proxy_pairs.capacity,
+      &world->stages[i].new_proxy_pairs
+    );
+  }
+
+  // The order of the proxy pairs depends on the history of the tree, which snapshots don't keep, so the pairs are
+  // sorted by bodies to be the same after a restore.
+  if (world->broadphase == FUN_BROADPHASE_TREE) {
+    qsort(world->pairs, world->pairs_count, sizeof(fun_pair_t), compare_pairs);
+  }
+
+  // Removed leaves stay marked until their pairs are purged.
+  for (int32_t i = 0; i < tree->moved_count; i++) {
+    fun_tree_node_t* leaf = tree->nodes + tree->moved[i];
+    if (leaf->linked) {
+      leaf->moved = false;
+    }
+  }
+  tree->moved_count = 0;
+}
+
+ECS_CTOR(ConvexHull, ptr, {
+  *ptr = (ConvexHull){ 0 };
+})
+
+ECS_COPY(ConvexHull, dst, src, {
+  free(dst->points);
+  dst->points = NULL;
+  dst->count = src->count;
+  if (src->count > 0) {
+    dst->points = malloc(src->count * sizeof(vkm_vec3));
+    memcpy(dst->points, src->points, src->count * sizeof(vkm_vec3));
+  }
+})
+
+ECS_MOVE(ConvexHull, dst, src, {
+  free(dst->points);
+  *dst = *src;
+  *src = (ConvexHull){ 0 };
+})
+
+ECS_DTOR(ConvexHull, ptr, {
+  free(ptr->points);
+  *ptr = (ConvexHull){ 0 };
+})
+
+// The bounding radius of every shape is the distance of its furthest point from Position3D.
+static void OnSetSphere(ecs_iter_t* it) {
+  const Sphere* spheres = ecs_field(it, Sphere, 0);
+  for (int i = 0; i < it->count; i++) {
+    ecs_set(it->world, it->entities[i], BoundingRadius, { spheres[i].radius });
+  }
+}
+
+static void OnSetBox(ecs_iter_t* it) {
+  const Box* boxes = ecs_field(it, Box, 0);
+  for (int i = 0; i < it->count; i++) {
+    ecs_set(it->world, it->entities[i], BoundingRadius, { vkm_magnitude(&boxes[i].half_extents) });
+  }
+}
+
+static void OnSetCapsule(ecs_iter_t* it) {
+  const Capsule* capsules = ecs_field(it, Capsule, 0);
+  for (int i = 0; i < it->count; i++) {
+    ecs_set(it->world, it->entities[i], BoundingRadius, { capsules[i].radius + capsules[i].half_height });
+  }
+}
+
+static void OnSetConvexHull(ecs_iter_t* it) {
+  const ConvexHull* convex_hulls = ecs_field(it, ConvexHull, 0);
+  for (int i = 0; i < it->count; i++) {
+    float radius = 0.0f;
+    for (int32_t j = 0; j < convex_hulls[i].count; j++) {
+      radius = fmaxf(radius, vkm_magnitude(convex_hulls[i].points + j));
+    }
+    ecs_set(it->world, it->entities[i], BoundingRadius, { radius });
+  }
+}
+
+// Collects the planes every step, since there are few of them and every body is tested against all of them.
+static void GatherPlanes3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (!world) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  world->planes_count = 0;
+  while (ecs_iter_next(it)) {
+    const Plane* planes = ecs_field(it, Plane, 0);
+
+    const int32_t count = world->planes_count + it->count;
+    int32_t capacity = world->planes_capacity;
+    world->planes = reserve(world->planes, &capacity, count, sizeof(Plane));
+    world->plane_entities = reserve(world->plane_entities, &world->planes_capacity, count, sizeof(ecs_entity_t));
+
+    memcpy(world->planes + world->planes_count, planes, it->count * sizeof(Plane));
+    memcpy(world->plane_entities + world->planes_count, it->entities, it->count * sizeof(ecs_entity_t));
+    world->planes_count = count;
+  }
+}
+
+#define FUN_GJK_MAX_ITERATIONS 64
+#define FUN_EPA_MAX_ITERATIONS 64
+#define FUN_EPA_MAX_FACES 128
+#define FUN_EPA_TOLERANCE 0.001f
+// Cached contacts that drift further than this apart, along the normal or across it, are dropped.
+#define FUN_CONTACT_BREAKING_DISTANCE 0.02f
+
+// A shape placed in the world.
+typedef struct collider_t {
+  const fun_shape_t* shape;
+  vkm_vec3 position;
+} collider_t;
+
+// A single point of contact, before it becomes part of a manifold.
+typedef struct contact_point_t {
+  // Pointing from the first shape towards the second one.
+  vkm_vec3 normal;
+  // The deepest point of each shape inside the other one, in world space.
+  vkm_vec3 points[2];
+  float depth;
+} contact_point_t;
+
+static collider_t body_collider(const CollisionWorld3D* world, const uint32_t body) {
+  return (collider_t){
+    world->shapes + body,
+    { { world->x[body], world->y[body], world->z[body] } },
+  };
+}
+
+static void flip_contact_point(contact_point_t* point) {
+  vkm_mul(&point->normal, -1.0f, &point->normal);
+  const vkm_vec3 first = point->points[0];
+  point->points[0] = point->points[1];
+  point->points[1] = first;
+}
+
+// Adds the radius of a rounded shape in the given local direction.
+static void add_rounding(const vkm_vec3* direction, const float radius, vkm_vec3* result) {
+  const float magnitude = vkm_magnitude(direction);
+  if (magnitude > FLT_EPSILON) {
+    vkm_muladd(direction, radius / magnitude, result);
+  }
+}
+
+// The furthest point of the shape in the given world space direction.
+static void shape_support(const collider_t* collider, const vkm_vec3* direction, vkm_vec3* result) {
+  const fun_shape_t* shape = collider->shape;
+  vkm_vec3 local_direction, local = { { 0.0f, 0.0f, 0.0f } };
+  rotate_vector(&shape->rotation, true, direction, &local_direction);
+
+  switch (shape->type) {
+    case FUN_SHAPE_SPHERE:
+      add_rounding(&local_direction, shape->sphere.radius, &local);
+      break;
+    case FUN_SHAPE_BOX:
+      local = (vkm_vec3){ {
+        copysignf(shape->box.half_extents.x, local_direction.x),
+        copysignf(shape->box.half_extents.y, local_direction.y),
+        copysignf(shape->box.half_extents.z, local_direction.z),
+      } };
+      break;
+    case FUN_SHAPE_CAPSULE:
+      local.y = copysignf(shape->capsule.half_height, local_direction.y);
+      add_rounding(&local_direction, shape->capsule.radius, &local);
+      break;
+    case FUN_SHAPE_CONVEX_HULL: {
+      float best = -FLT_MAX;
+      for (int32_t i = 0; i < shape->convex_hull.count; i++) {
+        const float distance = vkm_dot(shape->convex_hull.points + i, &local_direction);
+        if (distance > best) {
+          best = distance;
+          local = shape->convex_hull.points[i];
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  vkm_vec3 position = collider->position;
+  rotate_vector(&shape->rotation, false, &local, result);
+  vkm_add(result, &position, result);
+}
+
+// A point of the Minkowski difference a - b, along with the point of a it came from to recover the contact points.
+typedef struct minkowski_point_t {
+  vkm_vec3 point, on_a;
+} minkowski_point_t;
+
+static void minkowski_support(
+  const collider_t* a,
+  const collider_t* b,
+  const vkm_vec3* direction,
+  minkowski_point_t* result
+) {
+  vkm_vec3 negated, on_b;
+  vkm_mul(direction, -1.0f, &negated);
+  shape_support(a, direction, &result->on_a);
+  shape_support(b, &negated, &on_b);
+  vkm_sub(&result->on_a, &on_b, &result->point);
+}
+
+// The simplex is a, b, c and d, a being the newest point. Those reduce it to the feature closest to the origin and
+// return the direction to search next, keeping the triangles wound so that their normal faces the origin.
+static void gjk_update_triangle(minkowski_point_t* simplex, int* dimension, vkm_vec3* direction) {
+  minkowski_point_t* a = simplex, *b = simplex + 1, *c = simplex + 2, *d = simplex + 3;
+  vkm_vec3 ab, ac, ao, normal, edge_normal;
+  vkm_sub(&b->point, &a->point, &ab);
+  vkm_sub(&c->point, &a->point, &ac);
+  vkm_mul(&a->point, -1.0f, &ao);
+  vkm_cross(&ab, &ac, &normal);
+
+  *dimension = 2;
+  vkm_cross(&ab, &normal, &edge_normal);
+  if (vkm_dot(&edge_normal, &ao) > 0.0f) {
+    *c = *a;
+    vkm_cross(&ab, &ao, &edge_normal);
+    vkm_cross(&edge_normal, &ab, direction);
+    return;
+  }
+  vkm_cross(&normal, &ac, &edge_normal);
+  if (vkm_dot(&edge_normal, &ao) > 0.0f) {
+    *b = *a;
+    vkm_cross(&ac, &ao, &edge_normal);
+    vkm_cross(&edge_normal, &ac, direction);
+    return;
+  }
+
+  *dimension = 3;
+  if (vkm_dot(&normal, &ao) > 0.0f) {
+    *d = *c;
+    *c = *b;
+    *b = *a;
+    *direction = normal;
+    return;
+  }
+  *d = *b;
+  *b = *a;
+  vkm_mul(&normal, -1.0f, direction);
+}
+
+static bool gjk_update_tetrahedron(minkowski_point_t* simplex, int* dimension, vkm_vec3* direction) {
+  minkowski_point_t* a = simplex, *b = simplex + 1, *c = simplex + 2, *d = simplex + 3;
+  vkm_vec3 ab, ac, ad, ao, abc, acd, adb;
+  vkm_sub(&b->point, &a->point, &ab);
+  vkm_sub(&c->point, &a->point, &ac);
+  vkm_sub(&d->point, &a->point, &ad);
+  vkm_mul(&a->point, -1.0f, &ao);
+  vkm_cross(&ab, &ac, &abc);
+  vkm_cross(&ac, &ad, &acd);
+  vkm_cross(&ad, &ab, &adb);
+
+  *dimension = 3;
+  if (vkm_dot(&abc, &ao) > 0.0f) {
+    *d = *c;
+    *c = *b;
+    *b = *a;
+    *direction = abc;
+    return false;
+  }
+  if (vkm_dot(&acd, &ao) > 0.0f) {
+    *b = *a;
+    *direction = acd;
+    return false;
+  }
+  if (vkm_dot(&adb, &ao) > 0.0f) {
+    *c = *d;
+    *d = *b;
+    *b = *a;
+    *direction = adb;
+    return false;
+  }
+  return true;
+}
+
+// Tells whether two convex shapes overlap. If they do, the simplex ends up as a tetrahedron around the origin, which
+// is where EPA starts from.
+static bool gjk(const collider_t* a, const collider_t* b, minkowski_point_t* simplex) {
+  vkm_vec3 direction = b->position, position_a = a->position;
+  vkm_sub(&direction, &position_a, &direction);
+  if (vkm_sqr_magnitude(&direction) < FLT_EPSILON) {
+    direction = (vkm_vec3){ { 1.0f, 0.0f, 0.0f } };
+  }
+
+  minkowski_support(a, b, &direction, simplex + 2);
+  vkm_mul(&simplex[2].point, -1.0f, &direction);
+  minkowski_support(a, b, &direction, simplex + 1);
+  if (vkm_dot(&simplex[1].point, &direction) < 0.0f) {
+    return false;
+  }
+
+  vkm_vec3 bc, bo;
+  vkm_sub(&simplex[2].point, &simplex[1].point, &bc);
+  vkm_mul(&simplex[1].point, -1.0f, &bo);
+  vkm_cross(&bc, &bo, &direction);
+  vkm_cross(&direction, &bc, &direction);
+  // The origin lies on the segment, any perpendicular direction does.
+  if (vkm_sqr_magnitude(&direction) < FLT_EPSILON) {
+    const vkm_vec3 x = { { 1.0f, 0.0f, 0.0f } }, z = { { 0.0f, 0.0f, -1.0f } };
+    vkm_cross(&bc, &x, &direction);
+    if (vkm_sqr_magnitude(&direction) < FLT_EPSILON) {
+      vkm_cross(&bc, &z, &direction);
+    }
+  }
+
+  int dimension = 2;
+  for (int i = 0; i < FUN_GJK_MAX_ITERATIONS; i++) {
+    minkowski_support(a, b, &direction, simplex);
+    if (vkm_dot(&simplex[0].point, &direction) < 0.0f) {
+      return false;
+    }
+
+    dimension++;
+    if (dimension == 3) {
+      gjk_update_triangle(simplex, &dimension, &direction);
+    } else if (gjk_update_tetrahedron(simplex, &dimension, &direction)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+typedef struct epa_face_t {
+  int32_t vertices[3];
+  vkm_vec3 normal;
+  float distance;
+} epa_face_t;
+
+static epa_face_t epa_face(const minkowski_point_t* vertices, const int32_t a, const int32_t b, const int32_t c) {
+  epa_face_t face = { { a, b, c }, { { 0.0f, 0.0f, 0.0f } }, FLT_MAX };
+  vkm_vec3 origin = vertices[a].point, ab, ac;
+  vkm_sub(&vertices[b].point, &origin, &ab);
+  vkm_sub(&vertices[c].point, &origin, &ac);
+  vkm_cross(&ab, &ac, &face.normal);
+
+  // Degenerate faces are never picked as the closest one.
+  const float magnitude = vkm_magnitude(&face.normal);
+  if (magnitude > FLT_EPSILON) {
+    vkm_mul(&face.normal, 1.0f / magnitude, &face.normal);
+    face.distance = vkm_dot(&face.normal, &vertices[a].point);
+    // Keep the normals facing away from the origin, which is inside the polytope.
+    if (face.distance < 0.0f) {
+      face.vertices[0] = b;
+      face.vertices[1] = a;
+      vkm_mul(&face.normal, -1.0f, &face.normal);
+      face.distance = -face.distance;
+    }
+  }
+  return face;
+}
+
+// Barycentric coordinates of the projection of the origin on the face give the matching point on a.
+static void epa_contact(const minkowski_point_t* vertices, const epa_face_t* face, contact_point_t* result) {
+  const minkowski_point_t* a = vertices + face->vertices[0];
+  const minkowski_point_t* b = vertices + face->vertices[1];
+  const minkowski_point_t* c = vertices + face->vertices[2];
+
+  vkm_vec3 origin = a->point, v0 = b->point, v1 = c->point, v2;
+  vkm_mul(&face->normal, face->distance, &v2);
+  vkm_sub(&v0, &origin, &v0);
+  vkm_sub(&v1, &origin, &v1);
+  vkm_sub(&v2, &origin, &v2);
+
+  const float d00 = vkm_dot(&v0, &v0), d01 = vkm_dot(&v0, &v1), d11 = vkm_dot(&v1, &v1);
+  const float d20 = vkm_dot(&v2, &v0), d21 = vkm_dot(&v2, &v1);
+  const float denominator = d00 * d11 - d01 * d01;
+  float v = 0.0f, w = 0.0f;
+  if (fabsf(denominator) > FLT_EPSILON) {
+    v = (d11 * d20 - d01 * d21) / denominator;
+    w = (d00 * d21 - d01 * d20) / denominator;
+  }
+
+  vkm_mul(&a->on_a, 1.0f - v - w, result->points);
+  vkm_muladd(&b->on_a, v, result->points);
+  vkm_muladd(&c->on_a, w, result->points);
+
+  result->normal = face->normal;
+  result->depth = face->distance;
+  result->points[1] = result->points[0];
+  vkm_muladd(&face->normal, -face->distance, result->points + 1);
+}
+
+// Expands the tetrahedron found by GJK towards the boundary of the Minkowski difference, until the face closest to
+// the origin can't be pushed further. That face gives the penetration depth and normal.
+static void epa(const collider_t* a, const collider_t* b, const minkowski_point_t* simplex, contact_point_t* result) {
+  minkowski_point_t vertices[FUN_EPA_MAX_ITERATIONS + 4];
+  epa_face_t faces[FUN_EPA_MAX_FACES];
+  int32_t edges[FUN_EPA_MAX_FACES * 3][2];
+
+  memcpy(vertices, simplex, 4 * sizeof(minkowski_point_t));
+  int32_t vertices_count = 4, faces_count = 4;
+  faces[0] = epa_face(vertices, 0, 1, 2);
+  faces[1] = epa_face(vertices, 0, 2, 3);
+  faces[2] = epa_face(vertices, 0, 3, 1);
+  faces[3] = epa_face(vertices, 1, 3, 2);
+
+  // A copy, as the faces move around while the polytope is expanded. It stays valid if the expansion has to stop.
+  epa_face_t closest = faces[0];
+  for (int iteration = 0; iteration < FUN_EPA_MAX_ITERATIONS; iteration++) {
+    int32_t nearest = 0;
+    for (int32_t i = 1; i < faces_count; i++) {
+      if (faces[i].distance < faces[nearest].distance) {
+        nearest = i;
+      }
+    }
+    closest = faces[nearest];
+
+    minkowski_point_t support;
+    minkowski_support(a, b, &closest.normal, &support);
+    if (vkm_dot(&support.point, &closest.normal) - closest.distance < FUN_EPA_TOLERANCE) {
+      break;
+    }
+
+    // Find every face the new point sees, keeping the edges on the border of the hole they leave.
+    bool visible[FUN_EPA_MAX_FACES];
+    int32_t visible_count = 0, edges_count = 0;
+    for (int32_t i = 0; i < faces_count; i++) {
+      vkm_vec3 offset;
+      vkm_sub(&support.point, &vertices[faces[i].vertices[0]].point, &offset);
+      visible[i] = vkm_dot(&faces[i].normal, &offset) > 0.0f;
+      if (!visible[i]) {
+        continue;
+      }
+      visible_count++;
+
+      for (int j = 0; j < 3; j++) {
+        const int32_t from = faces[i].vertices[j], to = faces[i].vertices[(j + 1) % 3];
+        bool shared = false;
+        for (int32_t k = 0; k < edges_count; k++) {
+          if (edges[k][0] == to && edges[k][1] == from) {
+            edges[k][0] = edges[edges_count - 1][0];
+            edges[k][1] = edges[edges_count - 1][1];
+            edges_count--;
+            shared = true;
+            break;
+          }
+        }
+        if (!shared) {
+          edges[edges_count][0] = from;
+          edges[edges_count][1] = to;
+          edges_count++;
+        }
+      }
+    }
+
+    // Without room to patch the whole hole, the polytope would be left open, so the closest face so far has to do.
+    if (faces_count - visible_count + edges_count > FUN_EPA_MAX_FACES) {
+      break;
+    }
+
+    int32_t kept = 0;
+    for (int32_t i = 0; i < faces_count; i++) {
+      if (!visible[i]) {
+        faces[kept++] = faces[i];
+      }
+    }
+    faces_count = kept;
+
+    // Patch the hole with faces fanning out from the new point.
+    const int32_t vertex = vertices_count++;
+    vertices[vertex] = support;
+    for (int32_t i = 0; i < edges_count; i++) {
+      faces[faces_count++] = epa_face(vertices, edges[i][0], edges[i][1], vertex);
+    }
+  }
+
+  epa_contact(vertices, &closest, result);
+}
+
+static void closest_point_on_segment(
+  const vkm_vec3* start,
+  const vkm_vec3* end,
+  const vkm_vec3* point,
+  vkm_vec3* result
+) {
+  vkm_vec3 origin = *start, segment = *end, offset = *point;
+  vkm_sub(&segment, &origin, &segment);
+  vkm_sub(&offset, &origin, &offset);
+  const float length = vkm_dot(&segment, &segment);
+  const float t = length > FLT_EPSILON ? fminf(fmaxf(vkm_dot(&offset, &segment) / length, 0.0f), 1.0f) : 0.0f;
+  *result = *start;
+  vkm_muladd(&segment, t, result);
+}
+
+// The closest points of two segments, from Real-Time Collision Detection by Christer Ericson.
+static void closest_points_of_segments(
+  const vkm_vec3* start_a,
+  const vkm_vec3* end_a,
+  const vkm_vec3* start_b,
+  const vkm_vec3* end_b,
+  vkm_vec3* result_a,
+  vkm_vec3* result_b
+) {
+  vkm_vec3 origin_a = *start_a, origin_b = *start_b, d1 = *end_a, d2 = *end_b, r = *start_a;
+  vkm_sub(&d1, &origin_a, &d1);
+  vkm_sub(&d2, &origin_b, &d2);
+  vkm_sub(&r, &origin_b, &r);
+  const float a = vkm_dot(&d1, &d1), e = vkm_dot(&d2, &d2), f = vkm_dot(&d2, &r);
+
+  float s = 0.0f, t = 0.0f;
+  if (a <= FLT_EPSILON && e > FLT_EPSILON) {
+    t = fminf(fmaxf(f / e, 0.0f), 1.0f);
+  } else if (a > FLT_EPSILON) {
+    const float c = vkm_dot(&d1, &r);
+    if (e <= FLT_EPSILON) {
+      s = fminf(fmaxf(-c / a, 0.0f), 1.0f);
+    } else {
+      const float b = vkm_dot(&d1, &d2);
+      const float denominator = a * e - b * b;
+      s = denominator > FLT_EPSILON ? fminf(fmaxf((b * f - c * e) / denominator, 0.0f), 1.0f) : 0.0f;
+      t = (b * s + f) / e;
+      if (t < 0.0f) {
+        t = 0.0f;
+        s = fminf(fmaxf(-c / a, 0.0f), 1.0f);
+      } else if (t > 1.0f) {
+        t = 1.0f;
+        s = fminf(fmaxf((b - c) / a, 0.0f), 1.0f);
+      }
+    }
+  }
+
+  *result_a = *start_a;
+  vkm_muladd(&d1, s, result_a);
+  *result_b = *start_b;
+  vkm_muladd(&d2, t, result_b);
+}
+
+static void capsule_segment(const collider_t* collider, vkm_vec3* start, vkm_vec3* end) {
+  const vkm_vec3 local_axis = { { 0.0f, collider->shape->capsule.half_height, 0.0f } };
+  vkm_vec3 axis;
+  rotate_vector(&collider->shape->rotation, false, &local_axis, &axis);
+  vkm_sub(&collider->position, &axis, start);
+  vkm_add(&collider->position, &axis, end);
+}
+
+// Spheres, and everything that reduces to them like capsules, are handled in closed form.
+static bool collide_spheres(
+  const vkm_vec3* center_a,
+  const float radius_a,
+  const vkm_vec3* center_b,
+  const float radius_b,
+  contact_point_t* result
+) {
+  vkm_vec3 origin = *center_a, offset = *center_b;
+  vkm_sub(&offset, &origin, &offset);
+  const float distance = vkm_magnitude(&offset);
+  const float reach = radius_a + radius_b;
+  if (distance > reach) {
+    return false;
+  }
+
+  result->normal = (vkm_vec3){ { 0.0f, 1.0f, 0.0f } };
+  if (distance > FLT_EPSILON) {
+    vkm_mul(&offset, 1.0f / distance, &result->normal);
+  }
+  result->depth = reach - distance;
+  result->points[0] = *center_a;
+  vkm_muladd(&result->normal, radius_a, result->points);
+  result->points[1] = *center_b;
+  vkm_muladd(&result->normal, -radius_b, result->points + 1);
+  return true;
+}
+
+static bool collide_sphere_box(const collider_t* sphere, const collider_t* box, contact_point_t* result) {
+  const float radius = sphere->shape->sphere.radius;
+  const vkm_vec3* half_extents = &box->shape->box.half_extents;
+
+  vkm_vec3 center = sphere->position, position = box->position;
+  vkm_sub(&center, &position, &center);
+  rotate_vector(&box->shape->rotation, true, &center, &center);
+
+  vkm_vec3 clamped = { {
+    fminf(fmaxf(center.x, -half_extents->x), half_extents->x),
+    fminf(fmaxf(center.y, -half_extents->y), half_extents->y),
+    fminf(fmaxf(center.z, -half_extents->z), half_extents->z),
+  } };
+
+  // Pointing from the box towards the sphere, in the local space of the box.
+  vkm_vec3 normal, surface = clamped;
+  float depth;
+  if (center.x != clamped.x || center.y != clamped.y || center.z != clamped.z) {
+    vkm_sub(&center, &clamped, &normal);
+    const float distance = vkm_magnitude(&normal);
+    if (distance > radius) {
+      return false;
+    }
+    vkm_mul(&normal, 1.0f / distance, &normal);
+    depth = radius - distance;
+  } else {
+    // The center is inside, push it out through the closest face.
+    int axis = 0;
+    float closest = FLT_MAX;
+    for (int i = 0; i < 3; i++) {
+      const float distance = half_extents->raw[i] - fabsf(center.raw[i]);
+      if (distance < closest) {
+        closest = distance;
+        axis = i;
+      }
+    }
+    normal = (vkm_vec3){ { 0.0f, 0.0f, 0.0f } };
+    normal.raw[axis] = center.raw[axis] < 0.0f ? -1.0f : 1.0f;
+    surface.raw[axis] = normal.raw[axis] * half_extents->raw[axis];
+    depth = radius + closest;
+  }
+
+  rotate_vector(&box->shape->rotation, false, &normal, &normal);
+  rotate_vector(&box->shape->rotation, false, &surface, &surface);
+  vkm_mul(&normal, -1.0f, &result->normal);
+  result->depth = depth;
+  result->points[0] = sphere->position;
+  vkm_muladd(&result->normal, radius, result->points);
+  vkm_add(&surface, &position, result->points + 1);
+  return true;
+}
+
+static bool collide_shapes(const collider_t* a, const collider_t* b, contact_point_t* result) {
+  const fun_shape_type_t type_a = a->shape->type, type_b = b->shape->type;
+  // The closed form cases are written for the simpler shape first.
+  if (type_a > type_b) {
+    if (!collide_shapes(b, a, result)) {
+      return false;
+    }
+    flip_contact_point(result);
+    return true;
+  }
+
+  vkm_vec3 start_a, end_a, start_b, end_b, closest_a, closest_b;
+  if (type_a == FUN_SHAPE_SPHERE && type_b == FUN_SHAPE_SPHERE) {
+    return collide_spheres(
+      &a->position,
+      a->shape->sphere.radius,
+      &b->position,
+      b->shape->sphere.radius,
+      result
+    );
+  } else if (type_a == FUN_SHAPE_SPHERE && type_b == FUN_SHAPE_BOX) {
+    return collide_sphere_box(a, b, result);
+  } else if (type_a == FUN_SHAPE_SPHERE && type_b == FUN_SHAPE_CAPSULE) {
+    capsule_segment(b, &start_b, &end_b);
+    closest_point_on_segment(&start_b, &end_b, &a->position, &closest_b);
+    return collide_spheres(&a->position, a->shape->sphere.radius, &closest_b, b->shape->capsule.radius, result);
+  } else if (type_a == FUN_SHAPE_CAPSULE && type_b == FUN_SHAPE_CAPSULE) {
+    capsule_segment(a, &start_a, &end_a);
+    capsule_segment(b, &start_b, &end_b);
+    closest_points_of_segments(&start_a, &end_a, &start_b, &end_b, &closest_a, &closest_b);
+    return collide_spheres(&closest_a, a->shape->capsule.radius, &closest_b, b->shape->capsule.radius, result);
+  }
+
+  minkowski_point_t simplex[4];
+  if (!gjk(a, b, simplex)) {
+    return false;
+  }
+  epa(a, b, simplex, result);
+  return true;
+}
+
+static uint32_t manifold_hash(const ecs_entity_t a, const ecs_entity_t b) {
+  uint64_t hash = a * 0x9E3779B97F4A7C15ull ^ b * 0xC2B2AE3D27D4EB4Full;
+  hash ^= hash >> 32;
+  return (uint32_t)hash;
+}
+
+// The manifold of the same two entities last step, if they were touching.
+static const fun_manifold_t* find_cached_manifold(
+  const CollisionWorld3D* world,
+  const ecs_entity_t a,
+  const ecs_entity_t b
+) {
+  if (!world->manifolds_table_size) {
+    return NULL;
+  }
+
+  const uint32_t mask = world->manifolds_table_size - 1;
+  for (uint32_t slot = manifold_hash(a, b) & mask; world->manifolds_table[slot]; slot = (slot + 1) & mask) {
+    const fun_manifold_t* manifold = world->manifolds + world->manifolds_table[slot] - 1;
+    if (manifold->entities[0] == a && manifold->entities[1] == b) {
+      return manifold;
+    }
+  }
+  return NULL;
+}
+
+static void to_local_point(const collider_t* collider, const vkm_vec3* point, vkm_vec3* result) {
+  if (!collider) {
+    *result = *point;
+    return;
+  }
+  vkm_vec3 position = collider->position;
+  vkm_sub(point, &position, result);
+  rotate_vector(&collider->shape->rotation, true, result, result);
+}
+
+static void to_world_point(const collider_t* collider, const vkm_vec3* point, vkm_vec3* result) {
+  if (!collider) {
+    *result = *point;
+    return;
+  }
+  vkm_vec3 position = collider->position;
+  rotate_vector(&collider->shape->rotation, false, point, result);
+  vkm_add(result, &position, result);
+}
+
+static void set_contact(fun_contact_t* contact, const collider_t* colliders[2], const contact_point_t* point) {
+  to_local_point(colliders[0], point->points, contact->local_points);
+  to_local_point(colliders[1], point->points + 1, contact->local_points + 1);
+  vkm_vec3 point_b = point->points[1];
+  vkm_add(point->points, &point_b, &contact->position);
+  vkm_mul(&contact->position, 0.5f, &contact->position);
+  contact->depth = point->depth;
+}
+
+static float triangle_area(const vkm_vec3* a, const vkm_vec3* b, const vkm_vec3* c) {
+  vkm_vec3 origin = *a, ab = *b, ac = *c, normal;
+  vkm_sub(&ab, &origin, &ab);
+  vkm_sub(&ac, &origin, &ac);
+  vkm_cross(&ab, &ac, &normal);
+  return vkm_magnitude(&normal);
+}
+
+// Keeps the 4 contacts that matter the most: the deepest one, and the ones that span the largest area so the bodies
+// rest stably on them.
+static void reduce_contacts(fun_contact_t* contacts, const int count) {
+  int chosen[FUN_MAX_CONTACTS] = { 0 };
+  for (int i = 1; i < count; i++) {
+    if (contacts[i].depth > contacts[chosen[0]].depth) {
+      chosen[0] = i;
+    }
+  }
+
+  for (int k = 1; k < FUN_MAX_CONTACTS; k++) {
+    float best = -1.0f;
+    for (int i = 0; i < count; i++) {
+      bool taken = false;
+      for (int j = 0; j < k; j++) {
+        taken |= chosen[j] == i;
+      }
+      if (taken) {
+        continue;
+      }
+
+      const vkm_vec3* p = &contacts[i].position;
+      const vkm_vec3* p0 = &contacts[chosen[0]].position;
+      float score;
+      if (k == 1) {
+        vkm_vec3 origin = *p0, offset;
+        vkm_sub(p, &origin, &offset);
+        score = vkm_sqr_magnitude(&offset);
+      } else if (k == 2) {
+        score = triangle_area(p0, &contacts[chosen[1]].position, p);
+      } else {
+        // Inside the triangle the three areas add up to its own, outside they add up to more.
+        const vkm_vec3* p1 = &contacts[chosen[1]].position, *p2 = &contacts[chosen[2]].position;
+        score = triangle_area(p0, p1, p) + triangle_area(p1, p2, p) + triangle_area(p2, p0, p);
+      }
+
+      if (score > best) {
+        best = score;
+        chosen[k] = i;
+      }
+    }
+  }
+
+  fun_contact_t kept[FUN_MAX_CONTACTS];
+  for (int k = 0; k < FUN_MAX_CONTACTS; k++) {
+    kept[k] = contacts[chosen[k]];
+  }
+  memcpy(contacts, kept, sizeof(kept));
+}
+
+// Adds a contact to a manifold, unless it's where an existing one already is, in which case that one is moved to it.
+static void add_contact(fun_manifold_t* manifold, const collider_t* colliders[2], const contact_point_t* point) {
+  fun_contact_t contact = { 0 };
+  set_contact(&contact, colliders, point);
+
+  for (int32_t i = 0; i < manifold->contacts_count; i++) {
+    vkm_vec3 offset;
+    vkm_sub(&manifold->contacts[i].local_points[0], &contact.local_points[0], &offset);
+    if (vkm_sqr_magnitude(&offset) < FUN_CONTACT_BREAKING_DISTANCE * FUN_CONTACT_BREAKING_DISTANCE) {
+      contact.normal_impulse = manifold->contacts[i].normal_impulse;
+      contact.tangent_impulses[0] = manifold->contacts[i].tangent_impulses[0];
+      contact.tangent_impulses[1] = manifold->contacts[i].tangent_impulses[1];
+      manifold->contacts[i] = contact;
+      return;
+    }
+  }
+
+  // There's always room for a fifth one before reducing.
+  fun_contact_t contacts[FUN_MAX_CONTACTS + 1];
+  memcpy(contacts, manifold->contacts, manifold->contacts_count * sizeof(fun_contact_t));
+  contacts[manifold->contacts_count++] = contact;
+  if (manifold->contacts_count > FUN_MAX_CONTACTS) {
+    reduce_contacts(contacts, manifold->contacts_count);
+    manifold->contacts_count = FUN_MAX_CONTACTS;
+  }
+  memcpy(manifold->contacts, contacts, manifold->contacts_count * sizeof(fun_contact_t));
+}
+
+// Gives the new contacts the impulses of the cached ones at the same place, so the solver starts from them.
+static void inherit_impulses(fun_manifold_t* manifold, const fun_manifold_t* cached) {
+  if (!cached) {
+    return;
+  }
+
+  for (int32_t i = 0; i < manifold->contacts_count; i++) {
+    fun_contact_t* contact = manifold->contacts + i;
+    for (int32_t j = 0; j < cached->contacts_count; j++) {
+      vkm_vec3 offset;
+      vkm_sub(&cached->contacts[j].local_points[0], &contact->local_points[0], &offset);
+      if (vkm_sqr_magnitude(&offset) < FUN_CONTACT_BREAKING_DISTANCE * FUN_CONTACT_BREAKING_DISTANCE) {
+        contact->normal_impulse = cached->contacts[j].normal_impulse;
+        contact->tangent_impulses[0] = cached->contacts[j].tangent_impulses[0];
+        contact->tangent_impulses[1] = cached->contacts[j].tangent_impulses[1];
+        break;
+      }
+    }
+  }
+}
+
+// Carries over the cached contacts that still hold with the current poses. GJK and EPA only give one point per step,
+// this is how a box resting on another one ends up with the four corners it needs to stay stable.
+static void refresh_cached_contacts(
+  fun_manifold_t* manifold,
+  const fun_manifold_t* cached,
+  const collider_t* colliders[2]
+) {
+  manifold->contacts_count = 0;
+  if (!cached) {
+    return;
+  }
+
+  for (int32_t i = 0; i < cached->contacts_count; i++) {
+    fun_contact_t contact = cached->contacts[i];
+    vkm_vec3 point_a, point_b, offset, drift;
+    to_world_point(colliders[0], contact.local_points, &point_a);
+    to_world_point(colliders[1], contact.local_points + 1, &point_b);
+    vkm_sub(&point_a, &point_b, &offset);
+
+    contact.depth = vkm_dot(&offset, &manifold->normal);
+    drift = offset;
+    vkm_muladd(&manifold->normal, -contact.depth, &drift);
+    if (
+      contact.depth < -FUN_CONTACT_BREAKING_DISTANCE ||
+      vkm_sqr_magnitude(&drift) > FUN_CONTACT_BREAKING_DISTANCE * FUN_CONTACT_BREAKING_DISTANCE
+    ) {
+      continue;
+    }
+
+    vkm_add(&point_a, &point_b, &contact.position);
+    vkm_mul(&contact.position, 0.5f, &contact.position);
+    manifold->contacts[manifold->contacts_count++] = contact;
+  }
+}
+
+// Features with more points than this are reduced to their outline anyway.
+#define FUN_MAX_FACE_POINTS 16
+
+// Two unit vectors perpendicular to the normal and to each other, from Building an Orthonormal Basis, Revisited by
+// Duff et al.
+static void tangent_basis(const vkm_vec3* normal, vkm_vec3* tangent, vkm_vec3* bitangent) {
+  const float sign = copysignf(1.0f, normal->z);
+  const float a = -1.0f / (sign + normal->z);
+  const float b = normal->x * normal->y * a;
+  *tangent = (vkm_vec3){ { 1.0f + sign * normal->x * normal->x * a, sign * b, -sign * normal->x } };
+  *bitangent = (vkm_vec3){ { b, sign + normal->y * normal->y * a, -normal->y } };
+}
+
+static float cross_2d(const vkm_vec2* o, const vkm_vec2* a, const vkm_vec2* b) {
+  return (a->x - o->x) * (b->y - o->y) - (a->y - o->y) * (b->x - o->x);
+}
+
+// Orders coplanar points around their outline and drops the ones inside it, with Andrew's monotone chain.
+static int outline_points(vkm_vec3* points, const int count, const vkm_vec3* normal) {
+  vkm_vec3 tangent, bitangent;
+  tangent_basis(normal, &tangent, &bitangent);
+
+  vkm_vec2 projected[FUN_MAX_FACE_POINTS];
+  vkm_vec3 sorted[FUN_MAX_FACE_POINTS];
+  for (int i = 0; i < count; i++) {
+    const vkm_vec2 p = { { vkm_dot(points + i, &tangent), vkm_dot(points + i, &bitangent) } };
+    int j = i;
+    for (; j > 0 && (projected[j - 1].x > p.x || (projected[j - 1].x == p.x && projected[j - 1].y > p.y)); j--) {
+      projected[j] = projected[j - 1];
+      sorted[j] = sorted[j - 1];
+    }
+    projected[j] = p;
+    sorted[j] = points[i];
+  }
+
+  int hull[2 * FUN_MAX_FACE_POINTS];
+  int hull_count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    const int start = hull_count;
+    for (int k = 0; k < count; k++) {
+      const int i = pass ? count - 1 - k : k;
+      while (
+        hull_count >= start + 2 &&
+        cross_2d(projected + hull[hull_count - 2], projected + hull[hull_count - 1], projected + i) <= 0.0f
+      ) {
+        hull_count--;
+      }
+      hull[hull_count++] = i;
+    }
+    // The last point of each chain is the first of the other one.
+    hull_count--;
+  }
+
+  for (int i = 0; i < hull_count; i++) {
+    points[i] = sorted[hull[i]];
+  }
+  return hull_count;
+}
+
+// The feature of a shape furthest along a world space direction: a face as a convex polygon, an edge as 2 points or
+// a single point, in world space.
+static int support_feature(const collider_t* collider, const vkm_vec3* direction, vkm_vec3* points) {
+  const fun_shape_t* shape = collider->shape;
+  vkm_vec3 local_direction;
+  rotate_vector(&shape->rotation, true, direction, &local_direction);
+
+  int count = 0;
+  switch (shape->type) {
+    case FUN_SHAPE_BOX: {
+      // The face whose normal is closest to the direction.
+      int axis = 0;
+      for (int i = 1; i < 3; i++) {
+        if (fabsf(local_direction.raw[i]) > fabsf(local_direction.raw[axis])) {
+          axis = i;
+        }
+      }
+      const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+      const float corners[4][2] = { { 1.0f, 1.0f }, { -1.0f, 1.0f }, { -1.0f, -1.0f }, { 1.0f, -1.0f } };
+      for (; count < 4; count++) {
+        points[count].raw[axis] = copysignf(shape->box.half_extents.raw[axis], local_direction.raw[axis]);
+        points[count].raw[u] = corners[count][0] * shape->box.half_extents.raw[u];
+        points[count].raw[v] = corners[count][1] * shape->box.half_extents.raw[v];
+      }
+      break;
+    }
+    case FUN_SHAPE_CAPSULE: {
+      // Only a capsule lying flat against the direction touches along its whole length.
+      const float magnitude = vkm_magnitude(&local_direction);
+      if (magnitude > FLT_EPSILON && fabsf(local_direction.y) < 0.05f * magnitude) {
+        for (; count < 2; count++) {
+          points[count] = (vkm_vec3){ { 0.0f, count ? shape->capsule.half_height : -shape->capsule.half_height, 0.0f } };
+          add_rounding(&local_direction, shape->capsule.radius, points + count);
+        }
+      }
+      break;
+    }
+    case FUN_SHAPE_CONVEX_HULL: {
+      // The points close enough to the furthest one make the face.
+      float furthest = -FLT_MAX;
+      for (int32_t i = 0; i < shape->convex_hull.count; i++) {
+        furthest = fmaxf(furthest, vkm_dot(shape->convex_hull.points + i, &local_direction));
+      }
+      const float threshold = furthest - FUN_CONTACT_BREAKING_DISTANCE * vkm_magnitude(&local_direction);
+      for (int32_t i = 0; i < shape->convex_hull.count && count < FUN_MAX_FACE_POINTS; i++) {
+        if (vkm_dot(shape->convex_hull.points + i, &local_direction) >= threshold) {
+          points[count++] = shape->convex_hull.points[i];
+        }
+      }
+      if (count >= 3) {
+        count = outline_points(points, count, &local_direction);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  for (int i = 0; i < count; i++) {
+    to_world_point(collider, points + i, points + i);
+  }
+  return count;
+}
+
+// Keeps the part of a polygon where dot(normal, p) <= offset, with Sutherland-Hodgman.
+static int clip_polygon(
+  const vkm_vec3* points,
+  const int count,
+  const vkm_vec3* normal,
+  const float offset,
+  vkm_vec3* result
+) {
+  int result_count = 0;
+  // A segment is clipped once, as a polygon it would be clipped through both of its edges.
+  const int edges = count == 2 ? 1 : count;
+  for (int i = 0; i < edges; i++) {
+    const vkm_vec3* from = points + i, *to = points + (i + 1) % count;
+    const float from_distance = vkm_dot(normal, from) - offset, to_distance = vkm_dot(normal, to) - offset;
+    if (from_distance <= 0.0f && (count > 2 || !result_count)) {
+      result[result_count++] = *from;
+    }
+    if ((from_distance < 0.0f) != (to_distance < 0.0f)) {
+      vkm_vec3 start = *from, edge = *to;
+      vkm_sub(&edge, &start, &edge);
+      result[result_count] = *from;
+      vkm_muladd(&edge, from_distance / (from_distance - to_distance), result + result_count);
+      result_count++;
+    }
+    if (count == 2 && to_distance <= 0.0f) {
+      result[result_count++] = *to;
+    }
+  }
+  return result_count;
+}
+
+// GJK and EPA give a single point, but flat shapes resting on each other touch over an area. The features of both
+// shapes facing each other are clipped against each other to find all of its corners at once, the face with more
+// points being the reference.
+static int feature_contacts(
+  const collider_t* a,
+  const collider_t* b,
+  const contact_point_t* point,
+  contact_point_t* results
+) {
+  vkm_vec3 features[2][FUN_MAX_FACE_POINTS], negated;
+  vkm_mul(&point->normal, -1.0f, &negated);
+  const int counts[2] = { support_feature(a, &point->normal, features[0]), support_feature(b, &negated, features[1]) };
+  if (counts[0] < 2 || counts[1] < 2 || (counts[0] < 3 && counts[1] < 3)) {
+    return 0;
+  }
+
+  // The reference normal points from the reference shape towards the other one.
+  const int reference = counts[0] >= counts[1] ? 0 : 1;
+  vkm_vec3* reference_points = features[reference];
+  const int reference_count = counts[reference];
+  vkm_vec3 normal = reference ? negated : point->normal;
+
+  vkm_vec3 buffers[2][2 * FUN_MAX_FACE_POINTS], center = CVKM_VEC3_ZERO;
+  for (int i = 0; i < reference_count; i++) {
+    vkm_add(&center, reference_points + i, &center);
+  }
+  vkm_mul(&center, 1.0f / (float)reference_count, &center);
+
+  memcpy(buffers[0], features[1 - reference], counts[1 - reference] * sizeof(vkm_vec3));
+  int count = counts[1 - reference], current = 0;
+  for (int i = 0; i < reference_count && count; i++) {
+    vkm_vec3 edge = reference_points[(i + 1) % reference_count], side, inward;
+    vkm_sub(&edge, reference_points + i, &edge);
+    vkm_cross(&edge, &normal, &side);
+    vkm_sub(&center, reference_points + i, &inward);
+    if (vkm_dot(&side, &inward) > 0.0f) {
+      vkm_mul(&side, -1.0f, &side);
+    }
+    count = clip_polygon(buffers[current], count, &side, vkm_dot(&side, reference_points + i), buffers[1 - current]);
+    current = 1 - current;
+  }
+
+  const float height = vkm_dot(&normal, reference_points);
+  int results_count = 0;
+  for (int i = 0; i < count; i++) {
+    const vkm_vec3* incident = buffers[current] + i;
+    const float depth = height - vkm_dot(&normal, incident);
+    if (depth < -FUN_CONTACT_BREAKING_DISTANCE) {
+      continue;
+    }
+
+    contact_point_t* result = results + results_count++;
+    result->normal = point->normal;
+    result->depth = depth;
+    result->points[reference] = *incident;
+    vkm_muladd(&normal, depth, result->points + reference);
+    result->points[1 - reference] = *incident;
+  }
+  return results_count;
+}
+
+static fun_manifold_t* push_manifold(fun_manifold_buffer_t* buffer) {
+  buffer->manifolds = reserve(buffer->manifolds, &buffer->capacity, buffer->count + 1, sizeof(fun_manifold_t));
+  return buffer->manifolds + buffer->count++;
+}
+
+// Pairs are processed with the smaller entity first, so a pair is recognized whatever the order of the bodies.
+static fun_pair_t ordered_pair(const CollisionWorld3D* world, const fun_pair_t* pair) {
+  if (world->entities[pair->a] > world->entities[pair->b]) {
+    return (fun_pair_t){ pair->b, pair->a };
+  }
+  return *pair;
+}
+
+static void collide_bodies(fun_manifold_buffer_t* buffer, const CollisionWorld3D* world, const fun_pair_t* pair) {
+  const collider_t a = body_collider(world, pair->a), b = body_collider(world, pair->b);
+  contact_point_t point;
+  if (!collide_shapes(&a, &b, &point)) {
+    return;
+  }
+
+  fun_manifold_t* manifold = push_manifold(buffer);
+  manifold->entities[0] = world->entities[pair->a];
+  manifold->entities[1] = world->entities[pair->b];
+  manifold->bodies[0] = pair->a;
+  manifold->bodies[1] = pair->b;
+  manifold->normal = point.normal;
+
+  const collider_t* colliders[2] = { &a, &b };
+  const fun_manifold_t* cached = find_cached_manifold(world, manifold->entities[0], manifold->entities[1]);
+  contact_point_t points[2 * FUN_MAX_FACE_POINTS];
+  const int count = feature_contacts(&a, &b, &point, points);
+  // A sphere touches anything at a single point, and touching features give all their points at once. Only the other
+  // shapes, edges and curved ones, accumulate their points over steps.
+  if (a.shape->type == FUN_SHAPE_SPHERE || b.shape->type == FUN_SHAPE_SPHERE || count) {
+    fun_contact_t contacts[2 * FUN_MAX_FACE_POINTS];
+    const int contacts_count = count ? count : 1;
+    for (int i = 0; i < contacts_count; i++) {
+      contacts[i] = (fun_contact_t){ 0 };
+      set_contact(contacts + i, colliders, count ? points + i : &point);
+    }
+    if (contacts_count > FUN_MAX_CONTACTS) {
+      reduce_contacts(contacts, contacts_count);
+    }
+    manifold->contacts_count = contacts_count < FUN_MAX_CONTACTS ? contacts_count : FUN_MAX_CONTACTS;
+    memcpy(manifold->contacts, contacts, manifold->contacts_count * sizeof(fun_contact_t));
+    inherit_impulses(manifold, cached);
+  } else {
+    refresh_cached_contacts(manifold, cached, colliders);
+    add_contact(manifold, colliders, &point);
+  }
+}
+
+static void write_sphere_manifold(
+  fun_manifold_buffer_t* buffer,
+  const CollisionWorld3D* world,
+  const fun_pair_t* pair,
+  const contact_point_t* point
+) {
+  const collider_t a = body_collider(world, pair->a), b = body_collider(world, pair->b);
+  const collider_t* colliders[2] = { &a, &b };
+
+  fun_manifold_t* manifold = push_manifold(buffer);
+  manifold->entities[0] = world->entities[pair->a];
+  manifold->entities[1] = world->entities[pair->b];
+  manifold->bodies[0] = pair->a;
+  manifold->bodies[1] = pair->b;
+  manifold->normal = point->normal;
+  manifold->contacts_count = 1;
+  manifold->contacts[0] = (fun_contact_t){ 0 };
+  set_contact(manifold->contacts, colliders, point);
+  inherit_impulses(manifold, find_cached_manifold(world, manifold->entities[0], manifold->entities[1]));
+}
+
+#if defined(FUN_AVX2) || defined(FUN_SSE2)
+#define FUN_SPHERE_BATCH 4
+
+// Sphere pairs are the bulk of particle simulations, so 4 of them are solved at once in closed form. Same operations
+// in the same order as collide_spheres().
+static void collide_sphere_batch(
+  fun_manifold_buffer_t* buffer,
+  const CollisionWorld3D* world,
+  const fun_pair_t* pairs,
+  const int count
+) {
+  float ax[4], ay[4], az[4], ar[4], bx[4], by[4], bz[4], br[4];
+  for (int i = 0; i < FUN_SPHERE_BATCH; i++) {
+    // Unused lanes repeat the first pair and are ignored.
+    const fun_pair_t* pair = pairs + (i < count ? i : 0);
+    ax[i] = world->x[pair->a];
+    ay[i] = world->y[pair->a];
+    az[i] = world->z[pair->a];
+    ar[i] = world->shapes[pair->a].sphere.radius;
+    bx[i] = world->x[pair->b];
+    by[i] = world->y[pair->b];
+    bz[i] = world->z[pair->b];
+    br[i] = world->shapes[pair->b].sphere.radius;
+  }
+
+  const __m128 dx = _mm_sub_ps(_mm_loadu_ps(bx), _mm_loadu_ps(ax));
+  const __m128 dy = _mm_sub_ps(_mm_loadu_ps(by), _mm_loadu_ps(ay));
+  const __m128 dz = _mm_sub_ps(_mm_loadu_ps(bz), _mm_loadu_ps(az));
+  const __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+  const __m128 reach = _mm_add_ps(_mm_loadu_ps(ar), _mm_loadu_ps(br));
+  const int touching = _mm_movemask_ps(_mm_cmple_ps(distance, reach));
+  if (!touching) {
+    return;
+  }
+
+  // Concentric spheres get an arbitrary up normal.
+  const __m128 separated = _mm_cmpgt_ps(distance, _mm_set1_ps(FLT_EPSILON));
+  const __m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), distance);
+  float nx[4], ny[4], nz[4], depth[4];
+  _mm_storeu_ps(nx, _mm_and_ps(separated, _mm_mul_ps(dx, inverse)));
+  _mm_storeu_ps(ny, _mm_or_ps(_mm_and_ps(separated, _mm_mul_ps(dy, inverse)), _mm_andnot_ps(separated, _mm_set1_ps(1.0f))));
+  _mm_storeu_ps(nz, _mm_and_ps(separated, _mm_mul_ps(dz, inverse)));
+  _mm_storeu_ps(depth, _mm_sub_ps(reach, distance));
+
+  for (int i = 0; i < count; i++) {
+    if (!(touching & (1 << i))) {
+      continue;
+    }
+
+    contact_point_t point = { { { nx[i], ny[i], nz[i] } }, { { { ax[i], ay[i], az[i] } }, { { bx[i], by[i], bz[i] } } }, depth[i] };
+    vkm_muladd(&point.normal, ar[i], point.points);
+    vkm_muladd(&point.normal, -br[i], point.points + 1);
+    write_sphere_manifold(buffer, world, pairs + i, &point);
+  }
+}
+#else
+#define FUN_SPHERE_BATCH 1
+
+static void collide_sphere_batch(
+  fun_manifold_buffer_t* buffer,
+  const CollisionWorld3D* world,
+  const fun_pair_t* pairs,
+  const int count
+) {
+  for (int i = 0; i < count; i++) {
+    const collider_t a = body_collider(world, pairs[i].a), b = body_collider(world, pairs[i].b);
+    contact_point_t point;
+    if (collide_spheres(&a.position, a.shape->sphere.radius, &b.position, b.shape->sphere.radius, &point)) {
+      write_sphere_manifold(buffer, world, pairs + i, &point);
+    }
+  }
+}
+#endif
+
+static void add_plane_contact(
+  fun_manifold_t* manifold,
+  const collider_t* colliders[2],
+  const Plane* plane,
+  const vkm_vec3* point
+) {
+  const float distance = vkm_dot(&plane->normal, point) - plane->distance;
+  if (distance > 0.0f) {
+    return;
+  }
+
+  contact_point_t contact = { manifold->normal, { *point, *point }, -distance };
+  vkm_muladd(&plane->normal, -distance, contact.points + 1);
+  add_contact(manifold, colliders, &contact);
+}
+
+// Every shape is made of a few points that can touch a plane: corners of boxes, ends of capsules, and so on.
+static void collide_plane(
+  fun_manifold_buffer_t* buffer,
+  const CollisionWorld3D* world,
+  const uint32_t body,
+  const int32_t plane_index
+) {
+  const Plane* plane = world->planes + plane_index;
+  const collider_t collider = body_collider(world, body);
+  const fun_shape_t* shape = collider.shape;
+  const collider_t* colliders[2] = { &collider, NULL };
+
+  fun_manifold_t manifold = {
+    { world->entities[body], world->plane_entities[plane_index] },
+    { body, FUN_NO_BODY },
+    { { -plane->normal.x, -plane->normal.y, -plane->normal.z } },
+    { { { { { 0.0f } } } } },
+    0,
+  };
+
+  vkm_vec3 point, local;
+  switch (shape->type) {
+    case FUN_SHAPE_SPHERE:
+      point = collider.position;
+      vkm_muladd(&plane->normal, -shape->sphere.radius, &point);
+      add_plane_contact(&manifold, colliders, plane, &point);
+      break;
+    case FUN_SHAPE_BOX:
+      for (int i = 0; i < 8; i++) {
+        local = (vkm_vec3){ {
+          i & 1 ? shape->box.half_extents.x : -shape->box.half_extents.x,
+          i & 2 ? shape->box.half_extents.y : -shape->box.half_extents.y,
+          i & 4 ? shape->box.half_extents.z : -shape->box.half_extents.z,
+        } };
+        to_world_point(&collider, &local, &point);
+        add_plane_contact(&manifold, colliders, plane, &point);
+      }
+      break;
+    case FUN_SHAPE_CAPSULE: {
+      vkm_vec3 ends[2];
+      capsule_segment(&collider, ends, ends + 1);
+      for (int i = 0; i < 2; i++) {
+        vkm_muladd(&plane->normal, -shape->capsule.radius, ends + i);
+        add_plane_contact(&manifold, colliders, plane, ends + i);
+      }
+      break;
+    }
+    case FUN_SHAPE_CONVEX_HULL:
+      for (int32_t i = 0; i < shape->convex_hull.count; i++) {
+        to_world_point(&collider, shape->convex_hull.points + i, &point);
+        add_plane_contact(&manifold, colliders, plane, &point);
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (manifold.contacts_count) {
+    inherit_impulses(&manifold, find_cached_manifold(world, manifold.entities[0], manifold.entities[1]));
+    *push_manifold(buffer) = manifold;
+  }
+}
+
+// Planes are tested against the bounding spheres of several bodies at once, and only the bodies that reach below
+// them go through collide_plane(). The work is laid out plane by plane, so any slice of it comes out in the same
+// order.
+static void collide_planes(
+  fun_manifold_buffer_t* buffer,
+  const CollisionWorld3D* world,
+  const int64_t begin,
+  const int64_t end
+) {
+  const int64_t bodies_count = world->bodies_count;
+  for (int64_t work = begin; work < end;) {
+    const int32_t plane_index = (int32_t)(work / bodies_count);
+    const Plane* plane = world->planes + plane_index;
+    uint32_t body = (uint32_t)(work % bodies_count);
+    const uint32_t row_end = (uint32_t)(end - work < bodies_count - body ? body + (end - work) : bodies_count);
+    work += row_end - body;
+
+#if defined(FUN_AVX2) || defined(FUN_SSE2)
+    const __m128 nx = _mm_set1_ps(plane->normal.x), ny = _mm_set1_ps(plane->normal.y);
+    const __m128 nz = _mm_set1_ps(plane->normal.z), distance = _mm_set1_ps(plane->distance);
+    for (; body + 4 <= row_end; body += 4) {
+      const __m128 height = _mm_sub_ps(
+        _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(world->x + body)), _mm_mul_ps(ny, _mm_loadu_ps(world->y + body))),
+          _mm_mul_ps(nz, _mm_loadu_ps(world->z + body))
+        ),
+        _mm_add_ps(distance, _mm_loadu_ps(world->radii + body))
+      );
+      const int below = _mm_movemask_ps(_mm_cmple_ps(height, _mm_setzero_ps()));
+      for (int i = 0; below && i < 4; i++) {
+        if (below & (1 << i) && world->shapes[body + i].type != FUN_SHAPE_NONE) {
+          collide_plane(buffer, world, body + i, plane_index);
+        }
+      }
+    }
+#endif
+    for (; body < row_end; body++) {
+      const float height =
+        plane->normal.x * world->x[body] + plane->normal.y * world->y[body] + plane->normal.z * world->z[body];
+      if (height <= plane->distance + world->radii[body] && world->shapes[body].type != FUN_SHAPE_NONE) {
+        collide_plane(buffer, world, body, plane_index);
+      }
+    }
+  }
+}
+
+#define FUN_DISTANCE_MAX_ITERATIONS 32
+#define FUN_DISTANCE_TOLERANCE 0.0001f
+#define FUN_TOI_MAX_ITERATIONS 32
+
+// Closest point to the origin on the triangle a, b, c, keeping in the simplex only the vertices of the feature it lies
+// on.
+static void reduce_triangle(vkm_vec3* simplex, int* count, vkm_vec3* closest) {
+  vkm_vec3 a = simplex[0], b = simplex[1], c = simplex[2], ab, ac, bc;
+  vkm_sub(&b, &a, &ab);
+  vkm_sub(&c, &a, &ac);
+  vkm_sub(&c, &b, &bc);
+
+  // Regions of the triangle, as in Real-Time Collision Detection, with the origin as the query point.
+  const float d1 = -vkm_dot(&ab, &a), d2 = -vkm_dot(&ac, &a);
+  if (d1 <= 0.0f && d2 <= 0.0f) {
+    *count = 1;
+    *closest = a;
+    return;
+  }
+  const float d3 = -vkm_dot(&ab, &b), d4 = -vkm_dot(&ac, &b);
+  if (d3 >= 0.0f && d4 <= d3) {
+    simplex[0] = b;
+    *count = 1;
+    *closest = b;
+    return;
+  }
+  const float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    *count = 2;
+    *closest = a;
+    vkm_muladd(&ab, d1 / (d1 - d3), closest);
+    return;
+  }
+  const float d5 = -vkm_dot(&ab, &c), d6 = -vkm_dot(&ac, &c);
+  if (d6 >= 0.0f && d5 <= d6) {
+    simplex[0] = c;
+    *count = 1;
+    *closest = c;
+    return;
+  }
+  const float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    simplex[1] = c;
+    *count = 2;
+    *closest = a;
+    vkm_muladd(&ac, d2 / (d2 - d6), closest);
+    return;
+  }
+  const float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+    simplex[0] = b;
+    simplex[1] = c;
+    *count = 2;
+    *closest = b;
+    vkm_muladd(&bc, (d4 - d3) / ((d4 - d3) + (d5 - d6)), closest);
+    return;
+  }
+
+  const float denominator = 1.0f / (va + vb + vc);
+  *count = 3;
+  *closest = a;
+  vkm_muladd(&ab, vb * denominator, closest);
+  vkm_muladd(&ac, vc * denominator, closest);
+}
+
+// Closest point to the origin on the simplex, which is reduced to the smallest feature holding that point. Returns
+// false when the simplex is a tetrahedron around the origin.
+static bool reduce_simplex(vkm_vec3* simplex, int* count, vkm_vec3* closest) {
+  if (*count == 1) {
+    *closest = simplex[0];
+    return true;
+  }
+
+  if (*count == 2) {
+    vkm_vec3 a = simplex[0], ab;
+    vkm_sub(simplex + 1, &a, &ab);
+    const float length = vkm_sqr_magnitude(&ab);
+    const float t = length > FLT_EPSILON ? -vkm_dot(&a, &ab) / length : 0.0f;
+    if (t <= 0.0f) {
+      *count = 1;
+      *closest = a;
+    } else if (t >= 1.0f) {
+      simplex[0] = simplex[1];
+      *count = 1;
+      *closest = simplex[0];
+    } else {
+      *closest = a;
+      vkm_muladd(&ab, t, closest);
+    }
+    return true;
+  }
+
+  if (*count == 3) {
+    reduce_triangle(simplex, count, closest);
+    return true;
+  }
+
+  // Only the faces the origin is in front of, seen from the opposite vertex, can hold the closest point.
+  static const int faces[4][4] = { { 0, 1, 2, 3 }, { 0, 2, 3, 1 }, { 0, 3, 1, 2 }, { 1, 3, 2, 0 } };
+  vkm_vec3 best_simplex[3];
+  int best_count = 0;
+  float best = FLT_MAX;
+  for (int f = 0; f < 4; f++) {
+    vkm_vec3 face[3] = { simplex[faces[f][0]], simplex[faces[f][1]], simplex[faces[f][2]] };
+    vkm_vec3 ab, ac, normal, opposite;
+    vkm_sub(face + 1, face, &ab);
+    vkm_sub(face + 2, face, &ac);
+    vkm_cross(&ab, &ac, &normal);
+    vkm_sub(simplex + faces[f][3], face, &opposite);
+    if (-vkm_dot(&normal, face) * vkm_dot(&normal, &opposite) >= 0.0f) {
+      continue;
+    }
+
+    int face_count = 3;
+    vkm_vec3 point;
+    reduce_triangle(face, &face_count, &point);
+    const float distance = vkm_sqr_magnitude(&point);
+    if (distance < best) {
+      best = distance;
+      best_count = face_count;
+      *closest = point;
+      memcpy(best_simplex, face, face_count * sizeof(vkm_vec3));
+    }
+  }
+
+  if (!best_count) {
+    return false;
+  }
+  memcpy(simplex, best_simplex, best_count * sizeof(vkm_vec3));
+  *count = best_count;
+  return true;
+}
+
+// Lower bound of the distance between a point and a shape, within FUN_DISTANCE_TOLERANCE of the actual one, and 0 if
+// the point is inside. It's GJK looking for the point of the shape closest to the given one. When the point is outside,
+// normal is the direction from that closest point to it.
+static float point_shape_distance(const collider_t* collider, const vkm_vec3* point, vkm_vec3* normal) {
+  vkm_vec3 simplex[4], closest, direction, origin = *point;
+  int count = 1;
+  vkm_sub(&collider->position, &origin, &direction);
+  if (vkm_sqr_magnitude(&direction) < FLT_EPSILON) {
+    direction = (vkm_vec3){ { 1.0f, 0.0f, 0.0f } };
+  }
+  shape_support(collider, &direction, simplex);
+  vkm_sub(simplex, &origin, simplex);
+  closest = simplex[0];
+
+  float lower = 0.0f;
+  for (int i = 0; i < FUN_DISTANCE_MAX_ITERATIONS; i++) {
+    const float distance = vkm_magnitude(&closest);
+    if (distance < FUN_DISTANCE_TOLERANCE) {
+      return 0.0f;
+    }
+    vkm_mul(&closest, -1.0f / distance, normal);
+
+    // The plane through the support point facing the point separates them, which bounds the distance from below.
+    vkm_vec3 support;
+    vkm_mul(&closest, -1.0f, &direction);
+    shape_support(collider, &direction, &support);
+    vkm_sub(&support, &origin, &support);
+    lower = fmaxf(lower, vkm_dot(&support, &closest) / distance);
+    if (distance - lower <= FUN_DISTANCE_TOLERANCE) {
+      return lower;
+    }
+
+    // Rounding can make the support point one the simplex already has, which wouldn't get it any closer.
+    for (int j = 0; j < count; j++) {
+      vkm_vec3 offset;
+      vkm_sub(&support, simplex + j, &offset);
+      if (vkm_sqr_magnitude(&offset) <= FUN_DISTANCE_TOLERANCE * FUN_DISTANCE_TOLERANCE) {
+        return lower;
+      }
+    }
+
+    // A point inside the shape can't be separated from it, so a lower bound above 0 means the tetrahedron only seems to
+    // enclose the point because it's almost flat.
+    simplex[count++] = support;
+    if (!reduce_simplex(simplex, &count, &closest)) {
+      return lower;
+    }
+  }
+
+  return lower;
+}
+
+// How far along its sweep a bullet can go before the sphere at its center sinks slop into the other body, from 0 to
+// 1, by conservative advancement. The distance from a point moving in a straight line to a convex shape is a convex
+// function of time, so it never falls faster than it does right now: advancing until the current rate of approach
+// would close the gap can't skip past the impact, and it converges from below. The other body is taken as it is at the
+// end of the step. Bodies the sphere already touches at the start of the sweep are left to the contact solver, like
+// the ones it moves away from.
+static float bullet_time_of_impact(
+  const vkm_vec3* origin,
+  const vkm_vec3* sweep,
+  const float target,
+  const collider_t* other,
+  const float limit
+) {
+  float t = 0.0f;
+  for (int i = 0; i < FUN_TOI_MAX_ITERATIONS && t < limit; i++) {
+    vkm_vec3 center = *origin, normal = CVKM_VEC3_ZERO;
+    vkm_muladd(sweep, t, &center);
+    const float gap = point_shape_distance(other, &center, &normal) - target;
+    if (gap <= FUN_DISTANCE_TOLERANCE) {
+      return t > 0.0f ? t : limit;
+    }
+
+    const float approach = -vkm_dot(sweep, &normal);
+    if (approach <= 0.0f) {
+      return limit;
+    }
+    t += gap / approach;
+  }
+  return t < limit ? t : limit;
+}
+
+// The same for a plane, whose distance is exact.
+static float bullet_plane_time_of_impact(
+  const vkm_vec3* origin,
+  const vkm_vec3* sweep,
+  const float target,
+  const Plane* plane,
+  const float limit
+) {
+  const float height = vkm_dot(&plane->normal, origin) - plane->distance - target;
+  const float approach = -vkm_dot(&plane->normal, sweep);
+  if (height <= FUN_DISTANCE_TOLERANCE || approach <= height) {
+    return limit;
+  }
+  const float t = height / approach;
+  return t < limit ? t : limit;
+}
+
+static int compare_bodies(const void* a, const void* b) {
+  const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Sets up the sweep of a bullet. Returns false if it has nothing to sweep.
+static bool bullet_sweep(
+  const CollisionWorld3D* world,
+  const SolverSettings* settings,
+  const int32_t bullet,
+  vkm_vec3* origin,
+  vkm_vec3* sweep,
+  float* target
+) {
+  const uint32_t body = world->bullets[bullet];
+  const vkm_vec3 end = { { world->x[body], world->y[body], world->z[body] } };
+  *origin = world->bullet_origins[bullet];
+  vkm_sub(&end, origin, sweep);
+  // Sinking the swept sphere by slop makes sure the narrowphase finds the contact.
+  *target = fmaxf(world->bullet_radii[bullet] - settings->slop, 0.0f);
+  return vkm_magnitude(sweep) > FUN_DISTANCE_TOLERANCE && world->shapes[body].type != FUN_SHAPE_NONE;
+}
+
+// Sweeps every bullet against the planes and the bodies the broadphase paired it with, and moves the ones that hit
+// something back to where they first touched it, before the narrowphase looks for their contacts.
+static void SweepBullets3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_field(it, CollisionWorld3D, 0);
+  const SolverSettings* settings = ecs_field(it, SolverSettings, 1);
+
+  float* times = world->bullet_times;
+  vkm_vec3 origin, sweep;
+  float target;
+  for (int32_t k = 0; k < world->bullets_count; k++) {
+    times[k] = 1.0f;
+    if (!bullet_sweep(world, settings, k, &origin, &sweep, &target)) {
+      continue;
+    }
+    for (int32_t p = 0; p < world->planes_count; p++) {
+      times[k] = bullet_plane_time_of_impact(&origin, &sweep, target, world->planes + p, times[k]);
+    }
+  }
+
+  // The bullets are in body order, so the pairs find theirs with a binary search.
+  for (int32_t i = 0; world->bullets_count && i < world->pairs_count; i++) {
+    const uint32_t bodies[2] = { world->pairs[i].a, world->pairs[i].b };
+    for (int side = 0; side < 2; side++) {
+      const uint32_t* bullet = bsearch(
+        bodies + side,
+        world->bullets,
+        world->bullets_count,
+        sizeof(uint32_t),
+        compare_bodies
+      );
+      const uint32_t other = bodies[!side];
+      if (!bullet || world->shapes[other].type == FUN_SHAPE_NONE) {
+        continue;
+      }
+
+      const int32_t k = (int32_t)(bullet - world->bullets);
+      if (bullet_sweep(world, settings, k, &origin, &sweep, &target)) {
+        const collider_t collider = body_collider(world, other);
+        times[k] = bullet_time_of_impact(&origin, &sweep, target, &collider, times[k]);
+      }
+    }
+  }
+
+  for (int32_t k = 0; k < world->bullets_count; k++) {
+    if (times[k] >= 1.0f) {
+      continue;
+    }
+
+    const uint32_t body = world->bullets[k];
+    vkm_vec3 position = world->bullet_origins[k];
+    bullet_sweep(world, settings, k, &origin, &sweep, &target);
+    vkm_muladd(&sweep, times[k], &position);
+    world->x[body] = position.x;
+    world->y[body] = position.y;
+    world->z[body] = position.z;
+    *ecs_get_mut(it->world, world->entities[body], Position3D) = position;
+  }
+}
+
+// Each worker takes a slice of the pairs and of the body and plane combinations. Sphere pairs are set aside and
+// processed in batches.
+static void FindContacts3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (!world || !world->stages) {
+    return;
+  }
+
+  const int32_t stage = ecs_stage_get_id(it->world);
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  fun_stage_pairs_t* buffers = world->stages + stage;
+  buffers->manifolds.count = 0;
+  buffers->sphere_manifolds.count = 0;
+  buffers->plane_manifolds.count = 0;
+
+  const int32_t begin = (int32_t)((int64_t)world->pairs_count * stage / stages_count);
+  const int32_t end = (int32_t)((int64_t)world->pairs_count * (stage + 1) / stages_count);
+  fun_pair_t batch[FUN_SPHERE_BATCH];
+  int batch_count = 0;
+  for (int32_t i = begin; i < end; i++) {
+    const fun_pair_t pair = ordered_pair(world, world->pairs + i);
+    const fun_shape_type_t type_a = world->shapes[pair.a].type, type_b = world->shapes[pair.b].type;
+    if (type_a == FUN_SHAPE_NONE || type_b == FUN_SHAPE_NONE) {
+      continue;
+    }
+
+    if (type_a == FUN_SHAPE_SPHERE && type_b == FUN_SHAPE_SPHERE) {
+      batch[batch_count++] = pair;
+      if (batch_count == FUN_SPHERE_BATCH) {
+        collide_sphere_batch(&buffers->sphere_manifolds, world, batch, batch_count);
+        batch_count = 0;
+      }
+    } else {
+      collide_bodies(&buffers->manifolds, world, &pair);
+    }
+  }
+  if (batch_count) {
+    collide_sphere_batch(&buffers->sphere_manifolds, world, batch, batch_count);
+  }
+
+  const int64_t work = (int64_t)world->planes_count * world->bodies_count;
+  collide_planes(&buffers->plane_manifolds, world, work * stage / stages_count, work * (stage + 1) / stages_count);
+}
+
+static void append_manifolds(fun_manifold_buffer_t* destination, fun_manifold_buffer_t* source) {
+  if (!source->count) {
+    return;
+  }
+
+  destination->manifolds = reserve(
+    destination->manifolds,
+    &destination->capacity,
+    destination->count + source->count,
+    sizeof(fun_manifold_t)
+  );
+  memcpy(destination->manifolds + destination->count, source->manifolds, source->count * sizeof(fun_manifold_t));
+  destination->count += source->count;
+  source->count = 0;
+}
+
+// Rebuilds the hash table that looks the manifolds up by entities.
+static void index_manifolds(CollisionWorld3D* world) {
+  // At most half full, so probing stays short.
+  uint32_t size = 16;
+  while (size < 2u * (uint32_t)world->manifolds_count) {
+    size *= 2;
+  }
+  if (size > world->manifolds_table_size) {
+    world->manifolds_table = realloc(world->manifolds_table, size * sizeof(int32_t));
+  }
+  world->manifolds_table_size = size;
+  memset(world->manifolds_table, 0, size * sizeof(int32_t));
+
+  const uint32_t mask = size - 1;
+  for (int32_t i = 0; i < world->manifolds_count; i++) {
+    const fun_manifold_t* manifold = world->manifolds + i;
+    uint32_t slot = manifold_hash(manifold->entities[0], manifold->entities[1]) & mask;
+    while (world->manifolds_table[slot]) {
+      slot = (slot + 1) & mask;
+    }
+    world->manifolds_table[slot] = i + 1;
+  }
+}
+
+// Concatenates the manifolds of every worker, kind by kind and in stage order, then indexes them by entities so the
+// next narrowphase finds them.
+static void MergeContacts3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_field(it, CollisionWorld3D, 0);
+
+  fun_manifold_buffer_t* merged = &world->spare_manifolds;
+  merged->count = 0;
+  for (int32_t i = 0; i < world->stages_count; i++) {
+    append_manifolds(merged, &world->stages[i].manifolds);
+  }
+  for (int32_t i = 0; i < world->stages_count; i++) {
+    append_manifolds(merged, &world->stages[i].sphere_manifolds);
+  }
+  for (int32_t i = 0; i < world->stages_count; i++) {
+    append_manifolds(merged, &world->stages[i].plane_manifolds);
+  }
+
+  const fun_manifold_buffer_t previous = { world->manifolds, world->manifolds_count, world->manifolds_capacity };
+  world->manifolds = merged->manifolds;
+  world->manifolds_count = merged->count;
+  world->manifolds_capacity = merged->capacity;
+  *merged = previous;
+
+  index_manifolds(world);
+}
+
+// Contacts that approach faster than this bounce, slower ones just stop so resting contacts don't jitter.
+#define FUN_RESTITUTION_THRESHOLD 1.0f
+
+// Applies the inverse inertia of a body, given in its local axes, to a world space vector.
+static void apply_inverse_inertia(
+  const Rotation3D* rotation,
+  const InverseInertia3D* inverse_inertia,
+  const vkm_vec3* vector,
+  vkm_vec3* result
+) {
+  vkm_vec3 local;
+  rotate_vector(rotation, true, vector, &local);
+  local = (vkm_vec3){ { local.x * inverse_inertia->x, local.y * inverse_inertia->y, local.z * inverse_inertia->z } };
+  rotate_vector(rotation, false, &local, result);
+}
+
+static float row_velocity(
+  const fun_contact_rows_t* rows,
+  const vkm_vec3* linear_velocities,
+  const vkm_vec3* angular_velocities,
+  const int32_t row
+) {
+  const vkm_vec3* la = linear_velocities + rows->a[row], *lb = linear_velocities + rows->b[row];
+  const vkm_vec3* wa = angular_velocities + rows->a[row], *wb = angular_velocities + rows->b[row];
+  return rows->nx[row] * (lb->x - la->x) + rows->ny[row] * (lb->y - la->y) + rows->nz[row] * (lb->z - la->z)
+    + rows->rbx[row] * wb->x + rows->rby[row] * wb->y + rows->rbz[row] * wb->z
+    - rows->rax[row] * wa->x - rows->ray[row] * wa->y - rows->raz[row] * wa->z;
+}
+
+// The static body is never written, as islands solved by different workers all share it.
+static void apply_row_impulse(
+  const fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t row,
+  const uint32_t static_body,
+  const float impulse
+) {
+  if (rows->a[row] != static_body) {
+    vkm_vec3* la = linear_velocities + rows->a[row], *wa = angular_velocities + rows->a[row];
+    const float linear_a = impulse * rows->inverse_masses_a[row];
+    la->x -= rows->nx[row] * linear_a;
+    la->y -= rows->ny[row] * linear_a;
+    la->z -= rows->nz[row] * linear_a;
+    wa->x -= rows->iax[row] * impulse;
+    wa->y -= rows->iay[row] * impulse;
+    wa->z -= rows->iaz[row] * impulse;
+  }
+  if (rows->b[row] != static_body) {
+    vkm_vec3* lb = linear_velocities + rows->b[row], *wb = angular_velocities + rows->b[row];
+    const float linear_b = impulse * rows->inverse_masses_b[row];
+    lb->x += rows->nx[row] * linear_b;
+    lb->y += rows->ny[row] * linear_b;
+    lb->z += rows->nz[row] * linear_b;
+    wb->x += rows->ibx[row] * impulse;
+    wb->y += rows->iby[row] * impulse;
+    wb->z += rows->ibz[row] * impulse;
+  }
+}
+
+// One projected Gauss-Seidel update: the impulse that cancels the velocity error of the row, with the total impulse
+// kept within its bounds.
+static void solve_row(
+  fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t row,
+  const uint32_t static_body,
+  const float lower,
+  const float upper
+) {
+  const float velocity = row_velocity(rows, linear_velocities, angular_velocities, row);
+  const float previous = rows->impulses[row];
+  const float impulse = fminf(
+    fmaxf(previous - rows->effective_masses[row] * (velocity + rows->biases[row]), lower),
+    upper
+  );
+  rows->impulses[row] = impulse;
+  apply_row_impulse(rows, linear_velocities, angular_velocities, row, static_body, impulse - previous);
+}
+
+// Where a row of a contact is, kind 0 being the normal row and kinds 1 and 2 the friction rows.
+static int32_t contact_row(const int32_t contact, const int kind) {
+  return contact / FUN_SOLVER_LANES * 3 * FUN_SOLVER_LANES + kind * FUN_SOLVER_LANES + contact % FUN_SOLVER_LANES;
+}
+
+static void push_contact_row(
+  fun_contact_rows_t* rows,
+  const CollisionWorld3D* world,
+  const int32_t row,
+  const uint32_t bodies[2],
+  const vkm_vec3* arms,
+  const vkm_vec3* direction,
+  fun_contact_t* contact,
+  const float impulse
+) {
+  rows->a[row] = bodies[0];
+  rows->b[row] = bodies[1];
+  rows->nx[row] = direction->x;
+  rows->ny[row] = direction->y;
+  rows->nz[row] = direction->z;
+  rows->contacts[row] = contact;
+  rows->impulses[row] = impulse;
+
+  // The static body has no shape to rotate its inertia with, but its inverse inertia is zero anyway.
+  vkm_vec3 angular[2], inertia[2] = { CVKM_VEC3_ZERO, CVKM_VEC3_ZERO };
+  float inverse_masses[2] = { 0.0f, 0.0f }, effective_mass = 0.0f;
+  for (int k = 0; k < 2; k++) {
+    vkm_cross(arms + k, direction, angular + k);
+    if (bodies[k] < (uint32_t)world->bodies_count) {
+      inverse_masses[k] = world->inverse_masses[bodies[k]];
+      apply_inverse_inertia(
+        &world->shapes[bodies[k]].rotation,
+        world->inverse_inertias + bodies[k],
+        angular + k,
+        inertia + k
+      );
+    }
+    effective_mass += inverse_masses[k] + vkm_dot(angular + k, inertia + k);
+  }
+
+  rows->rax[row] = angular[0].x;
+  rows->ray[row] = angular[0].y;
+  rows->raz[row] = angular[0].z;
+  rows->rbx[row] = angular[1].x;
+  rows->rby[row] = angular[1].y;
+  rows->rbz[row] = angular[1].z;
+  rows->iax[row] = inertia[0].x;
+  rows->iay[row] = inertia[0].y;
+  rows->iaz[row] = inertia[0].z;
+  rows->ibx[row] = inertia[1].x;
+  rows->iby[row] = inertia[1].y;
+  rows->ibz[row] = inertia[1].z;
+  rows->inverse_masses_a[row] = inverse_masses[0];
+  rows->inverse_masses_b[row] = inverse_masses[1];
+  rows->effective_masses[row] = effective_mass > 0.0f ? 1.0f / effective_mass : 0.0f;
+  rows->biases[row] = 0.0f;
+}
+
+// Fills the rest of a block with rows between static bodies, which never apply any impulse.
+static void pad_contact_rows(fun_contact_rows_t* rows, const uint32_t static_body, const int32_t contact) {
+  float** floats[] = FUN_CONTACT_ROWS_FLOATS(rows);
+  for (int kind = 0; kind < 3; kind++) {
+    const int32_t row = contact_row(contact, kind);
+    for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+      (*floats[i])[row] = 0.0f;
+    }
+    rows->a[row] = static_body;
+    rows->b[row] = static_body;
+    rows->contacts[row] = NULL;
+  }
+}
+
+// The lowest color neither body has a contact of yet, or the sequential color once they have them all. The static
+// body never moves, so it doesn't count.
+static int color_contact(uint64_t* body_colors, const uint32_t bodies[2], const uint32_t static_body) {
+  uint64_t used = 0;
+  for (int k = 0; k < 2; k++) {
+    used |= bodies[k] != static_body ? body_colors[bodies[k]] : 0;
+  }
+  if (used == UINT64_MAX) {
+    return FUN_SOLVER_COLORS;
+  }
+
+  int color = 0;
+  while (used & (UINT64_C(1) << color)) {
+    color++;
+  }
+  for (int k = 0; k < 2; k++) {
+    if (bodies[k] != static_body) {
+      body_colors[bodies[k]] |= UINT64_C(1) << color;
+    }
+  }
+  return color;
+}
+
+// The bodies a manifold pushes, with the static body standing for those that can't move.
+static bool manifold_bodies(const CollisionWorld3D* world, const fun_manifold_t* manifold, uint32_t bodies[2]) {
+  const uint32_t static_body = (uint32_t)world->bodies_count;
+  for (int k = 0; k < 2; k++) {
+    const uint32_t body = manifold->bodies[k];
+    bodies[k] = body != FUN_NO_BODY && world->inverse_masses[body] > 0.0f ? body : static_body;
+  }
+  return bodies[0] != static_body || bodies[1] != static_body;
+}
+
+// Whether contacts can push a body, now or once it wakes up. Only those join islands, static bodies would merge
+// everything resting on the ground into one.
+static bool island_body(const CollisionWorld3D* world, const uint32_t body) {
+  return body != FUN_NO_BODY
+    && world->velocities[body]
+    && (world->inverse_masses[body] > 0.0f || world->sleeping[body]);
+}
+
+static int32_t island_root(int32_t* parents, int32_t body) {
+  while (parents[body] != body) {
+    parents[body] = parents[parents[body]];
+    body = parents[body];
+  }
+  return body;
+}
+
+static int compare_island_jobs(const void* a, const void* b) {
+  const uint64_t job_a = *(const uint64_t*)a, job_b = *(const uint64_t*)b;
+  return (job_a > job_b) - (job_a < job_b);
+}
+
+// Unites the bodies of every manifold, then numbers the islands and lists their bodies.
+static void build_islands(CollisionWorld3D* world) {
+  fun_islands_t* islands = &world->islands;
+  int32_t* parents = islands->parents;
+  for (int32_t i = 0; i < world->bodies_count; i++) {
+    parents[i] = i;
+  }
+
+  // The smallest body becomes the root, so parents are never larger than their children.
+  for (int32_t i = 0; i < world->manifolds_count; i++) {
+    const uint32_t* bodies = world->manifolds[i].bodies;
+    if (island_body(world, bodies[0]) && island_body(world, bodies[1])) {
+      const int32_t a = island_root(parents, (int32_t)bodies[0]), b = island_root(parents, (int32_t)bodies[1]);
+      if (a < b) {
+        parents[b] = a;
+      } else {
+        parents[a] = b;
+      }
+    }
+  }
+
+  // Islands are numbered in the order of their first body, which doesn't depend on the thread count.
+  islands->count = 0;
+  for (int32_t i = 0; i < world->bodies_count; i++) {
+    const int32_t root = island_root(parents, i);
+    islands->body_islands[i] = root == i ? islands->count++ : islands->body_islands[root];
+  }
+
+  int32_t capacity = islands->islands_capacity;
+  islands->body_starts = reserve(islands->body_starts, &capacity, islands->count + 1, sizeof(int32_t));
+  capacity = islands->islands_capacity;
+  islands->contact_starts = reserve(islands->contact_starts, &capacity, islands->count + 1, sizeof(int32_t));
+  capacity = islands->islands_capacity;
+  islands->order = reserve(islands->order, &capacity, islands->count + 1, sizeof(uint64_t));
+  islands->waking = reserve(islands->waking, &islands->islands_capacity, islands->count + 1, sizeof(bool));
+
+  // Counting sort of the bodies by island, with the contact starts as cursors until the contacts are counted.
+  memset(islands->body_starts, 0, (islands->count + 1) * sizeof(int32_t));
+  for (int32_t i = 0; i < world->bodies_count; i++) {
+    islands->body_starts[islands->body_islands[i] + 1]++;
+  }
+  for (int32_t i = 0; i < islands->count; i++) {
+    islands->body_starts[i + 1] += islands->body_starts[i];
+  }
+  memcpy(islands->contact_starts, islands->body_starts, islands->count * sizeof(int32_t));
+  for (int32_t i = 0; i < world->bodies_count; i++) {
+    islands->bodies[islands->contact_starts[islands->body_islands[i]]++] = i;
+  }
+  memset(islands->waking, 0, islands->count * sizeof(bool));
+}
+
+// The island a contact between bodies is solved with, given the bodies the solver sees.
+static int32_t contact_island(const CollisionWorld3D* world, const uint32_t bodies[2]) {
+  return world->islands.body_islands[bodies[0] != (uint32_t)world->bodies_count ? bodies[0] : bodies[1]];
+}
+
+// Turns every contact point between bodies that can move into rows, grouped by color, and loads the velocities of the
+// bodies. The sequential color is grouped by island, and the islands with contacts are sorted into jobs.
+static void prepare_contact_rows(CollisionWorld3D* world, const SolverSettings* settings, const float delta_time) {
+  const uint32_t static_body = (uint32_t)world->bodies_count;
+  fun_contact_rows_t* rows = &world->solver.rows;
+  vkm_vec3* linear_velocities = world->solver.linear_velocities;
+  vkm_vec3* angular_velocities = world->solver.angular_velocities;
+
+  for (int32_t i = 0; i < world->bodies_count; i++) {
+    const bool moving = world->inverse_masses[i] > 0.0f;
+    linear_velocities[i] = moving ? *world->velocities[i] : CVKM_VEC3_ZERO;
+    angular_velocities[i] = moving && world->angular_velocities[i] ? *world->angular_velocities[i] : CVKM_VEC3_ZERO;
+  }
+  linear_velocities[static_body] = CVKM_VEC3_ZERO;
+  angular_velocities[static_body] = CVKM_VEC3_ZERO;
+
+  int32_t contacts_count = 0;
+  for (int32_t i = 0; i < world->manifolds_count; i++) {
+    contacts_count += world->manifolds[i].contacts_count;
+  }
+  world->solver.contact_colors = reserve(
+    world->solver.contact_colors,
+    &world->solver.contact_colors_capacity,
+    contacts_count,
+    sizeof(uint8_t)
+  );
+  if (settings->graph_coloring) {
+    memset(world->solver.body_colors, 0, world->bodies_count * sizeof(uint64_t));
+  }
+
+  // Contacts are colored in the order of the manifolds, which doesn't depend on the thread count.
+  fun_islands_t* islands = &world->islands;
+  memset(islands->contact_starts, 0, (islands->count + 1) * sizeof(int32_t));
+  int32_t colors_counts[FUN_SOLVER_COLORS + 1] = { 0 };
+  int32_t contact = 0;
+  for (int32_t i = 0; i < world->manifolds_count; i++) {
+    uint32_t bodies[2];
+    if (!manifold_bodies(world, world->manifolds + i, bodies)) {
+      continue;
+    }
+
+    for (int32_t j = 0; j < world->manifolds[i].contacts_count; j++) {
+      const int color = settings->graph_coloring
+        ? color_contact(world->solver.body_colors, bodies, static_body)
+        : FUN_SOLVER_COLORS;
+      world->solver.contact_colors[contact++] = (uint8_t)color;
+      colors_counts[color]++;
+      if (color == FUN_SOLVER_COLORS) {
+        islands->contact_starts[contact_island(world, bodies) + 1]++;
+      }
+    }
+  }
+
+  // Bigger islands first, so that a worker doesn't start on one when all the others are about done.
+  islands->jobs_count = 0;
+  islands->next_job = 0;
+  for (int32_t i = 0; i < islands->count; i++) {
+    const int32_t contacts = islands->contact_starts[i + 1];
+    if (contacts) {
+      islands->order[islands->jobs_count++] = (uint64_t)(UINT32_MAX - (uint32_t)contacts) << 32 | (uint32_t)i;
+    }
+    islands->contact_starts[i + 1] += islands->contact_starts[i];
+  }
+  qsort(islands->order, islands->jobs_count, sizeof(uint64_t), compare_island_jobs);
+
+  // Each color starts a new block, so that a block never mixes colors.
+  int32_t* starts = world->solver.color_starts;
+  int32_t cursors[FUN_SOLVER_COLORS + 1];
+  starts[0] = 0;
+  for (int color = 0; color <= FUN_SOLVER_COLORS; color++) {
+    cursors[color] = starts[color] * FUN_SOLVER_LANES;
+    starts[color + 1] = starts[color] + (colors_counts[color] + FUN_SOLVER_LANES - 1) / FUN_SOLVER_LANES;
+  }
+  rows->count = starts[FUN_SOLVER_COLORS + 1] * 3 * FUN_SOLVER_LANES;
+  contact_rows_reserve(rows, rows->count);
+
+  contact = 0;
+  for (int32_t i = 0; i < world->manifolds_count; i++) {
+    fun_manifold_t* manifold = world->manifolds + i;
+    uint32_t bodies[2];
+    if (!manifold_bodies(world, manifold, bodies)) {
+      continue;
+    }
+
+    vkm_vec3 tangents[2];
+    tangent_basis(&manifold->normal, tangents, tangents + 1);
+
+    for (int32_t j = 0; j < manifold->contacts_count; j++) {
+      fun_contact_t* point = manifold->contacts + j;
+      vkm_vec3 arms[2] = { CVKM_VEC3_ZERO, CVKM_VEC3_ZERO };
+      for (int k = 0; k < 2; k++) {
+        if (bodies[k] != static_body) {
+          vkm_vec3 position = { { world->x[bodies[k]], world->y[bodies[k]], world->z[bodies[k]] } };
+          vkm_sub(&point->position, &position, arms + k);
+        }
+      }
+
+      // Sequential contacts keep the order of the manifolds within their island.
+      const int color = world->solver.contact_colors[contact++];
+      const int32_t index = color == FUN_SOLVER_COLORS
+        ? cursors[color] + islands->contact_starts[contact_island(world, bodies)]++
+        : cursors[color]++;
+      const int32_t row = contact_row(index, 0);
+      push_contact_row(rows, world, row, bodies, arms, &manifold->normal, point, point->normal_impulse);
+      push_contact_row(rows, world, contact_row(index, 1), bodies, arms, tangents, point, point->tangent_impulses[0]);
+      push_contact_row(
+        rows,
+        world,
+        contact_row(index, 2),
+        bodies,
+        arms,
+        tangents + 1,
+        point,
+        point->tangent_impulses[1]
+      );
+
+      // Push the bodies apart by a fraction of the penetration per step, and bounce off fast enough approaches.
+      const float approach = row_velocity(rows, linear_velocities, angular_velocities, row);
+      // Contacts that are still apart let the bodies close the gap within the step.
+      float bias = point->depth < 0.0f
+        ? -point->depth / delta_time
+        : -settings->baumgarte / delta_time * fmaxf(point->depth - settings->slop, 0.0f);
+      if (approach < -FUN_RESTITUTION_THRESHOLD) {
+        bias = fminf(bias, settings->restitution * approach);
+      }
+      rows->biases[row] = bias;
+    }
+  }
+
+  // The contact starts were moved to where the next island starts.
+  memmove(islands->contact_starts + 1, islands->contact_starts, islands->count * sizeof(int32_t));
+  islands->contact_starts[0] = 0;
+  cursors[FUN_SOLVER_COLORS] += islands->contact_starts[islands->count];
+
+  for (int color = 0; color <= FUN_SOLVER_COLORS; color++) {
+    for (int32_t i = cursors[color]; i < starts[color + 1] * FUN_SOLVER_LANES; i++) {
+      pad_contact_rows(rows, static_body, i);
+    }
+  }
+}
+
+// Applies last step's impulses first, so that resting contacts start from an almost converged solution and stacks
+// hold with few iterations.
+static void warm_start_contact(
+  fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t contact,
+  const uint32_t static_body
+) {
+  for (int kind = 0; kind < 3; kind++) {
+    const int32_t row = contact_row(contact, kind);
+    apply_row_impulse(rows, linear_velocities, angular_velocities, row, static_body, rows->impulses[row]);
+  }
+}
+
+static void solve_contact(
+  fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t contact,
+  const uint32_t static_body,
+  const float friction
+) {
+  const int32_t row = contact_row(contact, 0);
+  solve_row(rows, linear_velocities, angular_velocities, row, static_body, 0.0f, FLT_MAX);
+  // Friction can't exceed the normal impulse times the friction coefficient, in either direction.
+  const float limit = friction * rows->impulses[row];
+  solve_row(rows, linear_velocities, angular_velocities, row + FUN_SOLVER_LANES, static_body, -limit, limit);
+  solve_row(rows, linear_velocities, angular_velocities, row + 2 * FUN_SOLVER_LANES, static_body, -limit, limit);
+}
+
+// The velocities of the bodies of a block, one lane per contact: linear then angular velocity of a, then of b. The
+// contacts of a block share no body, but the static one, which is never written.
+typedef float fun_block_velocities_t[12][FUN_SOLVER_LANES];
+
+static void load_block_velocities(
+  const fun_contact_rows_t* rows,
+  const vkm_vec3* linear_velocities,
+  const vkm_vec3* angular_velocities,
+  const int32_t row,
+  fun_block_velocities_t velocities
+) {
+  for (int lane = 0; lane < FUN_SOLVER_LANES; lane++) {
+    const uint32_t bodies[2] = { rows->a[row + lane], rows->b[row + lane] };
+    for (int k = 0; k < 2; k++) {
+      const vkm_vec3* linear = linear_velocities + bodies[k], *angular = angular_velocities + bodies[k];
+      velocities[k * 6][lane] = linear->x;
+      velocities[k * 6 + 1][lane] = linear->y;
+      velocities[k * 6 + 2][lane] = linear->z;
+      velocities[k * 6 + 3][lane] = angular->x;
+      velocities[k * 6 + 4][lane] = angular->y;
+      velocities[k * 6 + 5][lane] = angular->z;
+    }
+  }
+}
+
+static void store_block_velocities(
+  const fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t row,
+  const uint32_t static_body,
+  fun_block_velocities_t velocities
+) {
+  for (int lane = 0; lane < FUN_SOLVER_LANES; lane++) {
+    const uint32_t bodies[2] = { rows->a[row + lane], rows->b[row + lane] };
+    for (int k = 0; k < 2; k++) {
+      if (bodies[k] != static_body) {
+        linear_velocities[bodies[k]] = (vkm_vec3){ {
+          velocities[k * 6][lane], velocities[k * 6 + 1][lane], velocities[k * 6 + 2][lane]
+        } };
+        angular_velocities[bodies[k]] = (vkm_vec3){ {
+          velocities[k * 6 + 3][lane], velocities[k * 6 + 4][lane], velocities[k * 6 + 5][lane]
+        } };
+      }
+    }
+  }
+}
+
+#if defined(FUN_AVX2) || defined(FUN_SSE2)
+// Same operations in the same order as row_velocity(), apply_row_impulse() and solve_row(), one contact per lane.
+static __m128 block_row_velocity(const fun_contact_rows_t* rows, const __m128* velocities, const int32_t row) {
+  __m128 velocity = _mm_mul_ps(_mm_loadu_ps(rows->nx + row), _mm_sub_ps(velocities[6], velocities[0]));
+  velocity = _mm_add_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->ny + row), _mm_sub_ps(velocities[7], velocities[1])));
+  velocity = _mm_add_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->nz + row), _mm_sub_ps(velocities[8], velocities[2])));
+  velocity = _mm_add_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->rbx + row), velocities[9]));
+  velocity = _mm_add_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->rby + row), velocities[10]));
+  velocity = _mm_add_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->rbz + row), velocities[11]));
+  velocity = _mm_sub_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->rax + row), velocities[3]));
+  velocity = _mm_sub_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->ray + row), velocities[4]));
+  return _mm_sub_ps(velocity, _mm_mul_ps(_mm_loadu_ps(rows->raz + row), velocities[5]));
+}
+
+static void apply_block_row_impulse(
+  const fun_contact_rows_t* rows,
+  __m128* velocities,
+  const int32_t row,
+  const __m128 impulse
+) {
+  const __m128 nx = _mm_loadu_ps(rows->nx + row), ny = _mm_loadu_ps(rows->ny + row);
+  const __m128 nz = _mm_loadu_ps(rows->nz + row);
+  const __m128 linear_a = _mm_mul_ps(impulse, _mm_loadu_ps(rows->inverse_masses_a + row));
+  const __m128 linear_b = _mm_mul_ps(impulse, _mm_loadu_ps(rows->inverse_masses_b + row));
+
+  velocities[0] = _mm_sub_ps(velocities[0], _mm_mul_ps(nx, linear_a));
+  velocities[1] = _mm_sub_ps(velocities[1], _mm_mul_ps(ny, linear_a));
+  velocities[2] = _mm_sub_ps(velocities[2], _mm_mul_ps(nz, linear_a));
+  velocities[3] = _mm_sub_ps(velocities[3], _mm_mul_ps(_mm_loadu_ps(rows->iax + row), impulse));
+  velocities[4] = _mm_sub_ps(velocities[4], _mm_mul_ps(_mm_loadu_ps(rows->iay + row), impulse));
+  velocities[5] = _mm_sub_ps(velocities[5], _mm_mul_ps(_mm_loadu_ps(rows->iaz + row), impulse));
+  velocities[6] = _mm_add_ps(velocities[6], _mm_mul_ps(nx, linear_b));
+  velocities[7] = _mm_add_ps(velocities[7], _mm_mul_ps(ny, linear_b));
+  velocities[8] = _mm_add_ps(velocities[8], _mm_mul_ps(nz, linear_b));
+  velocities[9] = _mm_add_ps(velocities[9], _mm_mul_ps(_mm_loadu_ps(rows->ibx + row), impulse));
+  velocities[10] = _mm_add_ps(velocities[10], _mm_mul_ps(_mm_loadu_ps(rows->iby + row), impulse));
+  velocities[11] = _mm_add_ps(velocities[11], _mm_mul_ps(_mm_loadu_ps(rows->ibz + row), impulse));
+}
+
+static __m128 solve_block_row(
+  fun_contact_rows_t* rows,
+  __m128* velocities,
+  const int32_t row,
+  const __m128 lower,
+  const __m128 upper
+) {
+  const __m128 velocity = block_row_velocity(rows, velocities, row);
+  const __m128 previous = _mm_loadu_ps(rows->impulses + row);
+  const __m128 target = _mm_add_ps(velocity, _mm_loadu_ps(rows->biases + row));
+  const __m128 impulse = _mm_min_ps(
+    _mm_max_ps(_mm_sub_ps(previous, _mm_mul_ps(_mm_loadu_ps(rows->effective_masses + row), target)), lower),
+    upper
+  );
+  _mm_storeu_ps(rows->impulses + row, impulse);
+  apply_block_row_impulse(rows, velocities, row, _mm_sub_ps(impulse, previous));
+  return impulse;
+}
+
+// Warm starts or solves the FUN_SOLVER_LANES contacts of a block at once.
+static void solve_contact_block(
+  fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t block,
+  const uint32_t static_body,
+  const float friction,
+  const bool warm_start
+) {
+  const int32_t row = block * 3 * FUN_SOLVER_LANES;
+  fun_block_velocities_t lanes;
+  load_block_velocities(rows, linear_velocities, angular_velocities, row, lanes);
+  __m128 velocities[12];
+  for (int i = 0; i < 12; i++) {
+    velocities[i] = _mm_loadu_ps(lanes[i]);
+  }
+
+  if (warm_start) {
+    for (int kind = 0; kind < 3; kind++) {
+      const int32_t kind_row = row + kind * FUN_SOLVER_LANES;
+      apply_block_row_impulse(rows, velocities, kind_row, _mm_loadu_ps(rows->impulses + kind_row));
+    }
+  } else {
+    const __m128 normal = solve_block_row(rows, velocities, row, _mm_setzero_ps(), _mm_set1_ps(FLT_MAX));
+    const __m128 limit = _mm_mul_ps(_mm_set1_ps(friction), normal);
+    const __m128 negative_limit = _mm_sub_ps(_mm_setzero_ps(), limit);
+    solve_block_row(rows, velocities, row + FUN_SOLVER_LANES, negative_limit, limit);
+    solve_block_row(rows, velocities, row + 2 * FUN_SOLVER_LANES, negative_limit, limit);
+  }
+
+  for (int i = 0; i < 12; i++) {
+    _mm_storeu_ps(lanes[i], velocities[i]);
+  }
+  store_block_velocities(rows, linear_velocities, angular_velocities, row, static_body, lanes);
+}
+#else
+static float block_row_velocity(
+  const fun_contact_rows_t* rows,
+  fun_block_velocities_t velocities,
+  const int32_t row,
+  const int lane
+) {
+  const int32_t i = row + lane;
+  return rows->nx[i] * (velocities[6][lane] - velocities[0][lane])
+    + rows->ny[i] * (velocities[7][lane] - velocities[1][lane])
+    + rows->nz[i] * (velocities[8][lane] - velocities[2][lane])
+    + rows->rbx[i] * velocities[9][lane] + rows->rby[i] * velocities[10][lane] + rows->rbz[i] * velocities[11][lane]
+    - rows->rax[i] * velocities[3][lane] - rows->ray[i] * velocities[4][lane] - rows->raz[i] * velocities[5][lane];
+}
+
+static void apply_block_row_impulse(
+  const fun_contact_rows_t* rows,
+  fun_block_velocities_t velocities,
+  const int32_t row,
+  const int lane,
+  const float impulse
+) {
+  const int32_t i = row + lane;
+  const float linear_a = impulse * rows->inverse_masses_a[i], linear_b = impulse * rows->inverse_masses_b[i];
+  velocities[0][lane] -= rows->nx[i] * linear_a;
+  velocities[1][lane] -= rows->ny[i] * linear_a;
+  velocities[2][lane] -= rows->nz[i] * linear_a;
+  velocities[3][lane] -= rows->iax[i] * impulse;
+  velocities[4][lane] -= rows->iay[i] * impulse;
+  velocities[5][lane] -= rows->iaz[i] * impulse;
+  velocities[6][lane] += rows->nx[i] * linear_b;
+  velocities[7][lane] += rows->ny[i] * linear_b;
+  velocities[8][lane] += rows->nz[i] * linear_b;
+  velocities[9][lane] += rows->ibx[i] * impulse;
+  velocities[10][lane] += rows->iby[i] * impulse;
+  velocities[11][lane] += rows->ibz[i] * impulse;
+}
+
+static float solve_block_row(
+  fun_contact_rows_t* rows,
+  fun_block_velocities_t velocities,
+  const int32_t row,
+  const int lane,
+  const float lower,
+  const float upper
+) {
+  const float velocity = block_row_velocity(rows, velocities, row, lane);
+  const float previous = rows->impulses[row + lane];
+  const float impulse = fminf(
+    fmaxf(previous - rows->effective_masses[row + lane] * (velocity + rows->biases[row + lane]), lower),
+    upper
+  );
+  rows->impulses[row + lane] = impulse;
+  apply_block_row_impulse(rows, velocities, row, lane, impulse - previous);
+  return impulse;
+}
+
+static void solve_contact_block(
+  fun_contact_rows_t* rows,
+  vkm_vec3* linear_velocities,
+  vkm_vec3* angular_velocities,
+  const int32_t block,
+  const uint32_t static_body,
+  const float friction,
+  const bool warm_start
+) {
+  const int32_t row = block * 3 * FUN_SOLVER_LANES;
+  fun_block_velocities_t velocities;
+  load_block_velocities(rows, linear_velocities, angular_velocities, row, velocities);
+
+  for (int lane = 0; lane < FUN_SOLVER_LANES; lane++) {
+    if (warm_start) {
+      for (int kind = 0; kind < 3; kind++) {
+        const int32_t kind_row = row + kind * FUN_SOLVER_LANES;
+        apply_block_row_impulse(rows, velocities, kind_row, lane, rows->impulses[kind_row + lane]);
+      }
+    } else {
+      const float limit = friction * solve_block_row(rows, velocities, row, lane, 0.0f, FLT_MAX);
+      solve_block_row(rows, velocities, row + FUN_SOLVER_LANES, lane, -limit, limit);
+      solve_block_row(rows, velocities, row + 2 * FUN_SOLVER_LANES, lane, -limit, limit);
+    }
+  }
+
+  store_block_velocities(rows, linear_velocities, angular_velocities, row, static_body, velocities);
+}
+#endif
+
+// One pass over every contact, warm starting them or solving them. Each worker takes a slice of the blocks of every
+// color, and waits for the others before moving on to the next color. The first worker then goes through the
+// sequential color alone.
+static void solve_contact_colors(
+  CollisionWorld3D* world,
+  const int32_t stage,
+  const int32_t stages_count,
+  const float friction,
+  const bool warm_start
+) {
+  fun_contact_rows_t* rows = &world->solver.rows;
+  vkm_vec3* linear_velocities = world->solver.linear_velocities;
+  vkm_vec3* angular_velocities = world->solver.angular_velocities;
+  const uint32_t static_body = (uint32_t)world->bodies_count;
+  const int32_t* starts = world->solver.color_starts;
+
+  // Colors are handed out from the first one, so the first empty color ends them.
+  for (int color = 0; color < FUN_SOLVER_COLORS && starts[color] < starts[color + 1]; color++) {
+    const int32_t blocks = starts[color + 1] - starts[color];
+    const int32_t begin = starts[color] + (int32_t)((int64_t)blocks * stage / stages_count);
+    const int32_t end = starts[color] + (int32_t)((int64_t)blocks * (stage + 1) / stages_count);
+    for (int32_t block = begin; block < end; block++) {
+      solve_contact_block(rows, linear_velocities, angular_velocities, block, static_body, friction, warm_start);
+    }
+    wait_for_workers(&world->solver.barrier, stages_count);
+  }
+
+  const int32_t sequential_begin = starts[FUN_SOLVER_COLORS] * FUN_SOLVER_LANES;
+  const int32_t sequential_end = starts[FUN_SOLVER_COLORS + 1] * FUN_SOLVER_LANES;
+  if (sequential_begin == sequential_end) {
+    return;
+  }
+  if (!stage) {
+    for (int32_t contact = sequential_begin; contact < sequential_end; contact++) {
+      if (warm_start) {
+        warm_start_contact(rows, linear_velocities, angular_velocities, contact, static_body);
+      } else {
+        solve_contact(rows, linear_velocities, angular_velocities, contact, static_body, friction);
+      }
+    }
+  }
+  wait_for_workers(&world->solver.barrier, stages_count);
+}
+
+// Stores the velocities back into the bodies and the impulses back into the contacts. A body hitting a sleeping one
+// faster than a sleeping body may move wakes it up.
+static void finish_contact_rows(ecs_world_t* ecs, CollisionWorld3D* world, const float wake_speed) {
+  fun_contact_rows_t* rows = &world->solver.rows;
+  for (int32_t row = 0; row < rows->count; row += 3 * FUN_SOLVER_LANES) {
+    for (int lane = 0; lane < FUN_SOLVER_LANES; lane++) {
+      fun_contact_t* contact = rows->contacts[row + lane];
+      if (contact) {
+        contact->normal_impulse = rows->impulses[row + lane];
+        contact->tangent_impulses[0] = rows->impulses[row + FUN_SOLVER_LANES + lane];
+        contact->tangent_impulses[1] = rows->impulses[row + 2 * FUN_SOLVER_LANES + lane];
+      }
+    }
+  }
+
+  fun_islands_t* islands = &world->islands;
+  for (int32_t i = 0; i < world->manifolds_count; i++) {
+    const fun_manifold_t* manifold = world->manifolds + i;
+    const uint32_t a = manifold->bodies[0], b = manifold->bodies[1];
+    if (b == FUN_NO_BODY || world->sleeping[a] == world->sleeping[b]) {
+      continue;
+    }
+
+    // The velocities of the bodies still hold what they were before solving.
+    const uint32_t awake = world->sleeping[a] ? b : a, asleep = world->sleeping[a] ? a : b;
+    const Velocity3D* velocity = world->velocities[awake];
+    if (world->inverse_masses[awake] > 0.0f && vkm_dot(velocity, velocity) > wake_speed * wake_speed) {
+      islands->waking[islands->body_islands[asleep]] = true;
+    }
+  }
+
+  for (int32_t i = 0; i < islands->count; i++) {
+    if (!islands->waking[i]) {
+      continue;
+    }
+    for (int32_t j = islands->body_starts[i]; j < islands->body_starts[i + 1]; j++) {
+      if (world->sleeping[islands->bodies[j]]) {
+        ecs_remove(ecs, world->entities[islands->bodies[j]], Sleeping);
+      }
+    }
+  }
+
+  for (int32_t i = 0; i < world->bodies_count; i++) {
+    if (world->inverse_masses[i] > 0.0f) {
+      *world->velocities[i] = world->solver.linear_velocities[i];
+      if (world->angular_velocities[i]) {
+        *world->angular_velocities[i] = world->solver.angular_velocities[i];
+      }
+    }
+  }
+}
+
+// Puts islands to sleep once all of their awake bodies have been idle for long enough. FallAsleep() keeps counting the
+// idle time of bodies that collide, but leaves the decision to this.
+static void sleep_islands(ecs_world_t* ecs, CollisionWorld3D* world, const SleepSettings* settings) {
+  const fun_islands_t* islands = &world->islands;
+  for (int32_t i = 0; i < islands->count; i++) {
+    if (islands->waking[i]) {
+      continue;
+    }
+
+    bool idle = true, awake = false;
+    for (int32_t j = islands->body_starts[i]; idle && j < islands->body_starts[i + 1]; j++) {
+      const int32_t body = islands->bodies[j];
+      if (world->inverse_masses[body] > 0.0f) {
+        const Sleepable* sleepable = world->sleepables[body];
+        idle = sleepable && sleepable->idle_time >= settings->time;
+        awake = true;
+      }
+    }
+    if (!idle || !awake) {
+      continue;
+    }
+
+    for (int32_t j = islands->body_starts[i]; j < islands->body_starts[i + 1]; j++) {
+      const int32_t body = islands->bodies[j];
+      if (world->inverse_masses[body] > 0.0f) {
+        world->sleepables[body]->idle_time = 0.0f;
+        *world->velocities[body] = CVKM_VEC3_ZERO;
+        if (world->angular_velocities[body]) {
+          *world->angular_velocities[body] = CVKM_VEC3_ZERO;
+        }
+        ecs_add(ecs, world->entities[body], Sleeping);
+      }
+    }
+  }
+}
+
+// The contacts found this step are resolved by changing the velocities of the bodies, with sequential impulses. It
+// happens once the positions of the step are known, so the velocities it leaves are the ones the next step integrates.
+// This first finds the islands and turns the contacts into rows.
+static void PrepareContacts3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_field(it, CollisionWorld3D, 0);
+  const SolverSettings* settings = ecs_field(it, SolverSettings, 1);
+  const FixedTimeStep* fixed = ecs_field(it, FixedTimeStep, 2);
+
+  // Nothing moved if no step was taken, and the contacts were already solved.
+  const float delta_time = fixed ? fixed->delta_time : it->delta_system_time;
+  world->solver.solving = false;
+  if ((fixed && !fixed->substeps) || delta_time <= 0.0f) {
+    return;
+  }
+
+  const int32_t count = world->bodies_count + 1;
+  int32_t capacity = world->solver.velocities_capacity;
+  world->solver.linear_velocities = reserve(world->solver.linear_velocities, &capacity, count, sizeof(vkm_vec3));
+  capacity = world->solver.velocities_capacity;
+  world->solver.body_colors = reserve(world->solver.body_colors, &capacity, count, sizeof(uint64_t));
+  world->solver.angular_velocities = reserve(
+    world->solver.angular_velocities,
+    &world->solver.velocities_capacity,
+    count,
+    sizeof(vkm_vec3)
+  );
+
+  if (ecs_get_stage_count(it->world) > 1 && !world->solver.barrier.lock) {
+    world->solver.barrier.lock = ecs_os_mutex_new();
+    world->solver.barrier.condition = ecs_os_cond_new();
+  }
+
+  build_islands(world);
+  prepare_contact_rows(world, settings, delta_time);
+  world->solver.solving = true;
+}
+
+// Warm starts then solves all the contacts of an island, in the order of the manifolds.
+static void solve_island(CollisionWorld3D* world, const int32_t island, const SolverSettings* settings) {
+  fun_contact_rows_t* rows = &world->solver.rows;
+  vkm_vec3* linear_velocities = world->solver.linear_velocities;
+  vkm_vec3* angular_velocities = world->solver.angular_velocities;
+  const int32_t first = world->solver.color_starts[FUN_SOLVER_COLORS] * FUN_SOLVER_LANES;
+  const int32_t begin = first + world->islands.contact_starts[island];
+  const int32_t end = first + world->islands.contact_starts[island + 1];
+  const uint32_t static_body = (uint32_t)world->bodies_count;
+
+  for (int32_t contact = begin; contact < end; contact++) {
+    warm_start_contact(rows, linear_velocities, angular_velocities, contact, static_body);
+  }
+  for (uint32_t iteration = 0; iteration < settings->iterations; iteration++) {
+    for (int32_t contact = begin; contact < end; contact++) {
+      solve_contact(rows, linear_velocities, angular_velocities, contact, static_body, settings->friction);
+    }
+  }
+}
+
+// With colors, every worker warm starts, then solves the colored contacts, the first one also taking the sequential
+// ones. Otherwise, the workers take whole islands one after the other until none is left. Either way, the results
+// don't depend on which worker solved what.
+static void SolveContacts3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  CollisionWorld3D* world = ecs_get_mut(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  const SolverSettings* settings = ecs_singleton_get(it->world, SolverSettings);
+  if (!world || !settings || !world->solver.solving) {
+    return;
+  }
+
+  if (world->solver.color_starts[1] > 0) {
+    const int32_t stage = ecs_stage_get_id(it->world);
+    const int32_t stages_count = ecs_get_stage_count(it->world);
+    solve_contact_colors(world, stage, stages_count, settings->friction, true);
+    for (uint32_t iteration = 0; iteration < settings->iterations; iteration++) {
+      solve_contact_colors(world, stage, stages_count, settings->friction, false);
+    }
+    return;
+  }
+
+  fun_islands_t* islands = &world->islands;
+  for (int32_t job = ecs_os_ainc(&islands->next_job) - 1; job < islands->jobs_count;
+    job = ecs_os_ainc(&islands->next_job) - 1) {
+    solve_island(world, (int32_t)(islands->order[job] & UINT32_MAX), settings);
+  }
+}
+
+static void FinishContacts3D(ecs_iter_t* it) {
+  CollisionWorld3D* world = ecs_field(it, CollisionWorld3D, 0);
+  const SleepSettings* sleep_settings = ecs_field(it, SleepSettings, 1);
+
+  if (world->solver.solving) {
+    finish_contact_rows(it->world, world, sleep_settings ? sleep_settings->linear_velocity : 0.0f);
+    if (sleep_settings) {
+      sleep_islands(it->world, world, sleep_settings);
+    }
+  }
+}
+
+#ifndef _MSC_VER
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wdollar-in-identifier-extension"
+#endif
+#endif
+
+// Collects the particles every step into the structure of arrays the solver steps. Their acceleration from gravity
+// and forces is computed once here, and stays constant over the step.
+static void GatherParticles3D(ecs_iter_t* it) {
+  ParticleWorld3D* world = ecs_get_mut(it->world, ecs_id(ParticleWorld3D), ParticleWorld3D);
+  const fun_step_t* step = it->param;
+  if (!world) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  // Like for other bodies, the forces act over every step of the frame and are cleared by the last one.
+  const bool last_step = step->index == step->count - 1;
+  world->count = 0;
+
+  while (ecs_iter_next(it)) {
+    Position3D* positions = ecs_field(it, Position3D, 0);
+    Velocity3D* velocities = ecs_field(it, Velocity3D, 1);
+    Particle3D* particles = ecs_field(it, Particle3D, 2);
+    const InverseMass* inverse_masses = ecs_field(it, InverseMass, 4);
+    Force3D* forces = ecs_field(it, Force3D, 5);
+    const GravityScale* gravity_scales = ecs_field(it, GravityScale, 6);
+    const DampingRate* damping_rates = ecs_field(it, DampingRate, 7);
+    const int inverse_mass_stride = ecs_field_is_self(it, 4);
+    const int gravity_scale_stride = ecs_field_is_self(it, 6);
+    const int damping_rate_stride = ecs_field_is_self(it, 7);
+    const Gravity3D* gravity_ptr = ecs_field(it, Gravity3D, 8);
+    Interpolation3D* interpolations = ecs_field(it, Interpolation3D, 9);
+
+    const Gravity3D gravity = gravity_ptr ? *gravity_ptr : CVKM_VEC3_ZERO;
+    const float default_damping = -fun_logf(FUN_DEFAULT_DRAG);
+
+    particle_world_3d_reserve(world, world->count + it->count);
+    for (int i = 0; i < it->count; i++) {
+      const int32_t particle = world->count++;
+      particles[i].index = (uint32_t)particle;
+      world->entities[particle] = it->entities[i];
+      world->positions[particle] = positions + i;
+      world->velocities[particle] = velocities + i;
+      world->interpolations[particle] = interpolations ? interpolations + i : NULL;
+
+      world->x[particle] = positions[i].x;
+      world->y[particle] = positions[i].y;
+      world->z[particle] = positions[i].z;
+      world->vx[particle] = velocities[i].x;
+      world->vy[particle] = velocities[i].y;
+      world->vz[particle] = velocities[i].z;
+      world->radii[particle] = particles[i].radius;
+      world->inverse_masses[particle] = inverse_masses ? inverse_masses[i * inverse_mass_stride] : 1.0f;
+      world->damping_rates[particle] = damping_rates ? damping_rates[i * damping_rate_stride] : default_damping;
+
+      vkm_vec3 acceleration = CVKM_VEC3_ZERO;
+      if (world->inverse_masses[particle] > 0.0f) {
+        acceleration = gravity;
+        if (gravity_scales) {
+          vkm_mul(&acceleration, gravity_scales[i * gravity_scale_stride], &acceleration);
+        }
+        if (forces) {
+          vkm_muladd(forces + i, world->inverse_masses[particle], &acceleration);
+        }
+      }
+      world->ax[particle] = acceleration.x;
+      world->ay[particle] = acceleration.y;
+      world->az[particle] = acceleration.z;
+
+      if (forces && last_step) {
+        forces[i] = CVKM_VEC3_ZERO;
+      }
+    }
+  }
+}
+
+// Any link added, set or removed has them all flattened again before the next step.
+static void OnChangeDistanceLink3D(ecs_iter_t* it) {
+  if (ecs_is_fini(it->world)) {
+    return;
+  }
+
+  ParticleWorld3D* world = ecs_get_mut(it->world, ecs_id(ParticleWorld3D), ParticleWorld3D);
+  if (world) {
+    world->links_cached = false;
+  }
+}
+
+// Where a linked entity is among the particles gathered this step, or UINT32_MAX if it isn't one of them. Where it
+// was last time is checked first, which only misses when the particles were gathered in another order.
+static uint32_t find_linked_particle(
+  const ecs_world_t* ecs,
+  const ParticleWorld3D* world,
+  const ecs_entity_t entity,
+  const uint32_t index
+) {
+  if (index < (uint32_t)world->count && world->entities[index] == entity) {
+    return index;
+  }
+
+  const Particle3D* particle = ecs_is_alive(ecs, entity) ? ecs_get(ecs, entity, Particle3D) : NULL;
+  if (!particle || particle->index >= (uint32_t)world->count || world->entities[particle->index] != entity) {
+    return UINT32_MAX;
+  }
+  return particle->index;
+}
+
+// Flattens the DistanceLink3D relationships again only after one of them changed. Otherwise the cached links are
+// just matched with the gathered particles, dropping the ones whose ends aren't both particles this step, so the
+// solver never has to look the relationships up.
+static void GatherDistanceLinks3D(ecs_iter_t* it) {
+  ParticleWorld3D* world = ecs_get_mut(it->world, ecs_id(ParticleWorld3D), ParticleWorld3D);
+  if (!world || world->links_cached) {
+    ecs_iter_fini(it);
+  } else {
+    world->cached_links.count = 0;
+    world->links_cached = true;
+    while (ecs_iter_next(it)) {
+      const DistanceLink3D* links = ecs_field(it, DistanceLink3D, 0);
+      const int link_stride = ecs_field_is_self(it, 0);
+      const ecs_entity_t target = ecs_pair_second(it->world, ecs_field_id(it, 0));
+      for (int i = 0; i < it->count; i++) {
+        push_particle_link(world, it->entities[i], target, links + i * link_stride);
+      }
+    }
+  }
+  if (!world) {
+    return;
+  }
+
+  fun_particle_constraints_t* cached = &world->cached_links;
+  world->links.count = 0;
+  for (int32_t i = 0; i < cached->count; i++) {
+    cached->a[i] = find_linked_particle(it->world, world, world->link_entities[i * 2], cached->a[i]);
+    cached->b[i] = find_linked_particle(it->world, world, world->link_entities[i * 2 + 1], cached->b[i]);
+    if (cached->a[i] != UINT32_MAX && cached->b[i] != UINT32_MAX) {
+      push_particle_constraint(&world->links, cached->a[i], cached->b[i], cached->lengths[i], cached->compliances[i]);
+    }
+  }
+}
+
+// Finds the pairs of particles that may touch during the next step of delta_time, so that the substeps only have to
+// check the distance between them.
+static void find_particle_contacts(ParticleWorld3D* world, const float delta_time) {
+  world->contacts.count = 0;
+
+  float max_reach = 0.0f, max_radius = 0.0f;
+  for (int32_t i = 0; i < world->count; i++) {
+    const float speed = sqrtf(world->vx[i] * world->vx[i] + world->vy[i] * world->vy[i] + world->vz[i] * world->vz[i]);
+    world->reaches[i] = world->radii[i] + speed * delta_time;
+    max_reach = fmaxf(max_reach, world->reaches[i]);
+    max_radius = fmaxf(max_radius, world->radii[i]);
+  }
+
+  // Points never collide with each other, so only bother when some particle has a size.
+  if (max_radius <= 0.0f) {
+    return;
+  }
+
+  build_grid(&world->grid, world->count, world->x, world->y, world->z, world->reaches, 2.0f * max_reach);
+  find_grid_pairs(&world->contacts, &world->grid, 0, (uint32_t)world->count);
+}
+
+// Moves the particles by their velocity, after adding their acceleration and applying their drag.
+static void predict_particles(ParticleWorld3D* world, const float delta_time) {
+  const body_scalars_t scalars = { .damping_rates = world->damping_rates, .damping_rate_stride = 1 };
+  drag_cache_t drag_cache = drag_cache_init(delta_time);
+  for (int32_t i = 0; i < world->count; i++) {
+    world->previous_x[i] = world->x[i];
+    world->previous_y[i] = world->y[i];
+    world->previous_z[i] = world->z[i];
+    if (world->inverse_masses[i] <= 0.0f) {
+      continue;
+    }
+
+    const float drag = drag_factor(&drag_cache, &scalars, i);
+    world->vx[i] = (world->vx[i] + world->ax[i] * delta_time) * drag;
+    world->vy[i] = (world->vy[i] + world->ay[i] * delta_time) * drag;
+    world->vz[i] = (world->vz[i] + world->az[i] * delta_time) * drag;
+    world->x[i] += world->vx[i] * delta_time;
+    world->y[i] += world->vy[i] * delta_time;
+    world->z[i] += world->vz[i] * delta_time;
+  }
+}
+
+// Pushes the particles out of the planes, and cancels as much of their sliding along them this substep as friction
+// allows, which is proportional to how deep they went.
+static void project_particle_planes(
+  ParticleWorld3D* world,
+  const Plane* planes,
+  const int32_t planes_count,
+  const float friction
+) {
+  for (int32_t p = 0; p < planes_count; p++) {
+    const vkm_vec3 normal = planes[p].normal;
+    const float distance = planes[p].distance;
+
+    for (int32_t i = 0; i < world->count; i++) {
+      const float depth = distance + world->radii[i] -
+        (normal.x * world->x[i] + normal.y * world->y[i] + normal.z * world->z[i]);
+      if (depth <= 0.0f || world->inverse_masses[i] <= 0.0f) {
+        continue;
+      }
+
+      world->x[i] += normal.x * depth;
+      world->y[i] += normal.y * depth;
+      world->z[i] += normal.z * depth;
+
+      float x = world->x[i] - world->previous_x[i];
+      float y = world->y[i] - world->previous_y[i];
+      float z = world->z[i] - world->previous_z[i];
+      const float along = normal.x * x + normal.y * y + normal.z * z;
+      x -= normal.x * along;
+      y -= normal.y * along;
+      z -= normal.z * along;
+
+      // Static friction stops the sliding altogether, kinetic friction only slows it down.
+      const float slide = sqrtf(x * x + y * y + z * z);
+      const float limit = friction * depth;
+      const float scale = slide <= limit ? 1.0f : limit / slide;
+      world->x[i] -= x * scale;
+      world->y[i] -= y * scale;
+      world->z[i] -= z * scale;
+    }
+  }
+}
+
+// Moves both particles along the line between them, in proportion to their inverse masses, towards being length
+// apart. A link is solved in both directions, a contact only pushes them apart. The compliance is scaled by the
+// substep as XPBD does, so that softness doesn't depend on the time step or the substep count.
+static void project_particle_distance(
+  ParticleWorld3D* world,
+  const uint32_t a,
+  const uint32_t b,
+  const float length,
+  const float alpha,
+  const bool push_only
+) {
+  const float weight = world->inverse_masses[a] + world->inverse_masses[b] + alpha;
+  if (weight <= 0.0f) {
+    return;
+  }
+
+  const float x = world->x[b] - world->x[a], y = world->y[b] - world->y[a], z = world->z[b] - world->z[a];
+  const float distance = sqrtf(x * x + y * y + z * z);
+  const float error = distance - length;
+  if (distance <= 0.0f || (push_only && error >= 0.0f)) {
+    return;
+  }
+
+  const float lambda = -error / (weight * distance);
+  const float wa = world->inverse_masses[a] * lambda, wb = world->inverse_masses[b] * lambda;
+  world->x[a] -= x * wa;
+  world->y[a] -= y * wa;
+  world->z[a] -= z * wa;
+  world->x[b] += x * wb;
+  world->y[b] += y * wb;
+  world->z[b] += z * wb;
+}
+
+// Each fixed step finds the contacts, then splits into substeps that move the particles and project every constraint
+// once. Taking small steps converges much better than iterating over the constraints of one big step. Everything runs
+// in the order the particles and constraints were gathered, so the results don't depend on anything else.
+static void StepParticles3D(ecs_iter_t* it) {
+  ParticleWorld3D* world = ecs_field(it, ParticleWorld3D, 0);
+  const ParticleSettings* settings = ecs_field(it, ParticleSettings, 1);
+  const CollisionWorld3D* collision_world = ecs_field(it, CollisionWorld3D, 2);
+  const FixedTimeStep* fixed = ecs_field(it, FixedTimeStep, 3);
+  const fun_step_t* step = it->param;
+
+  const float delta_time = fixed ? fixed->delta_time : it->delta_system_time;
+  const uint32_t substeps = settings->substeps ? settings->substeps : 1;
+  const float h = delta_time / (float)substeps;
+  const Plane* planes = collision_world ? collision_world->planes : NULL;
+  const int32_t planes_count = collision_world ? collision_world->planes_count : 0;
+  const fun_particle_constraints_t* links = &world->links;
+
+  if (!world->count || delta_time <= 0.0f) {
+    return;
+  }
+
+  // Rendering blends between the last two fixed steps.
+  if (step->index == step->count - 1) {
+    for (int32_t i = 0; i < world->count; i++) {
+      if (world->interpolations[i]) {
+        world->interpolations[i]->previous_position = (Position3D){ { world->x[i], world->y[i], world->z[i] } };
+        world->interpolations[i]->previous_rotation = CVKM_QUAT_IDENTITY;
+        world->interpolations[i]->stepped = true;
+      }
+    }
+  }
+
+  find_particle_contacts(world, delta_time);
+
+  for (uint32_t substep = 0; substep < substeps; substep++) {
+    predict_particles(world, h);
+    project_particle_planes(world, planes, planes_count, settings->friction);
+
+    const float inverse_h_squared = 1.0f / (h * h);
+    for (int32_t i = 0; i < links->count; i++) {
+      const float alpha = links->compliances[i] * inverse_h_squared;
+      project_particle_distance(world, links->a[i], links->b[i], links->lengths[i], alpha, false);
+    }
+    for (int32_t i = 0; i < world->contacts.count; i++) {
+      const fun_pair_t pair = world->contacts.pairs[i];
+      project_particle_distance(world, pair.a, pair.b, world->radii[pair.a] + world->radii[pair.b], 0.0f, true);
+    }
+
+    // The velocity is whatever the substep ended up doing, constraints included.
+    const float inverse_h = 1.0f / h;
+    for (int32_t i = 0; i < world->count; i++) {
+      world->vx[i] = (world->x[i] - world->previous_x[i]) * inverse_h;
+      world->vy[i] = (world->y[i] - world->previous_y[i]) * inverse_h;
+      world->vz[i] = (world->z[i] - world->previous_z[i]) * inverse_h;
+    }
+  }
+
+  for (int32_t i = 0; i < world->count; i++) {
+    *world->positions[i] = (Position3D){ { world->x[i], world->y[i], world->z[i] } };
+    *world->velocities[i] = (Velocity3D){ { world->vx[i], world->vy[i], world->vz[i] } };
+  }
+}
+
+// Collects the fluid particles every step, then sorts them by bucket of a cell list as large as the smoothing radius,
+// so that the particles of a cell are contiguous. Particles of other cells that share a bucket are too far to count,
+// as the kernels are zero past the smoothing radius.
+static void GatherFluid3D(ecs_iter_t* it) {
+  FluidWorld3D* fluid = ecs_get_mut(it->world, ecs_id(FluidWorld3D), FluidWorld3D);
+  const fun_step_t* step = it->param;
+  if (fluid) {
+    fluid->count = 0;
+  }
+  if (!fluid || fluid->smoothing_radius <= 0.0f) {
+    ecs_iter_fini(it);
+    return;
+  }
+
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  if (stages_count > fluid->neighbors_count) {
+    fluid->neighbors = realloc(fluid->neighbors, stages_count * sizeof(fun_fluid_neighbors_t));
+    for (int32_t i = fluid->neighbors_count; i < stages_count; i++) {
+      fluid->neighbors[i] = (fun_fluid_neighbors_t){ 0 };
+    }
+    fluid->neighbors_count = stages_count;
+  }
+
+  fun_fluid_particles_t* gathered = &fluid->gathered;
+  const float inverse_cell_size = 1.0f / fluid->smoothing_radius;
+  while (ecs_iter_next(it)) {
+    const Position3D* positions = ecs_field(it, Position3D, 0);
+    const Velocity3D* velocities = ecs_field(it, Velocity3D, 1);
+    Force3D* forces = ecs_field(it, Force3D, 2);
+    const InverseMass* inverse_masses = ecs_field(it, InverseMass, 3);
+    const int inverse_mass_stride = ecs_field_is_self(it, 3);
+
+    fluid_world_3d_reserve(fluid, fluid->count + it->count);
+    for (int i = 0; i < it->count; i++) {
+      // Like particles, they weigh 1 kg without InverseMass, and pinned ones have no mass to weigh in with.
+      const InverseMass inverse_mass = inverse_masses ? inverse_masses[i * inverse_mass_stride] : 1.0f;
+      if (inverse_mass <= 0.0f) {
+        continue;
+      }
+
+      const int32_t particle = fluid->count++;
+      gathered->x[particle] = positions[i].x;
+      gathered->y[particle] = positions[i].y;
+      gathered->z[particle] = positions[i].z;
+      gathered->vx[particle] = velocities[i].x;
+      gathered->vy[particle] = velocities[i].y;
+      gathered->vz[particle] = velocities[i].z;
+      gathered->masses[particle] = 1.0f / inverse_mass;
+      gathered->cells[particle] = (vkm_ivec3){ {
+        (int32_t)floorf(positions[i].x * inverse_cell_size),
+        (int32_t)floorf(positions[i].y * inverse_cell_size),
+        (int32_t)floorf(positions[i].z * inverse_cell_size),
+      } };
+      gathered->forces[particle] = forces + i;
+
+      // Forces are only cleared by the last step, so the ones the fluid added in the previous step are taken back out.
+      // No table changes between the steps of a frame, so the particles are gathered in the same order every time.
+      if (step->index) {
+        forces[i] = fluid->own_forces[particle];
+      } else {
+        fluid->own_forces[particle] = forces[i];
+      }
+    }
+  }
+
+  // About two buckets per particle keeps hash collisions between distinct cells rare.
+  uint32_t buckets = 1;
+  while (buckets < 2u * (uint32_t)fluid->count) {
+    buckets *= 2;
+  }
+  fluid->cell_starts = reserve(fluid->cell_starts, &fluid->buckets_capacity, (int32_t)buckets + 1, sizeof(uint32_t));
+  fluid->buckets_count = buckets;
+  memset(fluid->cell_starts, 0, (buckets + 1) * sizeof(uint32_t));
+
+  const uint32_t mask = buckets - 1;
+  for (int32_t i = 0; i < fluid->count; i++) {
+    fluid->buckets[i] = grid_hash(gathered->cells + i, mask);
+    fluid->cell_starts[fluid->buckets[i] + 1]++;
+  }
+  for (uint32_t i = 0; i < buckets; i++) {
+    fluid->cell_starts[i + 1] += fluid->cell_starts[i];
+  }
+
+  // Scatter using the bucket starts as cursors, then shift them back into place.
+  fun_fluid_particles_t* sorted = &fluid->sorted;
+  for (int32_t i = 0; i < fluid->count; i++) {
+    const uint32_t j = fluid->cell_starts[fluid->buckets[i]]++;
+    sorted->x[j] = gathered->x[i];
+    sorted->y[j] = gathered->y[i];
+    sorted->z[j] = gathered->z[i];
+    sorted->vx[j] = gathered->vx[i];
+    sorted->vy[j] = gathered->vy[i];
+    sorted->vz[j] = gathered->vz[i];
+    sorted->masses[j] = gathered->masses[i];
+    sorted->cells[j] = gathered->cells[i];
+    sorted->forces[j] = gathered->forces[i];
+  }
+  memmove(fluid->cell_starts + 1, fluid->cell_starts, buckets * sizeof(uint32_t));
+  fluid->cell_starts[0] = 0;
+}
+
+// The buckets of the 27 cells around a cell that have particles, each only once even when cells share one.
+static int fluid_neighbor_buckets(const FluidWorld3D* fluid, const vkm_ivec3* cell, uint32_t* buckets) {
+  const uint32_t mask = fluid->buckets_count - 1;
+  int count = 0;
+  for (int z = -1; z <= 1; z++) {
+    for (int y = -1; y <= 1; y++) {
+      for (int x = -1; x <= 1; x++) {
+        const vkm_ivec3 neighbor = { { cell->x + x, cell->y + y, cell->z + z } };
+        const uint32_t bucket = grid_hash(&neighbor, mask);
+        bool skipped = fluid->cell_starts[bucket] == fluid->cell_starts[bucket + 1];
+        for (int i = 0; i < count && !skipped; i++) {
+          skipped = buckets[i] == bucket;
+        }
+        if (!skipped) {
+          buckets[count++] = bucket;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+#ifdef FUN_AVX2
+#define FUN_FLUID_LANES 8
+#elif defined(FUN_SSE2)
+#define FUN_FLUID_LANES 4
+#else
+#define FUN_FLUID_LANES 1
+#endif
+
+// Copies the particles of the buckets around a cell, which every particle of the cell then sums up in one go. The
+// density only needs the positions and the masses. The padding has no mass and no volume, so it adds nothing.
+static void gather_fluid_neighbors(
+  const FluidWorld3D* fluid,
+  const vkm_ivec3* cell,
+  fun_fluid_neighbors_t* neighbors,
+  const bool forces
+) {
+  uint32_t buckets[27];
+  const int buckets_count = fluid_neighbor_buckets(fluid, cell, buckets);
+  const fun_fluid_particles_t* sorted = &fluid->sorted;
+
+  neighbors->count = 0;
+  for (int b = 0; b < buckets_count; b++) {
+    const uint32_t begin = fluid->cell_starts[buckets[b]];
+    const int32_t count = (int32_t)(fluid->cell_starts[buckets[b] + 1] - begin);
+    fluid_neighbors_reserve(neighbors, neighbors->count + count + FUN_FLUID_LANES);
+
+    const float* sources[] = {
+      sorted->x, sorted->y, sorted->z, sorted->masses,
+      sorted->vx, sorted->vy, sorted->vz, fluid->pressure_terms, fluid->volumes,
+    };
+    float* destinations[] = {
+      neighbors->x, neighbors->y, neighbors->z, neighbors->masses,
+      neighbors->vx, neighbors->vy, neighbors->vz, neighbors->pressure_terms, neighbors->volumes,
+    };
+    const size_t arrays_count = forces ? FUN_COUNTOF(sources) : 4;
+    for (size_t i = 0; i < arrays_count; i++) {
+      memcpy(destinations[i] + neighbors->count, sources[i] + begin, count * sizeof(float));
+    }
+    neighbors->count += count;
+  }
+
+  while (neighbors->count % FUN_FLUID_LANES) {
+    float** floats[] = FUN_FLUID_NEIGHBOR_FLOATS(neighbors);
+    for (size_t i = 0; i < FUN_COUNTOF(floats); i++) {
+      (*floats[i])[neighbors->count] = 0.0f;
+    }
+    neighbors->count++;
+  }
+}
+
+#ifdef FUN_AVX2
+// Wendland kernel (1 - q)^4 (1 + 4q) times the mass of 8 neighbors at a time, which is 0 past the smoothing radius.
+static int32_t fluid_density_simd(
+  const fun_fluid_neighbors_t* neighbors,
+  const float* point,
+  const float inverse_radius,
+  float* density
+) {
+  const __m256 px = _mm256_set1_ps(point[0]), py = _mm256_set1_ps(point[1]), pz = _mm256_set1_ps(point[2]);
+  const __m256 scale = _mm256_set1_ps(inverse_radius);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), four = _mm256_set1_ps(4.0f);
+  __m256 sum = zero;
+
+  int32_t i = 0;
+  for (; i + FUN_FLUID_LANES <= neighbors->count; i += FUN_FLUID_LANES) {
+    const __m256 dx = _mm256_mul_ps(_mm256_sub_ps(px, _mm256_loadu_ps(neighbors->x + i)), scale);
+    const __m256 dy = _mm256_mul_ps(_mm256_sub_ps(py, _mm256_loadu_ps(neighbors->y + i)), scale);
+    const __m256 dz = _mm256_mul_ps(_mm256_sub_ps(pz, _mm256_loadu_ps(neighbors->z + i)), scale);
+    const __m256 q = _mm256_sqrt_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz))
+    );
+    const __m256 t = _mm256_max_ps(_mm256_sub_ps(one, q), zero);
+    const __m256 t_squared = _mm256_mul_ps(t, t);
+    const __m256 w = _mm256_mul_ps(_mm256_mul_ps(t_squared, t_squared), _mm256_add_ps(one, _mm256_mul_ps(four, q)));
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(neighbors->masses + i), w));
+  }
+
+  float lanes[FUN_FLUID_LANES];
+  _mm256_storeu_ps(lanes, sum);
+  for (int k = 0; k < FUN_FLUID_LANES; k++) {
+    *density += lanes[k];
+  }
+  return i;
+}
+
+// Gradient of the Wendland kernel and laplacian of the viscosity kernel of 8 neighbors at a time. Both are 0 past the
+// smoothing radius, and for the particle itself.
+static int32_t fluid_forces_simd(
+  const fun_fluid_neighbors_t* neighbors,
+  const float* point,
+  const float* velocity,
+  const float pressure_term,
+  const float inverse_radius,
+  float* sums
+) {
+  const __m256 px = _mm256_set1_ps(point[0]), py = _mm256_set1_ps(point[1]), pz = _mm256_set1_ps(point[2]);
+  const __m256 vx = _mm256_set1_ps(velocity[0]), vy = _mm256_set1_ps(velocity[1]), vz = _mm256_set1_ps(velocity[2]);
+  const __m256 own_pressure_term = _mm256_set1_ps(pressure_term);
+  const __m256 scale = _mm256_set1_ps(inverse_radius);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  __m256 lanes_sums[6] = { zero, zero, zero, zero, zero, zero };
+
+  int32_t i = 0;
+  for (; i + FUN_FLUID_LANES <= neighbors->count; i += FUN_FLUID_LANES) {
+    const __m256 dx = _mm256_mul_ps(_mm256_sub_ps(px, _mm256_loadu_ps(neighbors->x + i)), scale);
+    const __m256 dy = _mm256_mul_ps(_mm256_sub_ps(py, _mm256_loadu_ps(neighbors->y + i)), scale);
+    const __m256 dz = _mm256_mul_ps(_mm256_sub_ps(pz, _mm256_loadu_ps(neighbors->z + i)), scale);
+    const __m256 q = _mm256_sqrt_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz))
+    );
+    const __m256 t = _mm256_max_ps(_mm256_sub_ps(one, q), zero);
+
+    const __m256 pressure_terms = _mm256_add_ps(own_pressure_term, _mm256_loadu_ps(neighbors->pressure_terms + i));
+    const __m256 pressure = _mm256_mul_ps(
+      _mm256_mul_ps(_mm256_loadu_ps(neighbors->masses + i), pressure_terms),
+      _mm256_mul_ps(t, _mm256_mul_ps(t, t))
+    );
+    lanes_sums[0] = _mm256_add_ps(lanes_sums[0], _mm256_mul_ps(pressure, dx));
+    lanes_sums[1] = _mm256_add_ps(lanes_sums[1], _mm256_mul_ps(pressure, dy));
+    lanes_sums[2] = _mm256_add_ps(lanes_sums[2], _mm256_mul_ps(pressure, dz));
+
+    const __m256 viscosity = _mm256_mul_ps(_mm256_loadu_ps(neighbors->volumes + i), t);
+    const __m256 relative_x = _mm256_sub_ps(_mm256_loadu_ps(neighbors->vx + i), vx);
+    const __m256 relative_y = _mm256_sub_ps(_mm256_loadu_ps(neighbors->vy + i), vy);
+    const __m256 relative_z = _mm256_sub_ps(_mm256_loadu_ps(neighbors->vz + i), vz);
+    lanes_sums[3] = _mm256_add_ps(lanes_sums[3], _mm256_mul_ps(viscosity, relative_x));
+    lanes_sums[4] = _mm256_add_ps(lanes_sums[4], _mm256_mul_ps(viscosity, relative_y));
+    lanes_sums[5] = _mm256_add_ps(lanes_sums[5], _mm256_mul_ps(viscosity, relative_z));
+  }
+
+  for (int j = 0; j < 6; j++) {
+    float lanes[FUN_FLUID_LANES];
+    _mm256_storeu_ps(lanes, lanes_sums[j]);
+    for (int k = 0; k < FUN_FLUID_LANES; k++) {
+      sums[j] += lanes[k];
+    }
+  }
+  return i;
+}
+#elif defined(FUN_SSE2)
+// Wendland kernel (1 - q)^4 (1 + 4q) times the mass of 4 neighbors at a time, which is 0 past the smoothing radius.
+static int32_t fluid_density_simd(
+  const fun_fluid_neighbors_t* neighbors,
+  const float* point,
+  const float inverse_radius,
+  float* density
+) {
+  const __m128 px = _mm_set1_ps(point[0]), py = _mm_set1_ps(point[1]), pz = _mm_set1_ps(point[2]);
+  const __m128 scale = _mm_set1_ps(inverse_radius);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), four = _mm_set1_ps(4.0f);
+  __m128 sum = zero;
+
+  int32_t i = 0;
+  for (; i + FUN_FLUID_LANES <= neighbors->count; i += FUN_FLUID_LANES) {
+    const __m128 dx = _mm_mul_ps(_mm_sub_ps(px, _mm_loadu_ps(neighbors->x + i)), scale);
+    const __m128 dy = _mm_mul_ps(_mm_sub_ps(py, _mm_loadu_ps(neighbors->y + i)), scale);
+    const __m128 dz = _mm_mul_ps(_mm_sub_ps(pz, _mm_loadu_ps(neighbors->z + i)), scale);
+    const __m128 q = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+    const __m128 t = _mm_max_ps(_mm_sub_ps(one, q), zero);
+    const __m128 t_squared = _mm_mul_ps(t, t);
+    const __m128 w = _mm_mul_ps(_mm_mul_ps(t_squared, t_squared), _mm_add_ps(one, _mm_mul_ps(four, q)));
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(neighbors->masses + i), w));
+  }
+
+  float lanes[FUN_FLUID_LANES];
+  _mm_storeu_ps(lanes, sum);
+  for (int k = 0; k < FUN_FLUID_LANES; k++) {
+    *density += lanes[k];
+  }
+  return i;
+}
+
+// Gradient of the Wendland kernel and laplacian of the viscosity kernel of 4 neighbors at a time. Both are 0 past the
+// smoothing radius, and for the particle itself.
+static int32_t fluid_forces_simd(
+  const fun_fluid_neighbors_t* neighbors,
+  const float* point,
+  const float* velocity,
+  const float pressure_term,
+  const float inverse_radius,
+  float* sums
+) {
+  const __m128 px = _mm_set1_ps(point[0]), py = _mm_set1_ps(point[1]), pz = _mm_set1_ps(point[2]);
+  const __m128 vx = _mm_set1_ps(velocity[0]), vy = _mm_set1_ps(velocity[1]), vz = _mm_set1_ps(velocity[2]);
+  const __m128 own_pressure_term = _mm_set1_ps(pressure_term);
+  const __m128 scale = _mm_set1_ps(inverse_radius);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  __m128 lanes_sums[6] = { zero, zero, zero, zero, zero, zero };
+
+  int32_t i = 0;
+  for (; i + FUN_FLUID_LANES <= neighbors->count; i += FUN_FLUID_LANES) {
+    const __m128 dx = _mm_mul_ps(_mm_sub_ps(px, _mm_loadu_ps(neighbors->x + i)), scale);
+    const __m128 dy = _mm_mul_ps(_mm_sub_ps(py, _mm_loadu_ps(neighbors->y + i)), scale);
+    const __m128 dz = _mm_mul_ps(_mm_sub_ps(pz, _mm_loadu_ps(neighbors->z + i)), scale);
+    const __m128 q = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+    const __m128 t = _mm_max_ps(_mm_sub_ps(one, q), zero);
+
+    const __m128 pressure_terms = _mm_add_ps(own_pressure_term, _mm_loadu_ps(neighbors->pressure_terms + i));
+    const __m128 pressure = _mm_mul_ps(
+      _mm_mul_ps(_mm_loadu_ps(neighbors->masses + i), pressure_terms),
+      _mm_mul_ps(t, _mm_mul_ps(t, t))
+    );
+    lanes_sums[0] = _mm_add_ps(lanes_sums[0], _mm_mul_ps(pressure, dx));
+    lanes_sums[1] = _mm_add_ps(lanes_sums[1], _mm_mul_ps(pressure, dy));
+    lanes_sums[2] = _mm_add_ps(lanes_sums[2], _mm_mul_ps(pressure, dz));
+
+    const __m128 viscosity = _mm_mul_ps(_mm_loadu_ps(neighbors->volumes + i), t);
+    lanes_sums[3] = _mm_add_ps(lanes_sums[3], _mm_mul_ps(viscosity, _mm_sub_ps(_mm_loadu_ps(neighbors->vx + i), vx)));
+    lanes_sums[4] = _mm_add_ps(lanes_sums[4], _mm_mul_ps(viscosity, _mm_sub_ps(_mm_loadu_ps(neighbors->vy + i), vy)));
+    lanes_sums[5] = _mm_add_ps(lanes_sums[5], _mm_mul_ps(viscosity, _mm_sub_ps(_mm_loadu_ps(neighbors->vz + i), vz)));
+  }
+
+  for (int j = 0; j < 6; j++) {
+    float lanes[FUN_FLUID_LANES];
+    _mm_storeu_ps(lanes, lanes_sums[j]);
+    for (int k = 0; k < FUN_FLUID_LANES; k++) {
+      sums[j] += lanes[k];
+    }
+  }
+  return i;
+}
+#endif
+
+// Density at a point, divided by the scale of the kernel. Distances are in units of the smoothing radius, which keeps
+// the powers of small radii within float range.
+static float fluid_density(const fun_fluid_neighbors_t* neighbors, const float* point, const float inverse_radius) {
+  float density = 0.0f;
+  int32_t i = 0;
+#if defined(FUN_AVX2) || defined(FUN_SSE2)
+  i = fluid_density_simd(neighbors, point, inverse_radius, &density);
+#endif
+  for (; i < neighbors->count; i++) {
+    const float dx = (point[0] - neighbors->x[i]) * inverse_radius;
+    const float dy = (point[1] - neighbors->y[i]) * inverse_radius;
+    const float dz = (point[2] - neighbors->z[i]) * inverse_radius;
+    const float q = sqrtf(dx * dx + dy * dy + dz * dz);
+    const float t = fmaxf(1.0f - q, 0.0f);
+    density += neighbors->masses[i] * t * t * t * t * (1.0f + 4.0f * q);
+  }
+  return density;
+}
+
+// Sums of the pressure in sums[0..2] and of the viscosity in sums[3..5], divided by the scales of their kernels.
+static void fluid_forces(
+  const fun_fluid_neighbors_t* neighbors,
+  const float* point,
+  const float* velocity,
+  const float pressure_term,
+  const float inverse_radius,
+  float* sums
+) {
+  int32_t i = 0;
+#if defined(FUN_AVX2) || defined(FUN_SSE2)
+  i = fluid_forces_simd(neighbors, point, velocity, pressure_term, inverse_radius, sums);
+#endif
+  for (; i < neighbors->count; i++) {
+    const float dx = (point[0] - neighbors->x[i]) * inverse_radius;
+    const float dy = (point[1] - neighbors->y[i]) * inverse_radius;
+    const float dz = (point[2] - neighbors->z[i]) * inverse_radius;
+    const float t = fmaxf(1.0f - sqrtf(dx * dx + dy * dy + dz * dz), 0.0f);
+
+    const float pressure = neighbors->masses[i] * (pressure_term + neighbors->pressure_terms[i]) * t * t * t;
+    sums[0] += pressure * dx;
+    sums[1] += pressure * dy;
+    sums[2] += pressure * dz;
+
+    const float viscosity = neighbors->volumes[i] * t;
+    sums[3] += viscosity * (neighbors->vx[i] - velocity[0]);
+    sums[4] += viscosity * (neighbors->vy[i] - velocity[1]);
+    sums[5] += viscosity * (neighbors->vz[i] - velocity[2]);
+  }
+}
+
+// Every worker takes its share of the sorted particles. Pressure only pushes particles apart, so that the fluid has a
+// free surface instead of clumping.
+static void ComputeFluidDensities3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  FluidWorld3D* fluid = ecs_get_mut(it->world, ecs_id(FluidWorld3D), FluidWorld3D);
+  const int32_t stage = ecs_stage_get_id(it->world);
+  if (!fluid || !fluid->count || stage >= fluid->neighbors_count) {
+    return;
+  }
+
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  const int32_t begin = (int32_t)((int64_t)fluid->count * stage / stages_count);
+  const int32_t end = (int32_t)((int64_t)fluid->count * (stage + 1) / stages_count);
+  const float radius = fluid->smoothing_radius;
+  const float scale = 21.0f / (2.0f * CVKM_PI_F * radius * radius * radius);
+  const fun_fluid_particles_t* sorted = &fluid->sorted;
+  fun_fluid_neighbors_t* neighbors = fluid->neighbors + stage;
+
+  for (int32_t i = begin; i < end; i++) {
+    // The particles of a cell are contiguous, so they share their neighbors.
+    if (i == begin || memcmp(sorted->cells + i, sorted->cells + i - 1, sizeof(vkm_ivec3))) {
+      gather_fluid_neighbors(fluid, sorted->cells + i, neighbors, false);
+    }
+
+    const float point[3] = { sorted->x[i], sorted->y[i], sorted->z[i] };
+    const float density = scale * fluid_density(neighbors, point, 1.0f / radius);
+    const float pressure = fluid->stiffness * fmaxf(density - fluid->rest_density, 0.0f);
+    fluid->densities[i] = density;
+    fluid->pressure_terms[i] = pressure / (density * density);
+    fluid->volumes[i] = sorted->masses[i] / density;
+  }
+}
+
+// Needs the densities of every neighbor, so it waits for all the workers to be done with them. Every particle only
+// writes its own Force3D.
+static void ComputeFluidForces3D(ecs_iter_t* it) {
+  ecs_iter_fini(it);
+
+  FluidWorld3D* fluid = ecs_get_mut(it->world, ecs_id(FluidWorld3D), FluidWorld3D);
+  const int32_t stage = ecs_stage_get_id(it->world);
+  if (!fluid || !fluid->count || stage >= fluid->neighbors_count) {
+    return;
+  }
+
+  const int32_t stages_count = ecs_get_stage_count(it->world);
+  const int32_t begin = (int32_t)((int64_t)fluid->count * stage / stages_count);
+  const int32_t end = (int32_t)((int64_t)fluid->count * (stage + 1) / stages_count);
+  const float radius = fluid->smoothing_radius;
+  // The distances are in units of the radius, which leaves one less power of it for the gradient.
+  const float pressure_scale = 210.0f / (CVKM_PI_F * radius * radius * radius * radius);
+  const float viscosity_scale = fluid->viscosity * 45.0f / (CVKM_PI_F * radius * radius * radius * radius * radius);
+  const fun_fluid_particles_t* sorted = &fluid->sorted;
+  fun_fluid_neighbors_t* neighbors = fluid->neighbors + stage;
+
+  for (int32_t i = begin; i < end; i++) {
+    if (i == begin || memcmp(sorted->cells + i, sorted->cells + i - 1, sizeof(vkm_ivec3))) {
+      gather_fluid_neighbors(fluid, sorted->cells + i, neighbors, true);
+    }
+
+    const float point[3] = { sorted->x[i], sorted->y[i], sorted->z[i] };
+    const float velocity[3] = { sorted->vx[i], sorted->vy[i], sorted->vz[i] };
+    float sums[6] = { 0.0f };
+    fluid_forces(neighbors, point, velocity, fluid->pressure_terms[i], 1.0f / radius, sums);
+
+    const float pressure = sorted->masses[i] * pressure_scale;
+    const float viscosity = fluid->volumes[i] * viscosity_scale;
+    Force3D* force = sorted->forces[i];
+    force->x += pressure * sums[0] + viscosity * sums[3];
+    force->y += pressure * sums[1] + viscosity * sums[4];
+    force->z += pressure * sums[2] + viscosity * sums[5];
+  }
+}
+
+ECS_CTOR(SnapshotRing3D, ptr, {
+  *ptr = (SnapshotRing3D){
+    .frames_count = 16,
+  };
+})
+
+static void snapshot_ring_3d_free(SnapshotRing3D* ring) {
+  for (uint32_t i = 0; i < ring->snapshots_count; i++) {
+    free(ring->snapshots[i].tables);
+    free(ring->snapshots[i].data);
+  }
+  free(ring->snapshots);
+}
+
+ECS_MOVE(SnapshotRing3D, dst, src, {
+  snapshot_ring_3d_free(dst);
+  *dst = *src;
+  src->snapshots = NULL;
+  src->snapshots_count = 0;
+})
+
+ECS_DTOR(SnapshotRing3D, ptr, {
+  snapshot_ring_3d_free(ptr);
+  ptr->snapshots = NULL;
+  ptr->snapshots_count = 0;
+})
+
+typedef enum snapshot_mode_t {
+  SNAPSHOT_SAVE,
+  SNAPSHOT_CHECK,
+  SNAPSHOT_LOAD,
+} snapshot_mode_t;
+
+typedef struct snapshot_column_t {
+  ecs_id_t id;
+  int32_t size;
+} snapshot_column_t;
+
+// Walks every table a snapshot covers, always in the same order, and copies its entities and columns into the
+// snapshot when saving, or its columns back out of it when loading. Checking only compares the tables and their
+// entities with the saved ones, which is what makes loading safe.
+static bool copy_snapshot_tables(const ecs_world_t* world, fun_snapshot_t* snapshot, const snapshot_mode_t mode) {
+  // Every table with one of these has its columns saved.
+  const ecs_id_t roots[] = {
+    ecs_id(Position3D),
+    ecs_id(Plane),
+    ecs_id(FixedTimeStep),
+    ecs_id(StateHash),
+    ecs_id(FloatingOrigin3D),
+  };
+  const snapshot_column_t columns[] = {
+    { ecs_id(Position3D), sizeof(Position3D) },
+    { ecs_id(DoublePosition3D), sizeof(DoublePosition3D) },
+    { ecs_id(Velocity3D), sizeof(Velocity3D) },
+    { ecs_id(Force3D), sizeof(Force3D) },
+    { ecs_id(Rotation3D), sizeof(Rotation3D) },
+    { ecs_id(AngularVelocity3D), sizeof(AngularVelocity3D) },
+    { ecs_id(Torque3D), sizeof(Torque3D) },
+    { ecs_id(Interpolation3D), sizeof(Interpolation3D) },
+    { ecs_id(SweepOrigin3D), sizeof(SweepOrigin3D) },
+    { ecs_id(Sleepable), sizeof(Sleepable) },
+    { ecs_id(Plane), sizeof(Plane) },
+    { ecs_id(FixedTimeStep), sizeof(FixedTimeStep) },
+    { ecs_id(StateHash), sizeof(StateHash) },
+    { ecs_id(FloatingOrigin3D), sizeof(FloatingOrigin3D) },
+  };
+
+  int32_t tables_count = 0, offset = 0;
+  for (size_t r = 0; r < FUN_COUNTOF(roots); r++) {
+    ecs_iter_t it = ecs_each_id(world, roots[r]);
+    while (ecs_each_next(&it)) {
+      const int32_t entities_size = it.count * (int32_t)sizeof(ecs_entity_t);
+
+      if (mode == SNAPSHOT_SAVE) {
+        snapshot->tables = reserve(
+          snapshot->tables,
+          &snapshot->tables_capacity,
+          tables_count + 1,
+          sizeof(fun_snapshot_table_t)
+        );
+        snapshot->tables[tables_count] = (fun_snapshot_table_t){ it.table, it.count };
+        snapshot->data = reserve(snapshot->data, &snapshot->capacity, offset + entities_size, 1);
+        memcpy(snapshot->data + offset, it.entities, entities_size);
+      } else if (
+        tables_count >= snapshot->tables_count
+        || snapshot->tables[tables_count].table != it.table
+        || snapshot->tables[tables_count].count != it.count
+        || memcmp(snapshot->data + offset, it.entities, entities_size)
+      ) {
+        ecs_iter_fini(&it);
+        return false;
+      }
+      tables_count++;
+      offset += entities_size;
+
+      for (size_t c = 0; c < FUN_COUNTOF(columns); c++) {
+        void* column = ecs_table_get_id(world, it.table, columns[c].id, 0);
+        if (!column) {
+          continue;
+        }
+
+        const int32_t size = it.count * columns[c].size;
+        if (mode == SNAPSHOT_SAVE) {
+          snapshot->data = reserve(snapshot->data, &snapshot->capacity, offset + size, 1);
+          memcpy(snapshot->data + offset, column, size);
+        } else if (mode == SNAPSHOT_LOAD) {
+          memcpy(column, snapshot->data + offset, size);
+        }
+        offset += size;
+      }
+    }
+  }
+
+  if (mode == SNAPSHOT_SAVE) {
+    snapshot->tables_count = tables_count;
+    snapshot->size = offset;
+  }
+  return tables_count == snapshot->tables_count;
+}
+
+// Saves the state at the end of the frame, once the simulation is done with it and before it's interpolated.
+static void SaveSnapshot3D(ecs_iter_t* it) {
+  SnapshotRing3D* ring = ecs_field(it, SnapshotRing3D, 0);
+  if (!ring->frames_count) {
+    return;
+  }
+
+  ecs_time_t start = { 0 };
+  ecs_time_measure(&start);
+
+  if (!ring->snapshots) {
+    ring->snapshots = calloc(ring->frames_count, sizeof(fun_snapshot_t));
+    ring->snapshots_count = ring->frames_count;
+  }
+
+  ring->frame++;
+  fun_snapshot_t* snapshot = ring->snapshots + (ring->frame - 1) % ring->snapshots_count;
+  snapshot->frame = ring->frame;
+  copy_snapshot_tables(it->world, snapshot, SNAPSHOT_SAVE);
+
+  // The contacts are saved after the columns, they're what the solver warm starts from.
+  const CollisionWorld3D* world = ecs_get(it->world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  snapshot->manifolds_count = world ? world->manifolds_count : 0;
+  const int32_t manifolds_size = snapshot->manifolds_count * (int32_t)sizeof(fun_manifold_t);
+  if (manifolds_size) {
+    snapshot->data = reserve(snapshot->data, &snapshot->capacity, snapshot->size + manifolds_size, 1);
+    memcpy(snapshot->data + snapshot->size, world->manifolds, manifolds_size);
+  }
+  snapshot->size += manifolds_size;
+
+  ring->size = snapshot->size;
+  ring->save_time = (float)ecs_time_measure(&start);
+}
+
+bool fun_restore_snapshot(ecs_world_t* world, const uint64_t frame) {
+  SnapshotRing3D* ring = ecs_get_mut(world, ecs_id(SnapshotRing3D), SnapshotRing3D);
+  if (!ring || !ring->snapshots || !frame) {
+    return false;
+  }
+
+  ecs_time_t start = { 0 };
+  ecs_time_measure(&start);
+
+  fun_snapshot_t* snapshot = ring->snapshots + (frame - 1) % ring->snapshots_count;
+  if (snapshot->frame != frame || !copy_snapshot_tables(world, snapshot, SNAPSHOT_CHECK)) {
+    return false;
+  }
+  copy_snapshot_tables(world, snapshot, SNAPSHOT_LOAD);
+
+  CollisionWorld3D* collision_world = ecs_get_mut(world, ecs_id(CollisionWorld3D), CollisionWorld3D);
+  if (collision_world) {
+    const int32_t manifolds_size = snapshot->manifolds_count * (int32_t)sizeof(fun_manifold_t);
+    collision_world->manifolds = reserve(
+      collision_world->manifolds,
+      &collision_world->manifolds_capacity,
+      snapshot->manifolds_count,
+      sizeof(fun_manifold_t)
+    );
+    memcpy(collision_world->manifolds, snapshot->data + snapshot->size - manifolds_size, manifolds_size);
+    collision_world->manifolds_count = snapshot->manifolds_count;
+    index_manifolds(collision_world);
+  }
+
+  ring->frame = frame;
+  ring->restore_time = (float)ecs_time_measure(&start);
+  return true;
+}
+
+// Bodies are quantized a batch at a time before being packed, and unpacked a batch at a time before being dequantized,
+// so that the arithmetic and the bit twiddling each run in a tight loop of their own.
+#define FUN_CODEC_BATCH 256
+// Position and velocity changes this small, zigzag encoded, are sent as differences from the baseline.
+#define FUN_SMALL_DELTA_BITS 8
+
+typedef struct bit_writer_t {
+  fun_bit_stream_t* stream;
+  uint64_t bits;
+  uint32_t count;
+} bit_writer_t;
+
+// Writes the lowest count bits of value, count being at most 32.
+static void write_bits(bit_writer_t* writer, const uint64_t value, const uint32_t count) {
+  writer->bits |= value << writer->count;
+  writer->count += count;
+  if (writer->count < 32) {
+    return;
+  }
+
+  fun_bit_stream_t* stream = writer->stream;
+  stream->data = reserve(stream->data, &stream->capacity, stream->size + 4, 1);
+  for (int i = 0; i < 4; i++) {
+    stream->data[stream->size++] = (uint8_t)(writer->bits >> (8 * i));
+  }
+  writer->bits >>= 32;
+  writer->count -= 32;
+}
+
+// Writes what's left, padded to a whole byte.
+static void flush_bits(bit_writer_t* writer) {
+  fun_bit_stream_t* stream = writer->stream;
+  const int32_t bytes = (int32_t)(writer->count + 7) / 8;
+  stream->data = reserve(stream->data, &stream->capacity, stream->size + bytes, 1);
+  for (int32_t i = 0; i < bytes; i++) {
+    stream->data[stream->size++] = (uint8_t)(writer->bits >> (8 * i));
+  }
+  writer->bits = 0;
+  writer->count = 0;
+}
+
+static bool read_bits(fun_bit_stream_t* stream, const uint32_t count, uint64_t* value) {
+  if (stream->read_position + count > (int64_t)stream->size * 8) {
+    return false;
+  }
+
+  uint64_t result = 0;
+  for (uint32_t done = 0; done < count;) {
+    const uint32_t shift = (uint32_t)(stream->read_position & 7);
+    const uint32_t taken = 8 - shift < count - done ? 8 - shift : count - done;
+    const uint32_t byte = stream->data[stream->read_position >> 3];
+    result |= (uint64_t)((byte >> shift) & ((1u << taken) - 1)) << done;
+    done += taken;
+    stream->read_position += taken;
+  }
+
+  *value = result;
+  return true;
+}
+
+static uint32_t quantize(const float value, const float min, const float scale, const uint32_t max) {
+  const float x = (value - min) * scale;
+  // Also maps NaN to 0.
+  if (!(x > 0.0f)) {
+    return 0;
+  }
+  return x >= (float)max ? max : (uint32_t)(x + 0.5f);
+}
+
+static uint32_t max_quantized(const uint32_t bits) {
+  return (uint32_t)((1ull << bits) - 1);
+}
+
+// Smallest three: the largest component is left out and recomputed from the others, which then all lie within
+// +-sqrt(1/2). Negating the quaternion to make it positive doesn't change the rotation.
+static uint64_t quantize_rotation(const Rotation3D* rotation, const uint32_t bits) {
+  int largest = 0;
+  for (int k = 1; k < 4; k++) {
+    if (fabsf(rotation->raw[k]) > fabsf(rotation->raw[largest])) {
+      largest = k;
+    }
+  }
+
+  const float sign = rotation->raw[largest] < 0.0f ? -1.0f : 1.0f;
+  const uint32_t max = max_quantized(bits);
+  const float scale = (float)max / CVKM_SQRT2_F;
+  uint64_t result = (uint64_t)largest;
+  uint32_t shift = 2;
+  for (int k = 0; k < 4; k++) {
+    if (k != largest) {
+      result |= (uint64_t)quantize(rotation->raw[k] * sign, -CVKM_SQRT1_2_F, scale, max) << shift;
+      shift += bits;
+    }
+  }
+  return result;
+}
+
+static Rotation3D dequantize_rotation(const uint64_t rotation, const uint32_t bits) {
+  const int largest = (int)(rotation & 3);
+  const uint32_t max = max_quantized(bits);
+  const float inverse_scale = CVKM_SQRT2_F / (float)max;
+
+  Rotation3D result;
+  float sum = 0.0f;
+  uint32_t shift = 2;
+  for (int k = 0; k < 4; k++) {
+    if (k != largest) {
+      const float value = (float)((rotation >> shift) & max) * inverse_scale - CVKM_SQRT1_2_F;
+      result.raw[k] = value;
+      sum += value * value;
+      shift += bits;
+    }
+  }
+  result.raw[largest] = sqrtf(fmaxf(0.0f, 1.0f - sum));
+  return result;
+}
+
+// Where a range of values starts, and how it maps to and from the quantized integers.
+typedef struct quantized_range_t {
+  vkm_vec3 min, scale, inverse_scale;
+  uint32_t bits, max;
+} quantized_range_t;
+
+static quantized_range_t quantized_range(const vkm_vec3* min, const vkm_vec3* max, const uint32_t bits) {
+  quantized_range_t range = { .min = *min, .bits = bits, .max = max_quantized(bits) };
+  for (int k = 0; k < 3; k++) {
+    const float extent = max->raw[k] - min->raw[k];
+    range.scale.raw[k] = extent > 0.0f ? (float)range.max / extent : 0.0f;
+    range.inverse_scale.raw[k] = extent > 0.0f ? extent / (float)range.max : 0.0f;
+  }
+  return range;
+}
+
+static void quantize_vec3(const quantized_range_t* range, const vkm_vec3* value, uint32_t result[3]) {
+  for (int k = 0; k < 3; k++) {
+    result[k] = quantize(value->raw[k], range->min.raw[k], range->scale.raw[k], range->max);
+  }
+}
+
+static vkm_vec3 dequantize_vec3(const quantized_range_t* range, const uint32_t value[3]) {
+  vkm_vec3 result;
+  for (int k = 0; k < 3; k++) {
+    result.raw[k] = range->min.raw[k] + (float)value[k] * range->inverse_scale.raw[k];
+  }
+  return result;
+}
+
+// A flag telling whether the three axes are small differences from the baseline, then the axes.
+static void write_axes(bit_writer_t* writer, const quantized_range_t* range, const uint32_t* values,
+  const uint32_t* baseline) {
+  uint64_t deltas[3];
+  bool small = range->bits > FUN_SMALL_DELTA_BITS;
+  for (int k = 0; k < 3; k++) {
+    const int64_t delta = (int64_t)values[k] - (int64_t)baseline[k];
+    deltas[k] = delta < 0 ? ~((uint64_t)delta << 1) : (uint64_t)delta << 1;
+    small = small && deltas[k] < 1u << FUN_SMALL_DELTA_BITS;
+  }
+
+  write_bits(writer, small, 1);
+  for (int k = 0; k < 3; k++) {
+    write_bits(writer, small ? deltas[k] : values[k], small ? FUN_SMALL_DELTA_BITS : range->bits);
+  }
+}
+
+static bool read_axes(fun_bit_stream_t* stream, const quantized_range_t* range, uint32_t* values) {
+  uint64_t small;
+  if (!read_bits(stream, 1, &small)) {
+    return false;
+  }
+
+  for (int k = 0; k < 3; k++) {
+    uint64_t value;
+    if (!read_bits(stream, small ? FUN_SMALL_DELTA_BITS : range->bits, &value)) {
+      return false;
+    }
+    // The values already hold the baseline.
+    values[k] = small ? values[k] + (uint32_t)((value >> 1) ^ (0 - (value & 1))) : (uint32_t)value;
+  }
+  return true;
+}
+
+static void write_rotation(bit_writer_t* writer, const uint64_t rotation, const uint32_t bits) {
+  const uint32_t count = 2 + 3 * bits;
+  write_bits(writer, rotation & UINT32_MAX, count < 32 ? count : 32);
+  if (count > 32) {
+    write_bits(writer, rotation >> 32, count - 32);
+  }
+}
+
+static bool read_rotation(fun_bit_stream_t* stream, const uint32_t bits, uint64_t* rotation) {
+  const uint32_t count = 2 + 3 * bits;
+  uint64_t low, high = 0;
+  if (!read_bits(stream, count < 32 ? count : 32, &low) || (count > 32 && !read_bits(stream, count - 32, &high))) {
+    return false;
+  }
+  *rotation = low | high << 32;
+  return true;
+}
+
+void fun_encode_bodies(
+  fun_bit_stream_t* stream,
+  const fun_quantization_t* quantization,
+  const int32_t count,
+  const Position3D* positions,
+  const Rotation3D* rotations,
+  const Velocity3D* velocities,
+  fun_quantized_body_t* baselines
+) {
+  vkm_vec3 max_velocity = { { quantization->max_speed, quantization->max_speed, quantization->max_speed } };
+  vkm_vec3 min_velocity;
+  vkm_sub(&CVKM_VEC3_ZERO, &max_velocity, &min_velocity);
+  const quantized_range_t position_range = quantized_range(
+    &quantization->bounds.min,
+    &quantization->bounds.max,
+    quantization->position_bits
+  );
+  const quantized_range_t velocity_range = quantized_range(&min_velocity, &max_velocity, quantization->velocity_bits);
+
+  bit_writer_t writer = { .stream = stream };
+  fun_quantized_body_t quantized[FUN_CODEC_BATCH];
+  for (int32_t begin = 0; begin < count; begin += FUN_CODEC_BATCH) {
+    const int32_t batch = count - begin < FUN_CODEC_BATCH ? count - begin : FUN_CODEC_BATCH;
+
+    // What isn't sent stays as the baseline has it.
+    memcpy(quantized, baselines + begin, batch * sizeof(fun_quantized_body_t));
+    for (int32_t i = 0; i < batch; i++) {
+      quantize_vec3(&position_range, positions + begin + i, quantized[i].position);
+    }
+    if (rotations) {
+      for (int32_t i = 0; i < batch; i++) {
+        quantized[i].rotation = quantize_rotation(rotations + begin + i, quantization->rotation_bits);
+      }
+    }
+    if (velocities) {
+      for (int32_t i = 0; i < batch; i++) {
+        quantize_vec3(&velocity_range, velocities + begin + i, quantized[i].velocity);
+      }
+    }
+
+    for (int32_t i = 0; i < batch; i++) {
+      const fun_quantized_body_t* body = quantized + i;
+      fun_quantized_body_t* baseline = baselines + begin + i;
+      const bool position_changed = memcmp(body->position, baseline->position, sizeof(body->position));
+      const bool rotation_changed = body->rotation != baseline->rotation;
+      const bool velocity_changed = memcmp(body->velocity, baseline->velocity, sizeof(body->velocity));
+
+      write_bits(&writer, position_changed || rotation_changed || velocity_changed, 1);
+      if (!position_changed && !rotation_changed && !velocity_changed) {
+        continue;
+      }
+
+      write_bits(&writer, position_changed, 1);
+      if (position_changed) {
+        write_axes(&writer, &position_range, body->position, baseline->position);
+      }
+      if (rotations) {
+        write_bits(&writer, rotation_changed, 1);
+        if (rotation_changed) {
+          write_rotation(&writer, body->rotation, quantization->rotation_bits);
+        }
+      }
+      if (velocities) {
+        write_bits(&writer, velocity_changed, 1);
+        if (velocity_changed) {
+          write_axes(&writer, &velocity_range, body->velocity, baseline->velocity);
+        }
+      }
+      *baseline = *body;
+    }
+  }
+
+  flush_bits(&writer);
+}
+
+bool fun_decode_bodies(
+  fun_bit_stream_t* stream,
+  const fun_quantization_t* quantization,
+  const int32_t count,
+  Position3D* positions,
+  Rotation3D* rotations,
+  Velocity3D* velocities,
+  fun_quantized_body_t* baselines
+) {
+  vkm_vec3 max_velocity = { { quantization->max_speed, quantization->max_speed, quantization->max_speed } };
+  vkm_vec3 min_velocity;
+  vkm_sub(&CVKM_VEC3_ZERO, &max_velocity, &min_velocity);
+  const quantized_range_t position_range = quantized_range(
+    &quantization->bounds.min,
+    &quantization->bounds.max,
+    quantization->position_bits
+  );
+  const quantized_range_t velocity_range = quantized_range(&min_velocity, &max_velocity, quantization->velocity_bits);
+
+  for (int32_t begin = 0; begin < count; begin += FUN_CODEC_BATCH) {
+    const int32_t batch = count - begin < FUN_CODEC_BATCH ? count - begin : FUN_CODEC_BATCH;
+
+    for (int32_t i = 0; i < batch; i++) {
+      fun_quantized_body_t* body = baselines + begin + i;
+      uint64_t changed;
+      if (!read_bits(stream, 1, &changed)) {
+        return false;
+      }
+      if (!changed) {
+        continue;
+      }
+
+      if (!read_bits(stream, 1, &changed) || (changed && !read_axes(stream, &position_range, body->position))) {
+        return false;
+      }
+      if (rotations && (
+        !read_bits(stream, 1, &changed)
+        || (changed && !read_rotation(stream, quantization->rotation_bits, &body->rotation))
+      )) {
+        return false;
+      }
+      if (velocities && (
+        !read_bits(stream, 1, &changed)
+        || (changed && !read_axes(stream, &velocity_range, body->velocity))
+      )) {
+        return false;
+      }
+    }
+
+    for (int32_t i = 0; i < batch; i++) {
+      positions[begin + i] = dequantize_vec3(&position_range, baselines[begin + i].position);
+    }
+    if (rotations) {
+      for (int32_t i = 0; i < batch; i++) {
+        rotations[begin + i] = dequantize_rotation(baselines[begin + i].rotation, quantization->rotation_bits);
+      }
+    }
+    if (velocities) {
+      for (int32_t i = 0; i < batch; i++) {
+        velocities[begin + i] = dequantize_vec3(&velocity_range, baselines[begin + i].velocity);
+      }
+    }
+  }
+
+  // The encoder padded the bodies to a whole byte.
+  stream->read_position = (stream->read_position + 7) & ~(int64_t)7;
+  return true;
+}
+
+void fun_bit_stream_free(fun_bit_stream_t* stream) {
+  free(stream->data);
+  *stream = (fun_bit_stream_t){ 0 };
+}
+
+ECS_CTOR(BodyPool, ptr, {
+  *ptr = (BodyPool){ 0 };
+})
+
+ECS_MOVE(BodyPool, dst, src, {
+  free(dst->entities);
+  *dst = *src;
+  *src = (BodyPool){ 0 };
+})
+
+ECS_DTOR(BodyPool, ptr, {
+  free(ptr->entities);
+  *ptr = (BodyPool){ 0 };
+})
+
+// The parked bodies have nothing to come back to anymore.
+static void OnRemoveBodyPool(ecs_iter_t* it) {
+  const BodyPool* pools = ecs_field(it, BodyPool, 0);
+  if (ecs_is_fini(it->world)) {
+    return;
+  }
+
+  for (int i = 0; i < it->count; i++) {
+    for (int32_t j = 0; j < pools[i].count; j++) {
+      if (ecs_is_alive(it->world, pools[i].entities[j])) {
+        ecs_delete(it->world, pools[i].entities[j]);
+      }
+    }
+  }
+}
+
+// Whatever no burst took during the update has expired for good. This runs before collision detection, so the bodies
+// don't get any further than the systems that park and spawn them.
+static void ReleaseBodyPools(ecs_iter_t* it) {
+  ecs_defer_suspend(it->world);
+  while (ecs_query_next(it)) {
+    BodyPool* pools = ecs_field(it, BodyPool, 0);
+    for (int i = 0; i < it->count; i++) {
+      for (int32_t j = 0; j < pools[i].count; j++) {
+        if (ecs_is_alive(it->world, pools[i].entities[j])) {
+          ecs_delete(it->world, pools[i].entities[j]);
+        }
+      }
+      pools[i].count = 0;
+    }
+  }
+  ecs_defer_resume(it->world);
+}
+
+void fun_park_bodies(ecs_world_t* world, const ecs_entity_t* entities, const int32_t count) {
+  // Bodies usually come from a whole table, so they share their prefab.
+  const ecs_table_t* table = NULL;
+  BodyPool* pool = NULL;
+  for (int32_t i = 0; i < count; i++) {
+    const ecs_entity_t entity = entities[i];
+    if (ecs_get_table(world, entity) != table) {
+      table = ecs_get_table(world, entity);
+      const ecs_entity_t prefab = ecs_get_target(world, entity, EcsIsA, 0);
+      pool = prefab ? ecs_get_mut(world, prefab, BodyPool) : NULL;
+    }
+
+    if (!pool) {
+      ecs_delete(world, entity);
+      continue;
+    }
+
+    // Whatever it was scheduled for is over, whether it expired or was parked early.
+    Expiry* expiry = ecs_get_mut(world, entity, Expiry);
+    if (expiry) {
+      expiry->tick = UINT64_MAX;
+    }
+
+    pool->entities = reserve(pool->entities, &pool->capacity, pool->count + 1, sizeof(ecs_entity_t));
+    pool->entities[pool->count++] = entity;
+  }
+}
+
+// Overwrites the components of a parked body with the next values of a burst, where they are, so it doesn't move. The
+// columns are those of its table, or -1 for what has no data or no column.
+static void rearm_body(
+  ecs_world_t* world,
+  const ecs_entity_t entity,
+  const int32_t* columns,
+  const ecs_type_info_t* const* type_infos,
+  void* const* data,
+  const int32_t ids_count,
+  const int32_t index
+) {
+  ecs_record_t* record = ecs_record_find(world, entity);
+  for (int32_t i = 0; i < ids_count; i++) {
+    if (columns[i] < 0) {
+      continue;
+    }
+
+    const ecs_type_info_t* type_info = type_infos[i];
+    void* dst = ecs_record_get_by_column(record, columns[i], type_info->size);
+    const void* src = (const char*)data[i] + index * type_info->size;
+    if (type_info->hooks.copy) {
+      type_info->hooks.copy(dst, src, 1, type_info);
+    } else {
+      memcpy(dst, src, type_info->size);
+    }
+  }
+
+  // Like any teleport, it isn't blended or swept from where it was parked.
+  const Position3D* position = ecs_get(world, entity, Position3D);
+  Interpolation3D* interpolation = ecs_get_mut(world, entity, Interpolation3D);
+  if (interpolation) {
+    const Rotation3D* rotation = ecs_get(world, entity, Rotation3D);
+    interpolation->previous_position = *position;
+    interpolation->current_position = *position;
+    interpolation->previous_rotation = rotation ? *rotation : CVKM_QUAT_IDENTITY;
+    interpolation->current_rotation = interpolation->previous_rotation;
+    interpolation->interpolated = false;
+    interpolation->stepped = false;
+  }
+  SweepOrigin3D* origin = ecs_get_mut(world, entity, SweepOrigin3D);
+  if (origin) {
+    *origin = *position;
+  }
+}
+
+ECS_CTOR(ExpiryWheel, ptr, {
+  *ptr = (ExpiryWheel){
+    .tick_duration = 1.0f / 60.0f,
+  };
+})
+
+static void expiry_wheel_free(ExpiryWheel* wheel) {
+  for (int level = 0; level < FUN_EXPIRY_WHEEL_LEVELS; level++) {
+    for (int i = 0; i < FUN_EXPIRY_WHEEL_SLOTS; i++) {
+      free(wheel->slots[level][i].expiries);
+    }
+  }
+  free(wheel->expired);
+}
+
+ECS_MOVE(ExpiryWheel, dst, src, {
+  expiry_wheel_free(dst);
+  *dst = *src;
+  *src = (ExpiryWheel){ 0 };
+})
+
+ECS_DTOR(ExpiryWheel, ptr, {
+  expiry_wheel_free(ptr);
+  *ptr = (ExpiryWheel){ 0 };
+})
+
+// The level is the first one whose slots span further than the tick is from now, so every slot is visited before the
+// ticks wrap around to it again. The tick can't be in the past.
+static void expiry_wheel_insert(ExpiryWheel* wheel, const fun_expiry_t expiry) {
+  const uint64_t delta = expiry.tick - wheel->tick;
+  int level = 0;
+  while (level < FUN_EXPIRY_WHEEL_LEVELS - 1 && delta >> FUN_EXPIRY_WHEEL_BITS * (level + 1)) {
+    level++;
+  }
+
+  fun_expiry_slot_t* slot =
+    &wheel->slots[level][expiry.tick >> FUN_EXPIRY_WHEEL_BITS * level & (FUN_EXPIRY_WHEEL_SLOTS - 1)];
+  slot->expiries = reserve(slot->expiries, &slot->capacity, slot->count + 1, sizeof(fun_expiry_t));
+  slot->expiries[slot->count++] = expiry;
+}
+
+// The tick at which a delay from now ends, or UINT64_MAX if that's past the reach of the wheel.
+static uint64_t expiry_wheel_due(const ExpiryWheel* wheel, const float now, const float delay) {
+  const float tick = ceilf((now + delay) / wheel->tick_duration);
+  if (!(tick < (float)UINT64_MAX)) {
+    return UINT64_MAX;
+  }
+
+  const uint64_t due = vkm_max((uint64_t)tick, wheel->tick);
+  if ((due - wheel->tick) >> FUN_EXPIRY_WHEEL_BITS * FUN_EXPIRY_WHEEL_LEVELS) {
+    return UINT64_MAX;
+  }
+  return due;
+}
+
+// The entity must have the same tick in its Expiry for it to count.
+static void expiry_wheel_schedule(ExpiryWheel* wheel, const ecs_entity_t entity, const uint64_t due) {
+  if (due != UINT64_MAX) {
+    expiry_wheel_insert(wheel, (fun_expiry_t){ .entity = entity, .tick = due });
+    wheel->count++;
+  }
+}
+
+void fun_expire_after(ecs_world_t* world, const ecs_entity_t* entities, const float* delays, const int32_t count) {
+  ExpiryWheel* wheel = ecs_get_mut(world, ecs_id(ExpiryWheel), ExpiryWheel);
+  assert(wheel);
+  const float now = ecs_get_world_info(world)->world_time_total;
+  for (int32_t i = 0; i < count; i++) {
+    const uint64_t due = expiry_wheel_due(wheel, now, delays[i]);
+    ecs_set(world, entities[i], Expiry, { due });
+    expiry_wheel_schedule(wheel, entities[i], due);
+  }
+}
+
+static void ExpireBodies(ecs_iter_t* it) {
+  ExpiryWheel* wheel = ecs_field(it, ExpiryWheel, 0);
+
+  const uint64_t now = (uint64_t)(ecs_get_world_info(it->world)->world_time_total / wheel->tick_duration);
+  int32_t expired_count = 0;
+  for (; wheel->tick <= now && wheel->count; wheel->tick++) {
+    // Once the ticks reach the span of a slot of a higher level, its entities get spread over the lower ones, starting
+    // from the top so they can fall through several levels at once.
+    for (int level = FUN_EXPIRY_WHEEL_LEVELS - 1; level > 0; level--) {
+      if (wheel->tick & ((UINT64_C(1) << FUN_EXPIRY_WHEEL_BITS * level) - 1)) {
+        continue;
+      }
+
+      fun_expiry_slot_t* slot =
+        &wheel->slots[level][wheel->tick >> FUN_EXPIRY_WHEEL_BITS * level & (FUN_EXPIRY_WHEEL_SLOTS - 1)];
+      for (int32_t i = 0; i < slot->count; i++) {
+        expiry_wheel_insert(wheel, slot->expiries[i]);
+      }
+      slot->count = 0;
+    }
+
+    fun_expiry_slot_t* slot = &wheel->slots[0][wheel->tick & (FUN_EXPIRY_WHEEL_SLOTS - 1)];
+    wheel->expired =
+      reserve(wheel->expired, &wheel->expired_capacity, expired_count + slot->count, sizeof(ecs_entity_t));
+    for (int32_t i = 0; i < slot->count; i++) {
+      // Those that were deleted in the meantime are gone for good, even if their id was recycled. Those that were
+      // scheduled again or parked since then have another tick, if any.
+      const fun_expiry_t expiry = slot->expiries[i];
+      const Expiry* due = ecs_is_alive(it->world, expiry.entity) ? ecs_get(it->world, expiry.entity, Expiry) : NULL;
+      if (due && due->tick == expiry.tick) {
+        wheel->expired[expired_count++] = expiry.entity;
+      }
+    }
+    wheel->count -= slot->count;
+    slot->count = 0;
+  }
+  // Once the wheel is empty, the ticks left have nothing to visit.
+  if (!wheel->count) {
+    wheel->tick = vkm_max(wheel->tick, now + 1);
+  }
+
+  fun_park_bodies(it->world, wheel->expired, expired_count);
+}
+
+// Value i of a random fill comes from Thomas Wang's integer hash of seed + i * FUN_RANDOM_STEP, which only takes
+// additions, shifts and xors, all of which SSE2 has for 32 bit lanes unlike multiplications.
+#define FUN_RANDOM_STEP 0x9E3779B9u
+
+static uint32_t random_hash(uint32_t key) {
+  key = ~key + (key << 15);
+  key ^= key >> 12;
+  key += key << 2;
+  key ^= key >> 4;
+  key += (key << 3) + (key << 11);
+  key ^= key >> 16;
+  return key;
+}
+
+// The 23 highest bits of a hash as the mantissa of a float in [1, 2), minus 1.
+static float random_unit(const uint32_t hash) {
+  const uint32_t bits = (hash >> 9) | 0x3F800000u;
+  float unit;
+  memcpy(&unit, &bits, sizeof(unit));
+  return unit - 1.0f;
+}
+
+#ifdef FUN_AVX2
+#define FUN_RANDOM_LANES 8
+
+static __m256i random_hash_avx2(__m256i key) {
+  key = _mm256_add_epi32(_mm256_xor_si256(key, _mm256_set1_epi32(-1)), _mm256_slli_epi32(key, 15));
+  key = _mm256_xor_si256(key, _mm256_srli_epi32(key, 12));
+  key = _mm256_add_epi32(key, _mm256_slli_epi32(key, 2));
+  key = _mm256_xor_si256(key, _mm256_srli_epi32(key, 4));
+  key = _mm256_add_epi32(key, _mm256_add_epi32(_mm256_slli_epi32(key, 3), _mm256_slli_epi32(key, 11)));
+  return _mm256_xor_si256(key, _mm256_srli_epi32(key, 16));
+}
+
+// Three registers hold a whole number of vectors, the mins and ranges repeat with the same period.
+static int32_t random_fill_simd(
+  float* values,
+  const int32_t count,
+  const float* min,
+  const float* range,
+  const uint32_t seed
+) {
+  __m256 min_lanes[3], range_lanes[3];
+  for (int j = 0; j < 3; j++) {
+    float mins[FUN_RANDOM_LANES], ranges[FUN_RANDOM_LANES];
+    for (int k = 0; k < FUN_RANDOM_LANES; k++) {
+      mins[k] = min[(j * FUN_RANDOM_LANES + k) % 3];
+      ranges[k] = range[(j * FUN_RANDOM_LANES + k) % 3];
+    }
+    min_lanes[j] = _mm256_loadu_ps(mins);
+    range_lanes[j] = _mm256_loadu_ps(ranges);
+  }
+
+  __m256i key = _mm256_add_epi32(
+    _mm256_set1_epi32((int)seed),
+    _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)FUN_RANDOM_STEP))
+  );
+  const __m256i step = _mm256_set1_epi32((int)(FUN_RANDOM_LANES * FUN_RANDOM_STEP));
+  const __m256i exponent = _mm256_set1_epi32(0x3F800000);
+  const __m256 one = _mm256_set1_ps(1.0f);
+
+  int32_t i = 0;
+  for (; i + 3 * FUN_RANDOM_LANES <= count; i += 3 * FUN_RANDOM_LANES) {
+    for (int j = 0; j < 3; j++) {
+      const __m256i hash = random_hash_avx2(key);
+      const __m256 unit = _mm256_sub_ps(
+        _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(hash, 9), exponent)),
+        one
+      );
+      const __m256 value = _mm256_add_ps(min_lanes[j], _mm256_mul_ps(unit, range_lanes[j]));
+      _mm256_storeu_ps(values + i + j * FUN_RANDOM_LANES, value);
+      key = _mm256_add_epi32(key, step);
+    }
+  }
+
+  return i;
+}
+#elif defined(FUN_SSE2)
+#define FUN_RANDOM_LANES 4
+
+static __m128i random_hash_sse2(__m128i key) {
+  key = _mm_add_epi32(_mm_xor_si128(key, _mm_set1_epi32(-1)), _mm_slli_epi32(key, 15));
+  key = _mm_xor_si128(key, _mm_srli_epi32(key, 12));
+  key = _mm_add_epi32(key, _mm_slli_epi32(key, 2));
+  key = _mm_xor_si128(key, _mm_srli_epi32(key, 4));
+  key = _mm_add_epi32(key, _mm_add_epi32(_mm_slli_epi32(key, 3), _mm_slli_epi32(key, 11)));
+  return _mm_xor_si128(key, _mm_srli_epi32(key, 16));
+}
+
+// Three registers hold a whole number of vectors, the mins and ranges repeat with the same period.
+static int32_t random_fill_simd(
+  float* values,
+  const int32_t count,
+  const float* min,
+  const float* range,
+  const uint32_t seed
+) {
+  __m128 min_lanes[3], range_lanes[3];
+  for (int j = 0; j < 3; j++) {
+    float mins[FUN_RANDOM_LANES], ranges[FUN_RANDOM_LANES];
+    for (int k = 0; k < FUN_RANDOM_LANES; k++) {
+      mins[k] = min[(j * FUN_RANDOM_LANES + k) % 3];
+      ranges[k] = range[(j * FUN_RANDOM_LANES + k) % 3];
+    }
+    min_lanes[j] = _mm_loadu_ps(mins);
+    range_lanes[j] = _mm_loadu_ps(ranges);
+  }
+
+  __m128i key = _mm_setr_epi32(
+    (int)seed,
+    (int)(seed + FUN_RANDOM_STEP),
+    (int)(seed + 2 * FUN_RANDOM_STEP),
+    (int)(seed + 3 * FUN_RANDOM_STEP)
+  );
+  const __m128i step = _mm_set1_epi32((int)(FUN_RANDOM_LANES * FUN_RANDOM_STEP));
+  const __m128i exponent = _mm_set1_epi32(0x3F800000);
+  const __m128 one = _mm_set1_ps(1.0f);
+
+  int32_t i = 0;
+  for (; i + 3 * FUN_RANDOM_LANES <= count; i += 3 * FUN_RANDOM_LANES) {
+    for (int j = 0; j < 3; j++) {
+      const __m128i hash = random_hash_sse2(key);
+      const __m128 unit = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(hash, 9), exponent)), one);
+      const __m128 value = _mm_add_ps(min_lanes[j], _mm_mul_ps(unit, range_lanes[j]));
+      _mm_storeu_ps(values + i + j * FUN_RANDOM_LANES, value);
+      key = _mm_add_epi32(key, step);
+    }
+  }
+
+  return i;
+}
+#endif
+
+// Value i ends up in [min[i % 3], min[i % 3] + range[i % 3]), so that vectors are filled axis by axis.
+static void random_fill(
+  float* values,
+  const int32_t count,
+  const float* min,
+  const float* range,
+  const uint32_t seed
+) {
+  int32_t i = 0;
+#ifdef FUN_RANDOM_LANES
+  i = random_fill_simd(values, count, min, range, seed);
+#endif
+  for (; i < count; i++) {
+    values[i] = min[i % 3] + random_unit(random_hash(seed + (uint32_t)i * FUN_RANDOM_STEP)) * range[i % 3];
+  }
+}
+
+void fun_random_floats(float* values, const int32_t count, const float min, const float max, const uint32_t seed) {
+  const float mins[3] = { min, min, min };
+  const float ranges[3] = { max - min, max - min, max - min };
+  random_fill(values, count, mins, ranges, seed);
+}
+
+int32_t fun_spawn_burst(ecs_world_t* world, const fun_burst_desc_t* desc) {
+  // The table append happens right away, it would pull the rug from under whatever iterates the deferred world.
+  assert(!ecs_is_deferred(world));
+  assert(!desc->ids[FUN_COUNTOF(desc->ids) - 1]);
+
+  const int32_t count = desc->count;
+  vkm_vec3* scratch = malloc(2 * count * sizeof(vkm_vec3));
+  Position3D* positions = scratch;
+  Velocity3D* velocities = scratch + count;
+  for (int32_t i = 0; i < count; i++) {
+    positions[i] = desc->position;
+  }
+
+  ExpiryWheel* wheel = desc->lifespans ? ecs_get_mut(world, ecs_id(ExpiryWheel), ExpiryWheel) : NULL;
+  assert(wheel || !desc->lifespans);
+  Expiry* expiries = wheel ? malloc(count * sizeof(Expiry)) : NULL;
+  const float now = ecs_get_world_info(world)->world_time_total;
+  for (int32_t i = 0; wheel && i < count; i++) {
+    expiries[i].tick = expiry_wheel_due(wheel, now, desc->lifespans[i]);
+  }
+
+  float min[3], range[3];
+  for (int k = 0; k < 3; k++) {
+    min[k] = desc->min_velocity.raw[k];
+    range[k] = desc->max_velocity.raw[k] - desc->min_velocity.raw[k];
+  }
+  random_fill(velocities->raw, 3 * count, min, range, desc->seed);
+
+  ecs_bulk_desc_t bulk = {
+    .count = count,
+    .ids = { ecs_id(Position3D), ecs_id(Velocity3D) },
+  };
+  void* data[FLECS_ID_DESC_MAX] = { positions, velocities };
+  BodyPool* pool = NULL;
+  int32_t ids_count = 2;
+  for (size_t i = 0; desc->ids[i]; i++, ids_count++) {
+    bulk.ids[ids_count] = desc->ids[i];
+    data[ids_count] = desc->data ? desc->data[i] : NULL;
+    if (ECS_IS_PAIR(desc->ids[i]) && ECS_PAIR_FIRST(desc->ids[i]) == EcsIsA) {
+      pool = ecs_get_mut(world, ecs_pair_second(world, desc->ids[i]), BodyPool);
+    }
+  }
+  if (wheel) {
+    bulk.ids[ids_count] = ecs_id(Expiry);
+    data[ids_count++] = expiries;
+  }
+  bulk.data = data;
+
+  // Parked bodies are re-armed where they are if they already have everything the burst has, the others are left for
+  // a later one.
+  int32_t rearmed = 0;
+  if (pool) {
+    const ecs_type_info_t* type_infos[FLECS_ID_DESC_MAX];
+    for (int32_t j = 0; j < ids_count; j++) {
+      type_infos[j] = data[j] ? ecs_get_type_info(world, bulk.ids[j]) : NULL;
+    }
+
+    const ecs_table_t* table = NULL;
+    bool table_matches = false;
+    int32_t columns[FLECS_ID_DESC_MAX];
+    int32_t kept = 0;
+    for (int32_t i = 0; i < pool->count; i++) {
+      const ecs_entity_t entity = pool->entities[i];
+      if (!ecs_is_alive(world, entity)) {
+        continue;
+      }
+
+      if (ecs_get_table(world, entity) != table) {
+        table = ecs_get_table(world, entity);
+        table_matches = true;
+        for (int32_t j = 0; j < ids_count && table_matches; j++) {
+          table_matches = ecs_table_has_id(world, table, bulk.ids[j]);
+          columns[j] = data[j] ? ecs_table_get_column_index(world, table, bulk.ids[j]) : -1;
+        }
+      }
+
+      if (rearmed < count && table_matches) {
+        rearm_body(world, entity, columns, type_infos, data, ids_count, rearmed);
+        if (wheel) {
+          expiry_wheel_schedule(wheel, entity, expiries[rearmed].tick);
+        }
+        rearmed++;
+      } else {
+        pool->entities[kept++] = entity;
+      }
+    }
+    pool->count = kept;
+  }
+
+  // Whatever the pool couldn't provide is created, starting from the first value not used yet.
+  if (rearmed < count) {
+    bulk.count = count - rearmed;
+    for (int32_t j = 0; j < ids_count; j++) {
+      if (data[j]) {
+        data[j] = (char*)data[j] + rearmed * ecs_get_type_info(world, bulk.ids[j])->size;
+      }
+    }
+    const ecs_entity_t* entities = ecs_bulk_init(world, &bulk);
+    for (int32_t i = 0; wheel && i < bulk.count; i++) {
+      expiry_wheel_schedule(wheel, entities[i], expiries[rearmed + i].tick);
+    }
+  }
+
+  free(scratch);
+  free(expiries);
+  return rearmed;
+}
+
+void funomenalImport(ecs_world_t* world) {
+  ECS_MODULE(world, funomenal);
+
+  ECS_IMPORT(world, cvkm);
+
+  ECS_COMPONENT_DEFINE(world, InverseMass);
+  ecs_primitive(world, { .entity = ecs_id(InverseMass), .kind = EcsF32 });
+  ecs_add_pair(world, ecs_id(Mass), EcsWith, ecs_id(InverseMass));
+  ECS_COMPONENT_DEFINE(world, DampingRate);
+  ecs_primitive(world, { .entity = ecs_id(DampingRate), .kind = EcsF32 });
+  ecs_add_pair(world, ecs_id(Damping), EcsWith, ecs_id(DampingRate));
+
+  // Bodies spawned from a prefab share its mass properties instead of each storing a copy.
+  ecs_add_pair(world, ecs_id(Mass), EcsOnInstantiate, EcsInherit);
+  ecs_add_pair(world, ecs_id(InverseMass), EcsOnInstantiate, EcsInherit);
+  ecs_add_pair(world, ecs_id(Damping), EcsOnInstantiate, EcsInherit);
+  ecs_add_pair(world, ecs_id(DampingRate), EcsOnInstantiate, EcsInherit);
+  ecs_add_pair(world, ecs_id(GravityScale), EcsOnInstantiate, EcsInherit);
+
+  ECS_COMPONENT_DEFINE(world, AngularVelocity3D);
+  ecs_add_pair(world, ecs_id(AngularVelocity3D), EcsIsA, ecs_id(vkm_vec3));
+  ecs_add_pair(world, ecs_id(AngularVelocity3D), EcsWith, ecs_id(Rotation3D));
+  ECS_COMPONENT_DEFINE(world, Torque3D);
+  ecs_add_pair(world, ecs_id(Torque3D), EcsIsA, ecs_id(vkm_vec3));
+  ECS_COMPONENT_DEFINE(world, Inertia3D);
+  ecs_add_pair(world, ecs_id(Inertia3D), EcsIsA, ecs_id(vkm_vec3));
+  ECS_COMPONENT_DEFINE(world, InverseInertia3D);
+  ecs_add_pair(world, ecs_id(InverseInertia3D), EcsIsA, ecs_id(vkm_vec3));
+  ecs_add_pair(world, ecs_id(Inertia3D), EcsWith, ecs_id(InverseInertia3D));
+
+  ECS_COMPONENT_DEFINE(world, FixedTimeStep);
+  ecs_struct(world, {
+    .entity = ecs_id(FixedTimeStep),
+    .members = {
+      {
+        .name = "delta_time",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(FixedTimeStep, delta_time),
+        .unit = EcsSeconds,
+      },
+      {
+        .name = "accumulator",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(FixedTimeStep, accumulator),
+        .unit = EcsSeconds,
+      },
+      {
+        .name = "interpolation",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(FixedTimeStep, interpolation),
+      },
+      {
+        .name = "max_substeps",
+        .type = ecs_id(ecs_u32_t),
+        .offset = offsetof(FixedTimeStep, max_substeps),
+      },
+      {
+        .name = "substeps",
+        .type = ecs_id(ecs_u32_t),
+        .offset = offsetof(FixedTimeStep, substeps),
+      },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, StateHash);
+  ecs_struct(world, {
+    .entity = ecs_id(StateHash),
+    .members = {
+      { .name = "hash", .type = ecs_id(ecs_u64_t), .offset = offsetof(StateHash, hash) },
+      { .name = "steps", .type = ecs_id(ecs_u64_t), .offset = offsetof(StateHash, steps) },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, SnapshotRing3D);
+  ecs_struct(world, {
+    .entity = ecs_id(SnapshotRing3D),
+    .members = {
+      { .name = "frames_count", .type = ecs_id(ecs_u32_t), .offset = offsetof(SnapshotRing3D, frames_count) },
+      { .name = "frame", .type = ecs_id(ecs_u64_t), .offset = offsetof(SnapshotRing3D, frame) },
+      { .name = "size", .type = ecs_id(ecs_i32_t), .offset = offsetof(SnapshotRing3D, size), .unit = EcsBytes },
+      {
+        .name = "save_time",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(SnapshotRing3D, save_time),
+        .unit = EcsSeconds,
+      },
+      {
+        .name = "restore_time",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(SnapshotRing3D, restore_time),
+        .unit = EcsSeconds,
+      },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, Interpolation3D);
+  ecs_add_pair(world, ecs_id(Interpolation3D), EcsWith, ecs_id(Position3D));
+  ECS_COMPONENT_DEFINE(world, FloatingOrigin3D);
+  ecs_struct(world, {
+    .entity = ecs_id(FloatingOrigin3D),
+    .members = {
+      { .name = "origin", .type = ecs_id(DoublePosition3D), .offset = offsetof(FloatingOrigin3D, origin) },
+      {
+        .name = "rebase_distance",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(FloatingOrigin3D, rebase_distance),
+        .unit = EcsMeters,
+      },
+      { .name = "focus", .type = ecs_id(ecs_entity_t), .offset = offsetof(FloatingOrigin3D, focus) },
+      { .name = "rebases", .type = ecs_id(ecs_u32_t), .offset = offsetof(FloatingOrigin3D, rebases) },
+      { .name = "last_shift", .type = ecs_id(DoublePosition3D), .offset = offsetof(FloatingOrigin3D, last_shift) },
+    },
+  });
+  ecs_add_pair(world, ecs_id(DoublePosition3D), EcsWith, ecs_id(Position3D));
+  ECS_COMPONENT_DEFINE(world, BodyPool);
+  ecs_struct(world, {
+    .entity = ecs_id(BodyPool),
+    .members = {
+      { .name = "count", .type = ecs_id(ecs_i32_t), .offset = offsetof(BodyPool, count) },
+      { .name = "capacity", .type = ecs_id(ecs_i32_t), .offset = offsetof(BodyPool, capacity) },
+    },
+  });
+  ecs_add_pair(world, ecs_id(BodyPool), EcsOnInstantiate, EcsDontInherit);
+  ECS_COMPONENT_DEFINE(world, Expiry);
+  ecs_struct(world, {
+    .entity = ecs_id(Expiry),
+    .members = {
+      { .name = "tick", .type = ecs_id(ecs_u64_t), .offset = offsetof(Expiry, tick) },
+    },
+  });
+  ecs_add_pair(world, ecs_id(Expiry), EcsOnInstantiate, EcsDontInherit);
+  ECS_COMPONENT_DEFINE(world, ExpiryWheel);
+  ecs_struct(world, {
+    .entity = ecs_id(ExpiryWheel),
+    .members = {
+      {
+        .name = "tick_duration",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(ExpiryWheel, tick_duration),
+        .unit = EcsSeconds,
+      },
+      { .name = "tick", .type = ecs_id(ecs_u64_t), .offset = offsetof(ExpiryWheel, tick) },
+      { .name = "count", .type = ecs_id(ecs_i32_t), .offset = offsetof(ExpiryWheel, count) },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, Sleepable);
+  ecs_struct(world, {
+    .entity = ecs_id(Sleepable),
+    .members = {
+      {
+        .name = "idle_time",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(Sleepable, idle_time),
+        .unit = EcsSeconds,
+      },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, SleepSettings);
+  ecs_struct(world, {
+    .entity = ecs_id(SleepSettings),
+    .members = {
+      {
+        .name = "linear_velocity",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(SleepSettings, linear_velocity),
+        .unit = EcsMetersPerSecond,
+      },
+      {
+        .name = "angular_velocity",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(SleepSettings, angular_velocity),
+      },
+      {
+        .name = "time",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(SleepSettings, time),
+        .unit = EcsSeconds,
+      },
+    },
+  });
+
+  ECS_TAG_DEFINE(world, Sleeping);
+
+  ECS_COMPONENT_DEFINE(world, SolverSettings);
+  ecs_struct(world, {
+    .entity = ecs_id(SolverSettings),
+    .members = {
+      { .name = "iterations", .type = ecs_id(ecs_u32_t), .offset = offsetof(SolverSettings, iterations) },
+      { .name = "friction", .type = ecs_id(ecs_f32_t), .offset = offsetof(SolverSettings, friction) },
+      { .name = "restitution", .type = ecs_id(ecs_f32_t), .offset = offsetof(SolverSettings, restitution) },
+      { .name = "baumgarte", .type = ecs_id(ecs_f32_t), .offset = offsetof(SolverSettings, baumgarte) },
+      { .name = "slop", .type = ecs_id(ecs_f32_t), .offset = offsetof(SolverSettings, slop), .unit = EcsMeters },
+      { .name = "graph_coloring", .type = ecs_id(ecs_bool_t), .offset = offsetof(SolverSettings, graph_coloring) },
+    },
+  });
+
+  ECS_COMPONENT_DEFINE(world, BoundingRadius);
+  ecs_primitive(world, { .entity = ecs_id(BoundingRadius), .kind = EcsF32 });
+  ECS_COMPONENT_DEFINE(world, BroadphaseProxy3D);
+  ecs_primitive(world, { .entity = ecs_id(BroadphaseProxy3D), .kind = EcsU32 });
+  ecs_add_pair(world, ecs_id(BoundingRadius), EcsWith, ecs_id(BroadphaseProxy3D));
+  ECS_COMPONENT_DEFINE(world, CollisionWorld3D);
+  ECS_COMPONENT_DEFINE(world, Sphere);
+  ecs_struct(world, {
+    .entity = ecs_id(Sphere),
+    .members = {
+      { .name = "radius", .type = ecs_id(ecs_f32_t), .offset = offsetof(Sphere, radius), .unit = EcsMeters },
+    },
+  });
+  ecs_add_pair(world, ecs_id(Sphere), EcsWith, ecs_id(BoundingRadius));
+  ECS_COMPONENT_DEFINE(world, Box);
+  ecs_add_pair(world, ecs_id(Box), EcsWith, ecs_id(BoundingRadius));
+  ECS_COMPONENT_DEFINE(world, Capsule);
+  ecs_struct(world, {
+    .entity = ecs_id(Capsule),
+    .members = {
+      { .name = "radius", .type = ecs_id(ecs_f32_t), .offset = offsetof(Capsule, radius), .unit = EcsMeters },
+      {
+        .name = "half_height",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(Capsule, half_height),
+        .unit = EcsMeters,
+      },
+    },
+  });
+  ecs_add_pair(world, ecs_id(Capsule), EcsWith, ecs_id(BoundingRadius));
+  ECS_COMPONENT_DEFINE(world, ConvexHull);
+  ecs_add_pair(world, ecs_id(ConvexHull), EcsWith, ecs_id(BoundingRadius));
+  ECS_COMPONENT_DEFINE(world, Plane);
+  ECS_COMPONENT_DEFINE(world, SweepOrigin3D);
+  ecs_add_pair(world, ecs_id(SweepOrigin3D), EcsIsA, ecs_id(vkm_vec3));
+  ECS_TAG_DEFINE(world, Bullet);
+  ecs_add_pair(world, Bullet, EcsWith, ecs_id(SweepOrigin3D));
+  ECS_TAG_DEFINE(world, Attractor);
+  ECS_COMPONENT_DEFINE(world, NBodyGravity3D);
+  ecs_struct(world, {
+    .entity = ecs_id(NBodyGravity3D),
+    .members = {
+      {
+        .name = "gravitational_constant",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(NBodyGravity3D, gravitational_constant),
+      },
+      { .name = "theta", .type = ecs_id(ecs_f32_t), .offset = offsetof(NBodyGravity3D, theta) },
+      {
+        .name = "softening",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(NBodyGravity3D, softening),
+        .unit = EcsMeters,
+      },
+      { .name = "bodies_count", .type = ecs_id(ecs_i32_t), .offset = offsetof(NBodyGravity3D, bodies_count) },
+      { .name = "nodes_count", .type = ecs_id(ecs_i32_t), .offset = offsetof(NBodyGravity3D, nodes_count) },
+    },
+  });
+
+  ECS_COMPONENT_DEFINE(world, Particle3D);
+  ecs_struct(world, {
+    .entity = ecs_id(Particle3D),
+    .members = {
+      { .name = "radius", .type = ecs_id(ecs_f32_t), .offset = offsetof(Particle3D, radius), .unit = EcsMeters },
+      { .name = "index", .type = ecs_id(ecs_u32_t), .offset = offsetof(Particle3D, index) },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, DistanceLink3D);
+  ecs_struct(world, {
+    .entity = ecs_id(DistanceLink3D),
+    .members = {
+      {
+        .name = "rest_length",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(DistanceLink3D, rest_length),
+        .unit = EcsMeters,
+      },
+      { .name = "compliance", .type = ecs_id(ecs_f32_t), .offset = offsetof(DistanceLink3D, compliance) },
+    },
+  });
+  ecs_add_id(world, ecs_id(DistanceLink3D), EcsRelationship);
+  ECS_COMPONENT_DEFINE(world, ParticleSettings);
+  ecs_struct(world, {
+    .entity = ecs_id(ParticleSettings),
+    .members = {
+      { .name = "substeps", .type = ecs_id(ecs_u32_t), .offset = offsetof(ParticleSettings, substeps) },
+      { .name = "friction", .type = ecs_id(ecs_f32_t), .offset = offsetof(ParticleSettings, friction) },
+    },
+  });
+  ECS_COMPONENT_DEFINE(world, ParticleWorld3D);
+  ECS_TAG_DEFINE(world, Fluid);
+  ECS_COMPONENT_DEFINE(world, FluidWorld3D);
+  ecs_struct(world, {
+    .entity = ecs_id(FluidWorld3D),
+    .members = {
+      {
+        .name = "smoothing_radius",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(FluidWorld3D, smoothing_radius),
+        .unit = EcsMeters,
+      },
+      { .name = "rest_density", .type = ecs_id(ecs_f32_t), .offset = offsetof(FluidWorld3D, rest_density) },
+      { .name = "stiffness", .type = ecs_id(ecs_f32_t), .offset = offsetof(FluidWorld3D, stiffness) },
+      { .name = "viscosity", .type = ecs_id(ecs_f32_t), .offset = offsetof(FluidWorld3D, viscosity) },
+      { .name = "count", .type = ecs_id(ecs_i32_t), .offset = offsetof(FluidWorld3D, count) },
+    },
+  });
+
+  ecs_set_hooks(world, InverseMass, { .ctor = ecs_ctor(InverseMass) });
+  ecs_set_hooks(world, DampingRate, { .ctor = ecs_ctor(DampingRate) });
+  ecs_set_hooks(world, AngularVelocity3D, { .ctor = ecs_ctor(AngularVelocity3D) });
+  ecs_set_hooks(world, Torque3D, { .ctor = ecs_ctor(Torque3D) });
+  ecs_set_hooks(world, Inertia3D, { .ctor = ecs_ctor(Inertia3D) });
+  ecs_set_hooks(world, InverseInertia3D, { .ctor = ecs_ctor(InverseInertia3D) });
+  ecs_set_hooks(world, FixedTimeStep, { .ctor = ecs_ctor(FixedTimeStep) });
+  ecs_set_hooks(world, Interpolation3D, { .ctor = ecs_ctor(Interpolation3D) });
+  ecs_set_hooks(world, SnapshotRing3D, {
+    .ctor = ecs_ctor(SnapshotRing3D),
+    .move = ecs_move(SnapshotRing3D),
+    .dtor = ecs_dtor(SnapshotRing3D),
+  });
+  ecs_set_hooks(world, FloatingOrigin3D, { .ctor = ecs_ctor(FloatingOrigin3D) });
+  ecs_set_hooks(world, NBodyGravity3D, {
+    .ctor = ecs_ctor(NBodyGravity3D),
+    .move = ecs_move(NBodyGravity3D),
+    .dtor = ecs_dtor(NBodyGravity3D),
+  });
+  ecs_set_hooks(world, BodyPool, {
+    .ctor = ecs_ctor(BodyPool),
+    .move = ecs_move(BodyPool),
+    .dtor = ecs_dtor(BodyPool),
+  });
+  ecs_set_hooks(world, ExpiryWheel, {
+    .ctor = ecs_ctor(ExpiryWheel),
+    .move = ecs_move(ExpiryWheel),
+    .dtor = ecs_dtor(ExpiryWheel),
+  });
+  ecs_set_hooks(world, Sleepable, { .ctor = ecs_ctor(Sleepable) });
+  ecs_set_hooks(world, SleepSettings, { .ctor = ecs_ctor(SleepSettings) });
+  ecs_set_hooks(world, SolverSettings, { .ctor = ecs_ctor(SolverSettings) });
+  ecs_set_hooks(world, CollisionWorld3D, {
+    .ctor = ecs_ctor(CollisionWorld3D),
+    .move = ecs_move(CollisionWorld3D),
+    .dtor = ecs_dtor(CollisionWorld3D),
+  });
+  ecs_set_hooks(world, Particle3D, { .ctor = ecs_ctor(Particle3D) });
+  ecs_set_hooks(world, DistanceLink3D, { .ctor = ecs_ctor(DistanceLink3D) });
+  ecs_set_hooks(world, ParticleSettings, { .ctor = ecs_ctor(ParticleSettings) });
+  ecs_set_hooks(world, ParticleWorld3D, {
+    .ctor = ecs_ctor(ParticleWorld3D),
+    .move = ecs_move(ParticleWorld3D),
+    .dtor = ecs_dtor(ParticleWorld3D),
+  });
+  ecs_set_hooks(world, FluidWorld3D, {
+    .ctor = ecs_ctor(FluidWorld3D),
+    .move = ecs_move(FluidWorld3D),
+    .dtor = ecs_dtor(FluidWorld3D),
+  });
+  ecs_set_hooks(world, ConvexHull, {
+    .ctor = ecs_ctor(ConvexHull),
+    .copy = ecs_copy(ConvexHull),
+    .move = ecs_move(ConvexHull),
+    .dtor = ecs_dtor(ConvexHull),
+  });
+
+  ECS_OBSERVER(world, OnSetMass, EcsOnSet, [in] cvkm.Mass, ?Prefab);
+  ECS_OBSERVER(world, OnSetInertia3D, EcsOnSet, [in] Inertia3D);
+  ECS_OBSERVER(world, OnSetDamping, EcsOnSet, [in] cvkm.Damping, ?Prefab);
+  ECS_OBSERVER(world, OnSetDoublePosition3D, EcsOnSet, [in] cvkm.DoublePosition3D);
+  ECS_OBSERVER(world, OnRemoveBodyPool, EcsOnRemove, [in] BodyPool, ?Prefab);
+  ECS_OBSERVER(world, WakeUp, EcsOnSet,
+    cvkm.Force3D || cvkm.Velocity3D || cvkm.Position3D || cvkm.DoublePosition3D || Torque3D || AngularVelocity3D,
+    [filter] Sleeping,
+  );
+  ecs_observer(world, {
+    .entity = ecs_entity(world, { .name = "OnSetSweepOrigin3D" }),
+    .query.expr = "[out] SweepOrigin3D, [in] cvkm.Position3D",
+    .events = { EcsOnAdd, EcsOnSet },
+    .callback = OnSetSweepOrigin3D,
+  });
+  // Particle links are cached until they change.
+  ecs_observer(world, {
+    .entity = ecs_entity(world, { .name = "OnChangeDistanceLink3D" }),
+    .query.expr = "[in] (DistanceLink3D, *)",
+    .events = { EcsOnAdd, EcsOnSet, EcsOnRemove },
+    .callback = OnChangeDistanceLink3D,
+  });
+  // Keep the leaves of the broadphase tree in sync with the bodies that have bounds.
+  ECS_OBSERVER(world, AddBroadphaseProxy3D, EcsOnAdd, [out] BroadphaseProxy3D);
+  ECS_OBSERVER(world, RemoveBroadphaseProxy3D, EcsOnRemove, [inout] BroadphaseProxy3D);
+  // Shapes size the bounds of their body.
+  ECS_OBSERVER(world, OnSetSphere, EcsOnSet, [in] Sphere);
+  ECS_OBSERVER(world, OnSetBox, EcsOnSet, [in] Box);
+  ECS_OBSERVER(world, OnSetCapsule, EcsOnSet, [in] Capsule);
+  ECS_OBSERVER(world, OnSetConvexHull, EcsOnSet, [in] ConvexHull);
+
+  ECS_SYSTEM(world, RestoreInterpolated3D, EcsPostLoad,
+    [inout] cvkm.Position3D,
+    [inout] Interpolation3D,
+    [inout] ?cvkm.Rotation3D,
+    [in] ?FixedTimeStep($),
+  );
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "RebaseOrigin3D",
+      .add = ecs_ids(ecs_dependson(EcsPostLoad)),
+    }),
+    .query.expr =
+      "[inout] cvkm.Position3D,"
+      "[inout] ?cvkm.DoublePosition3D,"
+      "[inout] ?Interpolation3D,"
+      "[inout] ?SweepOrigin3D",
+    .run = RebaseOrigin3D,
+  });
+
+  ECS_SYSTEM(world, AccumulateTime, EcsPreUpdate, [inout] FixedTimeStep($));
+
+  // Mutual gravity adds to the forces before they are integrated.
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "BuildGravityTree3D",
+      .add = ecs_ids(ecs_dependson(EcsPreUpdate)),
+    }),
+    .query.expr =
+      "[in] cvkm.Position3D,"
+      "[in] cvkm.Mass,"
+      "Attractor,"
+      "[inout] ?cvkm.Force3D,"
+      "?Sleeping,"
+      "[inout] NBodyGravity3D($)",
+    .run = BuildGravityTree3D,
+  });
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "ComputeGravity3D",
+      .add = ecs_ids(ecs_dependson(EcsPreUpdate)),
+    }),
+    .query.expr = "[inout] NBodyGravity3D($)",
+    .run = ComputeGravity3D,
+    .multi_threaded = true,
+  });
+
+  // Expired entities are parked before anything else of the update phase runs, so its spawners can re-arm them.
+  ECS_SYSTEM(world, ExpireBodies, EcsOnUpdate, [inout] ExpiryWheel($));
+
+  ECS_SYSTEM(world, Interpolate3D, EcsPreStore,
+    [inout] cvkm.Position3D,
+    [inout] Interpolation3D,
+    [inout] ?cvkm.Rotation3D,
+    [in] FixedTimeStep($),
+    !Sleeping,
+  );
+
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "HashState",
+      .add = ecs_ids(ecs_dependson(EcsPostUpdate)),
+    }),
+    .query.expr =
+      "[in] cvkm.Position3D,"
+      "[in] ?cvkm.Velocity3D,"
+      "[in] ?cvkm.Rotation3D,"
+      "[in] ?AngularVelocity3D,"
+      "[in] ?cvkm.DoublePosition3D",
+    .run = HashState,
+  });
+  ECS_SYSTEM(world, SaveSnapshot3D, EcsPostUpdate, [inout] SnapshotRing3D($));
+
+  // Bodies are stepped in the validation phase, once the update phase is done with them and the parked bodies that
+  // were not re-armed are gone.
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "ReleaseBodyPools",
+      .add = ecs_ids(ecs_dependson(EcsOnValidate)),
+    }),
+    .query.expr = "[inout] BodyPool, ?Prefab",
+    .run = ReleaseBodyPools,
+    .immediate = true,
+  });
+  // Before the forces that the update phase added are used up.
+  ECS_SYSTEM(world, FallAsleep, EcsOnValidate,
+    [inout] Sleepable,
+    [inout] cvkm.Velocity3D,
+    [in] cvkm.Force3D,
+    [in] SleepSettings($),
+    [inout] ?AngularVelocity3D,
+    [in] ?Torque3D,
+    ?BoundingRadius,
+    !Sleeping,
+  );
+  // A fixed step adds the fluid forces, integrates the bodies, finds and solves their contacts, then steps the
+  // particles. These systems have no phase, Step3D runs them in this order once per step.
+  // The fluid adds its forces before anything uses them.
+  const ecs_entity_t gather_fluid = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "GatherFluid3D",
+    }),
+    .query.expr =
+      "[in] cvkm.Position3D,"
+      "[in] cvkm.Velocity3D,"
+      "[inout] cvkm.Force3D,"
+      "[in] ?InverseMass,"
+      "[inout] FluidWorld3D($),"
+      "Fluid,"
+      "!Sleeping",
+    .run = GatherFluid3D,
+  });
+  const ecs_entity_t compute_fluid_densities = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "ComputeFluidDensities3D",
+    }),
+    .query.expr = "[inout] FluidWorld3D($)",
+    .run = ComputeFluidDensities3D,
+    .multi_threaded = true,
+  });
+  const ecs_entity_t compute_fluid_forces = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "ComputeFluidForces3D",
+    }),
+    .query.expr = "[in] FluidWorld3D($)",
+    .run = ComputeFluidForces3D,
+    .multi_threaded = true,
+  });
+
+  ECS_SYSTEM(world, BeginSweep3D, 0, [in] cvkm.Position3D, [out] SweepOrigin3D, !Sleeping);
+  // Every body is integrated independently of all others, so the rows can be split across workers freely.
+  const ecs_entity_t integrate = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "Integrate3D",
+    }),
+    .query.expr =
+      "[inout] cvkm.Position3D,"
+      "[inout] cvkm.Velocity3D,"
+      "[inout] cvkm.Force3D,"
+      "[in] InverseMass,"
+      "[in] ?DampingRate,"
+      "[in] ?cvkm.GravityScale,"
+      "[in] ?cvkm.Gravity3D($),"
+      "[in] ?FixedTimeStep($),"
+      "[out] ?Interpolation3D,"
+      "[inout] ?cvkm.Rotation3D,"
+      "[inout] ?AngularVelocity3D,"
+      "[inout] ?Torque3D,"
+      "[in] ?InverseInertia3D,"
+      "[inout] ?cvkm.DoublePosition3D,"
+      "[in] ?FloatingOrigin3D($),"
+      "!Sleeping,"
+      "!Particle3D",
+    .callback = Integrate3D,
+    .multi_threaded = true,
+  });
+
+  const ecs_entity_t update_broadphase = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "UpdateBroadphase3D",
+    }),
+    .query.expr =
+      "[in] cvkm.Position3D,"
+      "[in] BoundingRadius,"
+      "[inout] BroadphaseProxy3D,"
+      "[inout] CollisionWorld3D($),"
+      "[in] ?cvkm.Rotation3D,"
+      "[in] ?Sphere,"
+      "[in] ?Box,"
+      "[in] ?Capsule,"
+      "[in] ?ConvexHull,"
+      "[in] ?cvkm.Velocity3D,"
+      "[in] ?AngularVelocity3D,"
+      "[in] ?InverseMass,"
+      "[in] ?InverseInertia3D,"
+      "?Sleeping,"
+      "[inout] ?Sleepable,"
+      "[in] ?SweepOrigin3D",
+    .run = UpdateBroadphase3D,
+  });
+  const ecs_entity_t find_pairs = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "FindPairs3D",
+    }),
+    .query.expr = "[inout] CollisionWorld3D($)",
+    .run = FindPairs3D,
+    .multi_threaded = true,
+  });
+  ECS_SYSTEM(world, MergePairs3D, 0, [inout] CollisionWorld3D($));
+  const ecs_entity_t gather_planes = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "GatherPlanes3D",
+    }),
+    .query.expr = "[in] Plane, [inout] CollisionWorld3D($)",
+    .run = GatherPlanes3D,
+  });
+  ECS_SYSTEM(world, SweepBullets3D, 0, [inout] CollisionWorld3D($), [in] SolverSettings($));
+  const ecs_entity_t find_contacts = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "FindContacts3D",
+    }),
+    .query.expr = "[inout] CollisionWorld3D($)",
+    .run = FindContacts3D,
+    .multi_threaded = true,
+  });
+  ECS_SYSTEM(world, MergeContacts3D, 0, [inout] CollisionWorld3D($));
+  ECS_SYSTEM(world, PrepareContacts3D, 0,
+    [inout] CollisionWorld3D($),
+    [in] SolverSettings($),
+    [in] ?FixedTimeStep($),
+  );
+  const ecs_entity_t solve_contacts = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "SolveContacts3D",
+    }),
+    .query.expr = "[inout] CollisionWorld3D($), [in] SolverSettings($)",
+    .run = SolveContacts3D,
+    .multi_threaded = true,
+  });
+  ECS_SYSTEM(world, FinishContacts3D, 0, [inout] CollisionWorld3D($), [in] ?SleepSettings($));
+
+  // Particles are stepped after the planes are gathered, which they collide with as well.
+  const ecs_entity_t gather_particles = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "GatherParticles3D",
+    }),
+    .query.expr =
+      "[in] cvkm.Position3D,"
+      "[in] cvkm.Velocity3D,"
+      "[inout] Particle3D,"
+      "[inout] ParticleWorld3D($),"
+      "[in] ?InverseMass,"
+      "[inout] ?cvkm.Force3D,"
+      "[in] ?cvkm.GravityScale,"
+      "[in] ?DampingRate,"
+      "[in] ?cvkm.Gravity3D($),"
+      "[inout] ?Interpolation3D,"
+      "!Sleeping",
+    .run = GatherParticles3D,
+  });
+  const ecs_entity_t gather_distance_links = ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "GatherDistanceLinks3D",
+    }),
+    .query.expr = "[in] (DistanceLink3D, *), [inout] ParticleWorld3D($)",
+    .run = GatherDistanceLinks3D,
+  });
+  ECS_SYSTEM(world, StepParticles3D, 0,
+    [inout] ParticleWorld3D($),
+    [in] ParticleSettings($),
+    [in] ?CollisionWorld3D($),
+    [in] ?FixedTimeStep($),
+  );
+
+  const ecs_entity_t step_systems[] = {
+    gather_fluid,
+    compute_fluid_densities,
+    compute_fluid_forces,
+    ecs_id(BeginSweep3D),
+    integrate,
+    update_broadphase,
+    find_pairs,
+    ecs_id(MergePairs3D),
+    gather_planes,
+    ecs_id(SweepBullets3D),
+    find_contacts,
+    ecs_id(MergeContacts3D),
+    ecs_id(PrepareContacts3D),
+    solve_contacts,
+    ecs_id(FinishContacts3D),
+    gather_particles,
+    gather_distance_links,
+    ecs_id(StepParticles3D),
+  };
+  fun_step_systems_t* step = malloc(sizeof(fun_step_systems_t));
+  *step = (fun_step_systems_t){
+    .systems = malloc(sizeof(step_systems)),
+    .count = (int32_t)FUN_COUNTOF(step_systems),
+  };
+  memcpy(step->systems, step_systems, sizeof(step_systems));
+  if (ecs_os_has_threading()) {
+    step->barrier.lock = ecs_os_mutex_new();
+    step->barrier.condition = ecs_os_cond_new();
+  }
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "Step3D",
+      .add = ecs_ids(ecs_dependson(EcsOnValidate)),
+    }),
+    .query.expr = "[in] ?FixedTimeStep($)",
+    .run = Step3D,
+    .multi_threaded = true,
+    .ctx = step,
+    .ctx_free = free_step_systems,
+  });
 
   ecs_singleton_add(world, Gravity2D);
   ecs_singleton_add(world, Gravity3D);
   ecs_singleton_add(world, Gravity4D);
+  ecs_singleton_add(world, SleepSettings);
+  ecs_singleton_add(world, SolverSettings);
+  ecs_singleton_add(world, CollisionWorld3D);
+  ecs_singleton_add(world, ParticleSettings);
+  ecs_singleton_add(world, ParticleWorld3D);
+  ecs_singleton_add(world, FloatingOrigin3D);
+  ecs_singleton_add(world, ExpiryWheel);
 }
 
 #ifndef _MSC_VER
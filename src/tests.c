@@ -16,7 +16,8 @@
 
 #define TARGET_FPS 60
 
-typedef float Lifetime;
+// The world time at which an entity was spawned, so its age doesn't need updating.
+typedef float SpawnTime;
 typedef float Lifespan;
 typedef float Size;
 
@@ -26,6 +27,8 @@ typedef struct Orbiter {
 
 typedef struct firework_phase_t {
   Color* colors;
+  // One prefab per color, holding what all the particles of that color share.
+  ecs_entity_t* prefabs;
   vkm_vec3 min_velocity, max_velocity;
   float min_lifespan, max_lifespan, min_size, max_size;
   uint16_t colors_count, min_particles, max_particles;
@@ -42,7 +45,21 @@ typedef struct FireworkParticle {
 
 typedef int32_t ShouldFadeAway;
 
-static ECS_COMPONENT_DECLARE(Lifetime);
+#ifdef FUN_REPLICATION_BENCHMARK
+// The state of a firework particle as the server last sent it, and as a client last received it. Both sides live in
+// this process, to measure how well the particles replicate.
+typedef fun_quantized_body_t ServerBaseline;
+typedef fun_quantized_body_t ClientBaseline;
+
+// Singleton with the replication measurements since the start, visible in the explorer.
+typedef struct ReplicationStats {
+  double entities, bytes, encode_time, decode_time;
+  // Of the raw Position3D and Velocity3D that were encoded, in megabytes per second.
+  float bytes_per_entity, encode_speed, decode_speed;
+} ReplicationStats;
+#endif
+
+static ECS_COMPONENT_DECLARE(SpawnTime);
 static ECS_COMPONENT_DECLARE(Lifespan);
 static ECS_COMPONENT_DECLARE(Size);
 static ECS_COMPONENT_DECLARE(Orbiter);
@@ -50,8 +67,13 @@ static ECS_TAG_DECLARE(LookingAt);
 static ECS_COMPONENT_DECLARE(Firework);
 static ECS_COMPONENT_DECLARE(FireworkParticle);
 static ECS_COMPONENT_DECLARE(ShouldFadeAway);
+#ifdef FUN_REPLICATION_BENCHMARK
+static ECS_COMPONENT_DECLARE(ServerBaseline);
+static ECS_COMPONENT_DECLARE(ClientBaseline);
+static ECS_COMPONENT_DECLARE(ReplicationStats);
+#endif
 
-ECS_CTOR(Lifetime, ptr, {
+ECS_CTOR(SpawnTime, ptr, {
   *ptr = 0.0f;
 })
 
@@ -79,6 +101,7 @@ ECS_DTOR(Firework, ptr, {
   if (ptr->phases) {
     for (unsigned j = 0; j < ptr->phases_count; j++) {
       free(ptr->phases[j].colors);
+      free(ptr->phases[j].prefabs);
     }
   }
   free(ptr->phases);
@@ -92,6 +115,20 @@ ECS_CTOR(ShouldFadeAway, ptr, {
   *ptr = 1;
 })
 
+#ifdef FUN_REPLICATION_BENCHMARK
+ECS_CTOR(ServerBaseline, ptr, {
+  *ptr = (ServerBaseline){ 0 };
+})
+
+ECS_CTOR(ClientBaseline, ptr, {
+  *ptr = (ClientBaseline){ 0 };
+})
+
+ECS_CTOR(ReplicationStats, ptr, {
+  *ptr = (ReplicationStats){ 0 };
+})
+#endif
+
 static float random_float(const float min, const float max) {
   return (float)rand() / (float)RAND_MAX * (max - min) + min;
 }
@@ -100,20 +137,6 @@ static int random_int(const int min, const int max) {
   return rand() % (max - min) + min;
 }
 
-static void Age(ecs_iter_t* it) {
-  Lifetime* lifetimes = ecs_field(it, Lifetime, 0);
-  const Lifespan* lifespans = ecs_field(it, Lifespan, 1);
-
-  for (int i = 0; i < it->count; i++) {
-    Lifetime* lifetime = lifetimes + i;
-
-    *lifetime += it->delta_time;
-    if (lifespans && *lifetime >= lifespans[i]) {
-      ecs_delete(it->world, it->entities[i]);
-    }
-  }
-}
-
 static void Orbit(ecs_iter_t* it) {
   Position3D* positions = ecs_field(it, Position3D, 0);
   Rotation3D* rotations = ecs_field(it, Rotation3D, 1);
@@ -143,44 +166,199 @@ static void Orbit(ecs_iter_t* it) {
   }
 }
 
+#ifdef FUN_REPLICATION_BENCHMARK
+static const fun_quantization_t replication_quantization = {
+  .bounds = { { { -50.0f, -10.0f, -50.0f } }, { { 50.0f, 90.0f, 50.0f } } },
+  .max_speed = 50.0f,
+  .position_bits = 16,
+  .velocity_bits = 12,
+};
+static fun_bit_stream_t replication_stream;
+static Position3D* received_positions;
+static Velocity3D* received_velocities;
+static int32_t received_capacity;
+
+// Sends the particles of every table to the client side, as a delta against what it already has, and decodes them again.
+static void Replicate(ecs_iter_t* it) {
+  const Position3D* positions = ecs_field(it, Position3D, 0);
+  const Velocity3D* velocities = ecs_field(it, Velocity3D, 1);
+  ServerBaseline* server_baselines = ecs_field(it, ServerBaseline, 2);
+  ClientBaseline* client_baselines = ecs_field(it, ClientBaseline, 3);
+  ReplicationStats* stats = ecs_field(it, ReplicationStats, 4);
+
+  if (it->count > received_capacity) {
+    received_capacity = it->count;
+    received_positions = realloc(received_positions, received_capacity * sizeof(Position3D));
+    received_velocities = realloc(received_velocities, received_capacity * sizeof(Velocity3D));
+  }
+
+  replication_stream.size = 0;
+  replication_stream.read_position = 0;
+
+  ecs_time_t start = { 0 };
+  ecs_time_measure(&start);
+  fun_encode_bodies(
+    &replication_stream,
+    &replication_quantization,
+    it->count,
+    positions,
+    NULL,
+    velocities,
+    server_baselines
+  );
+  stats->encode_time += ecs_time_measure(&start);
+  const bool decoded = fun_decode_bodies(
+    &replication_stream,
+    &replication_quantization,
+    it->count,
+    received_positions,
+    NULL,
+    received_velocities,
+    client_baselines
+  );
+  stats->decode_time += ecs_time_measure(&start);
+  assert(decoded);
+  (void)decoded;
+
+  stats->entities += it->count;
+  stats->bytes += replication_stream.size;
+
+  const double raw_megabytes = stats->entities * (sizeof(Position3D) + sizeof(Velocity3D)) / 1e6;
+  stats->bytes_per_entity = (float)(stats->bytes / stats->entities);
+  stats->encode_speed = stats->encode_time > 0.0 ? (float)(raw_megabytes / stats->encode_time) : 0.0f;
+  stats->decode_speed = stats->decode_time > 0.0 ? (float)(raw_megabytes / stats->decode_time) : 0.0f;
+}
+
+static void free_replication(ecs_world_t* world, void* ctx) {
+  (void)world;
+  (void)ctx;
+  fun_bit_stream_free(&replication_stream);
+  free(received_positions);
+  free(received_velocities);
+}
+#endif
+
 static ecs_entity_t particle_shader_program, particle_mesh;
 
-static void spawn_firework_particles(
+static void create_firework_prefabs(
   ecs_world_t* world,
   const ecs_entity_t parent,
-  const Position3D* position,
-  const firework_phase_t* phase,
-  const uint16_t phase_index,
+  firework_phase_t* phase,
   const bool last_phase
 ) {
-  const int count = random_int(phase->min_particles, phase->max_particles + 1);
-  for (int i = 0; i < count; i++) {
-    Position3D position_copy = *position;
-    ecs_entity(world, {
+  phase->prefabs = malloc(phase->colors_count * sizeof(phase->prefabs[0]));
+  for (int i = 0; i < phase->colors_count; i++) {
+    phase->prefabs[i] = ecs_entity(world, {
       .parent = parent,
       .add = ecs_ids(
-        ecs_id(Force3D),
+        EcsPrefab,
         ecs_pair(ecs_id(Uses), particle_shader_program),
         ecs_pair(ecs_id(Uses), particle_mesh)
       ),
       .set = ecs_values(
-        { .type = ecs_id(FireworkParticle), .ptr = &(FireworkParticle){ .phase = phase_index } },
-        { .type = ecs_id(Position3D), .ptr = &position_copy },
-        { .type = ecs_id(Velocity3D), .ptr = &(Velocity3D){ {
-          random_float(phase->min_velocity.x, phase->max_velocity.x),
-          random_float(phase->min_velocity.y, phase->max_velocity.y),
-          random_float(phase->min_velocity.z, phase->max_velocity.z),
-        } } },
         { .type = ecs_id(Mass), .ptr = &(Mass){ 0.01f } },
-        { .type = ecs_id(Color), .ptr = phase->colors + rand() % phase->colors_count },
-        { .type = ecs_id(Lifespan), .ptr = &(Lifespan){ random_float(phase->min_lifespan, phase->max_lifespan) } },
-        { .type = ecs_id(Size), .ptr = &(Size){ random_float(phase->min_size, phase->max_size) } },
+        { .type = ecs_id(Color), .ptr = phase->colors + i },
         { .type = ecs_id(ShouldFadeAway), .ptr = &(ShouldFadeAway){ last_phase } }
       ),
     });
+
+    // The particles of the last phase expire while more of its bursts spawn, so they are parked to be re-armed
+    // instead of deleted. Those of the other phases have to be deleted, which is what starts the next phase.
+    if (last_phase) {
+      ecs_add(world, phase->prefabs[i], BodyPool);
+    }
   }
 }
 
+// The particles of a firework phase to spawn at a position. The observers that start a phase run while the world is
+// deferred, so they queue them for SpawnParticleBursts, which creates each burst with a few table appends.
+typedef struct particle_burst_t {
+  ecs_entity_t firework;
+  Position3D position;
+  uint16_t phase;
+} particle_burst_t;
+
+static particle_burst_t* pending_bursts;
+static int32_t pending_bursts_count, pending_bursts_capacity;
+static FireworkParticle* burst_particles;
+static Lifespan* burst_lifespans;
+static SpawnTime* burst_spawn_times;
+static Size* burst_sizes;
+static int32_t burst_capacity;
+
+static void queue_firework_particles(const ecs_entity_t firework, const Position3D* position, const uint16_t phase) {
+  if (pending_bursts_count == pending_bursts_capacity) {
+    pending_bursts_capacity = pending_bursts_capacity ? 2 * pending_bursts_capacity : 64;
+    pending_bursts = realloc(pending_bursts, pending_bursts_capacity * sizeof(particle_burst_t));
+  }
+
+  pending_bursts[pending_bursts_count++] = (particle_burst_t){
+    .firework = firework,
+    .position = *position,
+    .phase = phase,
+  };
+}
+
+// Each color of a phase has its own prefab, so its own table, and gets an even share of the particles.
+static void SpawnParticleBursts(ecs_iter_t* it) {
+  ecs_defer_suspend(it->world);
+  for (int32_t i = 0; i < pending_bursts_count; i++) {
+    const particle_burst_t burst = pending_bursts[i];
+    // The firework may have ended in the meantime.
+    if (!ecs_is_alive(it->world, burst.firework)) {
+      continue;
+    }
+
+    const Firework* firework = ecs_get(it->world, burst.firework, Firework);
+    const firework_phase_t* phase = firework->phases + burst.phase;
+    const int count = random_int(phase->min_particles, phase->max_particles + 1);
+    if (count > burst_capacity) {
+      burst_capacity = count;
+      burst_particles = realloc(burst_particles, burst_capacity * sizeof(FireworkParticle));
+      burst_lifespans = realloc(burst_lifespans, burst_capacity * sizeof(Lifespan));
+      burst_spawn_times = realloc(burst_spawn_times, burst_capacity * sizeof(SpawnTime));
+      burst_sizes = realloc(burst_sizes, burst_capacity * sizeof(Size));
+    }
+
+    for (int j = 0; j < count; j++) {
+      burst_particles[j] = (FireworkParticle){ .phase = burst.phase };
+      burst_spawn_times[j] = ecs_get_world_info(it->world)->world_time_total;
+    }
+
+    for (int j = 0; j < phase->colors_count; j++) {
+      const int share = count * (j + 1) / phase->colors_count - count * j / phase->colors_count;
+      if (share == 0) {
+        continue;
+      }
+
+      fun_random_floats(burst_lifespans, share, phase->min_lifespan, phase->max_lifespan, (uint32_t)rand());
+      fun_random_floats(burst_sizes, share, phase->min_size, phase->max_size, (uint32_t)rand());
+      fun_spawn_burst(it->world, &(fun_burst_desc_t){
+        .ids = {
+          ecs_isa(phase->prefabs[j]),
+          ecs_childof(burst.firework),
+          ecs_id(Force3D),
+          ecs_id(FireworkParticle),
+          ecs_id(Lifespan),
+          ecs_id(SpawnTime),
+          ecs_id(Size),
+        },
+        .data = (void*[]){ NULL, NULL, NULL, burst_particles, burst_lifespans, burst_spawn_times, burst_sizes },
+        .count = share,
+        .lifespans = burst_lifespans,
+        .position = burst.position,
+        .min_velocity = phase->min_velocity,
+        .max_velocity = phase->max_velocity,
+        .seed = (uint32_t)rand(),
+      });
+    }
+  }
+
+  ecs_defer_resume(it->world);
+
+  pending_bursts_count = 0;
+}
+
 static void OnAddFirework(ecs_iter_t* it) {
   const Firework* fireworks = ecs_field(it, Firework, 0);
   const Position3D* positions = ecs_field(it, Position3D, 1);
@@ -191,14 +369,7 @@ static void OnAddFirework(ecs_iter_t* it) {
       continue;
     }
 
-    spawn_firework_particles(
-      it->world,
-      it->entities[i],
-      positions + i,
-      firework->phases,
-      0,
-      firework->phases_count == 1
-    );
+    queue_firework_particles(it->entities[i], positions + i, 0);
   }
 }
 
@@ -212,15 +383,7 @@ static void OnRemoveFireworkParticle(ecs_iter_t* it) {
 
     assert(firework_particle->phase < firework->phases_count);
     if (firework_particle->phase < firework->phases_count - 1) {
-      const uint16_t new_phase_index = firework_particle->phase + 1;
-      spawn_firework_particles(
-        it->world,
-        it->sources[2],
-        positions + i,
-        firework->phases + new_phase_index,
-        new_phase_index,
-        new_phase_index == firework->phases_count - 1
-      );
+      queue_firework_particles(it->sources[2], positions + i, firework_particle->phase + 1);
     }
   }
 }
@@ -250,7 +413,7 @@ static void SpawnFirework(ecs_iter_t* it) {
     .min_velocity = (vkm_vec3){ { -10.0f,   1.0f, -10.0f } },
     .max_velocity = (vkm_vec3){ {  10.0f,  10.0f,  10.0f } },
     .min_lifespan = 0.5f,
-    .max_lifespan = 1.0f,
+    .max_lifespan = 1.5f,
     .min_size = 0.15f,
     .max_size = 0.30f,
     .colors_count = 2,
@@ -284,11 +447,18 @@ static void SpawnFirework(ecs_iter_t* it) {
     lifespan_sum += firework.phases[i].max_lifespan;
   }
 
+  // The prefabs go away along with the firework and its particles.
+  const ecs_entity_t entity = ecs_new(it->world);
+  for (unsigned i = 0; i < firework.phases_count; i++) {
+    create_firework_prefabs(it->world, entity, firework.phases + i, i == firework.phases_count - 1);
+  }
+
   static int count = 0;
   char buffer[22];
   sprintf(buffer, "Firework #%d", ++count);
 
   ecs_entity(it->world, {
+    .id = entity,
     .name = buffer,
     .set = ecs_values(
       { .type = ecs_id(Firework), .ptr = &firework },
@@ -300,6 +470,7 @@ static void SpawnFirework(ecs_iter_t* it) {
       { .type = ecs_id(Lifespan), .ptr = &lifespan_sum }
     ),
   });
+  fun_expire_after(it->world, &entity, &lifespan_sum, 1);
 }
 
 #ifdef GLI_EMSCRIPTEN
@@ -331,18 +502,16 @@ int main(const int argc, char** argv) {
   ECS_IMPORT(world, funomenal);
   ECS_IMPORT(world, glitch);
 
-  ECS_COMPONENT_DEFINE(world, Lifetime);
-  ecs_primitive(world, { .entity = ecs_id(Lifetime), .kind = EcsF32 });
-  ecs_add_pair(world, ecs_id(Lifetime), EcsIsA, EcsSeconds);
-  ecs_set_hooks(world, Lifetime, { .ctor = ecs_ctor(Lifetime) });
+  ECS_COMPONENT_DEFINE(world, SpawnTime);
+  ecs_primitive(world, { .entity = ecs_id(SpawnTime), .kind = EcsF32 });
+  ecs_add_pair(world, ecs_id(SpawnTime), EcsIsA, EcsSeconds);
+  ecs_set_hooks(world, SpawnTime, { .ctor = ecs_ctor(SpawnTime) });
 
   ECS_COMPONENT_DEFINE(world, Lifespan);
   ecs_primitive(world, { .entity = ecs_id(Lifespan), .kind = EcsF32 });
   ecs_add_pair(world, ecs_id(Lifespan), EcsIsA, EcsSeconds);
   ecs_set_hooks(world, Lifespan, { .ctor = ecs_ctor(Lifespan) });
 
-  ecs_add_pair(world, ecs_id(Lifespan), EcsWith, ecs_id(Lifetime));
-
   ECS_COMPONENT_DEFINE(world, Size);
   ecs_primitive(world, { .entity = ecs_id(Size), .kind = EcsF32 });
   ecs_add_pair(world, ecs_id(Size), EcsIsA, EcsMeters);
@@ -389,8 +558,72 @@ int main(const int argc, char** argv) {
 
   ECS_COMPONENT_DEFINE(world, ShouldFadeAway);
   ecs_primitive(world, { .entity = ecs_id(ShouldFadeAway), .kind = EcsI32 });
+  ecs_add_pair(world, ecs_id(ShouldFadeAway), EcsOnInstantiate, EcsInherit);
+
+#ifdef FUN_REPLICATION_BENCHMARK
+  ECS_COMPONENT_DEFINE(world, ServerBaseline);
+  ecs_set_hooks(world, ServerBaseline, { .ctor = ecs_ctor(ServerBaseline) });
+  ECS_COMPONENT_DEFINE(world, ClientBaseline);
+  ecs_set_hooks(world, ClientBaseline, { .ctor = ecs_ctor(ClientBaseline) });
+  ecs_add_pair(world, ecs_id(FireworkParticle), EcsWith, ecs_id(ServerBaseline));
+  ecs_add_pair(world, ecs_id(FireworkParticle), EcsWith, ecs_id(ClientBaseline));
+
+  ECS_COMPONENT_DEFINE(world, ReplicationStats);
+  ecs_struct(world, {
+    .entity = ecs_id(ReplicationStats),
+    .members = {
+      { .name = "entities", .type = ecs_id(ecs_f64_t), .offset = offsetof(ReplicationStats, entities) },
+      {
+        .name = "bytes",
+        .type = ecs_id(ecs_f64_t),
+        .offset = offsetof(ReplicationStats, bytes),
+        .unit = EcsBytes,
+      },
+      {
+        .name = "encode_time",
+        .type = ecs_id(ecs_f64_t),
+        .offset = offsetof(ReplicationStats, encode_time),
+        .unit = EcsSeconds,
+      },
+      {
+        .name = "decode_time",
+        .type = ecs_id(ecs_f64_t),
+        .offset = offsetof(ReplicationStats, decode_time),
+        .unit = EcsSeconds,
+      },
+      {
+        .name = "bytes_per_entity",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(ReplicationStats, bytes_per_entity),
+        .unit = EcsBytes,
+      },
+      {
+        .name = "encode_speed",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(ReplicationStats, encode_speed),
+        .unit = EcsMegaBytesPerSecond,
+      },
+      {
+        .name = "decode_speed",
+        .type = ecs_id(ecs_f32_t),
+        .offset = offsetof(ReplicationStats, decode_speed),
+        .unit = EcsMegaBytesPerSecond,
+      },
+    },
+  });
+  ecs_set_hooks(world, ReplicationStats, { .ctor = ecs_ctor(ReplicationStats) });
+  ecs_singleton_add(world, ReplicationStats);
+
+  ECS_SYSTEM(world, Replicate, EcsPostUpdate,
+    [in] cvkm.Position3D,
+    [in] cvkm.Velocity3D,
+    [inout] ServerBaseline,
+    [inout] ClientBaseline,
+    [inout] ReplicationStats($),
+  );
+  ecs_atfini(world, free_replication, NULL);
+#endif
 
-  ECS_SYSTEM(world, Age, EcsOnUpdate, [inout] Lifetime, [in] ?Lifespan);
   ECS_SYSTEM(world, Orbit, EcsOnUpdate,
     [out] cvkm.Position3D,
     [out] cvkm.Rotation3D,
@@ -401,6 +634,14 @@ int main(const int argc, char** argv) {
 
   ECS_SYSTEM(world, SpawnFirework, EcsOnUpdate, 0);
   ecs_set_interval(world, ecs_id(SpawnFirework), 1.5f);
+  ecs_system(world, {
+    .entity = ecs_entity(world, {
+      .name = "SpawnParticleBursts",
+      .add = ecs_ids(ecs_dependson(EcsOnUpdate)),
+    }),
+    .callback = SpawnParticleBursts,
+    .immediate = true,
+  });
 
   static const float floor_vertices[] = {
     // Position
@@ -442,7 +683,7 @@ int main(const int argc, char** argv) {
 
   static const char* particle_vertex_shader =
     "uniform float entitySize;\n"
-    "uniform float entityLifetime;\n"
+    "uniform float entitySpawnTime;\n"
     "uniform float entityLifespan;\n"
     "uniform int entityShouldFadeAway;\n"
     "\n"
@@ -454,7 +695,7 @@ int main(const int argc, char** argv) {
     "  float focal_length_normalized = projection[1][1];\n"
     "  float focal_length_pixels = (resolution.y * 0.5) * focal_length_normalized;\n"
     "  float size = entitySize * (entityShouldFadeAway != 0\n"
-    "    ? (entityLifespan - entityLifetime) / entityLifespan\n"
+    "    ? (entityLifespan - (time - entitySpawnTime)) / entityLifespan\n"
     "    : entitySize);\n"
     "  gl_PointSize = size * focal_length_pixels / distance_to_camera;\n"
     "\n"
@@ -549,6 +790,11 @@ int main(const int argc, char** argv) {
   });
 
   ecs_fini(world);
+  free(pending_bursts);
+  free(burst_particles);
+  free(burst_lifespans);
+  free(burst_spawn_times);
+  free(burst_sizes);
 #endif
 }
 